@@ -0,0 +1,603 @@
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * End-to-end throughput benchmark.
+ *
+ * Simulates read pairs from a reference and runs them through
+ * rapi_set_read -> rapi_align_reads -> rapi_format_sam_batch for every
+ * combination of the requested thread counts and batch sizes.  The results
+ * (reads/s, bases/s and the time spent in each phase) are written as JSON.
+ *
+ * The reference must be indexed for the aligner;  by default the FASTA
+ * sequence from which the reads are simulated is read from the index prefix
+ * path itself (as with BWA, where the index is built next to the FASTA file).
+ */
+
+#define _POSIX_C_SOURCE 200809L // for getline, getopt, clock_gettime
+
+#include <rapi.h>
+#include <rapi_utils.h>
+
+#include <ctype.h>
+#include <kstring.h>
+#include <kvec.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_SWEEP 32
+#define ID_LEN 64
+#define PI 3.14159265358979323846
+
+typedef struct {
+	const char* ref_path;
+	const char* fasta_path;
+	const char* output_path;
+	int n_pairs;
+	int read_len;
+	double error_rate;
+	double insert_mean;
+	double insert_sd;
+	int repeats;
+	uint64_t seed;
+	int n_threads[MAX_SWEEP];
+	int n_thread_values;
+	int batch_sizes[MAX_SWEEP];
+	int n_batch_values;
+} bench_opts;
+
+typedef struct {
+	char* name;
+	kstring_t seq;
+} contig_seq;
+
+typedef struct {
+	kvec_t(contig_seq) contigs;
+	uint64_t* cum_len; // cumulative length of the contigs from which we can sample
+	int n_usable;
+	int* usable;       // indices of the contigs from which we can sample
+} reference_seq;
+
+typedef struct {
+	int n_pairs;
+	int read_len;
+	char* ids;   // n_pairs * ID_LEN
+	char* seqs;  // 2 * n_pairs * (read_len + 1)
+	char* quals; // read_len + 1;  the same for all reads
+} sim_reads;
+
+static void check_error(int code, const char* error_msg)
+{
+	if (code)
+	{
+		fprintf(stderr, "%s\n", error_msg);
+		fprintf(stderr, "\nError code: %d\n", code);
+		abort();
+	}
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/******* random numbers *******/
+
+// splitmix64:  small, fast and reproducible across platforms
+static inline uint64_t rng_next(uint64_t* state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+// uniform in [0, 1)
+static inline double rng_uniform(uint64_t* state)
+{
+	return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline double rng_gauss(uint64_t* state)
+{
+	double u1;
+	do {
+		u1 = rng_uniform(state);
+	} while (u1 <= 0.0);
+	const double u2 = rng_uniform(state);
+	return sqrt(-2.0 * log(u1)) * cos(2.0 * PI * u2);
+}
+
+/******* reference *******/
+
+static int load_fasta(const char* path, reference_seq* ref)
+{
+	FILE* f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+
+	kv_init(ref->contigs);
+	char* line = NULL;
+	size_t line_cap = 0;
+	ssize_t n;
+	contig_seq* current = NULL;
+
+	while ((n = getline(&line, &line_cap, f)) >= 0) {
+		while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r'))
+			line[--n] = '\0';
+
+		if (line[0] == '>') {
+			contig_seq* c = (kv_pushp(contig_seq, ref->contigs));
+			// the contig name goes up to the first whitespace
+			size_t name_len = strcspn(line + 1, " \t");
+			c->name = strndup(line + 1, name_len);
+			rapi_kstr_init(&c->seq);
+			current = c;
+		}
+		else if (current != NULL) {
+			for (ssize_t i = 0; i < n; ++i)
+				line[i] = toupper((unsigned char)line[i]);
+			kputsn(line, n, &current->seq);
+		}
+	}
+	free(line);
+	fclose(f);
+	return kv_size(ref->contigs) > 0 ? 0 : -1;
+}
+
+static void free_reference(reference_seq* ref)
+{
+	for (size_t i = 0; i < kv_size(ref->contigs); ++i) {
+		free(kv_A(ref->contigs, i).name);
+		free(kv_A(ref->contigs, i).seq.s);
+	}
+	kv_destroy(ref->contigs);
+	free(ref->cum_len);
+	free(ref->usable);
+}
+
+/*
+ * Only sample from contigs that can hold a fragment of `min_len` bases,
+ * with probability proportional to their length.
+ */
+static int prepare_sampling(reference_seq* ref, size_t min_len)
+{
+	const size_t n = kv_size(ref->contigs);
+	ref->cum_len = calloc(n, sizeof(ref->cum_len[0]));
+	ref->usable = calloc(n, sizeof(ref->usable[0]));
+	check_error(ref->cum_len == NULL || ref->usable == NULL, "Failed to allocate memory");
+
+	uint64_t total = 0;
+	ref->n_usable = 0;
+	for (size_t i = 0; i < n; ++i) {
+		if (kv_A(ref->contigs, i).seq.l >= min_len) {
+			total += kv_A(ref->contigs, i).seq.l;
+			ref->cum_len[ref->n_usable] = total;
+			ref->usable[ref->n_usable] = i;
+			ref->n_usable += 1;
+		}
+	}
+	return ref->n_usable > 0 ? 0 : -1;
+}
+
+static const contig_seq* sample_contig(const reference_seq* ref, uint64_t* rng)
+{
+	const uint64_t x = rng_next(rng) % ref->cum_len[ref->n_usable - 1];
+	int lo = 0, hi = ref->n_usable - 1;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (x < ref->cum_len[mid])
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return &kv_A(ref->contigs, ref->usable[lo]);
+}
+
+/******* read simulation *******/
+
+static inline char complement(char b)
+{
+	switch (b) {
+		case 'A': return 'T';
+		case 'C': return 'G';
+		case 'G': return 'C';
+		case 'T': return 'A';
+		default:  return 'N';
+	}
+}
+
+static void copy_with_errors(char* dest, const char* src, int len, int reverse, double error_rate, uint64_t* rng)
+{
+	static const char bases[] = "ACGT";
+
+	for (int i = 0; i < len; ++i) {
+		char b = reverse ? complement(src[len - 1 - i]) : src[i];
+		if (error_rate > 0 && rng_uniform(rng) < error_rate) {
+			// substitute with one of the other three bases
+			const char* p = strchr(bases, b);
+			int k = p ? (p - bases) : 0;
+			b = bases[(k + 1 + rng_next(rng) % 3) % 4];
+		}
+		dest[i] = b;
+	}
+	dest[len] = '\0';
+}
+
+static void simulate_reads(const bench_opts* opts, const reference_seq* ref, sim_reads* reads)
+{
+	const int L = opts->read_len;
+	reads->n_pairs = opts->n_pairs;
+	reads->read_len = L;
+	reads->ids = malloc((size_t)opts->n_pairs * ID_LEN);
+	reads->seqs = malloc((size_t)opts->n_pairs * 2 * (L + 1));
+	reads->quals = malloc(L + 1);
+	check_error(reads->ids == NULL || reads->seqs == NULL || reads->quals == NULL,
+	    "Failed to allocate memory for the simulated reads");
+
+	// Uniform base quality matching the simulated error rate
+	int phred = opts->error_rate > 0 ? (int)lround(-10.0 * log10(opts->error_rate)) : 41;
+	if (phred < 2) phred = 2;
+	if (phred > 41) phred = 41;
+	memset(reads->quals, RAPI_QUALITY_ENCODING_SANGER + phred, L);
+	reads->quals[L] = '\0';
+
+	uint64_t rng = opts->seed;
+	for (int p = 0; p < opts->n_pairs; ++p) {
+		const contig_seq* c = sample_contig(ref, &rng);
+		const long contig_len = c->seq.l;
+
+		long frag_len = lround(opts->insert_mean + opts->insert_sd * rng_gauss(&rng));
+		if (frag_len < L) frag_len = L;
+		if (frag_len > contig_len) frag_len = contig_len;
+		const long pos = rng_next(&rng) % (contig_len - frag_len + 1);
+
+		// read 1 on the forward strand at the start of the fragment, read 2
+		// on the reverse strand at its end;  swap them for half the pairs
+		const int swap = rng_next(&rng) & 1;
+		char* seq1 = reads->seqs + (size_t)(2 * p + swap) * (L + 1);
+		char* seq2 = reads->seqs + (size_t)(2 * p + !swap) * (L + 1);
+		copy_with_errors(seq1, c->seq.s + pos, L, 0, opts->error_rate, &rng);
+		copy_with_errors(seq2, c->seq.s + pos + frag_len - L, L, 1, opts->error_rate, &rng);
+
+		snprintf(reads->ids + (size_t)p * ID_LEN, ID_LEN, "sim:%d:%s:%ld:%ld", p, c->name, pos + 1, frag_len);
+	}
+}
+
+static void free_sim_reads(sim_reads* reads)
+{
+	free(reads->ids);
+	free(reads->seqs);
+	free(reads->quals);
+}
+
+/******* benchmark *******/
+
+typedef struct {
+	int n_threads;
+	int batch_size;
+	int rep;
+	double wall;
+	double set_read;
+	double align;
+	double format_sam;
+	size_t sam_bytes;
+	rapi_aligner_stats stats;
+} bench_result;
+
+static void run_one(const rapi_ref* ref, const sim_reads* reads, rapi_aligner_state* state,
+    int n_threads, int batch_size, bench_result* result)
+{
+	rapi_error_t error;
+	rapi_batch batch;
+	kstring_t sam = { 0, 0, NULL };
+
+	error = rapi_reads_alloc(&batch, 2, batch_size);
+	check_error(error, "Failed to allocate read batch");
+	error = rapi_aligner_stats_reset(state);
+	check_error(error, "Failed to reset aligner statistics");
+
+	result->set_read = result->align = result->format_sam = 0;
+	result->sam_bytes = 0;
+
+	const int L = reads->read_len;
+	const double start = now();
+	for (int first = 0; first < reads->n_pairs; first += batch_size) {
+		const int n = (reads->n_pairs - first) < batch_size ? (reads->n_pairs - first) : batch_size;
+
+		double t0 = now();
+		error = rapi_reads_clear(&batch);
+		check_error(error, "Failed to clear read batch");
+		for (int f = 0; f < n; ++f) {
+			const int p = first + f;
+			const char* id = reads->ids + (size_t)p * ID_LEN;
+			for (int r = 0; r < 2; ++r) {
+				error = rapi_set_read(&batch, f, r, id, reads->seqs + (size_t)(2 * p + r) * (L + 1),
+				    reads->quals, RAPI_QUALITY_ENCODING_SANGER);
+				check_error(error, "Failed to set read");
+			}
+		}
+
+		double t1 = now();
+		error = rapi_align_reads(ref, &batch, 0, n, state);
+		check_error(error, "Failed to align reads");
+
+		double t2 = now();
+		sam.l = 0;
+		error = rapi_format_sam_batch(&batch, 0, n, n_threads, &sam);
+		check_error(error, "Failed to format SAM");
+		double t3 = now();
+
+		result->set_read += t1 - t0;
+		result->align += t2 - t1;
+		result->format_sam += t3 - t2;
+		result->sam_bytes += sam.l;
+	}
+	result->wall = now() - start;
+
+	error = rapi_aligner_stats_get(state, &result->stats);
+	check_error(error, "Failed to get aligner statistics");
+
+	free(sam.s);
+	rapi_reads_free(&batch);
+}
+
+/******* output *******/
+
+static void json_string(FILE* out, const char* s)
+{
+	fputc('"', out);
+	for (; *s; ++s) {
+		if (*s == '"' || *s == '\\')
+			fprintf(out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			fprintf(out, "\\u%04x", *s);
+		else
+			fputc(*s, out);
+	}
+	fputc('"', out);
+}
+
+static void json_field(FILE* out, const char* name, const char* value)
+{
+	fprintf(out, "  \"%s\": ", name);
+	json_string(out, value);
+	fprintf(out, ",\n");
+}
+
+static void json_phase(FILE* out, const char* name, const rapi_phase_time* t, int last)
+{
+	fprintf(out, "        \"%s\": { \"wall\": %.6f, \"cpu\": %.6f }%s\n", name, t->wall, t->cpu, last ? "" : ",");
+}
+
+static void write_result(FILE* out, const bench_result* r, int last)
+{
+	const double reads = (double)r->stats.n_reads;
+	const double bases = (double)r->stats.n_bases;
+
+	fprintf(out, "    {\n");
+	fprintf(out, "      \"threads\": %d,\n", r->n_threads);
+	fprintf(out, "      \"batch_size\": %d,\n", r->batch_size);
+	fprintf(out, "      \"rep\": %d,\n", r->rep);
+	fprintf(out, "      \"n_batches\": %lld,\n", (long long)r->stats.n_batches);
+	fprintf(out, "      \"n_reads\": %lld,\n", (long long)r->stats.n_reads);
+	fprintf(out, "      \"n_bases\": %lld,\n", (long long)r->stats.n_bases);
+	fprintf(out, "      \"sam_bytes\": %zu,\n", r->sam_bytes);
+	fprintf(out, "      \"wall\": %.6f,\n", r->wall);
+	fprintf(out, "      \"reads_per_sec\": %.2f,\n", r->wall > 0 ? reads / r->wall : 0.0);
+	fprintf(out, "      \"bases_per_sec\": %.2f,\n", r->wall > 0 ? bases / r->wall : 0.0);
+	fprintf(out, "      \"phases\": {\n");
+	fprintf(out, "        \"set_read\": { \"wall\": %.6f },\n", r->set_read);
+	fprintf(out, "        \"align_reads\": { \"wall\": %.6f },\n", r->align);
+	json_phase(out, "convert_input", &r->stats.convert_input, 0);
+	json_phase(out, "map", &r->stats.map, 0);
+	json_phase(out, "pestat", &r->stats.pestat, 0);
+	json_phase(out, "align", &r->stats.align, 0);
+	json_phase(out, "convert_output", &r->stats.convert_output, 0);
+	fprintf(out, "        \"format_sam\": { \"wall\": %.6f }\n", r->format_sam);
+	fprintf(out, "      }\n");
+	fprintf(out, "    }%s\n", last ? "" : ",");
+}
+
+/******* command line *******/
+
+static void usage(FILE* out, const char* progname)
+{
+	fprintf(out,
+	    "Usage: %s [options] <reference index>\n"
+	    "\n"
+	    "Options:\n"
+	    "  -f FILE   FASTA from which to simulate the reads [reference index path]\n"
+	    "  -n INT    number of read pairs to simulate [20000]\n"
+	    "  -l INT    read length [100]\n"
+	    "  -e FLOAT  per-base substitution error rate [0.01]\n"
+	    "  -i FLOAT  mean insert size [300]\n"
+	    "  -d FLOAT  insert size standard deviation [30]\n"
+	    "  -t LIST   comma-separated thread counts to sweep [1,2,4]\n"
+	    "  -b LIST   comma-separated batch sizes (in pairs) to sweep [1000,10000]\n"
+	    "  -r INT    repetitions of each configuration [1]\n"
+	    "  -s INT    random seed [42]\n"
+	    "  -o FILE   write the JSON results to FILE [stdout]\n",
+	    progname);
+}
+
+static int parse_int_list(const char* s, int* values, int* n_values)
+{
+	char* copy = strdup(s);
+	char* saveptr = NULL;
+	int n = 0;
+
+	for (char* tok = strtok_r(copy, ",", &saveptr); tok != NULL; tok = strtok_r(NULL, ",", &saveptr)) {
+		char* end;
+		long v = strtol(tok, &end, 10);
+		if (*end != '\0' || v < 1 || n >= MAX_SWEEP) {
+			free(copy);
+			return -1;
+		}
+		values[n++] = (int)v;
+	}
+	free(copy);
+	*n_values = n;
+	return n > 0 ? 0 : -1;
+}
+
+static void parse_args(int argc, char* argv[], bench_opts* opts)
+{
+	memset(opts, 0, sizeof(*opts));
+	opts->n_pairs = 20000;
+	opts->read_len = 100;
+	opts->error_rate = 0.01;
+	opts->insert_mean = 300;
+	opts->insert_sd = 30;
+	opts->repeats = 1;
+	opts->seed = 42;
+	parse_int_list("1,2,4", opts->n_threads, &opts->n_thread_values);
+	parse_int_list("1000,10000", opts->batch_sizes, &opts->n_batch_values);
+
+	int c;
+	int bad = 0;
+	while ((c = getopt(argc, argv, "f:n:l:e:i:d:t:b:r:s:o:h")) != -1) {
+		switch (c) {
+			case 'f': opts->fasta_path = optarg; break;
+			case 'n': opts->n_pairs = atoi(optarg); bad |= opts->n_pairs < 1; break;
+			case 'l': opts->read_len = atoi(optarg); bad |= opts->read_len < 1; break;
+			case 'e': opts->error_rate = atof(optarg); bad |= opts->error_rate < 0 || opts->error_rate >= 1; break;
+			case 'i': opts->insert_mean = atof(optarg); break;
+			case 'd': opts->insert_sd = atof(optarg); bad |= opts->insert_sd < 0; break;
+			case 't': bad |= parse_int_list(optarg, opts->n_threads, &opts->n_thread_values); break;
+			case 'b': bad |= parse_int_list(optarg, opts->batch_sizes, &opts->n_batch_values); break;
+			case 'r': opts->repeats = atoi(optarg); bad |= opts->repeats < 1; break;
+			case 's': opts->seed = strtoull(optarg, NULL, 10); break;
+			case 'o': opts->output_path = optarg; break;
+			case 'h': usage(stdout, argv[0]); exit(0);
+			default: bad = 1;
+		}
+		if (bad) {
+			fprintf(stderr, "Invalid value for option -%c\n", c);
+			usage(stderr, argv[0]);
+			exit(1);
+		}
+	}
+
+	if (optind != argc - 1) {
+		usage(stderr, argv[0]);
+		exit(1);
+	}
+	opts->ref_path = argv[optind];
+	if (opts->fasta_path == NULL)
+		opts->fasta_path = opts->ref_path;
+}
+
+int main(int argc, char* argv[])
+{
+	bench_opts bopts;
+	parse_args(argc, argv, &bopts);
+
+	reference_seq ref_seq;
+	memset(&ref_seq, 0, sizeof(ref_seq));
+	if (load_fasta(bopts.fasta_path, &ref_seq)) {
+		fprintf(stderr, "Failed to read reference sequence from %s\n", bopts.fasta_path);
+		return 1;
+	}
+	if (prepare_sampling(&ref_seq, (size_t)(bopts.insert_mean > bopts.read_len ? bopts.insert_mean : bopts.read_len))) {
+		fprintf(stderr, "No contig in %s is long enough to simulate the requested fragments\n", bopts.fasta_path);
+		return 1;
+	}
+
+	sim_reads reads;
+	simulate_reads(&bopts, &ref_seq, &reads);
+	fprintf(stderr, "Simulated %d pairs of %d bp reads from %s\n", reads.n_pairs, reads.read_len, bopts.fasta_path);
+
+	rapi_error_t error = 0;
+	rapi_opts opts;
+	error = rapi_opts_init(&opts);
+	check_error(error, "Failed to init opts");
+	error = rapi_init(&opts);
+	check_error(error, "Failed to initialize");
+
+	rapi_ref ref;
+	error = rapi_ref_load(bopts.ref_path, &ref);
+	check_error(error, "Failed to load reference");
+
+	// fault the index in so that the first configuration isn't penalized
+	double prefetch_time;
+	error = rapi_ref_prefetch(&ref, bopts.n_threads[bopts.n_thread_values - 1], &prefetch_time);
+	check_error(error, "Failed to prefetch reference");
+	fprintf(stderr, "Prefetched the reference in %.2f sec\n", prefetch_time);
+
+	FILE* out = stdout;
+	if (bopts.output_path && (out = fopen(bopts.output_path, "w")) == NULL) {
+		fprintf(stderr, "Failed to open %s for writing\n", bopts.output_path);
+		return 1;
+	}
+
+	fprintf(out, "{\n");
+	json_field(out, "api_version", RAPI_API_VERSION);
+	json_field(out, "aligner", rapi_aligner_name());
+	json_field(out, "aligner_version", rapi_aligner_version());
+	json_field(out, "plugin_version", rapi_plugin_version());
+	json_field(out, "reference", bopts.ref_path);
+	fprintf(out, "  \"simulation\": { \"n_pairs\": %d, \"read_len\": %d, \"error_rate\": %g, "
+	    "\"insert_mean\": %g, \"insert_sd\": %g, \"seed\": %llu },\n",
+	    bopts.n_pairs, bopts.read_len, bopts.error_rate, bopts.insert_mean, bopts.insert_sd,
+	    (unsigned long long)bopts.seed);
+	fprintf(out, "  \"runs\": [\n");
+
+	const int n_runs = bopts.n_thread_values * bopts.n_batch_values * bopts.repeats;
+	int run = 0;
+	for (int ti = 0; ti < bopts.n_thread_values; ++ti) {
+		// one aligner state (and thread pool) per thread count
+		opts.n_threads = bopts.n_threads[ti];
+		rapi_aligner_state* state;
+		error = rapi_aligner_state_init(&state, &opts);
+		check_error(error, "Failed to initialize aligner state");
+
+		for (int bi = 0; bi < bopts.n_batch_values; ++bi) {
+			for (int rep = 0; rep < bopts.repeats; ++rep) {
+				bench_result result;
+				result.n_threads = bopts.n_threads[ti];
+				result.batch_size = bopts.batch_sizes[bi];
+				result.rep = rep;
+				run_one(&ref, &reads, state, result.n_threads, result.batch_size, &result);
+
+				fprintf(stderr, "threads %d, batch %d, rep %d: %.0f reads/s\n",
+				    result.n_threads, result.batch_size, rep, result.stats.n_reads / result.wall);
+				write_result(out, &result, ++run == n_runs);
+				fflush(out);
+			}
+		}
+		rapi_aligner_state_free(state);
+	}
+
+	fprintf(out, "  ]\n}\n");
+	if (out != stdout)
+		fclose(out);
+
+	rapi_ref_free(&ref);
+	rapi_shutdown();
+	rapi_opts_free(&opts);
+	free_sim_reads(&reads);
+	free_reference(&ref_seq);
+
+	return 0;
+}
@@ -11,10 +11,14 @@ or they won't have effect.
 */
 
 %rename("AlignerState") "rapi_aligner_state";
+%rename("AlignHandle")  "rapi_align_handle_wrap";
 %rename("Alignment")    "rapi_alignment";
+%rename("AlignerStats") "rapi_aligner_stats";
 %rename("Batch")        "rapi_batch_wrap";
 %rename("Contig")       "rapi_contig";
+%rename("IsizeDist")    "rapi_isize_dist";
 %rename("Opts")         "rapi_opts";
+%rename("PhaseTime")    "rapi_phase_time";
 %rename("Read")         "rapi_read";
 %rename("Ref")          "rapi_ref";
 
@@ -42,6 +46,7 @@ or they won't have effect.
 /* includes injected into the C wrapper code.  */
 #include <stddef.h>
 #include <stdio.h>
+#include <pthread.h>
 #include <rapi.h>
 #include <rapi_utils.h>
 %}
@@ -173,7 +178,13 @@ typedef int rapi_bool;
 %rename("%(lowercamelcase)s") mapq_min;
 %rename("%(lowercamelcase)s") isize_min;
 %rename("%(lowercamelcase)s") isize_max;
+%rename("%(lowercamelcase)s") isize_mode;
+%rename("%(lowercamelcase)s") isize_freeze_pairs;
+%rename("%(lowercamelcase)s") pin_threads;
 %rename("%(lowercamelcase)s") share_ref_mem;
+%rename("%(lowercamelcase)s") numa_replicate_ref;
+%rename("%(lowercamelcase)s") convert_input;
+%rename("%(lowercamelcase)s") convert_output;
 
 %mutable;
 /********* rapi_opts *******/
@@ -183,8 +194,13 @@ typedef struct rapi_opts {
   int mapq_min;
   int isize_min;
   int isize_max;
+  int isize_mode;
+  int isize_freeze_pairs;
   int n_threads;
+  rapi_bool pin_threads;
   rapi_bool share_ref_mem;
+  rapi_bool numa_replicate_ref;
+  rapi_bool verbose;
 
   /* Mismatch / Gap_Opens / Quality Trims --> Generalize ? */
 
@@ -286,6 +302,12 @@ typedef struct rapi_ref {
   }
 }
 
+%javaexception("RapiException") rapi_ref::prefetch {
+  $action
+}
+
+Set_exception_from_error_t(rapi_ref::fillMd5);
+
 %extend rapi_ref {
   rapi_ref(JNIEnv* jenv, const char* reference_path) {
     if (reference_path == NULL) {
@@ -344,6 +366,31 @@ typedef struct rapi_ref {
     else
       return $self->contigs + i;
   }
+
+  /** Find a Contig by name.
+   * @return the Contig, or null if there isn't one with that name.
+   * @warning Like getContig, the Contig points to the Ref's data.
+   */
+  const rapi_contig* findContig(const char* name) const {
+    return rapi_ref_find_contig($self, name);
+  }
+
+  /** Compute the M5 checksums of the contigs, using nThreads threads. */
+  rapi_error_t fillMd5(int nThreads) {
+    return rapi_ref_fill_md5($self, nThreads);
+  }
+
+  /** Fault the reference into memory using nThreads threads, so that the
+   * first alignments run at full speed.
+   * @return the time taken, in seconds.
+   */
+  double prefetch(JNIEnv* jenv, int nThreads) const {
+    double elapsed = 0;
+    rapi_error_t error = rapi_ref_prefetch($self, nThreads, &elapsed);
+    if (error != RAPI_NO_ERROR)
+      do_rapi_throw(jenv, error, "Failed to prefetch the reference");
+    return elapsed;
+  }
 };
 
 
@@ -469,14 +516,26 @@ static jobject rapi_java_tag_value(JNIEnv* jenv, const rapi_tag*const tag)
     }
     break;
     case RAPI_VTYPE_TEXT: {
-      const kstring_t* s;
-      error = rapi_tag_get_text(tag, &s);
+      const char* s;
+      error = rapi_tag_get_text(tag, &s, NULL);
       if (error) {
         PERROR("rapi_tag_get_text returned error %s (%d)\n", rapi_error_name(error), error);
       }
       else {
-        retval = (*jenv)->NewStringUTF(jenv, s->s);
+        retval = (*jenv)->NewStringUTF(jenv, s);
+      }
+    }
+    break;
+    case RAPI_VTYPE_DERIVED: {
+      kstring_t s = { 0, 0, NULL };
+      error = rapi_tag_put_text(tag, &s);
+      if (error) {
+        PERROR("rapi_tag_put_text returned error %s (%d)\n", rapi_error_name(error), error);
+      }
+      else {
+        retval = (*jenv)->NewStringUTF(jenv, s.s ? s.s : "");
       }
+      free(s.s);
     }
     break;
     case RAPI_VTYPE_INT: {
@@ -558,7 +617,9 @@ static jobject rapi_java_tag_value(JNIEnv* jenv, const rapi_tag*const tag)
   // now create the values and insert them
   for (int i = 0; i < kv_size($1); ++i) {
     // first create the key
-    jstring key = (*jenv)->NewStringUTF(jenv, kv_A($1, i).key);
+    char key_str[RAPI_TAG_KEY_LEN + 1];
+    rapi_tag_get_key(&(kv_A($1, i)), key_str);
+    jstring key = (*jenv)->NewStringUTF(jenv, key_str);
     if (!key) return $null; // fn should have already set the exception
     // create the value object
     jobject value = rapi_java_tag_value(jenv, &(kv_A($1, i)));
@@ -567,7 +628,7 @@ static jobject rapi_java_tag_value(JNIEnv* jenv, const rapi_tag*const tag)
     (*jenv)->CallObjectMethod(jenv, hm, op_put, key, value);
 
     if ((*jenv)->ExceptionOccurred(jenv)) {
-      PERROR("Exception insert tag %s into HashMap\n", kv_A($1, i).key);
+      PERROR("Exception insert tag %s into HashMap\n", key_str);
       return $null;
     }
   }
@@ -575,6 +636,19 @@ static jobject rapi_java_tag_value(JNIEnv* jenv, const rapi_tag*const tag)
   $result = hm;
 }
 
+/* A single tag is mapped to its value, or null if there's no tag */
+%typemap(javaout) const rapi_tag* {
+    return $jnicall;
+}
+%typemap(jni) const rapi_tag*  "jobject";
+%typemap(jstype) const rapi_tag*  "Object"
+%typemap(jtype) const rapi_tag*  "Object"
+
+%typemap(out) const rapi_tag* {
+  // rapi_java_tag_value throws in case of error
+  $result = $1 ? rapi_java_tag_value(jenv, $1) : NULL;
+}
+
 
 %nodefaultctor rapi_alignment;
 // Alignments are not to be deleted.  They are attached to the read, which is
@@ -622,6 +696,16 @@ typedef struct rapi_alignment {
         return $self->tags;
     }
 
+    /** The value of the tag `key`, or null if the alignment doesn't have it. */
+    const rapi_tag* getTag(JNIEnv* jenv, const char* key) const {
+        rapi_tag tmp;
+        if (rapi_tag_set_key(&tmp, key) != RAPI_NO_ERROR) {
+            do_rapi_throw(jenv, RAPI_PARAM_ERROR, "Tag keys must be two characters long");
+            return NULL;
+        }
+        return rapi_tag_find(&$self->tags, tmp.key);
+    }
+
     /** The length of the aligned read in terms of reference bases. */
     int get_rlen(void) const {
       return rapi_get_rlen($self->n_cigar_ops, $self->cigar_ops);
@@ -746,17 +830,85 @@ short rapi_read_mapq_get(const rapi_read* read) {
 
 %typemap(javainterfaces) rapi_batch_wrap "Iterable<Fragment>"
 %typemap(javacode) rapi_batch_wrap "
+// The asynchronous alignment started on this batch, if any.  Holding it
+// keeps the handle from being collected while we still reference the batch.
+AlignHandle pendingHandle;
+
 public java.util.Iterator<Fragment> iterator() {
   return new BatchIterator(this);
 }
+
+/**
+ * Append the records between the position and the limit of `buf`, in a
+ * single native call.  `format` is \"fastq\" or \"prq\";  with a batch of
+ * 2 reads per fragment, FASTQ records are taken to be interleaved pairs.
+ * `buf` must be a direct buffer.  Its position is moved to its limit.
+ * Returns the number of fragments appended.
+ */
+public long loadBuffer(java.nio.ByteBuffer buf, String format) throws RapiException {
+  if (!buf.isDirect())
+    throw new IllegalArgumentException(\"loadBuffer requires a direct ByteBuffer\");
+  long n = loadBufferImpl(buf, buf.position(), buf.remaining(), format);
+  buf.position(buf.limit());
+  return n;
+}
 ";
 
+// A direct java.nio.ByteBuffer, passed to C as is
+%typemap(jni) jobject DIRECT_BUFFER "jobject"
+%typemap(jtype) jobject DIRECT_BUFFER "java.nio.ByteBuffer"
+%typemap(jstype) jobject DIRECT_BUFFER "java.nio.ByteBuffer"
+%typemap(javain) jobject DIRECT_BUFFER "$javainput"
+%typemap(in) jobject DIRECT_BUFFER "$1 = $input;"
+
 
 %{ // this declaration is inserted in the C code
+struct rapi_align_handle_wrap;
+
 typedef struct rapi_batch_wrap {
   rapi_batch* batch;
   rapi_ssize_t len; // number of reads inserted in batch (as opposed to the space reserved)
+  struct rapi_align_handle_wrap* pending; // async alignment running on the batch;  non-NULL means busy
 } rapi_batch_wrap;
+
+typedef struct rapi_align_handle_wrap {
+  rapi_align_handle* handle;
+  rapi_batch_wrap* batch; // the batch being aligned;  NULL once it's been released
+} rapi_align_handle_wrap;
+
+/*
+ * Protects the links between batches and their pending handles.  The Java
+ * finalizers of a Batch and its AlignHandle can run in any order and on any
+ * thread, so both sides take this lock to link or unlink them.
+ */
+static pthread_mutex_t rapi_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Unlink the handle from its batch, clearing the batch's busy flag. */
+static void rapi_align_handle_wrap_release(rapi_align_handle_wrap* wrap)
+{
+  pthread_mutex_lock(&rapi_pending_lock);
+  if (wrap->batch) {
+    wrap->batch->pending = NULL;
+    wrap->batch = NULL;
+  }
+  pthread_mutex_unlock(&rapi_pending_lock);
+}
+
+/*
+ * Returns an error if an asynchronous alignment is running on the batch.
+ * Until its AlignHandle is done, the batch must not be modified or aligned.
+ */
+static rapi_error_t rapi_batch_wrap_check_idle(const rapi_batch_wrap* batch)
+{
+  pthread_mutex_lock(&rapi_pending_lock);
+  int busy = batch->pending != NULL;
+  pthread_mutex_unlock(&rapi_pending_lock);
+  if (busy) {
+    PERROR("Batch is being aligned asynchronously.  Call waitFor() on its AlignHandle first\n");
+    return RAPI_GENERIC_ERROR;
+  }
+  return RAPI_NO_ERROR;
+}
 %}
 
 %{
@@ -775,6 +927,23 @@ int rapi_batch_wrap_length_get(const rapi_batch_wrap* self) {
 rapi_ssize_t rapi_batch_wrap_capacity_get(const rapi_batch_wrap* wrap) {
   return rapi_batch_read_capacity(wrap->batch);
 }
+
+/*
+ * Get the fragment range to align from the Batch wrapper.
+ * Returns an error if the batch ends with an incomplete fragment.
+ */
+static rapi_error_t rapi_batch_wrap_frag_range(const rapi_batch_wrap* batch, rapi_ssize_t* start, rapi_ssize_t* end)
+{
+  if (batch->len % batch->batch->n_reads_frag != 0) {
+    PERROR("Incomplete fragment in batch! Number of reads appended (%lld) is not a multiple of the number of reads per fragment (%d)\n",
+      batch->len, batch->batch->n_reads_frag);
+    return RAPI_GENERIC_ERROR;
+  }
+
+  *start = 0;
+  *end = batch->len / batch->batch->n_reads_frag;
+  return RAPI_NO_ERROR;
+}
 %}
 
 // This one to the SWIG interpreter.
@@ -796,6 +965,11 @@ Set_exception_from_error_t(rapi_batch_wrap::append);
 Set_exception_from_error_t(rapi_batch_wrap::clear);
 Set_exception_from_error_t(rapi_batch_wrap::setRead);
 
+%javaexception("RapiException") rapi_batch_wrap::loadBufferImpl {
+  $action
+}
+%javamethodmodifiers rapi_batch_wrap::loadBufferImpl "private";
+
 %extend rapi_batch_wrap {
   /**
    * Creates a new read_batch for fragments composed of `n_reads_per_frag` reads.
@@ -818,6 +992,7 @@ Set_exception_from_error_t(rapi_batch_wrap::setRead);
     }
 
     wrapper->len = 0;
+    wrapper->pending = NULL;
 
     rapi_error_t error = rapi_reads_alloc(wrapper->batch, n_reads_per_frag, 0); // zero-sized allocation to initialize
 
@@ -832,7 +1007,19 @@ Set_exception_from_error_t(rapi_batch_wrap::setRead);
   }
 
   ~rapi_batch_wrap(void) {
+    // An alignment may still be writing to the batch if its handle hasn't
+    // been waited for.  We wait holding the lock so the handle can't be
+    // freed under us, then unlink it.
+    pthread_mutex_lock(&rapi_pending_lock);
+    if ($self->pending) {
+      rapi_align_wait($self->pending->handle);
+      $self->pending->batch = NULL;
+      $self->pending = NULL;
+    }
+    pthread_mutex_unlock(&rapi_pending_lock);
+
     int error = rapi_reads_free($self->batch);
+    free($self->batch);
     free($self);
     if (error != RAPI_NO_ERROR) {
       PERROR("Problem destroying read batch (error code %d)\n", error);
@@ -875,19 +1062,23 @@ Set_exception_from_error_t(rapi_batch_wrap::setRead);
         PERROR("n_reads must be >= 0");
         return RAPI_PARAM_ERROR;
     }
+    rapi_error_t error = rapi_batch_wrap_check_idle($self);
+    if (error != RAPI_NO_ERROR)
+      return error;
 
     rapi_ssize_t n_fragments = n_reads / $self->batch->n_reads_frag;
     // If the reads don't fit completely in n_fragments, add one more
     if (n_reads % $self->batch->n_reads_frag != 0)
       n_fragments +=  1;
 
-    rapi_error_t error = rapi_reads_reserve($self->batch, n_fragments);
-    return error;
+    return rapi_reads_reserve($self->batch, n_fragments);
   }
 
   rapi_error_t append(const char* id, const char* seq, const char* qual, int q_offset)
   {
-    rapi_error_t error = RAPI_NO_ERROR;
+    rapi_error_t error = rapi_batch_wrap_check_idle($self);
+    if (error != RAPI_NO_ERROR)
+      return error;
 
     // if id or seq are NULL set them to the empty string and pass them down to the plugin.
     if (!id) id = "";
@@ -916,12 +1107,52 @@ Set_exception_from_error_t(rapi_batch_wrap::setRead);
   }
 
   rapi_error_t clear(void) {
-    rapi_error_t error = rapi_reads_clear($self->batch);
+    rapi_error_t error = rapi_batch_wrap_check_idle($self);
+    if (error != RAPI_NO_ERROR)
+      return error;
+    error = rapi_reads_clear($self->batch);
     if (error == RAPI_NO_ERROR)
       $self->len = 0;
     return error;
   }
 
+  rapi_ssize_t loadBufferImpl(JNIEnv* jenv, jobject DIRECT_BUFFER, rapi_ssize_t offset, rapi_ssize_t len, const char* format)
+  {
+    rapi_input_format fmt;
+    if (NULL == format || strcmp(format, "fastq") == 0)
+      fmt = RAPI_INPUT_FASTQ;
+    else if (strcmp(format, "prq") == 0)
+      fmt = RAPI_INPUT_PRQ;
+    else {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "format must be 'fastq' or 'prq'");
+      return -1;
+    }
+
+    const char* data = (*jenv)->GetDirectBufferAddress(jenv, DIRECT_BUFFER);
+    jlong capacity = (*jenv)->GetDirectBufferCapacity(jenv, DIRECT_BUFFER);
+    if (NULL == data || capacity < 0) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "buffer must be a direct ByteBuffer");
+      return -1;
+    }
+    if (offset < 0 || len < 0 || offset + len > capacity) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "buffer range out of bounds");
+      return -1;
+    }
+
+    rapi_ssize_t start_fragment, end_fragment, n_loaded = 0;
+    rapi_error_t error = rapi_batch_wrap_check_idle($self);
+    if (error == RAPI_NO_ERROR)
+      error = rapi_batch_wrap_frag_range($self, &start_fragment, &end_fragment);
+    if (error == RAPI_NO_ERROR)
+      error = rapi_reads_parse($self->batch, fmt, data + offset, len, end_fragment, &n_loaded);
+    if (error != RAPI_NO_ERROR) {
+      do_rapi_throw(jenv, error, "Error parsing reads");
+      return -1;
+    }
+    $self->len += n_loaded * $self->batch->n_reads_frag;
+    return n_loaded;
+  }
+
 /*  XXX:  maybe we shouldn't expose this method
   rapi_error_t setRead(rapi_ssize_t n_frag, int n_read, const char* id, const char* seq, const char* qual, int q_offset)
   {
@@ -945,19 +1176,125 @@ Set_exception_from_error_t(rapi_batch_wrap::setRead);
 */
 }
 
+/***************************************/
+/*      Asynchronous alignment handle  */
+/***************************************/
+
+// The C wrapper (rapi_align_handle_wrap) is declared with rapi_batch_wrap.
+%nodefaultctor rapi_align_handle_wrap;
+
+typedef struct {} rapi_align_handle_wrap; //< opaque structure
+
+// The handle holds on to the AlignerState, Ref and Batch being used so that
+// they aren't garbage collected while the alignment is running.
+%typemap(javacode) rapi_align_handle_wrap "
+private Object[] inUse;
+
+void keepAlive(Object... objs) {
+  inUse = objs;
+}
+";
+
+Set_exception_from_error_t(rapi_align_handle_wrap::waitFor);
+
+%extend rapi_align_handle_wrap {
+  ~rapi_align_handle_wrap(void) {
+    // Wait before unlinking, so the batch stays busy until the alignment is
+    // done.  If the batch is being destroyed, its destructor holds the lock
+    // while it waits on our handle, so we can't free the handle under it.
+    rapi_align_wait($self->handle);
+    rapi_align_handle_wrap_release($self);
+    rapi_align_handle_free($self->handle);
+    free($self);
+  }
+
+  /** Whether the alignment is complete.  Once it is, the batch can be used again. */
+  rapi_bool isDone(void) {
+    rapi_bool done = rapi_align_poll($self->handle);
+    if (done)
+      rapi_align_handle_wrap_release($self);
+    return done;
+  }
+
+  /** Wait for the alignment to complete.  Throws if the alignment failed. */
+  rapi_error_t waitFor(JNIEnv* jenv) {
+    rapi_error_t error = rapi_align_wait($self->handle);
+    rapi_align_handle_wrap_release($self);
+    return error;
+  }
+};
+
 /***************************************/
 /*      The aligner                    */
 /***************************************/
 
 %{ // forward declaration of opaque structure (in C-code)
 struct rapi_aligner_state;
+
 %}
 
 %nodefaultctor  rapi_aligner_state;
 
 typedef struct rapi_aligner_state {} rapi_aligner_state; //< opaque structure.  Aligner can use for whatever it wants.
 
+/** Time spent in an alignment phase, in seconds. */
+typedef struct rapi_phase_time {
+  double wall;
+  double cpu;
+} rapi_phase_time;
+
+/** Cumulative statistics of an aligner (see rapi.h). */
+typedef struct rapi_aligner_stats {
+  rapi_phase_time convert_input;
+  rapi_phase_time map;
+  rapi_phase_time pestat;
+  rapi_phase_time align;
+  rapi_phase_time convert_output;
+  int64_t n_batches;
+  int64_t n_reads;
+  int64_t n_bases;
+} rapi_aligner_stats;
+
+/** Insert size distribution of the read pairs in one orientation (see rapi.h). */
+typedef struct rapi_isize_dist {
+  rapi_bool failed;
+  int low;
+  int high;
+  double avg;
+  double std;
+} rapi_isize_dist;
+
+%newobject rapi_aligner_state::getStats;
+Set_exception_from_error_t(rapi_aligner_state::resetStats);
+
+%newobject rapi_aligner_state::getIsize;
+%javaexception("RapiException") rapi_aligner_state::getIsize {
+  $action
+}
+Set_exception_from_error_t(rapi_aligner_state::setIsize);
+
 Set_exception_from_error_t(rapi_aligner_state::alignReads);
+Set_exception_from_error_t(rapi_aligner_state::alignFragment);
+
+%newobject rapi_aligner_state::alignReadsAsyncImpl;
+%javaexception("RapiException") rapi_aligner_state::alignReadsAsyncImpl {
+  $action
+}
+%javamethodmodifiers rapi_aligner_state::alignReadsAsyncImpl "private";
+
+%typemap(javacode) rapi_aligner_state "
+/**
+ * Start aligning the batch in the background.  Call waitFor() on the returned
+ * handle to wait for the result.  Until then, calls that modify or align the
+ * batch throw a RapiException.
+ */
+public AlignHandle alignReadsAsync(Ref ref, Batch batch) throws RapiException {
+  AlignHandle handle = alignReadsAsyncImpl(ref, batch);
+  handle.keepAlive(this, ref, batch);
+  batch.pendingHandle = handle;
+  return handle;
+}
+";
 
 %extend rapi_aligner_state {
   rapi_aligner_state(JNIEnv* jenv, const rapi_opts* opts)
@@ -985,16 +1322,136 @@ Set_exception_from_error_t(rapi_aligner_state::alignReads);
       return RAPI_PARAM_ERROR;
     }
 
-    if (batch->len % batch->batch->n_reads_frag != 0) {
-      PERROR("Incomplete fragment in batch! Number of reads appended (%lld) is not a multiple of the number of reads per fragment (%d)\n",
-        batch->len, batch->batch->n_reads_frag);
-      return RAPI_GENERIC_ERROR;
-    }
+    rapi_ssize_t start_fragment, end_fragment;
+    rapi_error_t error = rapi_batch_wrap_check_idle(batch);
+    if (error == RAPI_NO_ERROR)
+      error = rapi_batch_wrap_frag_range(batch, &start_fragment, &end_fragment);
+    if (error != RAPI_NO_ERROR)
+      return error;
 
-    rapi_ssize_t start_fragment = 0;
-    rapi_ssize_t end_fragment = batch->len / batch->batch->n_reads_frag;
     return rapi_align_reads(ref, batch->batch, start_fragment, end_fragment, $self);
   }
+
+  /**
+   * Align only the fragment at index `fragment` of the batch, on the calling
+   * thread.  Meant for low latency on a few fragments at a time; see
+   * rapi_align_fragment in rapi.h.
+   */
+  rapi_error_t alignFragment(JNIEnv* jenv, const rapi_ref* ref, rapi_batch_wrap* batch, rapi_ssize_t fragment)
+  {
+    if (NULL == ref || NULL == batch) {
+      PERROR("ref and batch arguments must not be NULL\n");
+      return RAPI_PARAM_ERROR;
+    }
+
+    rapi_ssize_t start_fragment, end_fragment;
+    rapi_error_t error = rapi_batch_wrap_check_idle(batch);
+    if (error == RAPI_NO_ERROR)
+      error = rapi_batch_wrap_frag_range(batch, &start_fragment, &end_fragment);
+    if (error != RAPI_NO_ERROR)
+      return error;
+    if (fragment < start_fragment || fragment >= end_fragment) {
+      PERROR("fragment %lld is out of bounds (the batch has %lld fragments)\n", fragment, end_fragment);
+      return RAPI_PARAM_ERROR;
+    }
+
+    return rapi_align_fragment(ref, batch->batch, fragment, $self);
+  }
+
+  rapi_align_handle_wrap* alignReadsAsyncImpl(JNIEnv* jenv, const rapi_ref* ref, rapi_batch_wrap* batch)
+  {
+    if (NULL == ref || NULL == batch) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "ref and batch arguments must not be NULL");
+      return NULL;
+    }
+
+    rapi_align_handle_wrap* wrap = rapi_malloc(jenv, sizeof(rapi_align_handle_wrap));
+    if (!wrap)
+      return NULL;
+    wrap->handle = NULL;
+    wrap->batch = NULL;
+
+    rapi_ssize_t start_fragment, end_fragment;
+    rapi_error_t error = rapi_batch_wrap_frag_range(batch, &start_fragment, &end_fragment);
+    if (error == RAPI_NO_ERROR) {
+      // Mark the batch busy before the alignment starts, checking and setting
+      // the flag under one lock so two calls can't both take the batch.
+      pthread_mutex_lock(&rapi_pending_lock);
+      if (batch->pending)
+        error = RAPI_GENERIC_ERROR;
+      else {
+        batch->pending = wrap;
+        wrap->batch = batch;
+      }
+      pthread_mutex_unlock(&rapi_pending_lock);
+      if (error != RAPI_NO_ERROR) {
+        free(wrap);
+        do_rapi_throw(jenv, error, "Batch is already being aligned asynchronously");
+        return NULL;
+      }
+      error = rapi_align_reads_async(ref, batch->batch, start_fragment, end_fragment, $self, &wrap->handle);
+      if (error != RAPI_NO_ERROR)
+        rapi_align_handle_wrap_release(wrap);
+    }
+
+    if (error != RAPI_NO_ERROR) {
+      free(wrap);
+      do_rapi_throw(jenv, error, "Failed to start alignment");
+      return NULL;
+    }
+    return wrap;
+  }
+
+  /** A snapshot of the aligner's cumulative statistics. */
+  rapi_aligner_stats* getStats(JNIEnv* jenv)
+  {
+    rapi_aligner_stats* stats = rapi_malloc(jenv, sizeof(rapi_aligner_stats));
+    if (stats)
+      rapi_aligner_stats_get($self, stats);
+    return stats;
+  }
+
+  rapi_error_t resetStats(void) {
+    return rapi_aligner_stats_reset($self);
+  }
+
+  /** The insert size distribution the aligner uses for `orientation` (one of the ORIENT_* constants). */
+  rapi_isize_dist* getIsize(JNIEnv* jenv, int orientation)
+  {
+    if (orientation < 0 || orientation >= RAPI_N_ORIENT) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "Invalid read pair orientation");
+      return NULL;
+    }
+    rapi_isize_dist dist[RAPI_N_ORIENT];
+    rapi_error_t error = rapi_aligner_isize_get($self, dist);
+    if (error != RAPI_NO_ERROR) {
+      do_rapi_throw(jenv, error, "Failed to get the insert size distribution");
+      return NULL;
+    }
+    rapi_isize_dist* ret = rapi_malloc(jenv, sizeof(rapi_isize_dist));
+    if (ret)
+      *ret = dist[orientation];
+    return ret;
+  }
+
+  /**
+   * Fix the insert size distribution for `orientation`.  The aligner stops
+   * estimating it;  the other orientations keep their current distributions.
+   */
+  rapi_error_t setIsize(int orientation, const rapi_isize_dist* dist)
+  {
+    if (orientation < 0 || orientation >= RAPI_N_ORIENT || NULL == dist) {
+      PERROR("Invalid read pair orientation or NULL distribution\n");
+      return RAPI_PARAM_ERROR;
+    }
+    rapi_isize_dist all[RAPI_N_ORIENT];
+    rapi_error_t error = rapi_aligner_isize_get($self, all);
+    if (error == RAPI_NO_ERROR) {
+      all[orientation] = *dist;
+      error = rapi_aligner_isize_set($self, all);
+    }
+    return error;
+  }
 };
 
 /***************************************/
@@ -1021,45 +1478,37 @@ char* format_sam_hdr(JNIEnv* jenv, const rapi_ref* ref)
 
 
 // create overloaded `format_sam_batch` functions -- one that accepts
-// a fragment index and one that doesn't, but is applied to the entire batch.
+// a fragment index, one that doesn't, but is applied to the entire batch,
+// and one that formats a range of fragments with multiple threads.
 %rename(formatSamBatch) format_sam_batch;
 %rename(formatSamBatch) format_sam_batch2;
+%rename(formatSamBatch) format_sam_batch3;
 
 %newobject format_sam_batch;
 %newobject format_sam_batch2;
+%newobject format_sam_batch3;
 
 %inline %{
-char* format_sam_batch(JNIEnv* jenv, const rapi_batch_wrap* reads, rapi_ssize_t frag_idx)
+char* format_sam_batch3(JNIEnv* jenv, const rapi_batch_wrap* reads,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, int n_threads)
 {
   if (!reads) {
     do_rapi_throw(jenv, RAPI_PARAM_ERROR, "NULL read_batch pointer!");
     return NULL;
   }
 
-  if (frag_idx >= reads->len / reads->batch->n_reads_frag) {
-    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "Index value out of range");
+  if (start_frag < 0 || end_frag > reads->len / reads->batch->n_reads_frag || start_frag > end_frag) {
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "Fragment range out of bounds");
     return NULL;
   }
 
-  int start, end;
-
-  if (frag_idx < 0) {
-    start = 0;
-    end = reads->len / reads->batch->n_reads_frag;
-  }
-  else {
-    start = frag_idx;
-    end = start + 1;
-  }
-
   kstring_t output = { 0, 0, NULL };
-  rapi_error_t error = RAPI_NO_ERROR;
+  rapi_error_t error = rapi_format_sam_batch(reads->batch, start_frag, end_frag, n_threads, &output);
 
-  for (rapi_ssize_t i = start; i < end && error == RAPI_NO_ERROR; ++i) {
-    error = rapi_format_sam_b(reads->batch, i, &output);
-    kputc('\n', &output);
-  }
   if (error == RAPI_NO_ERROR) {
+    // an empty range produces no output, but we still want to return a string
+    if (output.s == NULL)
+      kputsn("", 0, &output);
     return output.s;
   }
   else {
@@ -1069,10 +1518,244 @@ char* format_sam_batch(JNIEnv* jenv, const rapi_batch_wrap* reads, rapi_ssize_t
   }
 }
 
+char* format_sam_batch(JNIEnv* jenv, const rapi_batch_wrap* reads, rapi_ssize_t frag_idx)
+{
+  if (!reads) {
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "NULL read_batch pointer!");
+    return NULL;
+  }
+
+  if (frag_idx >= reads->len / reads->batch->n_reads_frag) {
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "Index value out of range");
+    return NULL;
+  }
+
+  if (frag_idx < 0)
+    return format_sam_batch3(jenv, reads, 0, reads->len / reads->batch->n_reads_frag, 1);
+  else
+    return format_sam_batch3(jenv, reads, frag_idx, frag_idx + 1, 1);
+}
+
 char* format_sam_batch2(JNIEnv* jenv, const rapi_batch_wrap* reads)
 {
   return format_sam_batch(jenv, reads, -1);
 }
 %}
 
+
+// Formatting straight into a direct java.nio.ByteBuffer, without going
+// through a String.  format_to_buffer does the work;  the public methods
+// are in the module code below.
+%rename(formatToBuffer) format_to_buffer;
+%javamethodmodifiers format_to_buffer "private";
+%javaexception("RapiException") format_to_buffer {
+  $action
+}
+%typemap(jni) jobject format_to_buffer "jobject"
+%typemap(jtype) jobject format_to_buffer "java.nio.ByteBuffer"
+%typemap(jstype) jobject format_to_buffer "java.nio.ByteBuffer"
+%typemap(javaout) jobject format_to_buffer {
+    return $jnicall;
+  }
+%typemap(out) jobject format_to_buffer "$result = $1;"
+
+%{
+#define RAPI_JAVA_FORMAT_SAM_HDR 0
+#define RAPI_JAVA_FORMAT_SAM     1
+#define RAPI_JAVA_FORMAT_BAM_HDR 2
+#define RAPI_JAVA_FORMAT_BAM     3
+
+/* ByteBuffer.allocateDirect(capacity).  Returns NULL with an exception pending on error. */
+static jobject rapi_java_allocate_direct(JNIEnv* jenv, jint capacity)
+{
+  jclass clazz = (*jenv)->FindClass(jenv, "java/nio/ByteBuffer");
+  if (!clazz)
+    return NULL;
+  jmethodID allocate = (*jenv)->GetStaticMethodID(jenv, clazz, "allocateDirect", "(I)Ljava/nio/ByteBuffer;");
+  if (!allocate)
+    return NULL;
+  return (*jenv)->CallStaticObjectMethod(jenv, clazz, allocate, capacity);
+}
+
+/* buffer.position(position).  Returns 0 with an exception pending on error. */
+static int rapi_java_set_position(JNIEnv* jenv, jobject buffer, jint position)
+{
+  jclass clazz = (*jenv)->FindClass(jenv, "java/nio/Buffer");
+  if (!clazz)
+    return 0;
+  jmethodID set_position = (*jenv)->GetMethodID(jenv, clazz, "position", "(I)Ljava/nio/Buffer;");
+  if (!set_position)
+    return 0;
+  (*jenv)->CallObjectMethod(jenv, buffer, set_position, position);
+  return !(*jenv)->ExceptionCheck(jenv);
+}
+%}
+
+%inline %{
+/*
+ * Format the output selected by `what` into the direct buffer at `position`
+ * and return the buffer, with its position advanced past the output.  If the
+ * output doesn't fit before `limit`, a larger direct buffer is allocated and
+ * returned instead:  it gets the buffer's bytes up to `position`, followed by
+ * the output, so the output is formatted only once.
+ */
+jobject format_to_buffer(JNIEnv* jenv, int what, const rapi_ref* ref, const rapi_batch_wrap* reads,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, int n_threads,
+    jobject DIRECT_BUFFER, int position, int limit)
+{
+  char* data = (*jenv)->GetDirectBufferAddress(jenv, DIRECT_BUFFER);
+  jlong capacity = (*jenv)->GetDirectBufferCapacity(jenv, DIRECT_BUFFER);
+  if (NULL == data || capacity < 0) {
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "buffer must be a direct ByteBuffer");
+    return NULL;
+  }
+  if (position < 0 || position > limit || limit > capacity) {
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "buffer range out of bounds");
+    return NULL;
+  }
+
+  if (what == RAPI_JAVA_FORMAT_SAM || what == RAPI_JAVA_FORMAT_BAM) {
+    if (!reads) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "NULL read_batch pointer!");
+      return NULL;
+    }
+    if (start_frag < 0 || end_frag > reads->len / reads->batch->n_reads_frag || start_frag > end_frag) {
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "Fragment range out of bounds");
+      return NULL;
+    }
+  }
+  if (what != RAPI_JAVA_FORMAT_SAM && !ref) {
+    do_rapi_throw(jenv, RAPI_PARAM_ERROR, "NULL reference pointer!");
+    return NULL;
+  }
+
+  kstring_t output = { 0, 0, NULL };
+  rapi_error_t error;
+  switch (what) {
+  case RAPI_JAVA_FORMAT_SAM_HDR:
+    error = rapi_format_sam_hdr(ref, &output);
+    if (error == RAPI_NO_ERROR) // so that the records can follow it in the buffer
+      kputc('\n', &output);
+    break;
+  case RAPI_JAVA_FORMAT_SAM:
+    error = rapi_format_sam_batch(reads->batch, start_frag, end_frag, n_threads, &output);
+    break;
+  case RAPI_JAVA_FORMAT_BAM_HDR:
+    error = rapi_format_bam_hdr(ref, &output);
+    break;
+  case RAPI_JAVA_FORMAT_BAM:
+    error = rapi_format_bam_batch(ref, reads->batch, start_frag, end_frag, n_threads, &output);
+    break;
+  default:
+    error = RAPI_PARAM_ERROR;
+  }
+
+  if (error != RAPI_NO_ERROR) {
+    free(output.s);
+    do_rapi_throw(jenv, error, "Failed to format output");
+    return NULL;
+  }
+
+  jobject retval = DIRECT_BUFFER;
+  char* dest = data;
+  const jlong needed = position + (jlong)output.l;
+  if ((jlong)output.l > limit - position) {
+    if (needed > INT32_MAX) {
+      free(output.s);
+      do_rapi_throw(jenv, RAPI_PARAM_ERROR, "Output too large for a ByteBuffer");
+      return NULL;
+    }
+    jlong new_capacity = 2 * capacity;
+    if (new_capacity < needed)
+      new_capacity = needed;
+    else if (new_capacity > INT32_MAX)
+      new_capacity = INT32_MAX;
+    retval = rapi_java_allocate_direct(jenv, (jint)new_capacity);
+    if (!retval || !(dest = (*jenv)->GetDirectBufferAddress(jenv, retval))) {
+      free(output.s);
+      return NULL; // the exception is pending
+    }
+    memcpy(dest, data, position);
+  }
+  if (output.l > 0)
+    memcpy(dest + position, output.s, output.l);
+  free(output.s);
+
+  if (!rapi_java_set_position(jenv, retval, (jint)needed))
+    return NULL;
+  return retval;
+}
+%}
+
+%pragma(java) modulecode=%{
+  private static final int FORMAT_SAM_HDR = 0;
+  private static final int FORMAT_SAM = 1;
+  private static final int FORMAT_BAM_HDR = 2;
+  private static final int FORMAT_BAM = 3;
+
+  /*
+   * Format into `dest` at its position and advance the position.  If the
+   * output doesn't fit, the native code returns a larger direct buffer
+   * instead, with the same contents up to the position followed by the output.
+   */
+  private static java.nio.ByteBuffer formatInto(int what, Ref ref, Batch batch,
+      long startFrag, long endFrag, int nThreads, java.nio.ByteBuffer dest) throws RapiException
+  {
+    if (!dest.isDirect())
+      throw new IllegalArgumentException("dest must be a direct ByteBuffer");
+
+    java.nio.ByteBuffer out = formatToBuffer(what, ref, batch, startFrag, endFrag, nThreads, dest, dest.position(), dest.limit());
+    if (out != dest)
+      out.order(dest.order());
+    return out;
+  }
+
+  /**
+   * Write the SAM header, followed by a newline, into the direct buffer
+   * `dest`, at its position.  Returns `dest` with its position advanced, or
+   * a larger copy of it if the header didn't fit.  The bytes can be handed
+   * to a channel directly, without going through a String.
+   */
+  public static java.nio.ByteBuffer formatSamHdr(Ref ref, java.nio.ByteBuffer dest) throws RapiException
+  {
+    return formatInto(FORMAT_SAM_HDR, ref, null, 0, 0, 1, dest);
+  }
+
+  /**
+   * Write the SAM for the fragments [startFrag, endFrag) of the batch, each
+   * followed by a newline, into `dest`, using `nThreads` threads.  See
+   * formatSamHdr(Ref, ByteBuffer).
+   */
+  public static java.nio.ByteBuffer formatSamBatch(Batch batch, long startFrag, long endFrag, int nThreads,
+      java.nio.ByteBuffer dest) throws RapiException
+  {
+    return formatInto(FORMAT_SAM, null, batch, startFrag, endFrag, nThreads, dest);
+  }
+
+  /** Write the SAM for all the fragments in the batch into `dest`. */
+  public static java.nio.ByteBuffer formatSamBatch(Batch batch, java.nio.ByteBuffer dest) throws RapiException
+  {
+    return formatSamBatch(batch, 0, batch.getNFragments(), 1, dest);
+  }
+
+  /**
+   * Write the uncompressed BAM header into `dest`.  To produce a BAM file,
+   * the bytes must be BGZF-compressed.  See formatSamHdr(Ref, ByteBuffer).
+   */
+  public static java.nio.ByteBuffer formatBamHdr(Ref ref, java.nio.ByteBuffer dest) throws RapiException
+  {
+    return formatInto(FORMAT_BAM_HDR, ref, null, 0, 0, 1, dest);
+  }
+
+  /**
+   * Write the uncompressed BAM records for the fragments [startFrag, endFrag)
+   * of the batch into `dest`, using `nThreads` threads.
+   */
+  public static java.nio.ByteBuffer formatBamBatch(Ref ref, Batch batch, long startFrag, long endFrag, int nThreads,
+      java.nio.ByteBuffer dest) throws RapiException
+  {
+    return formatInto(FORMAT_BAM, ref, batch, startFrag, endFrag, nThreads, dest);
+  }
+%}
+
 long rapi_get_insert_size(const rapi_alignment* read, const rapi_alignment* mate);
@@ -30,6 +30,7 @@
  * java -cp build/jrapi.jar -Djrapi.so=$PWD/jrapi.so rapi_example /path/to/ref.fasta < /input/data.prq > /output/path.sam
  */
 
+import it.crs4.rapi.AlignHandle;
 import it.crs4.rapi.AlignerState;
 import it.crs4.rapi.Batch;
 import it.crs4.rapi.Opts;
@@ -39,19 +40,31 @@ import it.crs4.rapi.RapiException;
 import it.crs4.rapi.RapiUtils;
 import it.crs4.rapi.Ref;
 
-import java.io.BufferedReader;
-import java.io.InputStreamReader;
+import java.io.FileDescriptor;
+import java.io.FileOutputStream;
 import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.channels.Channels;
+import java.nio.channels.ReadableByteChannel;
+import java.nio.channels.WritableByteChannel;
 
 public class rapi_example
 {
   private Opts opts;
   private String refPath;
   private AlignerState aligner;
-  private int linesRead = 0;
+  private long linesRead = 0;
   private SimpleLogger log = new SimpleLogger();
 
-  private static final int BATCH_SIZE = 5000;
+  // Input is read in chunks of this size.  Each chunk's complete lines make a batch.
+  private static final int INPUT_BUFFER_SIZE = 4 << 20;
+  private final ByteBuffer inputBuffer = ByteBuffer.allocateDirect(INPUT_BUFFER_SIZE);
+  private boolean inputEof = false;
+
+  // SAM is formatted into this buffer and written from it to stdout.  It's
+  // replaced by a larger one when a batch's output doesn't fit.
+  private ByteBuffer outputBuffer = ByteBuffer.allocateDirect(2 * INPUT_BUFFER_SIZE);
+  private final WritableByteChannel output = new FileOutputStream(FileDescriptor.out).getChannel();
 
   public rapi_example() throws RapiException
   {
@@ -99,40 +112,50 @@ public class rapi_example
     Rapi.shutdown();
   }
 
-  protected boolean loadBatch(BufferedReader in, Batch dest) throws RapiException, IOException
+  protected boolean loadBatch(ReadableByteChannel in, Batch dest) throws RapiException, IOException
   {
-    if (BATCH_SIZE <= 0)
-      throw new RuntimeException("BUG!  BATCH_SIZE must be > 0");
-    dest.reserve(BATCH_SIZE);
     dest.clear();
 
-    int nLines = 0;
-    String thisLine = null;
-
-    while (nLines < BATCH_SIZE)
-    {
-      thisLine = in.readLine();
-      if (thisLine == null) {
+    while (!inputEof && inputBuffer.hasRemaining()) {
+      if (in.read(inputBuffer) < 0) {
         log.debug("input EOF");
-        break;
+        inputEof = true;
       }
-
-      nLines += 1;
-      String[] parts = thisLine.split("\t");
-      if (parts.length != 5)
-        throw new IllegalArgumentException("Invalid prq format in line " + (nLines + linesRead) + ":\n" + thisLine);
-      dest.append(parts[0], parts[1], parts[2], RapiConstants.QENC_SANGER);
-      dest.append(parts[0], parts[3], parts[4], RapiConstants.QENC_SANGER);
     }
+    inputBuffer.flip();
+
+    // Give the complete lines to the batch, in one native call, and keep the
+    // partial one at the end for the next batch
+    int dataEnd = inputBuffer.limit();
+    int end = dataEnd;
+    if (!inputEof) {
+      while (end > 0 && inputBuffer.get(end - 1) != '\n')
+        --end;
+      if (end == 0)
+        throw new IllegalArgumentException("Line " + (linesRead + 1) + " is longer than the input buffer");
+    }
+    inputBuffer.limit(end);
+    long nLines = dest.loadBuffer(inputBuffer, "prq");
+    inputBuffer.limit(dataEnd);
+    inputBuffer.compact();
 
     linesRead += nLines;
     log.debug("Added %d lines to batch", nLines);
     return nLines > 0;
   }
 
-  protected void processAlignments(Batch reads) throws RapiException
+  protected void writeOutput() throws IOException
+  {
+    outputBuffer.flip();
+    while (outputBuffer.hasRemaining())
+      output.write(outputBuffer);
+    outputBuffer.clear();
+  }
+
+  protected void processAlignments(Batch reads) throws RapiException, IOException
   {
-    System.out.append(Rapi.formatSamBatch(reads));
+    outputBuffer = Rapi.formatSamBatch(reads, 0, reads.getNFragments(), opts.getNThreads(), outputBuffer);
+    writeOutput();
   }
 
 
@@ -146,23 +169,40 @@ public class rapi_example
   public void run(String[] args) throws RapiException, IOException
   {
     parseArgs(args);
-    Batch reads = new Batch(2);
-    log.debug("Created batch");
+    // Two batches, so that we can load and write one while the other is being aligned
+    Batch[] batches = new Batch[] { new Batch(2), new Batch(2) };
+    log.debug("Created batches");
     Ref ref = new Ref(refPath);
     log.debug("Loaded reference from " + refPath);
 
-    BufferedReader reader = new BufferedReader(new InputStreamReader(System.in));
+    ReadableByteChannel reader = Channels.newChannel(System.in);
 
     log.debug("Starting to process");
     long startTime = System.nanoTime();
 
-    System.out.append(Rapi.formatSamHdr(ref));
+    outputBuffer = Rapi.formatSamHdr(ref, outputBuffer);
+    writeOutput();
 
-    while (loadBatch(reader, reads)) {
+    // Pipeline:  while batch N is aligned we load batch N+1 and write batch N-1
+    int batchCount = 0;
+    Batch current = batches[0];
+    AlignHandle handle = null;
+    if (loadBatch(reader, current)) {
       log.debug("Loaded batch.  Going to align");
-      aligner.alignReads(ref, reads);
+      handle = aligner.alignReadsAsync(ref, current);
+    }
+
+    while (handle != null) {
+      batchCount += 1;
+      Batch following = batches[batchCount % 2];
+      boolean hasData = loadBatch(reader, following);
+
+      handle.waitFor();
       log.debug("Alignment finished.  Need to print output");
-      processAlignments(reads);
+      handle = hasData ? aligner.alignReadsAsync(ref, following) : null;
+
+      processAlignments(current);
+      current = following;
       log.debug("Processed %d lines.  Time so far: %.3f s", linesRead, (System.nanoTime() - startTime) / 1.0e9);
     }
 
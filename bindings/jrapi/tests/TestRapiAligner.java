@@ -176,6 +176,22 @@ public class TestRapiAligner
     assertEquals("15T16C27", md_tag);
   }
 
+  @Test
+  public void testGetTag() throws RapiException
+  {
+    Alignment aln = reads.getRead(0, 0).getAln(0);
+    assertEquals("60", aln.getTag("MD"));
+    assertEquals(0L, aln.getTag("XS"));
+    assertNull(aln.getTag("SA"));
+    assertEquals("11^CCC49", reads.getRead(1, 0).getAln(0).getTag("MD"));
+  }
+
+  @Test(expected=RapiException.class)
+  public void testGetTagBadKey() throws RapiException
+  {
+    reads.getRead(0, 0).getAln(0).getTag("MDX");
+  }
+
   @Test
   public void testGetInsertSize()
   {
@@ -203,6 +219,197 @@ public class TestRapiAligner
     assertFalse(it.hasNext());
   }
 
+  @Test
+  public void testAlignSingleEnd() throws RapiException, IOException
+  {
+    Batch seReads = new Batch(1);
+    for (String[] fragment: TestUtils.readMiniRefSeqs())
+      seReads.append(fragment[0], fragment[1], fragment[2], RapiConstants.QENC_SANGER);
+
+    aligner.alignReads(refObj, seReads);
+
+    Read rapiRead = seReads.getRead(0, 0);
+    assertTrue(rapiRead.getNAlignments() > 0);
+    Alignment aln = rapiRead.getAln(0);
+    assertTrue(aln.getMapped());
+    assertFalse(aln.getPaired());
+    assertEquals("chr1", aln.getContig().getName());
+    assertEquals(32461, aln.getPos());
+    assertEquals("60M", aln.getCigarString());
+
+    assertEquals("11M3D49M", seReads.getRead(1, 0).getAln(0).getCigarString());
+  }
+
+  @Test
+  public void testAlignAsync() throws RapiException, IOException
+  {
+    Batch asyncReads = new Batch(2);
+    TestUtils.appendSeqsToBatch(TestUtils.readMiniRefSeqs(), asyncReads);
+
+    AlignHandle handle = aligner.alignReadsAsync(refObj, asyncReads);
+    handle.waitFor();
+    assertTrue(handle.isDone());
+
+    // same result as the synchronous alignment
+    assertEquals(Rapi.formatSamBatch(reads), Rapi.formatSamBatch(asyncReads));
+  }
+
+  @Test(expected=RapiException.class)
+  public void testAlignAsyncIncompleteFragment() throws RapiException
+  {
+    Batch asyncReads = new Batch(2);
+    asyncReads.append("read", "AAAACTGACCCACACAGAAAAACTAATTGTGAGAACCAATATTATACTAAATTCATTTGA", null, RapiConstants.QENC_SANGER);
+    aligner.alignReadsAsync(refObj, asyncReads);
+  }
+
+  @Test
+  public void testAlignAsyncBatchBusy() throws RapiException, IOException
+  {
+    Batch asyncReads = new Batch(2);
+    TestUtils.appendSeqsToBatch(TestUtils.readMiniRefSeqs(), asyncReads);
+
+    // the batch stays busy until we wait on the handle, even if the alignment is already done
+    AlignHandle handle = aligner.alignReadsAsync(refObj, asyncReads);
+    try {
+      asyncReads.append("read", "AAAACTGACC", null, RapiConstants.QENC_SANGER);
+      fail("append should throw while the batch is being aligned");
+    } catch (RapiException e) { }
+    try {
+      asyncReads.clear();
+      fail("clear should throw while the batch is being aligned");
+    } catch (RapiException e) { }
+    try {
+      aligner.alignReads(refObj, asyncReads);
+      fail("alignReads should throw while the batch is being aligned");
+    } catch (RapiException e) { }
+    try {
+      aligner.alignReadsAsync(refObj, asyncReads);
+      fail("alignReadsAsync should throw while the batch is being aligned");
+    } catch (RapiException e) { }
+
+    handle.waitFor();
+    asyncReads.clear();
+    assertEquals(0, asyncReads.getLength());
+  }
+
+  @Test
+  public void testAlignAsyncDropHandle() throws RapiException, IOException
+  {
+    Batch asyncReads = new Batch(2);
+    TestUtils.appendSeqsToBatch(TestUtils.readMiniRefSeqs(), asyncReads);
+
+    // free the batch and then the handle without waiting:  the batch must
+    // wait for the alignment before releasing its reads
+    AlignHandle handle = aligner.alignReadsAsync(refObj, asyncReads);
+    asyncReads.delete();
+    handle.delete();
+  }
+
+  @Test
+  public void testAlignThreadPool() throws RapiException, IOException
+  {
+    Opts opts = new Opts();
+    opts.setNThreads(3);
+    opts.setPinThreads(true);
+    AlignerState poolAligner = new AlignerState(opts);
+
+    // the same pool is used by successive alignments
+    for (int i = 0; i < 3; ++i) {
+      Batch poolReads = new Batch(2);
+      TestUtils.appendSeqsToBatch(TestUtils.readMiniRefSeqs(), poolReads);
+      poolAligner.alignReads(refObj, poolReads);
+      assertEquals(Rapi.formatSamBatch(reads), Rapi.formatSamBatch(poolReads));
+    }
+  }
+
+  @Test
+  public void testAlignNumaReplicateRef() throws RapiException, IOException
+  {
+    // on a single NUMA node this is the same as not replicating
+    Opts opts = new Opts();
+    opts.setNThreads(3);
+    opts.setNumaReplicateRef(true);
+    AlignerState numaAligner = new AlignerState(opts);
+
+    for (int i = 0; i < 2; ++i) {
+      Batch numaReads = new Batch(2);
+      TestUtils.appendSeqsToBatch(TestUtils.readMiniRefSeqs(), numaReads);
+      numaAligner.alignReads(refObj, numaReads);
+      assertEquals(Rapi.formatSamBatch(reads), Rapi.formatSamBatch(numaReads));
+    }
+  }
+
+  @Test
+  public void testAlignerStats() throws RapiException, IOException
+  {
+    Opts opts = new Opts();
+    opts.setVerbose(true);
+    AlignerState statsAligner = new AlignerState(opts);
+    AlignerStats stats = statsAligner.getStats();
+    assertEquals(0, stats.getNBatches());
+
+    statsAligner.alignReads(refObj, reads);
+    stats = statsAligner.getStats();
+    assertEquals(1, stats.getNBatches());
+    assertEquals(reads.getLength(), stats.getNReads());
+    assertTrue(stats.getMap().getWall() > 0.0);
+    assertTrue(stats.getAlign().getWall() > 0.0);
+    assertTrue(stats.getConvertOutput().getCpu() >= 0.0);
+
+    statsAligner.resetStats();
+    assertEquals(0, statsAligner.getStats().getNReads());
+  }
+
+  @Test
+  public void testAlignFragment() throws RapiException, IOException
+  {
+    // The mini batch is too small for an insert size estimate, so aligning
+    // the fragments one at a time pairs them like aligning the whole batch
+    AlignerState fragAligner = new AlignerState(rapiOpts);
+    Batch fragReads = new Batch(2);
+    TestUtils.appendSeqsToBatch(TestUtils.readMiniRefSeqs(), fragReads);
+    for (long f = 0; f < fragReads.getNFragments(); ++f)
+      fragAligner.alignFragment(refObj, fragReads, f);
+    assertEquals(Rapi.formatSamBatch(reads), Rapi.formatSamBatch(fragReads));
+  }
+
+  @Test(expected=RapiException.class)
+  public void testAlignFragmentOutOfBounds() throws RapiException
+  {
+    aligner.alignFragment(refObj, reads, reads.getNFragments());
+  }
+
+  @Test
+  public void testAlignerIsize() throws RapiException, IOException
+  {
+    AlignerState isizeAligner = new AlignerState(rapiOpts);
+    // no distribution until we've seen some pairs
+    assertTrue(isizeAligner.getIsize(RapiConstants.ORIENT_FR).getFailed());
+
+    IsizeDist dist = new IsizeDist();
+    dist.setFailed(false);
+    dist.setLow(50);
+    dist.setHigh(500);
+    dist.setAvg(200.0);
+    dist.setStd(40.0);
+    isizeAligner.setIsize(RapiConstants.ORIENT_FR, dist);
+
+    // a fixed distribution isn't re-estimated
+    isizeAligner.alignReads(refObj, reads);
+    IsizeDist fr = isizeAligner.getIsize(RapiConstants.ORIENT_FR);
+    assertFalse(fr.getFailed());
+    assertEquals(50, fr.getLow());
+    assertEquals(500, fr.getHigh());
+    assertEquals(200.0, fr.getAvg(), 0.0);
+    assertTrue(isizeAligner.getIsize(RapiConstants.ORIENT_RF).getFailed());
+  }
+
+  @Test(expected=RapiException.class)
+  public void testAlignerIsizeBadOrientation() throws RapiException
+  {
+    aligner.getIsize(4);
+  }
+
   public static void main(String args[])
   {
     TestUtils.testCaseMainMethod(TestRapiAligner.class.getName(), args);
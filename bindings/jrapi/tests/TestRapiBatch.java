@@ -31,6 +31,7 @@ import it.crs4.rapi.RapiUtils;
 import org.junit.*;
 import static org.junit.Assert.*;
 
+import java.nio.ByteBuffer;
 import java.util.Iterator;
 import java.util.List;
 
@@ -171,6 +172,82 @@ public class TestRapiBatch
     Read r = b.getRead(0, -1);
   }
 
+  private static ByteBuffer directBuffer(String text)
+  {
+    byte[] bytes = text.getBytes(java.nio.charset.Charset.forName("US-ASCII"));
+    ByteBuffer buf = ByteBuffer.allocateDirect(bytes.length);
+    buf.put(bytes);
+    buf.flip();
+    return buf;
+  }
+
+  private void assertBatchHasSomeReads(int startFragment) throws RapiException
+  {
+    for (int i = 0; i < someReads.size(); ++i) {
+      String[] fragment = someReads.get(i);
+      Read r1 = b.getRead(startFragment + i, 0);
+      Read r2 = b.getRead(startFragment + i, 1);
+      assertEquals(fragment[0], r1.getId());
+      assertEquals(fragment[1], r1.getSeq());
+      assertEquals(fragment[2], r1.getQual());
+      assertEquals(fragment[0], r2.getId());
+      assertEquals(fragment[3], r2.getSeq());
+      assertEquals(fragment[4], r2.getQual());
+    }
+  }
+
+  @Test
+  public void testLoadBufferPrq() throws RapiException
+  {
+    StringBuilder text = new StringBuilder();
+    for (String[] r : someReads)
+      text.append(r[0]).append('\t').append(r[1]).append('\t').append(r[2])
+          .append('\t').append(r[3]).append('\t').append(r[4]).append('\n');
+
+    ByteBuffer buf = directBuffer(text.toString());
+    assertEquals(someReads.size(), b.loadBuffer(buf, "prq"));
+    assertEquals(buf.limit(), buf.position());
+    assertEquals(2 * someReads.size(), b.getLength());
+    assertBatchHasSomeReads(0);
+  }
+
+  @Test
+  public void testLoadBufferFastq() throws RapiException
+  {
+    StringBuilder text = new StringBuilder("skipped");
+    for (String[] r : someReads) {
+      text.append('@').append(r[0]).append("/1\n").append(r[1]).append("\n+\n").append(r[2]).append('\n');
+      text.append('@').append(r[0]).append("/2\n").append(r[3]).append("\n+\n").append(r[4]).append('\n');
+    }
+
+    // appends after what's in the batch, starting from the buffer's position
+    loadSomeReads(1);
+    ByteBuffer buf = directBuffer(text.toString());
+    buf.position("skipped".length());
+    assertEquals(someReads.size(), b.loadBuffer(buf, "fastq"));
+    assertEquals(1 + someReads.size(), b.getNFragments());
+    assertBatchHasSomeReads(1);
+  }
+
+  @Test(expected=IllegalArgumentException.class)
+  public void testLoadBufferNotDirect() throws RapiException
+  {
+    b.loadBuffer(ByteBuffer.wrap("@r\nACGT\n+\nIIII\n".getBytes()), "fastq");
+  }
+
+  @Test(expected=RapiInvalidParamException.class)
+  public void testLoadBufferBadFormat() throws RapiException
+  {
+    b.loadBuffer(directBuffer("@r\nACGT\n+\nIIII\n"), "sam");
+  }
+
+  @Test(expected=RapiException.class)
+  public void testLoadBufferTruncated() throws RapiException
+  {
+    // the mate is missing
+    b.loadBuffer(directBuffer("@r\nACGT\n+\nIIII\n"), "fastq");
+  }
+
   @Test
   public void testFormatSAMBatch() throws RapiException
   {
@@ -202,6 +279,60 @@ public class TestRapiBatch
     }
   }
 
+  private static String bufferText(ByteBuffer buf)
+  {
+    // the bytes between 0 and the position
+    ByteBuffer view = buf.duplicate();
+    view.flip();
+    byte[] bytes = new byte[view.remaining()];
+    view.get(bytes);
+    return new String(bytes, java.nio.charset.Charset.forName("US-ASCII"));
+  }
+
+  @Test
+  public void testFormatSAMBatchBuffer() throws RapiException
+  {
+    loadSomeReads(2);
+    ByteBuffer buf = ByteBuffer.allocateDirect(1 << 16);
+    ByteBuffer out = Rapi.formatSamBatch(b, buf);
+    assertSame(buf, out);
+    assertEquals(Rapi.formatSamBatch(b), bufferText(out));
+
+    // a second call appends at the position
+    out = Rapi.formatSamBatch(b, 1, 2, 1, out);
+    assertEquals(Rapi.formatSamBatch(b) + Rapi.formatSamBatch(b, 1), bufferText(out));
+  }
+
+  @Test
+  public void testFormatSAMBatchBufferGrows() throws RapiException
+  {
+    loadSomeReads(2);
+    ByteBuffer buf = directBuffer("prefix\n");
+    buf.order(java.nio.ByteOrder.LITTLE_ENDIAN);
+    buf.position(buf.limit());
+    ByteBuffer out = Rapi.formatSamBatch(b, buf);
+    assertNotSame(buf, out);
+    assertTrue(out.isDirect());
+    assertEquals(buf.order(), out.order());
+    assertEquals("prefix\n" + Rapi.formatSamBatch(b), bufferText(out));
+    // the original buffer is left as it was
+    assertEquals(buf.limit(), buf.position());
+  }
+
+  @Test(expected=IllegalArgumentException.class)
+  public void testFormatSAMBatchBufferNotDirect() throws RapiException
+  {
+    loadSomeReads(1);
+    Rapi.formatSamBatch(b, ByteBuffer.allocate(1 << 16));
+  }
+
+  @Test(expected=RapiException.class)
+  public void testFormatSAMBatchBufferOutOfBounds() throws RapiException
+  {
+    loadSomeReads(1);
+    Rapi.formatSamBatch(b, 0, 2, 1, ByteBuffer.allocateDirect(1 << 16));
+  }
+
   @Test
   public void testIterator() throws RapiException
   {
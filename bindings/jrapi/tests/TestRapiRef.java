@@ -117,6 +117,54 @@ public class TestRapiRef
     refObj.unload();
   }
 
+  @Test
+  public void testLoadSameRefTwice() throws RapiException
+  {
+    Ref other = new Ref(TestUtils.RELATIVE_MINI_REF);
+    assertEquals(refObj.getNContigs(), other.getNContigs());
+    assertEquals(refObj.getContig(0).getName(), other.getContig(0).getName());
+
+    // the reference is shared, so it must stay loaded for refObj
+    other.unload();
+    Contig c = refObj.getContig(0);
+    assertEquals("chr1", c.getName());
+    assertEquals(60000, c.getLen());
+  }
+
+  @Test
+  public void testFindContig()
+  {
+    Contig c = refObj.findContig("chr1");
+    assertNotNull(c);
+    assertEquals("chr1", c.getName());
+    assertEquals(60000, c.getLen());
+    assertNull(refObj.findContig("chr2"));
+  }
+
+  @Test
+  public void testFillMd5() throws RapiException
+  {
+    java.io.File sidecar = new java.io.File(TestUtils.RELATIVE_MINI_REF + ".md5");
+    try {
+      refObj.fillMd5(2);
+      String md5 = refObj.getContig(0).getMd5();
+      assertNotNull(md5);
+      assertTrue(md5.matches("[0-9a-f]{32}"));
+      assertTrue(Rapi.formatSamHdr(refObj).contains("\tM5:" + md5));
+    }
+    finally {
+      sidecar.delete();
+    }
+  }
+
+  @Test
+  public void testPrefetch() throws RapiException
+  {
+    assertTrue(refObj.prefetch(1) >= 0);
+    assertTrue(refObj.prefetch(4) >= 0);
+    assertEquals("chr1", refObj.getContig(0).getName());
+  }
+
   @Test
   public void testFormatSAMHeader() throws RapiException
   {
@@ -130,6 +178,27 @@ public class TestRapiRef
     String hdr = Rapi.formatSamHdr(null);
   }
 
+  @Test
+  public void testFormatSAMHeaderBuffer() throws RapiException
+  {
+    java.nio.ByteBuffer buf = Rapi.formatSamHdr(refObj, java.nio.ByteBuffer.allocateDirect(16));
+    buf.flip();
+    byte[] bytes = new byte[buf.remaining()];
+    buf.get(bytes);
+    assertEquals(Rapi.formatSamHdr(refObj) + "\n", new String(bytes, java.nio.charset.Charset.forName("US-ASCII")));
+  }
+
+  @Test
+  public void testFormatBAMHeaderBuffer() throws RapiException
+  {
+    java.nio.ByteBuffer buf = Rapi.formatBamHdr(refObj, java.nio.ByteBuffer.allocateDirect(1 << 16));
+    assertTrue(buf.position() > 4);
+    assertEquals('B', buf.get(0));
+    assertEquals('A', buf.get(1));
+    assertEquals('M', buf.get(2));
+    assertEquals(1, buf.get(3));
+  }
+
   public static void main(String args[])
   {
     TestUtils.testCaseMainMethod(TestRapiRef.class.getName(), args);
@@ -168,13 +168,20 @@ class HiRapiAligner(object):
             yield f
 
     def write_sam(self, dest_io, include_header=True):
-        if include_header:
-            dest_io.write(self._plugin.format_sam_hdr(self._ref))
-        if self._batch.n_fragments > 0:
-            dest_io.write(self._plugin.format_sam_from_batch(self._batch, 0))
-        for idx in xrange(1, self._batch.n_fragments):
-            dest_io.write('\n')
-            dest_io.write(self._plugin.format_sam_from_batch(self._batch, idx))
+        """
+        Write the SAM for the whole batch to `dest_io`.  The SAM is formatted
+        in a single native call and, if `dest_io` has a file descriptor,
+        written straight to it.
+        """
+        if include_header and self._ref is None:
+            raise RuntimeError("Reference not loaded. You must load a reference to write the SAM header")
+        ref = self._ref if include_header else None
+        try:
+            dest_io.fileno()
+        except (AttributeError, IOError, ValueError): # e.g., StringIO
+            dest_io.write(self._plugin.write_sam(self._batch, None, ref, self._opts.n_threads))
+        else:
+            self._plugin.write_sam(self._batch, dest_io, ref, self._opts.n_threads)
 
     def format_sam_for_fragment(self, fragment):
         return self._plugin.format_sam(fragment)
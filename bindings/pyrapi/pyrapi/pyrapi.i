@@ -26,8 +26,10 @@ started calling swig with the "-builtin" option.
 %header %{
 
 /* includes injected into the C wrapper code.  */
+#include <errno.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <unistd.h>
 #include <rapi.h>
 #include <rapi_utils.h>
 
@@ -307,8 +309,13 @@ typedef struct {
   int mapq_min;
   int isize_min;
   int isize_max;
+  int isize_mode;
+  int isize_freeze_pairs;
   int n_threads;
+  rapi_bool pin_threads;
   rapi_bool share_ref_mem;
+  rapi_bool numa_replicate_ref;
+  rapi_bool verbose;
 
   /* Mismatch / Gap_Opens / Quality Trims --> Generalize ? */
 
@@ -400,6 +407,13 @@ typedef struct {
   }
 }
 
+%exception rapi_ref::prefetch {
+  $action;
+  if (PyErr_Occurred()) {
+    SWIG_fail;
+  }
+}
+
 
 %feature("python:slot", "tp_iter", functype="getiterfunc") rapi_ref::rapi___iter__;
 %extend rapi_ref {
@@ -412,7 +426,11 @@ typedef struct {
     rapi_ref* ref = (rapi_ref*) rapi_malloc(sizeof(rapi_ref));
     if (!ref) return NULL;
 
-    rapi_error_t error = rapi_ref_load(reference_path, ref);
+    rapi_error_t error;
+    // loading can take minutes for a large reference
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_ref_load(reference_path, ref);
+    Py_END_ALLOW_THREADS
     if (error == RAPI_NO_ERROR)
       return ref;
     else {
@@ -430,6 +448,10 @@ typedef struct {
     }
   }
 
+  /**
+   * Free the reference.  It must not be in use by an alignment running in
+   * another thread.
+   */
   void unload(void) {
     rapi_error_t error = rapi_ref_free($self);
     if (error != RAPI_NO_ERROR) {
@@ -459,6 +481,34 @@ typedef struct {
   const rapi_contig* rapi___getitem__(int i) const { return rapi_ref_rapi_get_contig($self, i); }
 
   rapi_contig_iter* rapi___iter__(void) const { return new_rapi_contig_iter($self->contigs, $self->n_contigs); }
+
+  /** Find a contig by name.  Returns None if there isn't one. */
+  const rapi_contig* find_contig(const char* name) const {
+    return rapi_ref_find_contig($self, name);
+  }
+
+  /** Compute the M5 checksums of the contigs (see rapi_ref_fill_md5). */
+  rapi_error_t fill_md5(int n_threads = 1) {
+    rapi_error_t error;
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_ref_fill_md5($self, n_threads);
+    Py_END_ALLOW_THREADS
+    return error;
+  }
+
+  /** Fault the reference into memory using `n_threads` threads, so that
+   * the first alignments run at full speed.  Returns the time taken in seconds.
+   */
+  double prefetch(int n_threads = 1) const {
+    double elapsed = 0;
+    rapi_error_t error;
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_ref_prefetch($self, n_threads, &elapsed);
+    Py_END_ALLOW_THREADS
+    if (error != RAPI_NO_ERROR)
+      SWIG_Error(rapi_swig_error_type(error), "Failed to prefetch the reference");
+    return elapsed;
+  }
 };
 
 /***************************************
@@ -546,13 +596,25 @@ static PyObject* rapi_py_tag_value(const rapi_tag*const tag)
             break;
         }
         case RAPI_VTYPE_TEXT: {
-            const kstring_t* s;
-            error = rapi_tag_get_text(tag, &s);
+            const char* s;
+            size_t len;
+            error = rapi_tag_get_text(tag, &s, &len);
             if (error) {
                 PERROR("rapi_tag_get_text returned error %s (%d)\n", rapi_error_name(error), error);
             }
             else
-                retval = PyString_FromStringAndSize(s->s, s->l);
+                retval = PyString_FromStringAndSize(s, len);
+            break;
+        }
+        case RAPI_VTYPE_DERIVED: {
+            kstring_t s = { 0, 0, NULL };
+            error = rapi_tag_put_text(tag, &s);
+            if (error) {
+                PERROR("rapi_tag_put_text returned error %s (%d)\n", rapi_error_name(error), error);
+            }
+            else
+                retval = PyString_FromStringAndSize(s.s, s.l);
+            free(s.s);
             break;
         }
         case RAPI_VTYPE_INT: {
@@ -606,9 +668,11 @@ static PyObject* rapi_py_tag_value(const rapi_tag*const tag)
     for (int i = 0; i < kv_size($1); ++i)
     {
         const rapi_tag*const pTag = &kv_A($1, i);
+        char key[RAPI_TAG_KEY_LEN + 1];
+        rapi_tag_get_key(pTag, key);
         PyObject* value = rapi_py_tag_value(pTag);
         if (value != NULL) {
-            if (PyDict_SetItemString(dict, pTag->key, value) < 0)
+            if (PyDict_SetItemString(dict, key, value) < 0)
                 error_msg = "Error inserting tag into dict";
         }
         else
@@ -627,6 +691,26 @@ static PyObject* rapi_py_tag_value(const rapi_tag*const tag)
         $result = dict;
 };
 
+%typemap(out) const rapi_tag* {
+    /* Map a single tag to its value, or None if there's no tag */
+    if ($1 == NULL) {
+        Py_INCREF(Py_None);
+        $result = Py_None;
+    }
+    else {
+        $result = rapi_py_tag_value($1);
+        if ($result == NULL)
+            SWIG_fail; // rapi_py_tag_value sets the exception
+    }
+};
+
+%exception rapi_alignment::get_tag {
+    $action
+    if (PyErr_Occurred()) {
+        SWIG_fail;
+    }
+}
+
 typedef struct {
     rapi_contig* contig;
     unsigned long int pos; // 1-based
@@ -666,6 +750,16 @@ typedef struct {
         return $self->tags;
     }
 
+    /** The value of the tag `key`, or None if the alignment doesn't have it. */
+    const rapi_tag* get_tag(const char* key) const {
+        rapi_tag tmp;
+        if (rapi_tag_set_key(&tmp, key) != RAPI_NO_ERROR) {
+            SWIG_Error(SWIG_ValueError, "Tag keys must be two characters long");
+            return NULL;
+        }
+        return rapi_tag_find(&$self->tags, tmp.key);
+    }
+
     int get_rlen(void) const {
       return rapi_get_rlen($self->n_cigar_ops, $self->cigar_ops);
     }
@@ -836,6 +930,8 @@ SWIGINTERN struct read_batch_iter* new_read_batch_iter(const struct rapi_batch_w
 typedef struct rapi_batch_wrap {
   rapi_batch* batch;
   rapi_ssize_t len; // number of reads inserted in batch (as opposed to the space reserved)
+  int busy;         // set while a call that released the GIL is modifying the batch
+  int n_readers;    // number of calls that released the GIL to format the batch
 } rapi_batch_wrap;
 %}
 
@@ -857,6 +953,71 @@ rapi_ssize_t rapi_batch_wrap_capacity_get(const rapi_batch_wrap* wrap) {
   return rapi_batch_read_capacity(wrap->batch);
 }
 
+/*
+ * Get the fragment range covered by the read_batch wrapper.
+ * Returns an error if the batch ends with an incomplete fragment.
+ */
+static rapi_error_t rapi_batch_wrap_frag_range(const rapi_batch_wrap* batch, rapi_ssize_t* start, rapi_ssize_t* end)
+{
+  if (batch->len % batch->batch->n_reads_frag != 0) {
+    PERROR("Incomplete fragment in batch! Number of reads appended (%lld) is not a multiple of the number of reads per fragment (%d)\n",
+      batch->len, batch->batch->n_reads_frag);
+    return RAPI_GENERIC_ERROR;
+  }
+
+  *start = 0;
+  *end = batch->len / batch->batch->n_reads_frag;
+  return RAPI_NO_ERROR;
+}
+
+/*
+ * Calls that work on a batch for a long time release the GIL, so other
+ * Python threads can run in the meantime.  Calls that modify the batch
+ * (loading reads, aligning) mark it busy so that those threads can't use it
+ * until they're done.  align_reads_async keeps it busy until the alignment
+ * is complete (see rapi_align_handle_wrap).  Formatters only read the batch,
+ * so any number of them can run at once:  they're counted as readers, which
+ * keep the batch from being modified.
+ *
+ * The flag and the count are only touched with the GIL held.
+ */
+static rapi_error_t rapi_batch_wrap_check_idle(const rapi_batch_wrap* batch)
+{
+  if (batch->busy || batch->n_readers > 0) {
+    PERROR("read_batch is in use by another thread\n");
+    return RAPI_GENERIC_ERROR;
+  }
+  return RAPI_NO_ERROR;
+}
+
+static rapi_error_t rapi_batch_wrap_acquire(rapi_batch_wrap* batch)
+{
+  rapi_error_t error = rapi_batch_wrap_check_idle(batch);
+  if (error == RAPI_NO_ERROR)
+    batch->busy = 1;
+  return error;
+}
+
+static void rapi_batch_wrap_release(rapi_batch_wrap* batch)
+{
+  batch->busy = 0;
+}
+
+static rapi_error_t rapi_batch_wrap_acquire_read(rapi_batch_wrap* batch)
+{
+  if (batch->busy) {
+    PERROR("read_batch is in use by another thread\n");
+    return RAPI_GENERIC_ERROR;
+  }
+  ++batch->n_readers;
+  return RAPI_NO_ERROR;
+}
+
+static void rapi_batch_wrap_release_read(rapi_batch_wrap* batch)
+{
+  --batch->n_readers;
+}
+
 %}
 
 // This one to the SWIG interpreter.
@@ -895,6 +1056,20 @@ typedef struct read_batch_iter {
   }
 }
 
+%exception rapi_batch_wrap::load {
+  $action
+  if (result < 0) {
+    SWIG_fail;
+  }
+}
+
+%exception rapi_batch_wrap::append_many {
+  $action
+  if (result < 0) {
+    SWIG_fail;
+  }
+}
+
 %extend rapi_batch_wrap {
 
   /**
@@ -918,6 +1093,8 @@ typedef struct read_batch_iter {
     }
 
     wrapper->len = 0;
+    wrapper->busy = 0;
+    wrapper->n_readers = 0;
 
     rapi_error_t error = rapi_reads_alloc(wrapper->batch, n_reads_per_frag, 0); // zero-sized allocation to initialize
 
@@ -974,6 +1151,8 @@ typedef struct read_batch_iter {
         PERROR("n_reads must be >= 0");
         return RAPI_PARAM_ERROR;
     }
+    if (rapi_batch_wrap_check_idle($self) != RAPI_NO_ERROR)
+      return RAPI_GENERIC_ERROR;
 
     rapi_ssize_t n_fragments = n_reads / $self->batch->n_reads_frag;
     // If the reads don't fit completely in n_fragments, add one more
@@ -992,6 +1171,10 @@ typedef struct read_batch_iter {
     if (!id) id = "";
     if (!seq) seq = "";
 
+    error = rapi_batch_wrap_check_idle($self);
+    if (error != RAPI_NO_ERROR)
+      return error;
+
     rapi_ssize_t fragment_num = $self->len / $self->batch->n_reads_frag;
     int read_num = $self->len % $self->batch->n_reads_frag;
 
@@ -1014,8 +1197,137 @@ typedef struct read_batch_iter {
     return error;
   }
 
+  /**
+   * Append all the reads in `ids`, `seqs` and `quals`, three sequences of
+   * the same length (`quals` may be None), in a single call.  The batch is
+   * grown once.  Returns the number of reads appended.  If a read is
+   * invalid, the ones before it remain in the batch.
+   */
+  rapi_ssize_t append_many(PyObject* ids, PyObject* seqs, PyObject* quals, int q_offset)
+  {
+    rapi_ssize_t retval = -1;
+    PyObject* fast_ids = NULL;
+    PyObject* fast_seqs = NULL;
+    PyObject* fast_quals = NULL;
+
+    if (rapi_batch_wrap_check_idle($self) != RAPI_NO_ERROR) {
+      SWIG_Error(SWIG_RuntimeError, "read_batch is in use by another thread");
+      return -1;
+    }
+
+    fast_ids = PySequence_Fast(ids, "ids must be a sequence");
+    if (!fast_ids) goto clean;
+    fast_seqs = PySequence_Fast(seqs, "seqs must be a sequence");
+    if (!fast_seqs) goto clean;
+    if (quals && quals != Py_None) {
+      fast_quals = PySequence_Fast(quals, "quals must be a sequence or None");
+      if (!fast_quals) goto clean;
+    }
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(fast_ids);
+    if (PySequence_Fast_GET_SIZE(fast_seqs) != n || (fast_quals && PySequence_Fast_GET_SIZE(fast_quals) != n)) {
+      SWIG_Error(SWIG_ValueError, "ids, seqs and quals must have the same length");
+      goto clean;
+    }
+
+    rapi_error_t error = RAPI_NO_ERROR;
+    if (rapi_batch_wrap_capacity_get($self) < $self->len + n) {
+      error = rapi_batch_wrap_reserve($self, $self->len + n);
+      if (error != RAPI_NO_ERROR) {
+        SWIG_Error(rapi_swig_error_type(error), "Error allocating space for reads");
+        goto clean;
+      }
+    }
+
+    const int n_reads_frag = $self->batch->n_reads_frag;
+    for (Py_ssize_t i = 0; i < n; ++i) {
+      char *id, *seq, *qual = NULL;
+      Py_ssize_t id_len, seq_len, qual_len;
+
+      // these set a TypeError if the item isn't a string
+      if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(fast_ids, i), &id, &id_len) < 0
+       || PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(fast_seqs, i), &seq, &seq_len) < 0)
+        goto clean;
+      if (fast_quals && PySequence_Fast_GET_ITEM(fast_quals, i) != Py_None) {
+        if (PyString_AsStringAndSize(PySequence_Fast_GET_ITEM(fast_quals, i), &qual, &qual_len) < 0)
+          goto clean;
+        if (qual_len != seq_len) {
+          PyErr_Format(PyExc_ValueError, "Read %zd: sequence and quality have different lengths", i);
+          goto clean;
+        }
+      }
+      if (id_len > INT_MAX || seq_len > INT_MAX) {
+        PyErr_Format(PyExc_ValueError, "Read %zd is too long", i);
+        goto clean;
+      }
+
+      error = rapi_set_read_n($self->batch, $self->len / n_reads_frag, $self->len % n_reads_frag,
+          id, id_len, seq, seq_len, qual, q_offset);
+      if (error != RAPI_NO_ERROR) {
+        PyErr_Format(rapi_py_error_type(error), "Error inserting read %zd", i);
+        goto clean;
+      }
+      ++$self->len;
+    }
+    retval = n;
+
+clean:
+    Py_XDECREF(fast_ids);
+    Py_XDECREF(fast_seqs);
+    Py_XDECREF(fast_quals);
+    return retval;
+  }
+
+  /**
+   * Append the FASTQ or PRQ records in `data`, which can be a str, bytearray,
+   * memoryview or any object supporting the buffer protocol.  `format` is
+   * 'fastq' or 'prq', as for the reader.  The records are parsed in C,
+   * without creating any Python objects.  Returns the number of fragments
+   * appended.
+   */
+  rapi_ssize_t load(PyObject* data, const char* format = "fastq") {
+    rapi_input_format fmt;
+    if (NULL == format || strcmp(format, "fastq") == 0)
+      fmt = RAPI_INPUT_FASTQ;
+    else if (strcmp(format, "prq") == 0)
+      fmt = RAPI_INPUT_PRQ;
+    else {
+      SWIG_Error(SWIG_ValueError, "format must be 'fastq' or 'prq'");
+      return -1;
+    }
+
+    Py_buffer view;
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) != 0)
+      return -1; // TypeError already set
+
+    rapi_ssize_t start_fragment, end_fragment, n_loaded = 0;
+    rapi_error_t error = rapi_batch_wrap_frag_range($self, &start_fragment, &end_fragment);
+    if (error == RAPI_NO_ERROR)
+      error = rapi_batch_wrap_acquire($self);
+    if (error == RAPI_NO_ERROR) {
+      // holding the view keeps `data` from being resized, so we can let
+      // other Python threads run while we parse
+      Py_BEGIN_ALLOW_THREADS
+      error = rapi_reads_parse($self->batch, fmt, view.buf, view.len, end_fragment, &n_loaded);
+      Py_END_ALLOW_THREADS
+      rapi_batch_wrap_release($self);
+    }
+    PyBuffer_Release(&view);
+
+    if (error != RAPI_NO_ERROR) {
+      SWIG_Error(rapi_swig_error_type(error), "Error parsing reads");
+      return -1;
+    }
+    $self->len += n_loaded * $self->batch->n_reads_frag;
+    return n_loaded;
+  }
+
   rapi_error_t clear(void) {
-    rapi_error_t error = rapi_reads_clear($self->batch);
+    rapi_error_t error = rapi_batch_wrap_check_idle($self);
+    if (error != RAPI_NO_ERROR)
+      return error;
+
+    error = rapi_reads_clear($self->batch);
     if (error == RAPI_NO_ERROR)
       $self->len = 0;
     return error;
@@ -1027,7 +1339,11 @@ typedef struct read_batch_iter {
     if (!id) id = "";
     if (!seq) seq = "";
 
-    rapi_error_t error = rapi_set_read($self->batch, n_frag, n_read, id, seq, qual, q_offset);
+    rapi_error_t error = rapi_batch_wrap_check_idle($self);
+    if (error != RAPI_NO_ERROR)
+      return error;
+
+    error = rapi_set_read($self->batch, n_frag, n_read, id, seq, qual, q_offset);
     if (error != RAPI_NO_ERROR) {
       SWIG_Error(rapi_swig_error_type(error), "Error setting read data");
     }
@@ -1091,18 +1407,357 @@ typedef struct read_batch_iter {
   }
 }
 
+/***************************************
+ ****** rapi_reader              *******
+ ***************************************/
+
+%{
+struct rapi_reader;
+%}
+
+typedef struct {
+} rapi_reader;
+
+%exception rapi_reader::fill {
+  $action
+  if (result < 0) {
+    SWIG_fail;
+  }
+}
+
+%extend rapi_reader {
+  /**
+   * Open a reader for `path1` and, for read pairs split over two files, `path2`.
+   * `format` is 'fastq' (plain or gzipped) or 'prq'.  With FASTQ and a single
+   * file, n_reads_per_frag = 2 means the pairs are interleaved.
+   */
+  rapi_reader(const char* path1, const char* path2 = NULL, const char* format = "fastq", int n_reads_per_frag = 2) {
+    rapi_input_format fmt;
+    if (NULL == path1) {
+      SWIG_Error(SWIG_ValueError, "path1 cannot be None");
+      return NULL;
+    }
+    if (NULL == format || strcmp(format, "fastq") == 0)
+      fmt = RAPI_INPUT_FASTQ;
+    else if (strcmp(format, "prq") == 0)
+      fmt = RAPI_INPUT_PRQ;
+    else {
+      SWIG_Error(SWIG_ValueError, "format must be 'fastq' or 'prq'");
+      return NULL;
+    }
+
+    struct rapi_reader* reader;
+    rapi_error_t error = rapi_reader_open(&reader, fmt, n_reads_per_frag, path1, path2);
+    if (error != RAPI_NO_ERROR) {
+      SWIG_Error(rapi_swig_error_type(error), "Error opening reader");
+      return NULL;
+    }
+    return reader;
+  }
+
+  ~rapi_reader(void) {
+    rapi_error_t error = rapi_reader_close($self);
+    if (error != RAPI_NO_ERROR)
+      PERROR("Problem closing reader (error code %d)\n", error);
+  }
+
+  /**
+   * Append up to `max_fragments` fragments to the batch, stopping early once
+   * `max_bases` bases have been read (if max_bases > 0).  Returns the number
+   * of fragments appended, which is 0 at the end of the input.
+   */
+  rapi_ssize_t fill(rapi_batch_wrap* batch, rapi_ssize_t max_fragments, rapi_ssize_t max_bases = 0) {
+    if (NULL == batch) {
+      SWIG_Error(SWIG_TypeError, "batch cannot be None");
+      return -1;
+    }
+    if (max_fragments < 0 || max_bases < 0) {
+      SWIG_Error(SWIG_ValueError, "max_fragments and max_bases must be >= 0");
+      return -1;
+    }
+
+    rapi_ssize_t start_fragment, end_fragment, n_loaded = 0;
+    rapi_error_t error = rapi_batch_wrap_frag_range(batch, &start_fragment, &end_fragment);
+    if (error == RAPI_NO_ERROR)
+      error = rapi_batch_wrap_acquire(batch);
+    if (error == RAPI_NO_ERROR) {
+      // parsing and waiting for input don't touch any Python objects
+      Py_BEGIN_ALLOW_THREADS
+      error = rapi_reader_fill($self, batch->batch, end_fragment, max_fragments, max_bases, &n_loaded);
+      Py_END_ALLOW_THREADS
+      rapi_batch_wrap_release(batch);
+    }
+
+    if (error != RAPI_NO_ERROR) {
+      SWIG_Error(rapi_swig_error_type(error), "Error reading input");
+      return -1;
+    }
+    batch->len += n_loaded * batch->batch->n_reads_frag;
+    return n_loaded;
+  }
+}
+
+/***************************************
+ ****** rapi_bgzf_writer         *******
+ ***************************************/
+
+%{
+/*
+ * Python wrapper for a rapi_bgzf_writer.  It holds a reference to the
+ * destination object, so that its file descriptor stays open while we use it.
+ */
+typedef struct rapi_bgzf_wrap {
+  rapi_bgzf_writer* writer; // NULL once closed
+  PyObject* dest;
+  int busy;                 // set while a call that released the GIL is using the writer
+} rapi_bgzf_wrap;
+
+static rapi_error_t rapi_bgzf_wrap_acquire(rapi_bgzf_wrap* wrap)
+{
+  if (NULL == wrap->writer) {
+    PERROR("bgzf_writer is closed\n");
+    return RAPI_PARAM_ERROR;
+  }
+  if (wrap->busy) {
+    PERROR("bgzf_writer is in use by another thread\n");
+    return RAPI_GENERIC_ERROR;
+  }
+  wrap->busy = 1;
+  return RAPI_NO_ERROR;
+}
+%}
+
+%rename(bgzf_writer) rapi_bgzf_wrap;
+
+typedef struct {
+} rapi_bgzf_wrap;
+
+%extend rapi_bgzf_wrap {
+  /**
+   * Open a BGZF writer on `dest`:  a file descriptor or a file object with a
+   * fileno() (which is flushed first).  Blocks are compressed at zlib
+   * compression `level` by `n_threads` threads.  Write the output of
+   * format_bam_hdr and format_bam_batch through it to make a BAM file.
+   */
+  rapi_bgzf_wrap(PyObject* dest, int level = -1, int n_threads = 1) {
+    if (PyObject_HasAttrString(dest, "flush")) {
+      PyObject* r = PyObject_CallMethod(dest, "flush", NULL);
+      if (NULL == r)
+        return NULL;
+      Py_DECREF(r);
+    }
+    int fd = PyObject_AsFileDescriptor(dest); // takes ints and objects with fileno()
+    if (fd < 0)
+      return NULL;
+
+    rapi_bgzf_wrap* wrap = (rapi_bgzf_wrap*) rapi_malloc(sizeof(rapi_bgzf_wrap));
+    if (!wrap)
+      return NULL;
+
+    rapi_error_t error = rapi_bgzf_open(&wrap->writer, fd, level, n_threads);
+    if (error != RAPI_NO_ERROR) {
+      free(wrap);
+      SWIG_Error(rapi_swig_error_type(error), "Error opening BGZF writer");
+      return NULL;
+    }
+    Py_INCREF(dest);
+    wrap->dest = dest;
+    wrap->busy = 0;
+    return wrap;
+  }
+
+  ~rapi_bgzf_wrap(void) {
+    if ($self->writer) {
+      rapi_error_t error;
+      Py_BEGIN_ALLOW_THREADS
+      error = rapi_bgzf_close($self->writer);
+      Py_END_ALLOW_THREADS
+      if (error != RAPI_NO_ERROR)
+        PERROR("Problem closing BGZF writer (error code %d)\n", error);
+    }
+    Py_XDECREF($self->dest);
+    free($self);
+  }
+
+  /** Write `data` (a str or any object with the buffer interface). */
+  rapi_error_t write(PyObject* data) {
+    Py_buffer view;
+    if (PyObject_GetBuffer(data, &view, PyBUF_SIMPLE) != 0)
+      return RAPI_TYPE_ERROR;
+
+    rapi_error_t error = rapi_bgzf_wrap_acquire($self);
+    if (error == RAPI_NO_ERROR) {
+      // full blocks are compressed and written here, so let other Python threads run
+      Py_BEGIN_ALLOW_THREADS
+      error = rapi_bgzf_write($self->writer, view.buf, view.len);
+      Py_END_ALLOW_THREADS
+      $self->busy = 0;
+    }
+    PyBuffer_Release(&view);
+    return error;
+  }
+
+  /** Compress and write all the buffered data. */
+  rapi_error_t flush(void) {
+    rapi_error_t error = rapi_bgzf_wrap_acquire($self);
+    if (error == RAPI_NO_ERROR) {
+      Py_BEGIN_ALLOW_THREADS
+      error = rapi_bgzf_flush($self->writer);
+      Py_END_ALLOW_THREADS
+      $self->busy = 0;
+    }
+    return error;
+  }
+
+  /**
+   * Flush and write the BGZF EOF marker.  The destination isn't closed.
+   * The writer can't be used afterwards.
+   */
+  rapi_error_t close(void) {
+    rapi_error_t error = rapi_bgzf_wrap_acquire($self);
+    if (error == RAPI_NO_ERROR) {
+      Py_BEGIN_ALLOW_THREADS
+      error = rapi_bgzf_close($self->writer);
+      Py_END_ALLOW_THREADS
+      $self->writer = NULL;
+      $self->busy = 0;
+      Py_CLEAR($self->dest);
+    }
+    return error;
+  }
+}
+
+/***************************************
+ ****** rapi_align_handle        *******
+ ***************************************/
+
+%{
+/*
+ * Python wrapper for a rapi_align_handle.  The background alignment reads
+ * the ref and writes into the batch, so the handle holds references to them
+ * (and to the aligner) until the alignment is complete.
+ */
+typedef struct rapi_align_handle_wrap {
+  rapi_align_handle* handle;
+  rapi_batch_wrap* batch; // marked busy until the alignment is complete
+  PyObject* keep_alive;   // (aligner, ref, read_batch);  NULL once the alignment is complete
+} rapi_align_handle_wrap;
+
+/* Call once the alignment is complete, with the GIL held. */
+static void rapi_align_handle_wrap_done(rapi_align_handle_wrap* wrap)
+{
+  if (wrap->keep_alive) {
+    rapi_batch_wrap_release(wrap->batch);
+    Py_CLEAR(wrap->keep_alive);
+  }
+}
+%}
+
+%rename(align_handle) rapi_align_handle_wrap;
+
+typedef struct {
+} rapi_align_handle_wrap;
+
+%extend rapi_align_handle_wrap {
+  ~rapi_align_handle_wrap(void) {
+    // waits for the alignment to complete, so let other Python threads run
+    Py_BEGIN_ALLOW_THREADS
+    rapi_align_handle_free($self->handle);
+    Py_END_ALLOW_THREADS
+    rapi_align_handle_wrap_done($self);
+    free($self);
+  }
+
+  /** True if the alignment is complete */
+  rapi_bool poll(void) {
+    if (!rapi_align_poll($self->handle))
+      return 0;
+    rapi_align_handle_wrap_done($self);
+    return 1;
+  }
+
+  /** Wait for the alignment to complete.  Raises an exception if it failed. */
+  rapi_error_t wait(void) {
+    rapi_error_t error;
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_align_wait($self->handle);
+    Py_END_ALLOW_THREADS
+    rapi_align_handle_wrap_done($self);
+    return error;
+  }
+}
+
+
 /***************************************
  ****** rapi_aligner             *******
  ***************************************/
 
 %{ // forward declaration of opaque structure (in C-code)
 struct rapi_aligner_state;
+
 %}
 
+/** Time spent in an alignment phase, in seconds. */
+typedef struct {
+  double wall;
+  double cpu;
+} rapi_phase_time;
+
+/** Cumulative statistics of an aligner (see rapi.h). */
+typedef struct {
+  rapi_phase_time convert_input;
+  rapi_phase_time map;
+  rapi_phase_time pestat;
+  rapi_phase_time align;
+  rapi_phase_time convert_output;
+  int64_t n_batches;
+  int64_t n_reads;
+  int64_t n_bases;
+} rapi_aligner_stats;
+
+/** Insert size distribution of the read pairs in one orientation (see rapi.h). */
+typedef struct {
+  rapi_bool failed;
+  int low;
+  int high;
+  double avg;
+  double std;
+} rapi_isize_dist;
+
 // declare the structure to SWIG as an empty struct
 typedef struct {
 } rapi_aligner_state;
 
+%newobject rapi_aligner_state::get_stats;
+%exception rapi_aligner_state::get_stats {
+  $action
+  if (result == NULL) {
+    SWIG_fail;
+  }
+}
+
+%newobject rapi_aligner_state::get_isize;
+%exception rapi_aligner_state::get_isize {
+  $action
+  if (result == NULL) {
+    SWIG_fail;
+  }
+}
+
+// The aligner as a Python object.  With swig -builtin the wrapper receives
+// it as `self`.
+%typemap(in, numinputs=0) PyObject* py_aligner {
+  $1 = self;
+}
+
+%newobject rapi_aligner_state::align_reads_async;
+%exception rapi_aligner_state::align_reads_async {
+  $action
+  if (result == NULL) {
+    SWIG_fail;
+  }
+}
+
 // attach methods to it
 %extend rapi_aligner_state {
   rapi_aligner_state(const rapi_opts* opts) {
@@ -1127,18 +1782,149 @@ typedef struct {
       return RAPI_PARAM_ERROR;
     }
 
-    if (batch->len % batch->batch->n_reads_frag != 0) {
-      PERROR("Incomplete fragment in batch! Number of reads appended (%lld) is not a multiple of the number of reads per fragment (%d)\n",
-        batch->len, batch->batch->n_reads_frag);
-      return RAPI_GENERIC_ERROR;
+    rapi_ssize_t start_fragment, end_fragment;
+    rapi_error_t error = rapi_batch_wrap_frag_range(batch, &start_fragment, &end_fragment);
+    if (error == RAPI_NO_ERROR)
+      error = rapi_batch_wrap_acquire(batch);
+    if (error != RAPI_NO_ERROR)
+      return error;
+
+    // let other Python threads (e.g., one reading the next batch) run while we align
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_align_reads(ref, batch->batch, start_fragment, end_fragment, $self);
+    Py_END_ALLOW_THREADS
+    rapi_batch_wrap_release(batch);
+    return error;
+  }
+
+  /**
+   * Align only the fragment at index `fragment` of the batch, on the calling
+   * thread.  Meant for low latency on a few fragments at a time; see
+   * rapi_align_fragment in rapi.h.
+   */
+  rapi_error_t align_fragment(const rapi_ref* ref, rapi_batch_wrap* batch, rapi_ssize_t fragment) {
+    if (NULL == ref || NULL == batch) {
+      PERROR("ref and batch arguments must not be NULL\n");
+      return RAPI_PARAM_ERROR;
     }
 
-    rapi_ssize_t start_fragment = 0;
-    rapi_ssize_t end_fragment = batch->len / batch->batch->n_reads_frag;
-    return rapi_align_reads(ref, batch->batch, start_fragment, end_fragment, $self);
+    rapi_ssize_t start_fragment, end_fragment;
+    rapi_error_t error = rapi_batch_wrap_frag_range(batch, &start_fragment, &end_fragment);
+    if (error != RAPI_NO_ERROR)
+      return error;
+    if (fragment < start_fragment || fragment >= end_fragment) {
+      PERROR("fragment %lld is out of bounds (the batch has %lld fragments)\n", fragment, end_fragment);
+      return RAPI_PARAM_ERROR;
+    }
+    error = rapi_batch_wrap_acquire(batch);
+    if (error != RAPI_NO_ERROR)
+      return error;
+
+    Py_BEGIN_ALLOW_THREADS
+    error = rapi_align_fragment(ref, batch->batch, fragment, $self);
+    Py_END_ALLOW_THREADS
+    rapi_batch_wrap_release(batch);
+    return error;
+  }
+
+  /**
+   * Start aligning the batch in the background and return an align_handle.
+   * Call `wait` on the handle to get the result.  Until then the batch is
+   * busy:  calls that would modify it raise an exception.  The handle keeps
+   * the aligner, the ref and the batch alive until the alignment is complete.
+   */
+  rapi_align_handle_wrap* align_reads_async(PyObject* py_aligner, PyObject* py_ref, PyObject* py_batch) {
+    const rapi_ref* ref = NULL;
+    rapi_batch_wrap* batch = NULL;
+    if (!SWIG_IsOK(SWIG_ConvertPtr(py_ref, (void**)&ref, SWIGTYPE_p_rapi_ref, 0))
+        || !SWIG_IsOK(SWIG_ConvertPtr(py_batch, (void**)&batch, SWIGTYPE_p_rapi_batch_wrap, 0))) {
+      SWIG_Error(SWIG_TypeError, "Expecting a ref and a read_batch");
+      return NULL;
+    }
+    if (NULL == ref || NULL == batch) {
+      SWIG_Error(SWIG_ValueError, "ref and batch arguments must not be NULL");
+      return NULL;
+    }
+
+    rapi_ssize_t start_fragment, end_fragment;
+    rapi_error_t error = rapi_batch_wrap_frag_range(batch, &start_fragment, &end_fragment);
+    if (error == RAPI_NO_ERROR)
+      error = rapi_batch_wrap_check_idle(batch);
+    if (error != RAPI_NO_ERROR) {
+      SWIG_Error(rapi_swig_error_type(error), "Error starting alignment");
+      return NULL;
+    }
+
+    rapi_align_handle_wrap* wrap = (rapi_align_handle_wrap*) rapi_malloc(sizeof(rapi_align_handle_wrap));
+    if (!wrap)
+      return NULL;
+    wrap->batch = batch;
+    wrap->keep_alive = PyTuple_Pack(3, py_aligner, py_ref, py_batch);
+    if (!wrap->keep_alive) {
+      free(wrap);
+      return NULL;
+    }
+
+    rapi_batch_wrap_acquire(batch); // can't fail:  we checked it's idle
+    error = rapi_align_reads_async(ref, batch->batch, start_fragment, end_fragment, $self, &wrap->handle);
+    if (error != RAPI_NO_ERROR) {
+      rapi_batch_wrap_release(batch);
+      Py_DECREF(wrap->keep_alive);
+      free(wrap);
+      SWIG_Error(rapi_swig_error_type(error), "Error starting alignment");
+      return NULL;
+    }
+    return wrap;
+  }
+
+  /** A snapshot of the aligner's cumulative statistics. */
+  rapi_aligner_stats* get_stats(void) {
+    rapi_aligner_stats* stats = (rapi_aligner_stats*) rapi_malloc(sizeof(rapi_aligner_stats));
+    if (stats)
+      rapi_aligner_stats_get($self, stats);
+    return stats;
+  }
+
+  rapi_error_t reset_stats(void) {
+    return rapi_aligner_stats_reset($self);
+  }
+
+  /** The insert size distribution the aligner uses for `orientation` (one of the ORIENT_* constants). */
+  rapi_isize_dist* get_isize(int orientation) {
+    if (orientation < 0 || orientation >= RAPI_N_ORIENT) {
+      SWIG_Error(SWIG_ValueError, "Invalid read pair orientation");
+      return NULL;
+    }
+    rapi_isize_dist dist[RAPI_N_ORIENT];
+    rapi_error_t error = rapi_aligner_isize_get($self, dist);
+    if (error != RAPI_NO_ERROR) {
+      SWIG_Error(rapi_swig_error_type(error), "Error getting the insert size distribution");
+      return NULL;
+    }
+    rapi_isize_dist* ret = (rapi_isize_dist*) rapi_malloc(sizeof(rapi_isize_dist));
+    if (ret)
+      *ret = dist[orientation];
+    return ret;
   }
-}
 
+  /**
+   * Fix the insert size distribution for `orientation`.  The aligner stops
+   * estimating it;  the other orientations keep their current distributions.
+   */
+  rapi_error_t set_isize(int orientation, const rapi_isize_dist* dist) {
+    if (orientation < 0 || orientation >= RAPI_N_ORIENT || NULL == dist) {
+      PERROR("Invalid read pair orientation or NULL distribution\n");
+      return RAPI_PARAM_ERROR;
+    }
+    rapi_isize_dist all[RAPI_N_ORIENT];
+    rapi_error_t error = rapi_aligner_isize_get($self, all);
+    if (error == RAPI_NO_ERROR) {
+      all[orientation] = *dist;
+      error = rapi_aligner_isize_set($self, all);
+    }
+    return error;
+  }
+}
 
 /***************************************
  ****** other stuff              *******
@@ -1243,7 +2029,10 @@ char* format_sam(PyObject* pyobj) {
 
   // now we can finally call our formatting function
   kstring_t str = { 0, 0, NULL };
-  rapi_error_t error = rapi_format_sam(read_ptrs, len, &str);
+  rapi_error_t error;
+  Py_BEGIN_ALLOW_THREADS
+  error = rapi_format_sam(read_ptrs, len, &str);
+  Py_END_ALLOW_THREADS
 
   if (error == RAPI_NO_ERROR)
     retval = str.s; // Python must free this string
@@ -1259,7 +2048,7 @@ clean:
 }
 
 
-char* format_sam_from_batch(const rapi_batch_wrap* wrapper, rapi_ssize_t n_frag) {
+char* format_sam_from_batch(rapi_batch_wrap* wrapper, rapi_ssize_t n_frag) {
   if (NULL == wrapper) {
     SWIG_Error(SWIG_TypeError, "wrapper argument cannot be None");
     return NULL;
@@ -1270,8 +2059,17 @@ char* format_sam_from_batch(const rapi_batch_wrap* wrapper, rapi_ssize_t n_frag)
     return NULL;
   }
 
+  if (rapi_batch_wrap_acquire_read(wrapper) != RAPI_NO_ERROR) {
+    SWIG_Error(SWIG_RuntimeError, "read_batch is in use by another thread");
+    return NULL;
+  }
+
   kstring_t str = { 0, 0, NULL };
-  rapi_error_t error = rapi_format_sam_b(wrapper->batch, n_frag, &str);
+  rapi_error_t error;
+  Py_BEGIN_ALLOW_THREADS
+  error = rapi_format_sam_b(wrapper->batch, n_frag, &str);
+  Py_END_ALLOW_THREADS
+  rapi_batch_wrap_release_read(wrapper);
   if (error == RAPI_NO_ERROR)
     return str.s; // Python must free this string
   else {
@@ -1281,6 +2079,40 @@ char* format_sam_from_batch(const rapi_batch_wrap* wrapper, rapi_ssize_t n_frag)
   }
 }
 
+/**
+ * Format SAM for all the complete fragments in the batch, using `n_threads`
+ * threads.  Each fragment's SAM is terminated by a newline.
+ */
+char* format_sam_batch(rapi_batch_wrap* wrapper, int n_threads) {
+  if (NULL == wrapper) {
+    SWIG_Error(SWIG_TypeError, "wrapper argument cannot be None");
+    return NULL;
+  }
+
+  if (rapi_batch_wrap_acquire_read(wrapper) != RAPI_NO_ERROR) {
+    SWIG_Error(SWIG_RuntimeError, "read_batch is in use by another thread");
+    return NULL;
+  }
+
+  kstring_t str = { 0, 0, NULL };
+  rapi_ssize_t n_fragments = wrapper->len / wrapper->batch->n_reads_frag;
+  rapi_error_t error;
+  Py_BEGIN_ALLOW_THREADS
+  error = rapi_format_sam_batch(wrapper->batch, 0, n_fragments, n_threads, &str);
+  Py_END_ALLOW_THREADS
+  rapi_batch_wrap_release_read(wrapper);
+  if (error == RAPI_NO_ERROR) {
+    if (NULL == str.s) // empty batch
+      kputsn("", 0, &str);
+    return str.s; // Python must free this string
+  }
+  else {
+    free(str.s);
+    SWIG_Error(rapi_swig_error_type(error), "Error formatting SAM");
+    return NULL;
+  }
+}
+
 char* format_sam_hdr(const rapi_ref* ref)
 {
   if (NULL == ref) {
@@ -1289,7 +2121,10 @@ char* format_sam_hdr(const rapi_ref* ref)
   }
 
   kstring_t str = { 0, 0, NULL };
-  rapi_error_t error = rapi_format_sam_hdr(ref, &str);
+  rapi_error_t error;
+  Py_BEGIN_ALLOW_THREADS
+  error = rapi_format_sam_hdr(ref, &str);
+  Py_END_ALLOW_THREADS
   if (error == RAPI_NO_ERROR)
     return str.s; // Python must free this string
   else {
@@ -1300,6 +2135,164 @@ char* format_sam_hdr(const rapi_ref* ref)
 }
 %}
 
+%rename(write_sam) rapi_write_sam_wrapper;
+
+/**
+ * Format the SAM for all the complete fragments in the batch into a single
+ * buffer, using `n_threads` threads, and write it to `dest`:  a file
+ * descriptor or a file object with a fileno() (which is flushed first).  If
+ * `ref` is given, the SAM header is written first.  If `dest` is None, the
+ * SAM is returned as a str instead.
+ */
+PyObject* rapi_write_sam_wrapper(rapi_batch_wrap* batch, PyObject* dest = NULL, const rapi_ref* ref = NULL, int n_threads = 1);
+
+%{
+/* Write all of `data` to `fd`.  Returns 0 or the errno of the failed write. */
+static int rapi_write_fd(int fd, const char* data, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+PyObject* rapi_write_sam_wrapper(rapi_batch_wrap* wrapper, PyObject* dest, const rapi_ref* ref, int n_threads)
+{
+  if (NULL == wrapper) {
+    SWIG_Error(SWIG_TypeError, "batch argument cannot be None");
+    return NULL;
+  }
+
+  int fd = -1;
+  if (dest && dest != Py_None) {
+    // flush what Python has buffered for a file object to keep the output in order
+    if (PyObject_HasAttrString(dest, "flush")) {
+      PyObject* r = PyObject_CallMethod(dest, "flush", NULL);
+      if (NULL == r)
+        return NULL;
+      Py_DECREF(r);
+    }
+    fd = PyObject_AsFileDescriptor(dest); // takes ints and objects with fileno()
+    if (fd < 0)
+      return NULL;
+  }
+
+  if (rapi_batch_wrap_acquire_read(wrapper) != RAPI_NO_ERROR) {
+    SWIG_Error(SWIG_RuntimeError, "read_batch is in use by another thread");
+    return NULL;
+  }
+
+  kstring_t str = { 0, 0, NULL };
+  rapi_ssize_t n_fragments = wrapper->len / wrapper->batch->n_reads_frag;
+  rapi_error_t error = RAPI_NO_ERROR;
+  int write_errno = 0;
+  Py_BEGIN_ALLOW_THREADS
+  if (ref) {
+    error = rapi_format_sam_hdr(ref, &str);
+    if (error == RAPI_NO_ERROR)
+      kputc('\n', &str);
+  }
+  if (error == RAPI_NO_ERROR)
+    error = rapi_format_sam_batch(wrapper->batch, 0, n_fragments, n_threads, &str);
+  if (error == RAPI_NO_ERROR && fd >= 0)
+    write_errno = rapi_write_fd(fd, str.s, str.l);
+  Py_END_ALLOW_THREADS
+  rapi_batch_wrap_release_read(wrapper);
+
+  PyObject* retval = NULL;
+  if (error != RAPI_NO_ERROR)
+    SWIG_Error(rapi_swig_error_type(error), "Error formatting SAM");
+  else if (write_errno != 0) {
+    errno = write_errno;
+    PyErr_SetFromErrno(PyExc_IOError);
+  }
+  else if (fd >= 0) {
+    Py_INCREF(Py_None);
+    retval = Py_None;
+  }
+  else
+    retval = PyString_FromStringAndSize(str.s ? str.s : "", str.l);
+
+  free(str.s);
+  return retval;
+}
+%}
+
+%rename(format_bam_hdr) rapi_format_bam_hdr_wrapper;
+%rename(format_bam_batch) rapi_format_bam_batch_wrapper;
+
+/**
+ * Format the BAM header for `ref` and return it as a str.  Like the records
+ * from format_bam_batch, it's uncompressed:  write it through a bgzf_writer.
+ */
+PyObject* rapi_format_bam_hdr_wrapper(const rapi_ref* ref);
+
+/**
+ * Format the BAM records for all the complete fragments in the batch, using
+ * `n_threads` threads, and return them as a str.
+ */
+PyObject* rapi_format_bam_batch_wrapper(const rapi_ref* ref, rapi_batch_wrap* batch, int n_threads = 1);
+
+%{
+PyObject* rapi_format_bam_hdr_wrapper(const rapi_ref* ref)
+{
+  if (NULL == ref) {
+    SWIG_Error(SWIG_TypeError, "ref argument cannot be None");
+    return NULL;
+  }
+
+  kstring_t str = { 0, 0, NULL };
+  rapi_error_t error;
+  Py_BEGIN_ALLOW_THREADS
+  error = rapi_format_bam_hdr(ref, &str);
+  Py_END_ALLOW_THREADS
+
+  PyObject* retval = NULL;
+  if (error == RAPI_NO_ERROR)
+    retval = PyString_FromStringAndSize(str.s, str.l);
+  else
+    SWIG_Error(rapi_swig_error_type(error), "Error formatting BAM header");
+  free(str.s);
+  return retval;
+}
+
+PyObject* rapi_format_bam_batch_wrapper(const rapi_ref* ref, rapi_batch_wrap* wrapper, int n_threads)
+{
+  if (NULL == ref || NULL == wrapper) {
+    SWIG_Error(SWIG_TypeError, "ref and batch arguments cannot be None");
+    return NULL;
+  }
+
+  if (rapi_batch_wrap_acquire_read(wrapper) != RAPI_NO_ERROR) {
+    SWIG_Error(SWIG_RuntimeError, "read_batch is in use by another thread");
+    return NULL;
+  }
+
+  kstring_t str = { 0, 0, NULL };
+  rapi_ssize_t n_fragments = wrapper->len / wrapper->batch->n_reads_frag;
+  rapi_error_t error;
+  Py_BEGIN_ALLOW_THREADS
+  error = rapi_format_bam_batch(ref, wrapper->batch, 0, n_fragments, n_threads, &str);
+  Py_END_ALLOW_THREADS
+  rapi_batch_wrap_release_read(wrapper);
+
+  PyObject* retval = NULL;
+  if (error == RAPI_NO_ERROR)
+    retval = PyString_FromStringAndSize(str.s ? str.s : "", str.l);
+  else
+    SWIG_Error(rapi_swig_error_type(error), "Error formatting BAM");
+  free(str.s);
+  return retval;
+}
+%}
+
 long rapi_get_insert_size(const rapi_alignment* read, const rapi_alignment* mate);
 
 // vim: set et sw=2 ts=2
@@ -28,8 +28,14 @@ MiniRefSequencesTxt = \
             os.path.join(
                 os.path.dirname(__file__), '../../../tests/mini_ref/mini_ref_seqs.txt'))
 
+MiniRefSequencesFastq = \
+        os.path.abspath(
+            os.path.join(
+                os.path.dirname(__file__), '../../../tests/mini_ref/mini_ref_seqs.fastq'))
+
 # we cache the list produced by get_mini_ref_seqs
 _mini_ref_seqs = None
+_mini_ref_sequence = None
 
 def read_seqs(filename):
     """
@@ -48,6 +54,16 @@ def get_mini_ref_seqs():
         _mini_ref_seqs = read_seqs(MiniRefSequencesTxt)
     return _mini_ref_seqs
 
+def get_mini_ref_sequence():
+    """
+    The sequence of the (single) contig in the mini reference.
+    """
+    global _mini_ref_sequence
+    if _mini_ref_sequence is None:
+        with open(MiniRef) as f:
+            _mini_ref_sequence = ''.join( line.strip() for line in f if not line.startswith('>') )
+    return _mini_ref_sequence
+
 
 _complement = {
     'A':'T',
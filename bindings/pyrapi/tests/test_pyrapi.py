@@ -16,9 +16,16 @@
 # SOFTWARE.
 ###############################################################################
 
+import hashlib
+import os
 import re
+import struct
 import sys
+import tempfile
+import threading
+import time
 import unittest
+import zlib
 
 import stuff
 
@@ -65,10 +72,29 @@ class TestPyrapi(unittest.TestCase):
         self.opts.isize_max = 500
         self.assertEquals(500, self.opts.isize_max)
 
+        self.assertEquals(rapi.ISIZE_PER_BATCH, self.opts.isize_mode)
+        self.opts.isize_mode = rapi.ISIZE_RUNNING
+        self.assertEquals(rapi.ISIZE_RUNNING, self.opts.isize_mode)
+
+        self.opts.isize_freeze_pairs = 1000
+        self.assertEquals(1000, self.opts.isize_freeze_pairs)
+
         self.assertEquals(True, self.opts.share_ref_mem)
         self.opts.share_ref_mem = False
         self.assertEquals(False, self.opts.share_ref_mem)
 
+        self.assertEquals(False, self.opts.pin_threads)
+        self.opts.pin_threads = True
+        self.assertEquals(True, self.opts.pin_threads)
+
+        self.assertEquals(False, self.opts.numa_replicate_ref)
+        self.opts.numa_replicate_ref = True
+        self.assertEquals(True, self.opts.numa_replicate_ref)
+
+        self.assertEquals(False, self.opts.verbose)
+        self.opts.verbose = True
+        self.assertEquals(True, self.opts.verbose)
+
     def test_rev_comp(self):
         seq = "AGCTN" # odd length
         self.assertEquals("NAGCT", rapi.rev_comp(seq))
@@ -101,6 +127,82 @@ class TestPyrapiRef(unittest.TestCase):
     def test_ref_len(self):
         self.assertEqual(1, len(self.ref))
 
+    def test_ref_load_shared(self):
+        # loading the same index again, even through a different path,
+        # returns a handle to the same contig table
+        rel_path = os.path.relpath(stuff.MiniRef)
+        ref2 = rapi.ref(rel_path)
+        try:
+            self.assertEqual(rel_path, ref2.path)
+            self.assertEqual(int(self.ref[0].this), int(ref2[0].this))
+        finally:
+            ref2.unload()
+        # the index stays loaded as long as someone holds a handle
+        self.assertEqual('chr1', self.ref[0].name)
+        self.assertEqual(60000, self.ref[0].len)
+
+    def test_ref_load_concurrent(self):
+        # threads loading the same index at the same time share one copy;
+        # the ones loading a bad path all fail
+        refs, errors = [], []
+        def load(path):
+            try:
+                refs.append(rapi.ref(path))
+            except RuntimeError as e:
+                errors.append(e)
+        threads = [ threading.Thread(target=load, args=(p,))
+                    for p in [stuff.MiniRef] * 4 + ['bad/path'] * 2 ]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        try:
+            self.assertEqual(4, len(refs))
+            self.assertEqual(2, len(errors))
+            for r in refs:
+                self.assertEqual(int(self.ref[0].this), int(r[0].this))
+        finally:
+            for r in refs:
+                r.unload()
+        self.assertEqual('chr1', self.ref[0].name)
+
+    def test_find_contig(self):
+        c = self.ref.find_contig('chr1')
+        self.assertIsNotNone(c)
+        self.assertEqual('chr1', c.name)
+        self.assertEqual(60000, c.len)
+        self.assertIsNone(self.ref.find_contig('chr2'))
+        self.assertIsNone(self.ref.find_contig(''))
+
+    def test_fill_md5(self):
+        expected = hashlib.md5(stuff.get_mini_ref_sequence().upper()).hexdigest()
+        sidecar = stuff.MiniRef + '.md5'
+        try:
+            self.ref.fill_md5(2)
+            self.assertEqual(expected, self.ref[0].md5)
+            self.assertTrue('\tM5:%s' % expected in rapi.format_sam_hdr(self.ref))
+            # a fresh load gets the checksums from the cache
+            self.assertTrue(os.path.exists(sidecar))
+            self.ref.unload()
+            self.ref = rapi.ref(stuff.MiniRef)
+            self.assertIsNone(self.ref[0].md5)
+            self.ref.fill_md5()
+            self.assertEqual(expected, self.ref[0].md5)
+        finally:
+            if os.path.exists(sidecar):
+                os.remove(sidecar)
+
+    def test_ref_prefetch(self):
+        self.assertTrue(self.ref.prefetch() >= 0)
+        self.assertTrue(self.ref.prefetch(4) >= 0)
+        # the reference is still usable afterwards
+        self.assertEqual('chr1', self.ref[0].name)
+
+    def test_ref_reload_after_unload(self):
+        self.ref.unload()
+        self.ref = rapi.ref(stuff.MiniRef)
+        self.assertEqual('chr1', self.ref[0].name)
+
     def test_ref_iteration(self):
         contigs = [ c for c in self.ref ]
         self.assertEquals(1, len(contigs))
@@ -217,6 +319,101 @@ class TestPyrapiReadBatch(unittest.TestCase):
         self.assertRaises(ValueError, self.w.append, "some id", None, None, rapi.QENC_SANGER)
         self.assertRaises(TypeError, self.w.append, "some id", "AGCT", None, None)
 
+    def test_append_many(self):
+        seqs = stuff.get_mini_ref_seqs()
+        ids = [ s[0] for s in seqs for _ in (0, 1) ]
+        reads = [ r for s in seqs for r in (s[1], s[3]) ]
+        quals = [ q for s in seqs for q in (s[2], s[4]) ]
+        self.assertEquals(len(ids), self.w.append_many(ids, reads, quals, rapi.QENC_SANGER))
+        self.assertEquals(len(ids), len(self.w))
+        self.assertEquals(len(seqs), self.w.n_fragments)
+        for idx, fragment in enumerate(self.w):
+            self.assertEquals(seqs[idx][0], fragment[0].id)
+            self.assertEquals(seqs[idx][1], fragment[0].seq)
+            self.assertEquals(seqs[idx][2], fragment[0].qual)
+            self.assertEquals(seqs[idx][3], fragment[1].seq)
+            self.assertEquals(seqs[idx][4], fragment[1].qual)
+        # without base qualities, appending to what's there
+        self.assertEquals(2, self.w.append_many(ids[0:2], reads[0:2], None, rapi.QENC_SANGER))
+        self.assertEquals(len(ids) + 2, len(self.w))
+        self.assertIsNone(self.w.get_read(len(seqs), 1).qual)
+
+    def test_append_many_bad_args(self):
+        seq_pair = stuff.get_mini_ref_seqs()[0]
+        self.assertRaises(ValueError, self.w.append_many, ['a', 'b'], [seq_pair[1]], None, rapi.QENC_SANGER)
+        self.assertRaises(ValueError, self.w.append_many, ['a'], [seq_pair[1]], [seq_pair[2][1:]], rapi.QENC_SANGER)
+        self.assertRaises(TypeError, self.w.append_many, ['a'], [None], None, rapi.QENC_SANGER)
+        self.assertRaises(TypeError, self.w.append_many, None, [seq_pair[1]], None, rapi.QENC_SANGER)
+        # the reads before the bad one are kept
+        self.assertRaises(ValueError, self.w.append_many, ['a', 'b'], [seq_pair[1], ''], None, rapi.QENC_SANGER)
+        self.assertEquals(1, len(self.w))
+
+    def test_load_fastq(self):
+        seqs = stuff.get_mini_ref_seqs()
+        with open(stuff.MiniRefSequencesFastq) as f:
+            data = f.read()
+        self.assertEquals(len(seqs), self.w.load(data))
+        self._assert_batch_has_seqs(self.w, seqs)
+        # appends to the batch and takes any object with a buffer
+        self.assertEquals(len(seqs), self.w.load(bytearray(data), 'fastq'))
+        self.assertEquals(2 * len(seqs), self.w.n_fragments)
+        self.assertEquals(seqs[0][3], self.w.get_read(len(seqs), 1).seq)
+        # single-end
+        batch = rapi.read_batch(1)
+        self.assertEquals(2 * len(seqs), batch.load(memoryview(data)))
+
+    def test_load_read_ids(self):
+        # ids are trimmed like append does:  only the /1 and /2 suffixes are removed
+        ids = [ 'r/1', 'r/2', 'r/3', 'r/12' ]
+        data = ''.join('@%s\nACGT\n+\nIIII\n' % i for i in ids)
+        batch = rapi.read_batch(1)
+        self.assertEquals(len(ids), batch.load(data))
+        for name in ids:
+            batch.append(name, 'ACGT', 'IIII', rapi.QENC_SANGER)
+        for i in xrange(len(ids)):
+            self.assertEquals(batch.get_read(len(ids) + i, 0).id, batch.get_read(i, 0).id)
+        self.assertEquals([ 'r', 'r', 'r/3', 'r/12' ], [ batch.get_read(i, 0).id for i in xrange(len(ids)) ])
+        # PRQ fragment ids are trimmed like FASTQ names
+        batch = rapi.read_batch(2)
+        batch.load('r/1 comment\tACGT\tIIII\tACGT\tIIII\n', 'prq')
+        batch.load('@r/1 comment\nACGT\n+\nIIII\n@r/2\nACGT\n+\nIIII\n')
+        self.assertEquals([ 'r' ] * 4, [ batch.get_read(f, i).id for f in (0, 1) for i in (0, 1) ])
+
+    def test_load_prq(self):
+        with open(stuff.MiniRefSequencesTxt) as f:
+            data = f.read()
+        self.assertEquals(len(stuff.get_mini_ref_seqs()), self.w.load(data, format='prq'))
+        self._assert_batch_has_seqs(self.w, stuff.get_mini_ref_seqs())
+        self.assertEquals(0, self.w.load('', format='prq'))
+
+    def test_load_bad_args(self):
+        with open(stuff.MiniRefSequencesFastq) as f:
+            data = f.read()
+        self.assertRaises(ValueError, self.w.load, data, 'sam')
+        self.assertRaises(TypeError, self.w.load, None)
+        self.assertRaises(ValueError, rapi.read_batch(1).load, data, 'prq')
+        # truncated record
+        self.assertRaises(RuntimeError, self.w.load, data[:-10])
+        # the batch must not end with an incomplete fragment
+        w = rapi.read_batch(2)
+        w.append('id', 'AAAA', None, rapi.QENC_SANGER)
+        self.assertRaises(RuntimeError, w.load, data)
+
+    def test_load_error_leaves_batch_unchanged(self):
+        seqs = stuff.get_mini_ref_seqs()
+        with open(stuff.MiniRefSequencesFastq) as f:
+            data = f.read()
+        self.assertEquals(len(seqs), self.w.load(data))
+        # complete fragments followed by a pair whose mate is truncated
+        # (the first read's 4 lines and the mate's first 2)
+        truncated = ''.join(data.splitlines(True)[0:6])
+        self.assertRaises(RuntimeError, self.w.load, data + truncated)
+        self.assertEquals(len(seqs), self.w.n_fragments)
+        # the fragments that were parsed before the error are gone:  the
+        # batch ends where it did and can be appended to
+        self.assertEquals(len(seqs), self.w.load(data))
+        self._assert_batch_has_seqs(self.w, seqs + seqs)
+
     def test_clear(self):
         seq_pair = stuff.get_mini_ref_seqs()[0]
         self.w.append(seq_pair[0], seq_pair[1], seq_pair[2], rapi.QENC_SANGER)
@@ -308,6 +505,83 @@ class TestPyrapiReadBatch(unittest.TestCase):
         fragment = next(it)
         self.assertEquals(1, len(fragment))
 
+    def _assert_batch_has_seqs(self, batch, seqs):
+        self.assertEquals(len(seqs), batch.n_fragments)
+        for idx, fragment in enumerate(batch):
+            self.assertEquals(seqs[idx][0], fragment[0].id)
+            self.assertEquals(seqs[idx][1], fragment[0].seq)
+            self.assertEquals(seqs[idx][2], fragment[0].qual)
+            self.assertEquals(seqs[idx][0], fragment[1].id)
+            self.assertEquals(seqs[idx][3], fragment[1].seq)
+            self.assertEquals(seqs[idx][4], fragment[1].qual)
+
+    def test_reader_fastq_interleaved(self):
+        reader = rapi.reader(stuff.MiniRefSequencesFastq)
+        self.assertEquals(len(stuff.get_mini_ref_seqs()), reader.fill(self.w, 1000))
+        self._assert_batch_has_seqs(self.w, stuff.get_mini_ref_seqs())
+        # end of input
+        self.assertEquals(0, reader.fill(self.w, 1000))
+
+    def test_reader_prq(self):
+        reader = rapi.reader(stuff.MiniRefSequencesTxt, format='prq')
+        reader.fill(self.w, 1000)
+        self._assert_batch_has_seqs(self.w, stuff.get_mini_ref_seqs())
+
+    def test_reader_appends(self):
+        seqs = stuff.get_mini_ref_seqs()
+        self.w.append(seqs[0][0], seqs[0][1], seqs[0][2], rapi.QENC_SANGER)
+        self.w.append(seqs[0][0], seqs[0][3], seqs[0][4], rapi.QENC_SANGER)
+        reader = rapi.reader(stuff.MiniRefSequencesTxt, format='prq')
+        # fragment budget
+        self.assertEquals(2, reader.fill(self.w, 2))
+        self._assert_batch_has_seqs(self.w, (seqs[0],) + seqs[0:2])
+        # base budget:  we stop after the first fragment that reaches it
+        self.assertEquals(1, reader.fill(self.w, 1000, 1))
+        self._assert_batch_has_seqs(self.w, (seqs[0],) + seqs[0:3])
+
+    def test_reader_single_end(self):
+        batch = rapi.read_batch(1)
+        reader = rapi.reader(stuff.MiniRefSequencesFastq, n_reads_per_frag=1)
+        self.assertEquals(2 * len(stuff.get_mini_ref_seqs()), reader.fill(batch, 1000))
+        self.assertEquals(stuff.get_mini_ref_seqs()[0][3], batch.get_read(1, 0).seq)
+
+    def test_reader_fill_releases_gil(self):
+        # fill waits for input with the GIL released and the batch marked busy
+        rfd, wfd = os.pipe()
+        reader = rapi.reader('/dev/fd/%d' % rfd)
+        result = []
+        t = threading.Thread(target=lambda: result.append(reader.fill(self.w, 1000)))
+        t.start()
+        busy = False
+        deadline = time.time() + 10
+        while not busy and time.time() < deadline:
+            try:
+                self.w.reserve(2)
+                time.sleep(0.01)
+            except RuntimeError:
+                busy = True
+        with open(stuff.MiniRefSequencesFastq) as f:
+            os.write(wfd, f.read())
+        os.close(wfd)
+        t.join()
+        os.close(rfd)
+        self.assertTrue(busy)
+        self.assertEquals([ len(stuff.get_mini_ref_seqs()) ], result)
+        # the batch can be modified again
+        self.w.reserve(2)
+        self._assert_batch_has_seqs(self.w, stuff.get_mini_ref_seqs())
+
+    def test_reader_bad_args(self):
+        self.assertRaises(RuntimeError, rapi.reader, '/not/a/file.fastq')
+        self.assertRaises(ValueError, rapi.reader, stuff.MiniRefSequencesTxt, format='sam')
+        self.assertRaises(ValueError, rapi.reader, stuff.MiniRefSequencesTxt, format='prq', n_reads_per_frag=1)
+        # the batch must have the same number of reads per fragment as the reader
+        reader = rapi.reader(stuff.MiniRefSequencesFastq)
+        self.assertRaises(ValueError, reader.fill, rapi.read_batch(1), 10)
+        # and it must not end with an incomplete fragment
+        self.w.append('id', 'AAAA', None, rapi.QENC_SANGER)
+        self.assertRaises(RuntimeError, reader.fill, self.w, 10)
+
 
 class TestPyrapiAlignment(unittest.TestCase):
 
@@ -415,6 +689,33 @@ class TestPyrapiAlignment(unittest.TestCase):
         md_tag = aln.get_tags()['MD']
         self.assertEqual('15T16C27', md_tag)
 
+    def test_get_tag(self):
+        aln = self.batch.get_read(0, 0).get_aln(0)
+        self.assertEqual('60', aln.get_tag('MD'))
+        self.assertEqual(0, aln.get_tag('XS'))
+        self.assertIsNone(aln.get_tag('SA'))
+        self.assertEqual('11^CCC49', self.batch.get_read(1, 0).get_aln(0).get_tag('MD'))
+        self.assertRaises(ValueError, aln.get_tag, 'MDX')
+        self.assertRaises(ValueError, aln.get_tag, 'M')
+
+    def test_sa_tag(self):
+        # a chimeric read, made of pieces from two distant parts of the reference
+        ref_seq = stuff.get_mini_ref_sequence()
+        batch = rapi.read_batch(1)
+        batch.append('chimera', ref_seq[30000:30060] + ref_seq[45000:45060], None, rapi.QENC_SANGER)
+        rapi.aligner(self.opts).align_reads(self.ref, batch)
+
+        rapi_read = batch.get_read(0, 0)
+        self.assertEqual(2, rapi_read.n_alignments)
+        for i in 0, 1:
+            aln = rapi_read.get_aln(i)
+            other = rapi_read.get_aln(1 - i)
+            # the SA tag of each alignment refers to the other one
+            sa = aln.get_tag('SA')
+            self.assertTrue(sa.startswith('chr1,%d,+,' % other.pos))
+            self.assertEqual(sa, aln.get_tags()['SA'])
+        self.assertEqual(2, rapi.format_sam_batch(batch, 1).count('\tSA:Z:chr1,'))
+
     def test_get_aln_out_of_bounds(self):
         rapi_read = self.batch.get_read(0, 0)
         self.assertRaises(IndexError, rapi_read.get_aln, -1)
@@ -465,6 +766,14 @@ class TestPyrapiAlignment(unittest.TestCase):
         for i in xrange(len(rapi_sam)):
             self._compare_sam_records(self.ExpectedSam[i], rapi_sam[i])
 
+    def test_sam_whole_batch(self):
+        self.assertRaises(TypeError, rapi.format_sam_batch, None, 1)
+        expected = ''.join(
+            rapi.format_sam_from_batch(self.batch, i) + '\n' for i in xrange(self.batch.n_fragments))
+        for n_threads in 1, 3:
+            self.assertEquals(expected, rapi.format_sam_batch(self.batch, n_threads))
+        self.assertEquals('', rapi.format_sam_batch(rapi.read_batch(2), 2))
+
     def test_sam_fragment(self):
         self.assertRaises(TypeError, rapi.format_sam)
         self.assertRaises(TypeError, rapi.format_sam, 42)
@@ -476,6 +785,229 @@ class TestPyrapiAlignment(unittest.TestCase):
         for i in 0, 1:
             self._compare_sam_records(self.ExpectedSam[i], rapi_sam[i])
 
+    def test_write_sam(self):
+        expected = rapi.format_sam_batch(self.batch, 1)
+        header = rapi.format_sam_hdr(self.ref) + '\n'
+        # without a destination we get the SAM back
+        self.assertEquals(expected, rapi.write_sam(self.batch))
+        self.assertEquals(header + expected, rapi.write_sam(self.batch, None, self.ref, 2))
+        self.assertEquals('', rapi.write_sam(rapi.read_batch(2)))
+        # to a file object (after what it has buffered) and to a file descriptor
+        with tempfile.TemporaryFile() as f:
+            f.write('before\n')
+            self.assertIsNone(rapi.write_sam(self.batch, f))
+            self.assertIsNone(rapi.write_sam(self.batch, f.fileno(), self.ref))
+            f.seek(0)
+            self.assertEquals('before\n' + expected + header + expected, f.read())
+
+    def test_write_sam_bad_args(self):
+        self.assertRaises(TypeError, rapi.write_sam, None)
+        self.assertRaises(TypeError, rapi.write_sam, self.batch, 'not a file')
+        self.assertRaises(ValueError, rapi.write_sam, self.batch, -1)
+        r, w = os.pipe()
+        os.close(r)
+        os.close(w)
+        self.assertRaises(IOError, rapi.write_sam, self.batch, w)
+
+    def test_format_concurrently(self):
+        # formatters only read the batch, so two threads can format it at once
+        for _ in xrange(100):
+            for row in stuff.get_mini_ref_seqs():
+                self.batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+        expected = rapi.format_sam_batch(self.batch, 1)
+        r, w = os.pipe()
+        self.assertTrue(len(expected) > 1 << 17) # more than the pipe holds
+        # write_sam blocks on the full pipe with the GIL released, still using the batch
+        t = threading.Thread(target=rapi.write_sam, args=(self.batch, w))
+        t.start()
+        received = [ os.read(r, 1) ]
+        self.assertEquals(expected, rapi.format_sam_batch(self.batch, 2))
+        self.assertEquals(expected[0:1000], rapi.write_sam(self.batch)[0:1000])
+        # but it can't be modified
+        self.assertRaises(RuntimeError, self.batch.clear)
+        n_received = 1
+        while n_received < len(expected):
+            received.append(os.read(r, 1 << 16))
+            n_received += len(received[-1])
+        t.join()
+        os.close(r)
+        os.close(w)
+        self.assertEquals(expected, ''.join(received))
+        self.batch.clear()
+
+    @staticmethod
+    def _reg2bin(beg, end):
+        # from the SAM specification
+        end -= 1
+        for shift, offset in (14, 4681), (17, 585), (20, 73), (23, 9), (26, 1):
+            if beg >> shift == end >> shift:
+                return offset + (beg >> shift)
+        return 0
+
+    def _bam_records_to_sam(self, data):
+        # Decode uncompressed BAM records into SAM lines, checking the bin on the way
+        contigs = [ c.name for c in self.ref ]
+        int_types = dict(c='b', C='B', s='h', S='H', i='i', I='I')
+        lines = []
+        offset = 0
+        while offset < len(data):
+            block_size, = struct.unpack_from('<i', data, offset)
+            rec = data[offset + 4:offset + 4 + block_size]
+            self.assertEquals(block_size, len(rec))
+            offset += 4 + block_size
+
+            ref_id, pos, l_name, mapq, bin_, n_cigar, flag, l_seq, next_ref_id, next_pos, tlen = \
+                struct.unpack_from('<iiBBHHHiiii', rec)
+            p = 32
+            name = rec[p:p + l_name - 1]
+            self.assertEquals('\0', rec[p + l_name - 1])
+            p += l_name
+            cigar_ops = [ (c >> 4, 'MIDNSHP=X'[c & 0xf]) for c in struct.unpack_from('<%dI' % n_cigar, rec, p) ]
+            p += 4 * n_cigar
+            packed = rec[p:p + (l_seq + 1) // 2]
+            p += len(packed)
+            seq = ''.join('=ACMGRSVTWYHKDBN'[(ord(packed[i // 2]) >> (4 * (1 - i % 2))) & 0xf] for i in xrange(l_seq))
+            qual = rec[p:p + l_seq]
+            p += l_seq
+            tags = []
+            while p < len(rec):
+                key, t = rec[p:p + 2], rec[p + 2]
+                p += 3
+                if t == 'Z':
+                    end = rec.index('\0', p)
+                    value, p = rec[p:end], end + 1
+                elif t == 'A':
+                    value, p = rec[p], p + 1
+                else:
+                    fmt = '<' + int_types[t]
+                    value, = struct.unpack_from(fmt, rec, p)
+                    p += struct.calcsize(fmt)
+                    t = 'i'
+                tags.append('%s:%s:%s' % (key, t, value))
+
+            end = pos + sum(n for n, op in cigar_ops if op in 'MDN=X')
+            self.assertEquals(self._reg2bin(pos, max(end, pos + 1)), bin_)
+
+            if next_ref_id < 0:
+                rnext = '*'
+            elif next_ref_id == ref_id:
+                rnext = '='
+            else:
+                rnext = contigs[next_ref_id]
+            fields = [
+                name, flag, contigs[ref_id] if ref_id >= 0 else '*', pos + 1, mapq,
+                ''.join('%d%s' % op for op in cigar_ops) or '*', rnext, next_pos + 1, tlen,
+                seq or '*',
+                '*' if not qual or qual == '\xff' * l_seq else ''.join(chr(ord(q) + 33) for q in qual) ]
+            lines.append('\t'.join(map(str, fields + tags)))
+        return lines
+
+    def test_bam_hdr(self):
+        self.assertRaises(TypeError, rapi.format_bam_hdr, None)
+        hdr = rapi.format_bam_hdr(self.ref)
+        self.assertEquals('BAM\1', hdr[0:4])
+        l_text, = struct.unpack_from('<i', hdr, 4)
+        self.assertEquals(rapi.format_sam_hdr(self.ref) + '\n', hdr[8:8 + l_text])
+        p = 8 + l_text
+        self.assertEquals((1, 5), struct.unpack_from('<ii', hdr, p))
+        self.assertEquals('chr1\0', hdr[p + 8:p + 13])
+        self.assertEquals((60000,), struct.unpack_from('<i', hdr, p + 13))
+        self.assertEquals(p + 17, len(hdr))
+
+    def test_bam_records(self):
+        self.assertRaises(TypeError, rapi.format_bam_batch, None, self.batch)
+        self.assertRaises(TypeError, rapi.format_bam_batch, self.ref, None)
+        self.assertEquals('', rapi.format_bam_batch(self.ref, rapi.read_batch(2)))
+
+        bam = rapi.format_bam_batch(self.ref, self.batch)
+        # the first record, field by field
+        self.assertEquals(
+                (0, 32460, len('read_00') + 1, 60, 4682, 1, 65, 60, 0, 32580, 121),
+                struct.unpack_from('<iiBBHHHiiii', bam, 4))
+        self.assertEquals('read_00\0', bam[36:44])
+        self.assertEquals((60 << 4,), struct.unpack_from('<I', bam, 44)) # 60M
+
+        # the records carry the same information as the SAM
+        sam = rapi.format_sam_batch(self.batch, 1).rstrip('\n').split('\n')
+        for n_threads in 1, 3:
+            decoded = self._bam_records_to_sam(rapi.format_bam_batch(self.ref, self.batch, n_threads))
+            self.assertEquals(len(sam), len(decoded))
+            for a, b in zip(sam, decoded):
+                a, b = a.split('\t'), b.split('\t')
+                self.assertEquals(a[0:11], b[0:11])
+                self.assertEquals(set(a[11:]), set(b[11:])) # the order of the tags isn't defined
+
+        # and they match BWA's output for the first pair and its reverse complement
+        known = [ r for r in decoded if r.split('\t')[0] in ('read_00', 'read_00_rev') ]
+        self.assertEquals(len(self.ExpectedSam), len(known))
+        for a, b in zip(self.ExpectedSam, known):
+            self._compare_sam_records(a, b)
+
+    BgzfEof = '1f8b08040000000000ff0600424302001b0003000000000000000000'.decode('hex')
+
+    def _read_bgzf(self, data):
+        # Check the framing of each BGZF block and return the decompressed data
+        blocks = []
+        offset = 0
+        while offset < len(data):
+            self.assertEquals((31, 139, 8, 4), struct.unpack_from('<BBBB', data, offset))
+            xlen, si1, si2, slen, bsize = struct.unpack_from('<HccHH', data, offset + 10)
+            self.assertEquals((6, 'B', 'C', 2), (xlen, si1, si2, slen))
+            block = data[offset:offset + bsize + 1]
+            self.assertEquals(bsize + 1, len(block))
+            self.assertTrue(len(block) <= 0x10000)
+            crc, isize = struct.unpack_from('<II', block, len(block) - 8)
+            text = zlib.decompress(block[18:-8], -15)
+            self.assertEquals(isize, len(text))
+            self.assertEquals(crc, zlib.crc32(text) & 0xffffffff)
+            blocks.append(block)
+            offset += len(block)
+        # only the last block is empty:  it's the standard EOF marker
+        self.assertEquals(self.BgzfEof, blocks[-1])
+        return [ zlib.decompress(b[18:-8], -15) for b in blocks[:-1] ]
+
+    def test_bgzf_writer(self):
+        hdr = rapi.format_bam_hdr(self.ref)
+        records = rapi.format_bam_batch(self.ref, self.batch)
+        n_copies = 1 + 3 * 0x10000 // len(records) # enough for a few blocks
+        for n_threads in 1, 3:
+            with tempfile.TemporaryFile() as f:
+                w = rapi.bgzf_writer(f, 6, n_threads)
+                w.write(hdr)
+                for _ in xrange(n_copies):
+                    w.write(records)
+                self.assertIsNone(w.close())
+                f.seek(0)
+                data = f.read()
+            blocks = self._read_bgzf(data)
+            self.assertTrue(len(blocks) > 3)
+            self.assertTrue(all(0 < len(b) <= 0xff00 for b in blocks))
+            self.assertEquals(hdr + records * n_copies, ''.join(blocks))
+
+    def test_bgzf_writer_flush(self):
+        with tempfile.TemporaryFile() as f:
+            f.write('before')  # buffered by Python;  the writer must flush it first
+            w = rapi.bgzf_writer(f)
+            w.write('some data')
+            self.assertIsNone(w.flush())
+            self.assertTrue(os.fstat(f.fileno()).st_size > len('before'))
+            w.write(buffer('more data'))
+            del w # the destructor closes the writer
+            f.seek(0)
+            self.assertEquals('before', f.read(len('before')))
+            self.assertEquals([ 'some data', 'more data' ], self._read_bgzf(f.read()))
+
+    def test_bgzf_writer_bad_args(self):
+        self.assertRaises(TypeError, rapi.bgzf_writer, 'not a file')
+        self.assertRaises(ValueError, rapi.bgzf_writer, -1)
+        with tempfile.TemporaryFile() as f:
+            self.assertRaises(ValueError, rapi.bgzf_writer, f, 10)
+            w = rapi.bgzf_writer(f)
+            self.assertRaises(TypeError, w.write, 42)
+            w.close()
+            self.assertRaises(ValueError, w.write, 'data')
+            self.assertRaises(ValueError, w.close)
+
     def test_get_insert_size(self):
         aln_read = self.batch.get_read(0, 0).get_aln(0)
         aln_mate = self.batch.get_read(0, 1).get_aln(0)
@@ -499,20 +1031,258 @@ class TestPyrapiAlignment(unittest.TestCase):
         # following assertion should hold:
         self.assertGreater(sys.getrefcount(next_ref), first_ref_count)
 
+    def test_align_async(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        handle = aligner.align_reads_async(self.ref, batch)
+        self.assertIsNone(handle.wait())
+        self.assertTrue(handle.poll())
+        # the result must be the same as that of the synchronous alignment
+        self.assertEquals(
+            rapi.format_sam_from_batch(self.batch, 0),
+            rapi.format_sam_from_batch(batch, 0))
+
+    def test_align_async_keeps_args_alive(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        ref = rapi.ref(stuff.MiniRef)
+        first_ref_count = sys.getrefcount(batch)
+        handle = aligner.align_reads_async(ref, batch)
+        self.assertGreater(sys.getrefcount(batch), first_ref_count)
+        # dropping our references while the alignment runs must be safe
+        del aligner
+        del ref
+        self.assertIsNone(handle.wait())
+        # once the alignment is complete the handle lets go of the batch
+        self.assertEquals(first_ref_count, sys.getrefcount(batch))
+        self.assertEquals(
+            rapi.format_sam_from_batch(self.batch, 0),
+            rapi.format_sam_from_batch(batch, 0))
+
+    def test_align_async_batch_busy(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        handle = aligner.align_reads_async(self.ref, batch)
+        # the batch stays busy until we wait on the handle (or poll says it's done)
+        row = stuff.get_mini_ref_seqs()[0]
+        self.assertRaises(RuntimeError, batch.clear)
+        self.assertRaises(RuntimeError, batch.append, row[0], row[1], row[2], rapi.QENC_SANGER)
+        self.assertRaises(RuntimeError, aligner.align_reads_async, self.ref, batch)
+        self.assertIsNone(handle.wait())
+        self.assertEquals(
+            rapi.format_sam_from_batch(self.batch, 0),
+            rapi.format_sam_from_batch(batch, 0))
+        batch.clear()
+        self.assertEquals(0, len(batch))
+        # the handle's destructor also releases it
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        handle = aligner.align_reads_async(self.ref, batch)
+        del handle
+        batch.clear()
+
+    def test_align_async_incomplete_fragment(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        row = stuff.get_mini_ref_seqs()[0]
+        batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+        self.assertRaises(RuntimeError, aligner.align_reads_async, self.ref, batch)
+
 
-#    def test_align_se(self):
-#        aligner = rapi.aligner(self.opts)
-#        batch = rapi.read_batch(1)
-#        reads = stuff.get_mini_ref_seqs()
-#        batch.append(reads[0][0], reads[0][1], reads[0][2], rapi.QENC_SANGER)
-#        batch.append(reads[1][0], reads[1][1], reads[1][2], rapi.QENC_SANGER)
-#        aligner.align_reads(self.ref, batch)
-#
-#        rapi_read = batch.get_read(0, 0)
-#        self.assertTrue(rapi_read.n_alignments > 0)
-#        rapi_read = batch.get_read(1, 0)
-#        self.assertTrue(rapi_read.n_alignments > 0)
+    def test_align_se(self):
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(1)
+        reads = stuff.get_mini_ref_seqs()
+        batch.append(reads[0][0], reads[0][1], reads[0][2], rapi.QENC_SANGER)
+        batch.append(reads[1][0], reads[1][1], reads[1][2], rapi.QENC_SANGER)
+        aligner.align_reads(self.ref, batch)
 
+        rapi_read = batch.get_read(0, 0)
+        self.assertTrue(rapi_read.n_alignments > 0)
+        aln = rapi_read.get_aln(0)
+        self.assertTrue(aln.mapped)
+        self.assertFalse(aln.paired)
+        self.assertEquals('chr1', aln.contig.name)
+        self.assertEquals(32461, aln.pos)
+        self.assertEquals('60M', aln.get_cigar_string())
+        rapi_read = batch.get_read(1, 0)
+        self.assertTrue(rapi_read.n_alignments > 0)
+        self.assertEquals('11M3D49M', rapi_read.get_aln(0).get_cigar_string())
+
+    def test_align_se_after_pe(self):
+        # the paired-end setting must not stick to the aligner
+        aligner = rapi.aligner(self.opts)
+        aligner.align_reads(self.ref, self.batch)
+        batch = rapi.read_batch(1)
+        reads = stuff.get_mini_ref_seqs()
+        batch.append(reads[0][0], reads[0][1], reads[0][2], rapi.QENC_SANGER)
+        aligner.align_reads(self.ref, batch)
+        self.assertFalse(batch.get_read(0, 0).get_aln(0).paired)
+
+    def test_align_thread_pool(self):
+        opts = rapi.opts()
+        opts.n_threads = 3
+        opts.pin_threads = True
+        aligner = rapi.aligner(opts)
+        expected = rapi.format_sam_batch(self.batch, 1)
+        # the same pool is used by successive alignments
+        for _ in xrange(3):
+            batch = rapi.read_batch(2)
+            for row in stuff.get_mini_ref_seqs():
+                batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+                batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+            aligner.align_reads(self.ref, batch)
+            self.assertEquals(expected, rapi.format_sam_batch(batch, 1))
+
+    def test_align_numa_replicate_ref(self):
+        # on a single NUMA node this is the same as not replicating
+        opts = rapi.opts()
+        opts.n_threads = 3
+        opts.numa_replicate_ref = True
+        aligner = rapi.aligner(opts)
+        expected = rapi.format_sam_batch(self.batch, 1)
+        for _ in xrange(2):
+            batch = rapi.read_batch(2)
+            for row in stuff.get_mini_ref_seqs():
+                batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+                batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+            aligner.align_reads(self.ref, batch)
+            self.assertEquals(expected, rapi.format_sam_batch(batch, 1))
+
+    def test_realign_after_clear(self):
+        # the alignment results live in the batch and are recycled by clear
+        aligner = rapi.aligner(self.opts)
+        expected = rapi.format_sam_batch(self.batch, 1)
+        batch = rapi.read_batch(2)
+        for _ in xrange(3):
+            batch.clear()
+            for row in stuff.get_mini_ref_seqs():
+                batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+                batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+            aligner.align_reads(self.ref, batch)
+            self.assertEquals(expected, rapi.format_sam_batch(batch, 1))
+            self.assertEquals(self.batch.get_read(0, 0).get_aln(0).get_tags(),
+                              batch.get_read(0, 0).get_aln(0).get_tags())
+
+    def test_aligner_stats(self):
+        aligner = rapi.aligner(self.opts)
+        stats = aligner.get_stats()
+        self.assertEquals(0, stats.n_batches)
+        self.assertEquals(0, stats.n_reads)
+        self.assertEquals(0.0, stats.map.wall)
+
+        for _ in xrange(2):
+            aligner.align_reads(self.ref, self.batch)
+        stats = aligner.get_stats()
+        n_reads = 2 * len(stuff.get_mini_ref_seqs())
+        self.assertEquals(2, stats.n_batches)
+        self.assertEquals(2 * n_reads, stats.n_reads)
+        self.assertEquals(2 * n_reads * 60, stats.n_bases)
+        for phase in (stats.convert_input, stats.map, stats.pestat, stats.align, stats.convert_output):
+            self.assertGreaterEqual(phase.wall, 0.0)
+            self.assertGreaterEqual(phase.cpu, 0.0)
+        self.assertGreater(stats.map.wall, 0.0)
+        self.assertGreater(stats.align.wall, 0.0)
+        # the snapshot doesn't change
+        aligner.reset_stats()
+        self.assertEquals(2, stats.n_batches)
+        self.assertEquals(0, aligner.get_stats().n_batches)
+
+    def test_align_fragment(self):
+        # The mini batch is too small for an insert size estimate, so aligning
+        # the fragments one at a time pairs them like aligning the whole batch
+        aligner = rapi.aligner(self.opts)
+        batch = rapi.read_batch(2)
+        for row in stuff.get_mini_ref_seqs():
+            batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+            batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        for f in xrange(batch.n_fragments):
+            aligner.align_fragment(self.ref, batch, f)
+        self.assertEquals(rapi.format_sam_batch(self.batch, 1), rapi.format_sam_batch(batch, 1))
+        self.assertEquals(len(batch), aligner.get_stats().n_reads)
+        self.assertRaises(ValueError, aligner.align_fragment, self.ref, batch, batch.n_fragments)
+        self.assertRaises(ValueError, aligner.align_fragment, self.ref, batch, -1)
+
+    def test_aligner_isize(self):
+        aligner = rapi.aligner(self.opts)
+        # no distribution until we've seen some pairs
+        for orientation in (rapi.ORIENT_FF, rapi.ORIENT_FR, rapi.ORIENT_RF, rapi.ORIENT_RR):
+            self.assertTrue(aligner.get_isize(orientation).failed)
+        self.assertRaises(ValueError, aligner.get_isize, 4)
+
+        dist = rapi.isize_dist()
+        dist.failed = False
+        dist.low, dist.high = 50, 500
+        dist.avg, dist.std = 200.0, 40.0
+        aligner.set_isize(rapi.ORIENT_FR, dist)
+        # a fixed distribution isn't re-estimated
+        aligner.align_reads(self.ref, self.batch)
+        fr = aligner.get_isize(rapi.ORIENT_FR)
+        self.assertFalse(fr.failed)
+        self.assertEquals((50, 500, 200.0, 40.0), (fr.low, fr.high, fr.avg, fr.std))
+        self.assertTrue(aligner.get_isize(rapi.ORIENT_RF).failed)
+
+        dist.std = 0.0
+        self.assertRaises(ValueError, aligner.set_isize, rapi.ORIENT_FR, dist)
+
+    def test_aligner_isize_frozen(self):
+        opts = rapi.opts()
+        opts.isize_mode = rapi.ISIZE_FROZEN
+        opts.isize_freeze_pairs = 1
+        aligner = rapi.aligner(opts)
+        aligner.align_reads(self.ref, self.batch)
+        frozen = [ aligner.get_isize(o) for o in xrange(4) ]
+        aligner.align_reads(self.ref, self.batch)
+        for o in xrange(4):
+            d = aligner.get_isize(o)
+            self.assertEquals((frozen[o].failed, frozen[o].low, frozen[o].high, frozen[o].avg, frozen[o].std),
+                              (d.failed, d.low, d.high, d.avg, d.std))
+
+    def test_concurrent_aligner_states(self):
+        opts = rapi.opts()
+        opts.n_threads = 2
+        aligners = [ rapi.aligner(opts), rapi.aligner(None) ]
+        batches = [ rapi.read_batch(2) for _ in aligners ]
+        for batch in batches:
+            for row in stuff.get_mini_ref_seqs():
+                batch.append(row[0], row[1], row[2], rapi.QENC_SANGER)
+                batch.append(row[0], row[3], row[4], rapi.QENC_SANGER)
+        # the two states align against the same reference at the same time
+        handles = [ a.align_reads_async(self.ref, b) for a, b in zip(aligners, batches) ]
+        for h in handles:
+            h.wait()
+        expected = rapi.format_sam_batch(self.batch, 1)
+        for batch in batches:
+            self.assertEquals(expected, rapi.format_sam_batch(batch, 1))
+
+
+    def test_align_python_threads(self):
+        # align_reads releases the GIL, so Python threads really run in parallel
+        expected = rapi.format_sam_batch(self.batch, 1)
+        results = [ None ] * 3
+        def work(i):
+            batch = rapi.read_batch(2)
+            with open(stuff.MiniRefSequencesFastq) as f:
+                batch.load(f.read())
+            rapi.aligner(self.opts).align_reads(self.ref, batch)
+            results[i] = rapi.format_sam_batch(batch, 1)
+        threads = [ threading.Thread(target=work, args=(i,)) for i in xrange(len(results)) ]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertEquals([ expected ] * len(results), results)
 
 def suite():
     s = unittest.TestLoader().loadTestsFromTestCase(TestPyrapi)
@@ -3,3 +3,14 @@
 // a couple of constants
 #define QENC_SANGER   33
 #define QENC_ILLUMINA 64
+
+// insert size estimation modes (rapi_opts.isize_mode)
+#define ISIZE_PER_BATCH 0
+#define ISIZE_FROZEN    1
+#define ISIZE_RUNNING   2
+
+// read pair orientations
+#define ORIENT_FF 0
+#define ORIENT_FR 1
+#define ORIENT_RF 2
+#define ORIENT_RR 3
@@ -18,7 +18,6 @@
 
 import argparse
 import logging
-import re
 import sys
 import time
 
@@ -27,75 +26,26 @@ import pyrapi
 logging.basicConfig(level=logging.INFO)
 _log = logging.getLogger('align')
 
-def _read_fq_record(fp):
-    # read 4 lines
-    lines = list()
-    lineno = 0
-    for _ in xrange(4):
-        lineno += 1
-        line = fp.readline()
-        if line:
-            lines.append(line.rstrip('\n'))
-        else:
-            return None
-    if lines[2] != '+':
-        raise RuntimeError("Format error at line %d:\n%s" % (lineno, '\n'.join(lines)))
-
-    retval = dict()
-    retval['id'] = re.sub(r'^@\s*', '', lines[0])
-    retval['seq'] = lines[1]
-    retval['q'] = lines[3]
-    return retval
-
-def read_fastq_1(fp):
-    done = False
-    try:
-        while not done:
-            record1 = _read_fq_record(fp)
-            record2 = _read_fq_record(fp)
-            if record1 and record2:
-                yield record1, record2
-            else:
-                done = True
-    finally:
-        fp.close()
-
-def read_fastq_2(f1, f2):
-    done = False
-    try:
-        while not done:
-            record1 = _read_fq_record(f1)
-            record2 = _read_fq_record(f2)
-            if record1 and record2:
-                yield record1, record2
-            else:
-                done = True
-    finally:
-        f1.close()
-        f2.close()
-
-def read_prq(fp):
-    try:
-        for line in fp:
-            row = line.rstrip('\n').split('\t')
-            record1 = dict( id=row[0], seq=row[1], q=row[2] )
-            record2 = dict( id=row[0], seq=row[3], q=row[4] )
-            yield record1, record2
-    finally:
-        fp.close()
-
-
-def create_input(options):
+def create_reader(plugin, options):
+    """
+    The input is parsed by the plugin's native reader, which decompresses
+    and parses the files in C and fills the read batches directly.
+    """
     if options.format == 'fastq':
-        if len(options.input) == 2:
-            return read_fastq_2(options.input[0], options.input[1])
+        if options.se:
+            if len(options.input) == 1:
+                return plugin.reader(options.input[0], None, 'fastq', 1)
+            else:
+                raise RuntimeError("Single-end alignment takes exactly one fastq input file (got %d)" % len(options.input))
+        elif len(options.input) == 2:
+            return plugin.reader(options.input[0], options.input[1], 'fastq', 2)
         elif len(options.input) == 1:
-            return read_fastq_1(options.input[0])
+            return plugin.reader(options.input[0], None, 'fastq', 2)
         else:
             raise RuntimeError("Unexpected number of fastq input files %d!" % len(options.input))
     elif options.format == 'prq':
         if len(options.input) == 1:
-            return read_prq(options.input[0])
+            return plugin.reader(options.input[0], None, 'prq', 2)
         else:
             raise RuntimeError("Unexpected number of prq input files %d!" % len(options.input))
 
@@ -103,7 +53,8 @@ def create_input(options):
 def parse_args(args=None):
     parser = argparse.ArgumentParser()
     parser.add_argument('ref')
-    parser.add_argument('input', type=argparse.FileType('r'), nargs='*', default=sys.stdin)
+    parser.add_argument('input', nargs='*', default=['-'],
+            help="Input files (plain or gzipped).  Defaults to standard input")
     parser.add_argument('--format', choices=['fastq', 'prq'], default='fastq')
     parser.add_argument('--se', action="store_true", default=False)
     parser.add_argument('-t', '--nthreads', type=int, metavar='N', default=1)
@@ -115,8 +66,8 @@ def parse_args(args=None):
     elif len(options.input) == 0:
         raise RuntimeError("BUG! Empty options.input array")
 
-    if options.se:
-        raise NotImplementedError("Sorry. Single-end alignments not implemented")
+    if options.se and options.format != 'fastq':
+        parser.error("Single-end alignment requires fastq input")
 
     if options.nthreads <= 0:
         parser.error("nthreads must be greater than 0")
@@ -146,50 +97,54 @@ def main(argv=None):
     ref = plugin.ref(options.ref)
     _log.info("Reference loaded")
 
-    batch = plugin.read_batch(2 if pe else 1)
-    # allocate space for reads
-    batch.reserve(100000 / batch.n_reads_per_frag)
+    # We use two batches so that we can load and write one while the other
+    # one is being aligned
+    batches = [ plugin.read_batch(2 if pe else 1) for _ in xrange(2) ]
+    for batch in batches:
+        # allocate space for reads
+        batch.reserve(batch_size)
 
     aligner = plugin.aligner(opts)
 
     # print SAM header
     print plugin.format_sam_hdr(ref)
 
-    input_generator = create_input(options)
+    reader = create_reader(plugin, options)
+    n_reads_frag = 2 if pe else 1
 
-    def _load_batch():
+    def _load_batch(batch):
         batch.clear()
         _log.info('loading batch %s', batch_count)
-        for reads in input_generator:
-            read1 = reads[0]
-            batch.append(read1['id'], read1['seq'], read1['q'], plugin.QENC_SANGER)
-            if pe:
-                read2 = reads[1]
-                batch.append(read2['id'], read2['seq'], read2['q'], plugin.QENC_SANGER)
-            if len(batch) >= batch_size:
-                break
+        reader.fill(batch, batch_size // n_reads_frag)
         # return whether or not the batch is empty
         return len(batch) != 0
 
-    def _process_batch():
-        _log.info("aligning...")
-        aligner.align_reads(ref, batch)
-        _log.info("finished aligning. Printing output")
-        for idx in xrange(batch.n_fragments):
-            sam = plugin.format_sam_from_batch(batch, idx)
-            print sam
+    def _write_batch(batch):
+        # formatted in one buffer and written straight to stdout's descriptor
+        plugin.write_sam(batch, sys.stdout, None, opts.n_threads)
 
-    done = False
+    # Pipeline:  while batch N is aligned we load batch N+1 and write batch N-1
+    batch_count = 1
+    current = batches[0]
+    handle = None
+    if _load_batch(current):
+        _log.info("aligning batch %s...", batch_count)
+        handle = aligner.align_reads_async(ref, current)
 
-    batch_count = 0
-    while not done:
+    while handle is not None:
         batch_count += 1
-        _log.info("Batch %s", batch_count)
-        has_data = _load_batch()
+        following = batches[batch_count % 2]
+        has_data = _load_batch(following)
+
+        handle.wait()
+        _log.info("finished aligning batch %s", batch_count - 1)
         if has_data:
-            _process_batch()
+            _log.info("aligning batch %s...", batch_count)
+            handle = aligner.align_reads_async(ref, following)
         else:
-            done = True
+            handle = None
+        _write_batch(current)
+        current = following
 
     ref.unload()
     end_time = time.time()
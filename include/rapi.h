@@ -39,7 +39,7 @@ typedef int rapi_error_t;
 #define RAPI_PARAM_ERROR                -40
 #define RAPI_TYPE_ERROR                 -50
 
-static const char*const rapi_error_name(rapi_error_t e)
+static inline const char* rapi_error_name(rapi_error_t e)
 {
 	switch (e) {
 		case RAPI_NO_ERROR:               return "NO_ERROR";
@@ -68,12 +68,13 @@ static const char rapi_cigops_char[] = "MIDSH";
 #define RAPI_VTYPE_TEXT       2
 #define RAPI_VTYPE_INT        3
 #define RAPI_VTYPE_REAL       4
+#define RAPI_VTYPE_DERIVED    5 // TEXT generated on demand; see rapi_tag_put_text
 
 /* Constants */
 
 #define RAPI_QUALITY_ENCODING_SANGER   33
 #define RAPI_QUALITY_ENCODING_ILLUMINA 64
-#define RAPI_MAX_TAG_LEN                6
+#define RAPI_TAG_KEY_LEN                2
 
 /************************* parameter and tag structures and functions **************/
 
@@ -143,28 +144,59 @@ static inline int rapi_param_get_text(const rapi_param* kv, const char** value)
 static inline int rapi_param_get_long(const rapi_param* kv, long * value      ) KV_GET_IMPL(RAPI_VTYPE_INT,  value.integer)
 static inline int rapi_param_get_dbl( const rapi_param* kv, double * value    ) KV_GET_IMPL(RAPI_VTYPE_REAL, value.real)
 
-/* Key-value list */
+/*
+ * Tags.
+ *
+ * Keys are two characters, as in SAM, packed into a uint16_t (see
+ * RAPI_TAG_KEY) so they're compared as integers.  Values are stored inline,
+ * except TEXT values which only point to their string.  Some tags produced by
+ * the aligner (e.g., SA) are DERIVED:  their text is only generated, from
+ * the other alignments of the read, when rapi_tag_put_text is called.  The strings of the
+ * tags produced by the aligner belong to the read batch (like the rest of the
+ * alignment results); the ones set by rapi_tag_set_text are heap copies owned
+ * by the tag and freed by rapi_tag_clear.
+ */
+#define RAPI_TAG_KEY(c1, c2) ((uint16_t)(((uint8_t)(c1) << 8) | (uint8_t)(c2)))
+
 typedef struct rapi_tag {
-	char key[RAPI_MAX_TAG_LEN + 1]; // null-terminated
+	uint16_t key;
 	uint8_t type;
+	// TEXT:    length of the string.
+	// DERIVED: n_alignments << 16 | index of the tag's alignment in `value.alignments`.
+	uint32_t text_len;
 	union {
 		char character;
-		kstring_t text;
+		char* text; // null-terminated
 		long integer;
 		double real;
+		const struct rapi_alignment* alignments; // DERIVED:  the read's alignments
 	} value;
 } rapi_tag;
 
 
-static inline void rapi_tag_set_key(rapi_tag* kv, const char* s) {
-	strncpy(kv->key, s, RAPI_MAX_TAG_LEN);
-	kv->key[RAPI_MAX_TAG_LEN] = '\0'; // null terminate, always
+/**
+ * Set the tag key from the string `s`, which must be exactly
+ * RAPI_TAG_KEY_LEN characters long.
+ */
+static inline int rapi_tag_set_key(rapi_tag* kv, const char* s) {
+	if (s == NULL || s[0] == '\0' || s[1] == '\0' || s[2] != '\0')
+		return RAPI_PARAM_ERROR;
+	kv->key = RAPI_TAG_KEY(s[0], s[1]);
+	return RAPI_NO_ERROR;
+}
+
+/** Write the tag key to `buf` as a null-terminated string. */
+static inline void rapi_tag_get_key(const rapi_tag* kv, char buf[RAPI_TAG_KEY_LEN + 1]) {
+	buf[0] = (char)(kv->key >> 8);
+	buf[1] = (char)(kv->key & 0xff);
+	buf[2] = '\0';
 }
 
 static inline void rapi_tag_clear(rapi_tag* kv) {
 	if (kv->type == RAPI_VTYPE_TEXT) {
-		free(kv->value.text.s);
-		kv->value.text.s = NULL;
+		free(kv->value.text);
+		kv->value.text = NULL;
+		kv->text_len = 0;
 	}
 	kv->type = 0;
 }
@@ -172,26 +204,38 @@ static inline void rapi_tag_clear(rapi_tag* kv) {
 /**
  * Set the tag value to TEXT type and copy `value` into it.
  *
- * If you need to write non-string data, call this fn with a `value` of ""
- * and then use the kstring functions directly with kv->value.text.
- *
  * NOTE: if you set_text and then call any other set_ function without calling
  * rapi_tag_clear you'll leak the previous string value (it won't be automatically
  * cleared).
+ *
+ * \return RAPI_MEMORY_ERROR if the string can't be copied.
  */
-static inline void rapi_tag_set_text(rapi_tag* kv, const char* value) {
+static inline int rapi_tag_set_text(rapi_tag* kv, const char* value) {
+	size_t len = strlen(value);
+	char* copy = (char*)malloc(len + 1);
+	if (copy == NULL)
+		return RAPI_MEMORY_ERROR;
+	memcpy(copy, value, len + 1);
 	kv->type = RAPI_VTYPE_TEXT;
-	rapi_kstr_init(&kv->value.text);
-	kputs(value, &kv->value.text);
+	kv->value.text = copy;
+	kv->text_len = len;
+	return RAPI_NO_ERROR;
 }
 
 static inline void rapi_tag_set_char(rapi_tag* kv, char value       ) KV_SET_IMPL(RAPI_VTYPE_CHAR, value.character)
 static inline void rapi_tag_set_long(rapi_tag* kv, long value       ) KV_SET_IMPL(RAPI_VTYPE_INT,  value.integer)
 static inline void rapi_tag_set_dbl( rapi_tag* kv, double value     ) KV_SET_IMPL(RAPI_VTYPE_REAL, value.real)
 
-static inline int rapi_tag_get_text(const rapi_tag* kv, const kstring_t** value) {
+/**
+ * Get a TEXT value.
+ *
+ * \param length If not NULL, set to the length of the string.
+ */
+static inline int rapi_tag_get_text(const rapi_tag* kv, const char** value, size_t* length) {
 	if (kv->type == RAPI_VTYPE_TEXT) {
-		*value = &kv->value.text;
+		*value = kv->value.text;
+		if (length)
+			*length = kv->text_len;
 		return RAPI_NO_ERROR;
 	}
 	else
@@ -203,6 +247,18 @@ static inline int rapi_tag_get_long(const rapi_tag* kv, long * value      ) KV_G
 static inline int rapi_tag_get_dbl( const rapi_tag* kv, double * value    ) KV_GET_IMPL(RAPI_VTYPE_REAL, value.real)
 
 
+/* How the aligner obtains the insert size distribution of read pairs (rapi_opts.isize_mode) */
+#define RAPI_ISIZE_PER_BATCH  0 // estimate it anew on each batch
+#define RAPI_ISIZE_FROZEN     1 // estimate it on the first isize_freeze_pairs pairs, then keep it
+#define RAPI_ISIZE_RUNNING    2 // keep refining a single estimate with the pairs of all batches
+
+/* Read pair orientations, which index the insert size distributions */
+#define RAPI_ORIENT_FF        0
+#define RAPI_ORIENT_FR        1
+#define RAPI_ORIENT_RF        2
+#define RAPI_ORIENT_RR        3
+#define RAPI_N_ORIENT         4
+
 /**
  * Options.
  */
@@ -216,13 +272,32 @@ typedef struct rapi_opts {
 	int isize_min;
 	int isize_max;
 
+	// Insert size estimation:  one of the RAPI_ISIZE_* modes.  A distribution
+	// set with rapi_aligner_isize_set overrides it.
+	int isize_mode;
+	// With RAPI_ISIZE_FROZEN, the number of read pairs to estimate the
+	// distribution from.  Whole batches are used, so it may be exceeded.
+	int isize_freeze_pairs;
+
 	// multithreading -- implementation may ignore it if single-threaded
 	int n_threads;
+	// Whether to pin the aligner's worker threads to CPUs
+	// (if the implementation supports it)
+	int pin_threads;
 
 	// Whether to share references in memory with other processes using RAPI
 	// (if the implementation supports it)
 	int share_ref_mem;
 
+	// Whether to keep a copy of the reference index on each NUMA node and have
+	// each worker thread read the copy local to its node.  Off by default since
+	// it multiplies the index's memory by the number of nodes
+	// (if the implementation supports it)
+	int numa_replicate_ref;
+
+	// Log the progress and timing of each alignment to stderr
+	int verbose;
+
 	/* Aligner specific parameters in 'parameters' list.
 	 * LP: I'm thinking we might want to drop this list in favour
 	 * of letting the user set aligner-specific options through the
@@ -264,7 +339,48 @@ typedef struct rapi_cigar {
 	         len:28;
 } rapi_cigar;
 
-typedef kvec_t(rapi_tag) rapi_tag_list;
+/*
+ * The tags of an alignment:  a packed array of rapi_tag, plus a bit mask with
+ * one bit per key hash for quick by-key lookups (rapi_tag_find).  The
+ * storage is provided by the list's owner and never grown:  only add tags
+ * with rapi_tag_list_push so the mask stays consistent.  The kvec macros
+ * kv_size and kv_A can be used to iterate.
+ */
+typedef struct rapi_tag_list {
+	uint16_t n, m;
+	uint32_t key_mask;
+	rapi_tag* a;
+} rapi_tag_list;
+
+static inline uint32_t rapi_tag_key_bit(uint16_t key) {
+	return (uint32_t)1 << (((key >> 8) * 7 + (key & 0xff)) & 31);
+}
+
+/**
+ * Append a tag with the given key.
+ *
+ * \return the new tag, with no value, or NULL if the list is full.
+ */
+static inline rapi_tag* rapi_tag_list_push(rapi_tag_list* list, uint16_t key) {
+	if (list->n >= list->m)
+		return NULL;
+	rapi_tag* tag = &list->a[list->n++];
+	memset(tag, 0, sizeof(*tag));
+	tag->key = key;
+	list->key_mask |= rapi_tag_key_bit(key);
+	return tag;
+}
+
+/** \return the tag with the given key, or NULL if there is none. */
+static inline const rapi_tag* rapi_tag_find(const rapi_tag_list* list, uint16_t key) {
+	if (!(list->key_mask & rapi_tag_key_bit(key)))
+		return NULL;
+	for (int i = 0; i < list->n; ++i) {
+		if (list->a[i].key == key)
+			return &list->a[i];
+	}
+	return NULL;
+}
 
 typedef struct rapi_alignment {
 	rapi_contig* contig;
@@ -343,12 +459,54 @@ const char* rapi_plugin_version(void);
  *
  * The implementation may configure its behaviour based on the options passed
  * into rapi_init.
+ *
+ * References are shared within the process:  loading a reference that's
+ * already loaded (even through a different path to the same index) doesn't
+ * load it again but fills `ref_struct` with a new handle to the same index
+ * and contig table.  Concurrent loads of the same reference wait for the
+ * first one and return its result;  loads of other references don't wait.
  */
 rapi_error_t rapi_ref_load( const char * reference_path, rapi_ref * ref_struct );
 
-/** Free reference structure and unload reference (if loaded). */
+/** Free reference structure.  The reference is unloaded when its last
+ * handle is freed.  Freeing an already freed structure does nothing.
+ */
 rapi_error_t rapi_ref_free( rapi_ref * ref_struct );
 
+/**
+ * Find a contig by name.  The lookup uses a hash index built when the
+ * reference is loaded.
+ *
+ * \return the contig, or NULL if there's no contig with that name.
+ */
+const rapi_contig* rapi_ref_find_contig( const rapi_ref * ref, const char * name );
+
+/**
+ * Compute the MD5 checksums of the contigs (as in the SAM header's M5 tag)
+ * and store them in the `md5` field of the contigs that don't have one yet.
+ * Contigs are processed in parallel with `n_threads` threads.
+ *
+ * The implementation may cache the checksums so that later calls for the
+ * same reference (also from other processes) don't have to compute them
+ * again.  Since the contigs are shared by all the handles to the reference,
+ * don't call this while other threads are reading them.
+ */
+rapi_error_t rapi_ref_fill_md5( rapi_ref * ref, int n_threads );
+
+/**
+ * Fault the reference's index into memory, so that the first alignments
+ * don't run slowly while it's paged in (especially when the reference is
+ * shared and the index is mapped from a file).  This trades start-up time for
+ * steady alignment speed from the first batch.
+ *
+ * If the library was initialized with `verbose` set, the progress is logged
+ * to stderr.
+ *
+ * \param n_threads Number of threads to use.
+ * \param elapsed If not NULL, set to the time taken in seconds.
+ */
+rapi_error_t rapi_ref_prefetch( const rapi_ref * ref, int n_threads, double * elapsed );
+
 /**
  * Create read batch configured for `n_reads_fragment` reads per fragment.
  * Allocate memory for `n_fragments` fragments.
@@ -374,6 +532,9 @@ rapi_error_t rapi_reads_reserve(rapi_batch* batch, rapi_ssize_t n_fragments);
  * Empty a `batch`, clearing any reads stored therein.  The `batch` will be
  * restored to a state as if it was just allocated by rapi_reads_alloc
  * (so the read memory is not freed).
+ *
+ * Any pointers into the batch's reads and alignments (e.g., rapi_read,
+ * rapi_alignment, cigars, tags) are invalidated.
  */
 rapi_error_t rapi_reads_clear(rapi_batch* batch);
 
@@ -402,6 +563,16 @@ static inline rapi_ssize_t rapi_batch_read_capacity(const rapi_batch* batch) {
  */
 rapi_error_t rapi_set_read(rapi_batch * batch, rapi_ssize_t n_frag, int n_read, const char* id, const char* seq, const char* qual, int q_offset);
 
+/**
+ * Like rapi_set_read, but with explicit lengths for id and seq, which then
+ * don't need to be NULL-terminated.  Useful to insert reads straight from
+ * a larger buffer without copying them first.
+ *
+ * \param qual per-base quality (seq_len values), or NULL
+ */
+rapi_error_t rapi_set_read_n(rapi_batch * batch, rapi_ssize_t n_frag, int n_read,
+    const char* id, int id_len, const char* seq, int seq_len, const char* qual, int q_offset);
+
 /**
  * Get pointer to read at coordinates (n_frag, n_read).
  *
@@ -429,6 +600,10 @@ typedef struct rapi_aligner_state rapi_aligner_state;
  * rapi_init().  However, the user can provide new options that override the
  * library-wide configuration.  Alternatively, \param opts is NULL.
  *
+ * The state keeps its own copy of the options, taken at this time, and never
+ * modifies it.  So, different states can align batches against the same
+ * reference concurrently, each with its own options (e.g., number of threads).
+ *
  * \param ret_state Return argument for the new aligner state.
  * \param opts User-specified options, or NULL if the user wants to use the options passed to rapi_init.
  * \return rapi_error_t Return code.
@@ -439,6 +614,11 @@ rapi_error_t rapi_aligner_state_init(struct rapi_aligner_state** ret_state, cons
  * Align the reads in batch to ref.
  *
  * The alignments are written directly to the read structures in the rapi_batch.
+ * Their memory (including cigars and tag values) belongs to the batch and
+ * is released by rapi_reads_clear or rapi_reads_free; don't free or resize
+ * it.  Realigning reads doesn't release their previous alignments until the
+ * batch is cleared.  Concurrent calls (with different aligner states) may
+ * align disjoint fragment ranges of the same batch.
  *
  * \param ref The alignment reference
  * \param batch A read batch
@@ -451,7 +631,131 @@ rapi_error_t rapi_aligner_state_init(struct rapi_aligner_state** ret_state, cons
 rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
     rapi_ssize_t start_frag, rapi_ssize_t end_frag, rapi_aligner_state* state );
 
-/** Clear aligner state and free any associated system resources. */
+/**
+ * Align the reads of a single fragment, for low-latency use (e.g., serving
+ * a few pairs per request).
+ *
+ * The alignment runs directly on the calling thread, without the worker
+ * threads and the per-batch setup of rapi_align_reads.  Paired reads are
+ * paired with the aligner's current insert size distribution, which this
+ * call doesn't update:  fix it with rapi_aligner_isize_set, or let earlier
+ * rapi_align_reads calls estimate it.  Otherwise the results are those of
+ * rapi_align_reads on the range [fragment, fragment + 1).  Calls with
+ * different aligner states may align different fragments of the same batch
+ * concurrently.
+ *
+ * \param fragment Index of the fragment within the batch (0-based).
+ */
+rapi_error_t rapi_align_fragment( const rapi_ref* ref, rapi_batch* batch,
+    rapi_ssize_t fragment, rapi_aligner_state* state );
+
+/**
+ * Clear aligner state and free any associated system resources.
+ *
+ * Any alignments still queued with rapi_align_reads_async are completed
+ * before the state is freed.  Their handles remain valid and must still be
+ * freed by the caller.
+ */
 rapi_error_t rapi_aligner_state_free(struct rapi_aligner_state* state);
 
+/** Time spent in an alignment phase, in seconds. */
+typedef struct rapi_phase_time {
+	double wall;
+	double cpu; // CPU time of the threads that ran the phase, summed
+} rapi_phase_time;
+
+/**
+ * Cumulative statistics of the alignments run with an aligner state.
+ */
+typedef struct rapi_aligner_stats {
+	rapi_phase_time convert_input;  // reads -> aligner input
+	rapi_phase_time map;            // finding the mapping positions of the reads
+	rapi_phase_time pestat;         // inferring the insert size distribution (paired-end only)
+	rapi_phase_time align;          // pairing and generating the final alignments (includes convert_output)
+	// Conversion of the aligner's results into rapi_alignment structures.
+	// It runs within the `align` phase on all the threads, so its times
+	// are summed over the threads (wall is in thread-seconds and cpu is
+	// the CPU time of the threads).
+	rapi_phase_time convert_output;
+	int64_t n_batches;
+	int64_t n_reads;
+	int64_t n_bases;
+} rapi_aligner_stats;
+
+/**
+ * Get a copy of the statistics accumulated by `state` since it was created
+ * or rapi_aligner_stats_reset was called.  It can be called while
+ * alignments are running;  the statistics are updated at the end of each
+ * alignment.
+ */
+rapi_error_t rapi_aligner_stats_get(struct rapi_aligner_state* state, rapi_aligner_stats* stats);
+
+/** Zero the statistics of `state`. */
+rapi_error_t rapi_aligner_stats_reset(struct rapi_aligner_state* state);
+
+/**
+ * Insert size distribution of the read pairs in one orientation.  Pairs with
+ * an insert size in [low, high] are considered proper.
+ */
+typedef struct rapi_isize_dist {
+	int failed; // non-zero if there's no distribution for the orientation
+	int low;
+	int high;
+	double avg;
+	double std;
+} rapi_isize_dist;
+
+/**
+ * Get the insert size distribution the aligner is using, one per orientation
+ * (indexed by RAPI_ORIENT_*).  Before the first paired alignment all the
+ * orientations are `failed`, unless a distribution was set.
+ */
+rapi_error_t rapi_aligner_isize_get(struct rapi_aligner_state* state, rapi_isize_dist dist[RAPI_N_ORIENT]);
+
+/**
+ * Fix the insert size distribution used by the following alignments
+ * (e.g., one known for the library or estimated by another aligner).  From
+ * now on the aligner doesn't estimate it, whatever the isize_mode.  If an
+ * alignment with this state is running, this waits for it to finish.
+ */
+rapi_error_t rapi_aligner_isize_set(struct rapi_aligner_state* state, const rapi_isize_dist dist[RAPI_N_ORIENT]);
+
+/** Opaque handle to an alignment started with rapi_align_reads_async. */
+typedef struct rapi_align_handle rapi_align_handle;
+
+/**
+ * Start aligning the reads in batch to ref and return immediately.
+ *
+ * The alignment runs in the background on threads owned by the aligner
+ * state, so the caller can do other work (e.g., load the next batch or write
+ * out the previous one) in the meantime.  Alignments requested on the same
+ * state run one at a time, in the order they were requested;  a synchronous
+ * rapi_align_reads on the same state waits for the running one to finish.
+ *
+ * The batch and the reference must not be modified or freed until the
+ * alignment is complete.  The parameters are the same as for rapi_align_reads.
+ *
+ * \param handle Return argument for the completion handle.  Free it with
+ *               rapi_align_handle_free.
+ *
+ * \return RAPI_NO_ERROR if the alignment was queued.  Errors in the alignment
+ *         itself are reported by rapi_align_wait.
+ */
+rapi_error_t rapi_align_reads_async( const rapi_ref* ref, rapi_batch* batch,
+    rapi_ssize_t start_frag, rapi_ssize_t end_frag, rapi_aligner_state* state,
+    rapi_align_handle** handle );
+
+/** \return non-zero if the alignment referenced by handle is complete. */
+int rapi_align_poll(rapi_align_handle* handle);
+
+/**
+ * Wait for the alignment referenced by handle to complete.
+ *
+ * \return The error code of the alignment (as would have been returned by rapi_align_reads).
+ */
+rapi_error_t rapi_align_wait(rapi_align_handle* handle);
+
+/** Wait for the alignment to complete (if necessary) and free the handle. */
+rapi_error_t rapi_align_handle_free(rapi_align_handle* handle);
+
 #endif
@@ -42,6 +42,13 @@ int rapi_get_rlen(int n_cigar, const rapi_cigar* cigar_ops);
  */
 void rapi_put_cigar(int n_ops, const rapi_cigar* ops, int force_hard_clip, kstring_t* output);
 
+/**
+ * Append the text value of a TEXT or DERIVED tag to `output`.
+ *
+ * \return RAPI_TYPE_ERROR if the tag has another type.
+ */
+rapi_error_t rapi_tag_put_text(const rapi_tag* tag, kstring_t* output);
+
 
 /******* SAM output *******/
 
@@ -69,6 +76,21 @@ rapi_error_t rapi_format_sam(const rapi_read** reads, int n_reads, kstring_t* ou
  */
 rapi_error_t rapi_format_sam_b(const rapi_batch* batch, rapi_ssize_t n_frag, kstring_t* output);
 
+/**
+ * Format SAM for all reads in the fragments [start_fragment, end_fragment) of
+ * the batch.  Each fragment's SAM is followed by a newline.
+ *
+ * The work is split into chunks of fragments that are formatted in parallel
+ * by `n_threads` threads into separate buffers, which are then appended to
+ * `output` in order.  So, the output is the same as that produced by calling
+ * rapi_format_sam_b on each fragment in sequence.
+ *
+ * \param output An initialized kstring_t to which the SAM will be appended.
+ *               If an error occurs it is left unchanged.
+ */
+rapi_error_t rapi_format_sam_batch(const rapi_batch* batch, rapi_ssize_t start_fragment, rapi_ssize_t end_fragment,
+    int n_threads, kstring_t* output);
+
 /**
  * Format the SAM header for the given reference.  The header will also contain
  * a @PG tag identifying the RAPI-interfaced aligner being used.
@@ -78,6 +100,124 @@ rapi_error_t rapi_format_sam_b(const rapi_batch* batch, rapi_ssize_t n_frag, kst
 rapi_error_t rapi_format_sam_hdr(const rapi_ref* ref, kstring_t* output);
 
 
+/******* BAM output *******/
+
+/**
+ * Format the binary BAM header (magic, SAM header text and reference list)
+ * for the given reference.  The output is uncompressed; write it through a
+ * rapi_bgzf_writer to produce a BAM file.
+ *
+ * \param output An initialized kstring_t to which the output will be appended.
+ */
+rapi_error_t rapi_format_bam_hdr(const rapi_ref* ref, kstring_t* output);
+
+/**
+ * Format uncompressed BAM records for all reads in the indicated fragment.
+ * The records carry the same information as the SAM produced by
+ * rapi_format_sam_b.
+ *
+ * \param output An initialized kstring_t to which the records will be appended.
+ *               If an error occurs it is left unchanged.
+ */
+rapi_error_t rapi_format_bam_b(const rapi_ref* ref, const rapi_batch* batch, rapi_ssize_t n_frag, kstring_t* output);
+
+/**
+ * Format uncompressed BAM records for the fragments [start_fragment, end_fragment)
+ * of the batch, using `n_threads` threads.  See rapi_format_sam_batch.
+ */
+rapi_error_t rapi_format_bam_batch(const rapi_ref* ref, const rapi_batch* batch,
+    rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, int n_threads, kstring_t* output);
+
+/**
+ * BGZF writer.  Data written to it is split into BGZF blocks which are
+ * compressed in parallel by `n_threads` threads and written to the file
+ * descriptor in order.
+ */
+typedef struct rapi_bgzf_writer rapi_bgzf_writer;
+
+/**
+ * \param fd An open file descriptor.  It is not closed by rapi_bgzf_close.
+ * \param level zlib compression level (-1 for the default).
+ */
+rapi_error_t rapi_bgzf_open(rapi_bgzf_writer** writer, int fd, int level, int n_threads);
+
+rapi_error_t rapi_bgzf_write(rapi_bgzf_writer* writer, const void* data, size_t len);
+
+/** Compress and write all buffered data. */
+rapi_error_t rapi_bgzf_flush(rapi_bgzf_writer* writer);
+
+/** Flush, write the BGZF EOF marker and free the writer. */
+rapi_error_t rapi_bgzf_close(rapi_bgzf_writer* writer);
+
+
+/******* Input *******/
+
+typedef enum {
+	RAPI_INPUT_FASTQ = 0,
+	RAPI_INPUT_PRQ = 1
+} rapi_input_format;
+
+/**
+ * Reader for FASTQ (plain or gzipped) and PRQ input.  The files are read and
+ * decompressed by background threads, one per file.
+ */
+typedef struct rapi_reader rapi_reader;
+
+/**
+ * Open a reader.
+ *
+ * Supported combinations:
+ *   - FASTQ, n_reads_frag = 1, one file:  single-end reads;
+ *   - FASTQ, n_reads_frag = 2, one file:  interleaved pairs;
+ *   - FASTQ, n_reads_frag = 2, two files: read 1 and read 2 in separate files;
+ *   - PRQ,   n_reads_frag = 2, one file.
+ *
+ * \param path1 Path of the first input file.  "-" reads from standard input.
+ * \param path2 Path of the second file, or NULL.
+ *
+ * Base qualities are expected to be in the Sanger encoding.  Read names
+ * (the FASTQ names and the PRQ fragment ids alike) are truncated at the first
+ * white space and any /1 or /2 suffix is removed.
+ */
+rapi_error_t rapi_reader_open(rapi_reader** reader, rapi_input_format format, int n_reads_frag,
+    const char* path1, const char* path2);
+
+/**
+ * Read fragments into `batch`, starting at fragment index `start_fragment`,
+ * until `max_fragments` fragments have been read, at least `max_bases` bases
+ * have been read (if max_bases > 0), or the input ends.  The batch is grown
+ * as necessary.
+ *
+ * \param n_loaded Set to the number of fragments read.  It's 0 at the end of the input.
+ *
+ * \note The batch must have the same number of reads per fragment as the
+ * reader.  In case of error, the fragments set by the call are reset, so
+ * the batch is left as it was (besides its capacity) and `n_loaded` is 0.
+ * The records read up to the error are lost.
+ */
+rapi_error_t rapi_reader_fill(rapi_reader* reader, rapi_batch* batch, rapi_ssize_t start_fragment,
+    rapi_ssize_t max_fragments, size_t max_bases, rapi_ssize_t* n_loaded);
+
+/** Stop the reader's threads, close the input files and free the reader. */
+rapi_error_t rapi_reader_close(rapi_reader* reader);
+
+/**
+ * Parse FASTQ or PRQ records from an uncompressed in-memory buffer into
+ * `batch`, starting at fragment index `start_fragment`.  The same rules as
+ * rapi_reader apply: FASTQ with a batch of 2 reads per fragment is taken to
+ * be interleaved, PRQ requires 2 reads per fragment, and the read names are
+ * trimmed.  The buffer doesn't need to be NULL-terminated, but it must
+ * contain whole records.  The batch is grown once, to fit all the records.
+ *
+ * \param n_loaded Set to the number of fragments parsed.
+ *
+ * \note In case of error, the fragments set by the call are reset, so the
+ * batch is left as it was (besides its capacity) and `n_loaded` is 0.
+ */
+rapi_error_t rapi_reads_parse(rapi_batch* batch, rapi_input_format format,
+    const char* buf, size_t len, rapi_ssize_t start_fragment, rapi_ssize_t* n_loaded);
+
+
 
 /**
  * Compute the reverse complement of a sequence, in place.
@@ -0,0 +1,133 @@
+/*
+ * rapi_arena.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "rapi_arena.h"
+
+#include <stdlib.h>
+
+#define ARENA_ROUND_UP(n) (((n) + (RAPI_ARENA_ALIGN - 1)) & ~((size_t)RAPI_ARENA_ALIGN - 1))
+
+void rapi_arena_init(rapi_arena* arena, size_t min_slab_size)
+{
+	arena->head = arena->current = NULL;
+	arena->min_slab_size = min_slab_size > 0 ? min_slab_size : 4096;
+}
+
+void* rapi_arena_alloc(rapi_arena* arena, size_t n)
+{
+	rapi_arena_slab* slab = arena->current;
+
+	while (slab) {
+		size_t start = ARENA_ROUND_UP(slab->used);
+		if (start + n <= slab->size) {
+			slab->used = start + n;
+			arena->current = slab;
+			return slab->data + start;
+		}
+		if (!slab->next)
+			break;
+		// The slabs after the current one are empty (they've been left there
+		// by a reset or a rewind), so we can try to use them.
+		slab = slab->next;
+	}
+
+	// We need a new slab.  Grow geometrically so that the number of slabs
+	// stays small even when we start from a tiny one.
+	size_t size = arena->min_slab_size;
+	if (slab && slab->size * 2 > size)
+		size = slab->size * 2;
+	if (size < n)
+		size = n;
+
+	rapi_arena_slab* new_slab = malloc(sizeof(*new_slab) + size);
+	if (NULL == new_slab)
+		return NULL;
+	new_slab->next = NULL;
+	new_slab->size = size;
+	new_slab->used = n;
+
+	if (slab)
+		slab->next = new_slab;
+	else
+		arena->head = new_slab;
+	arena->current = new_slab;
+
+	return new_slab->data;
+}
+
+size_t rapi_arena_capacity(const rapi_arena* arena)
+{
+	size_t total = 0;
+	for (const rapi_arena_slab* s = arena->head; s; s = s->next)
+		total += s->size;
+	return total;
+}
+
+static void _free_slab_chain(rapi_arena_slab* slab)
+{
+	while (slab) {
+		rapi_arena_slab* next = slab->next;
+		free(slab);
+		slab = next;
+	}
+}
+
+void rapi_arena_reset(rapi_arena* arena)
+{
+	if (arena->head && arena->head->next) {
+		// Coalesce the chain into a single slab.  If we fail to allocate it
+		// we simply keep the chain we have.
+		size_t total = rapi_arena_capacity(arena);
+		rapi_arena_slab* big = malloc(sizeof(*big) + total);
+		if (big) {
+			_free_slab_chain(arena->head);
+			big->next = NULL;
+			big->size = total;
+			arena->head = big;
+		}
+	}
+
+	for (rapi_arena_slab* s = arena->head; s; s = s->next)
+		s->used = 0;
+	arena->current = arena->head;
+}
+
+void rapi_arena_rewind(rapi_arena* arena, rapi_arena_mark mark)
+{
+	rapi_arena_slab* s;
+	if (NULL == mark.slab) { // the mark was taken on an empty arena
+		s = arena->head;
+		arena->current = arena->head;
+	}
+	else {
+		mark.slab->used = mark.used;
+		arena->current = mark.slab;
+		s = mark.slab->next;
+	}
+
+	for (; s; s = s->next)
+		s->used = 0;
+}
+
+void rapi_arena_destroy(rapi_arena* arena)
+{
+	_free_slab_chain(arena->head);
+	arena->head = arena->current = NULL;
+}
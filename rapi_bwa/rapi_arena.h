@@ -0,0 +1,97 @@
+/*
+ * rapi_arena.h
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * A simple growable slab allocator.
+ *
+ * Allocations are pointer bumps within the current slab.  When a slab is full
+ * a new one, at least twice as large, is chained after it.  Memory is never
+ * returned piecewise:  rapi_arena_reset makes all the space available again
+ * (without freeing it) and rapi_arena_destroy frees everything.
+ *
+ * On reset, if the arena had grown to more than one slab the slabs are
+ * coalesced into a single one large enough for all, so that after the first
+ * round the data allocated between two resets lies in contiguous memory.
+ *
+ * The arena is not thread-safe.
+ */
+
+#ifndef __RAPI_ARENA_H__
+#define __RAPI_ARENA_H__
+
+#include <stddef.h>
+
+#define RAPI_ARENA_ALIGN  8
+
+typedef struct rapi_arena_slab {
+	struct rapi_arena_slab* next;
+	size_t size; // usable bytes in data
+	size_t used; // bytes allocated thus far
+	char data[];
+} rapi_arena_slab;
+
+typedef struct rapi_arena {
+	rapi_arena_slab* head;    // first slab in the chain
+	rapi_arena_slab* current; // slab from which we're currently allocating
+	size_t min_slab_size;
+} rapi_arena;
+
+/* Opaque position within the arena, to undo the allocations made after it. */
+typedef struct rapi_arena_mark {
+	rapi_arena_slab* slab;
+	size_t used;
+} rapi_arena_mark;
+
+/** Initialize an empty arena.  No memory is allocated until the first rapi_arena_alloc. */
+void rapi_arena_init(rapi_arena* arena, size_t min_slab_size);
+
+/**
+ * Allocate `n` bytes, aligned to RAPI_ARENA_ALIGN.
+ *
+ * \return pointer to the new space, or NULL if a new slab was needed and
+ * couldn't be allocated.
+ */
+void* rapi_arena_alloc(rapi_arena* arena, size_t n);
+
+/** Make all the arena space available again, keeping the memory. */
+void rapi_arena_reset(rapi_arena* arena);
+
+/** Free all the memory held by the arena.  The arena can be reused after this call. */
+void rapi_arena_destroy(rapi_arena* arena);
+
+/** Total number of bytes held by the arena. */
+size_t rapi_arena_capacity(const rapi_arena* arena);
+
+/** Get a mark at the current position in the arena. */
+static inline rapi_arena_mark rapi_arena_get_mark(const rapi_arena* arena)
+{
+	rapi_arena_mark mark;
+	mark.slab = arena->current;
+	mark.used = arena->current ? arena->current->used : 0;
+	return mark;
+}
+
+/**
+ * Release all allocations made after `mark` was taken.  Allocations that
+ * spilled into later slabs are released as well.
+ */
+void rapi_arena_rewind(rapi_arena* arena, rapi_arena_mark mark);
+
+#endif
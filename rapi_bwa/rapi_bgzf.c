@@ -0,0 +1,246 @@
+/*
+ * rapi_bgzf.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * BGZF writer.
+ *
+ * Data is accumulated into blocks of BGZF_BLOCK_SIZE bytes.  When we have
+ * a few blocks per thread they're deflated in parallel (with kt_for) and
+ * written out in order.
+ */
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <rapi.h>
+#include <rapi_utils.h>
+#include <bwamem.h>
+#include <kstring.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "bwa_header.h"
+
+// Same as htslib:  leaves room for the compressed data to grow a little
+// when it's not compressible and still fit in a 64 KB block.
+#define BGZF_BLOCK_SIZE     0xff00
+#define BGZF_MAX_BLOCK_SIZE 0x10000
+#define BGZF_HEADER_SIZE    18
+#define BGZF_FOOTER_SIZE    8
+
+// number of blocks buffered per thread before compressing
+#define BGZF_BLOCKS_PER_THREAD 4
+
+typedef struct {
+	uint8_t in[BGZF_BLOCK_SIZE];
+	size_t in_len;
+	uint8_t out[BGZF_MAX_BLOCK_SIZE];
+	size_t out_len;
+	rapi_error_t error;
+} bgzf_block;
+
+struct rapi_bgzf_writer {
+	int fd;
+	int level;
+	int n_threads;
+	int n_blocks_max;
+	int n_blocks;       // blocks in use.  All but the last one are full.
+	bgzf_block* blocks;
+};
+
+static const uint8_t bgzf_eof_marker[28] = {
+	0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+	0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static inline void _put_le16(uint8_t* dest, uint16_t v)
+{
+	dest[0] = v & 0xff; dest[1] = v >> 8;
+}
+
+static inline void _put_le32(uint8_t* dest, uint32_t v)
+{
+	dest[0] = v & 0xff; dest[1] = (v >> 8) & 0xff; dest[2] = (v >> 16) & 0xff; dest[3] = v >> 24;
+}
+
+static void _bgzf_compress_block(rapi_bgzf_writer* w, bgzf_block* block)
+{
+	static const uint8_t header[BGZF_HEADER_SIZE] = {
+		0x1f, 0x8b, 0x08, 0x04, 0, 0, 0, 0, 0, 0xff, 6, 0, 'B', 'C', 2, 0, 0, 0
+	};
+
+	block->error = RAPI_NO_ERROR;
+
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	zs.next_in = block->in;
+	zs.avail_in = block->in_len;
+	zs.next_out = block->out + BGZF_HEADER_SIZE;
+	zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+
+	// raw deflate (negative window bits); we write the gzip header ourselves
+	if (deflateInit2(&zs, w->level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		block->error = RAPI_MEMORY_ERROR;
+		return;
+	}
+	int status = deflate(&zs, Z_FINISH);
+	deflateEnd(&zs);
+	if (status != Z_STREAM_END) { // compressed data doesn't fit in a block
+		PERROR("Failed to compress BGZF block (zlib status %d)\n", status);
+		block->error = RAPI_GENERIC_ERROR;
+		return;
+	}
+
+	block->out_len = BGZF_HEADER_SIZE + zs.total_out + BGZF_FOOTER_SIZE;
+	memcpy(block->out, header, BGZF_HEADER_SIZE);
+	_put_le16(block->out + 16, block->out_len - 1); // BSIZE
+
+	uint8_t* footer = block->out + BGZF_HEADER_SIZE + zs.total_out;
+	_put_le32(footer, crc32(crc32(0L, NULL, 0), block->in, block->in_len));
+	_put_le32(footer + 4, block->in_len);
+}
+
+static void _bgzf_worker(void* data, int i, int tid)
+{
+	rapi_bgzf_writer* w = (rapi_bgzf_writer*)data;
+	_bgzf_compress_block(w, &w->blocks[i]);
+}
+
+static rapi_error_t _write_all(int fd, const uint8_t* buf, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			PERROR("Error writing BGZF data: %s\n", strerror(errno));
+			return RAPI_GENERIC_ERROR;
+		}
+		buf += n;
+		len -= n;
+	}
+	return RAPI_NO_ERROR;
+}
+
+/* Compress all the pending blocks and write them out */
+static rapi_error_t _bgzf_flush_blocks(rapi_bgzf_writer* w)
+{
+	int n_blocks = w->n_blocks;
+	if (n_blocks > 0 && w->blocks[n_blocks - 1].in_len == 0)
+		n_blocks -= 1; // don't write an empty trailing block
+
+	if (n_blocks == 1 || w->n_threads == 1) {
+		for (int i = 0; i < n_blocks; ++i)
+			_bgzf_compress_block(w, &w->blocks[i]);
+	}
+	else if (n_blocks > 1)
+		kt_for(w->n_threads, _bgzf_worker, w, n_blocks);
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	for (int i = 0; i < n_blocks && error == RAPI_NO_ERROR; ++i) {
+		error = w->blocks[i].error;
+		if (error == RAPI_NO_ERROR)
+			error = _write_all(w->fd, w->blocks[i].out, w->blocks[i].out_len);
+	}
+
+	for (int i = 0; i < w->n_blocks; ++i)
+		w->blocks[i].in_len = 0;
+	w->n_blocks = 0;
+
+	return error;
+}
+
+rapi_error_t rapi_bgzf_open(rapi_bgzf_writer** writer, int fd, int level, int n_threads)
+{
+	if (NULL == writer || fd < 0 || level < -1 || level > 9)
+		return RAPI_PARAM_ERROR;
+
+	if (n_threads < 1)
+		n_threads = 1;
+
+	rapi_bgzf_writer* w = calloc(1, sizeof(*w));
+	if (NULL == w)
+		return RAPI_MEMORY_ERROR;
+
+	w->fd = fd;
+	w->level = level;
+	w->n_threads = n_threads;
+	w->n_blocks_max = n_threads * BGZF_BLOCKS_PER_THREAD;
+	w->blocks = malloc(w->n_blocks_max * sizeof(w->blocks[0]));
+	if (NULL == w->blocks) {
+		free(w);
+		return RAPI_MEMORY_ERROR;
+	}
+
+	*writer = w;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_bgzf_write(rapi_bgzf_writer* w, const void* data, size_t len)
+{
+	const uint8_t* input = data;
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	while (len > 0 && error == RAPI_NO_ERROR) {
+		if (w->n_blocks == 0 || w->blocks[w->n_blocks - 1].in_len == BGZF_BLOCK_SIZE) {
+			// need a new block
+			if (w->n_blocks == w->n_blocks_max) {
+				error = _bgzf_flush_blocks(w);
+				if (error)
+					break;
+			}
+			w->blocks[w->n_blocks++].in_len = 0;
+		}
+
+		bgzf_block* block = &w->blocks[w->n_blocks - 1];
+		size_t n = BGZF_BLOCK_SIZE - block->in_len;
+		if (n > len)
+			n = len;
+		memcpy(block->in + block->in_len, input, n);
+		block->in_len += n;
+		input += n;
+		len -= n;
+	}
+
+	return error;
+}
+
+rapi_error_t rapi_bgzf_flush(rapi_bgzf_writer* w)
+{
+	return _bgzf_flush_blocks(w);
+}
+
+rapi_error_t rapi_bgzf_close(rapi_bgzf_writer* w)
+{
+	if (NULL == w)
+		return RAPI_PARAM_ERROR;
+
+	rapi_error_t error = _bgzf_flush_blocks(w);
+	if (error == RAPI_NO_ERROR)
+		error = _write_all(w->fd, bgzf_eof_marker, sizeof(bgzf_eof_marker));
+
+	free(w->blocks);
+	free(w);
+	return error;
+}
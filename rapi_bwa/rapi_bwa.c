@@ -18,6 +18,8 @@
  *  SOFTWARE.
  ******************************************************************************/
 
+#define _XOPEN_SOURCE 700 // for clock_gettime, realpath
+
 #include <rapi.h>
 #include <rapi_utils.h>
 #include <bwamem.h>
@@ -25,13 +27,23 @@
 #include <kvec.h>
 #include <utils.h>
 
+#include <ctype.h>
 #include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "bwa_header.h"
+#include "rapi_arena.h"
+#include "rapi_md5.h"
+#include "rapi_numa.h"
+#include "rapi_pool.h"
 
 #define RAPI_BWA_PLUGIN_VERSION  "0.1.0-dev"
 
@@ -40,8 +52,13 @@ typedef struct {
 	int mapq_min;
 	int isize_min;
 	int isize_max;
+	int isize_mode;
+	int isize_freeze_pairs;
 	int n_threads;
+	int pin_threads;
 	int share_ref_mem;
+	int numa_replicate_ref;
+	int verbose;
 	mem_opt_t* bwa_opts;
 } library_opts;
 
@@ -52,7 +69,8 @@ const char vtype_char[] = {
 	'A', // RAPI_VTYPE_CHAR       1
 	'Z', // RAPI_VTYPE_TEXT       2
 	'i', // RAPI_VTYPE_INT        3
-	'f'  // RAPI_VTYPE_REAL       4
+	'f', // RAPI_VTYPE_REAL       4
+	'Z'  // RAPI_VTYPE_DERIVED    5
 };
 
 /**
@@ -67,6 +85,14 @@ const char*const bwa_pg = "rapi-bwa";
 extern unsigned char nst_nt4_table[256];
 
 /******** Utility functions *******/
+/* Seconds from clock `clock_id` */
+static inline double _clock_time(clockid_t clock_id)
+{
+	struct timespec ts;
+	clock_gettime(clock_id, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
 void rapi_print_read(FILE* out, const rapi_read* read)
 {
 	fprintf(out, "read id: %s\n", read->id);
@@ -128,12 +154,61 @@ int rapi_flag_string(const int flag, char* buf20)
 	return str_pos;
 }
 
+/*
+ * A DERIVED SA tag keeps the number of alignments of the read and the index
+ * of the tag's own alignment in separate 16-bit halves of text_len.
+ */
+#define SA_TAG_PACK(n_alignments, i_aln) ((uint32_t)(uint16_t)(n_alignments) << 16 | (uint16_t)(i_aln))
+#define SA_TAG_N_ALIGNMENTS(text_len)    ((int)((text_len) >> 16))
+#define SA_TAG_I_ALN(text_len)           ((int)((text_len) & 0xffff))
+
+/*
+ * Write the SA text for alignment `i_aln` of the list:  the other primary
+ * (i.e., not secondary) alignments.
+ */
+static void _put_sa_text(const rapi_alignment* alignments, int n_alignments, int i_aln, kstring_t* output)
+{
+	for (int other = 0; other < n_alignments; ++other) {
+		const rapi_alignment*const sa = alignments + other;
+
+		// proceed if: 1) different from the current; 2) not shadowed multi hit
+		if (other == i_aln || sa->secondary_aln) continue;
+
+		kputs(sa->contig->name, output); kputc(',', output);
+		kputl(sa->pos, output); kputc(',', output); // XXX: BWA has sa->pos + 1
+		kputc(sa->reverse_strand ? '-' : '+', output); kputc(',', output);
+		rapi_put_cigar(sa->n_cigar_ops, sa->cigar_ops, 0, output);
+		kputc(',', output); kputw(sa->mapq, output);
+		kputc(',', output); kputw(sa->n_mismatches, output);
+		kputc(';', output);
+	}
+}
+
+rapi_error_t rapi_tag_put_text(const rapi_tag* tag, kstring_t* output)
+{
+	switch (tag->type) {
+		case RAPI_VTYPE_TEXT:
+			kputsn(tag->value.text, tag->text_len, output);
+			return RAPI_NO_ERROR;
+		case RAPI_VTYPE_DERIVED:
+			if (tag->key != RAPI_TAG_KEY('S', 'A')) {
+				PERROR("Don't know how to derive the value of tag %c%c\n", tag->key >> 8, tag->key & 0xff);
+				return RAPI_TYPE_ERROR;
+			}
+			_put_sa_text(tag->value.alignments, SA_TAG_N_ALIGNMENTS(tag->text_len), SA_TAG_I_ALN(tag->text_len), output);
+			return RAPI_NO_ERROR;
+		default:
+			return RAPI_TYPE_ERROR;
+	}
+}
+
 rapi_error_t rapi_format_tag(const rapi_tag* tag, kstring_t* str) {
 	// in theory we should check the return values of all these kput functions
 	// and ensure they're != EOF
 	rapi_error_t error = RAPI_NO_ERROR;
 
-	kputs(tag->key, str);
+	kputc(tag->key >> 8, str);
+	kputc(tag->key & 0xff, str);
 	kputc(':', str);
 	kputc(vtype_char[tag->type], str);
 	kputc(':', str);
@@ -146,12 +221,16 @@ rapi_error_t rapi_format_tag(const rapi_tag* tag, kstring_t* str) {
 			break;
 		 }
 		case RAPI_VTYPE_TEXT: {
-			const kstring_t* s;
-			error = rapi_tag_get_text(tag, &s);
+			const char* s;
+			size_t len;
+			error = rapi_tag_get_text(tag, &s, &len);
 			if (error) return RAPI_TYPE_ERROR;
-			kputsn(s->s, s->l, str);
+			kputsn(s, len, str);
 			break;
 		}
+		case RAPI_VTYPE_DERIVED:
+			error = rapi_tag_put_text(tag, str);
+			break;
 		case RAPI_VTYPE_INT: {
 			long i;
 			error = rapi_tag_get_long(tag, &i);
@@ -173,47 +252,66 @@ rapi_error_t rapi_format_tag(const rapi_tag* tag, kstring_t* str) {
 	return error;
 }
 
-/**
- * Produce SAM for `read`, using the alignment at index i_aln, or no alignment (as unmapped read) if i_aln < 0.
+/*
+ * The information needed to write a SAM or BAM record for one alignment of a
+ * read.  It's filled by _rapi_prepare_aln_record.
  */
-static rapi_error_t _rapi_format_sam_aln(const rapi_read* read, int i_aln, const rapi_read* mate, int read_num, kstring_t* output)
+typedef struct {
+	const rapi_read* read;
+	int i_aln;
+	rapi_alignment aln;       // the alignment, with coordinates from the mate if unmapped
+	rapi_alignment mate_aln;  // the mate's primary alignment, if we have a mate
+	int has_mate;
+	int flag;
+	int hard_clip;            // convert soft clips to hard clips
+	int write_seq;            // write SEQ and QUAL?
+	int front_trim, rear_trim; // bases to trim from the printed sequence
+} aln_record;
+
+/*
+ * Prepare the record for `read`, using the alignment at index i_aln, or no
+ * alignment (as unmapped read) if i_aln < 0.
+ */
+static rapi_error_t _rapi_prepare_aln_record(const rapi_read* read, int i_aln, const rapi_read* mate, int read_num, aln_record* rec)
 {
 	/**** code based on mem_aln2sam in BWA ***/
 
 	if (NULL == read) {
-		PERROR("_rapi_format_sam_aln: NULL read pointer\n");
+		PERROR("_rapi_prepare_aln_record: NULL read pointer\n");
 		return RAPI_PARAM_ERROR;
 	}
 
 	if (read->n_alignments > 0 && i_aln >= read->n_alignments) {
-		PERROR("_rapi_format_sam_aln: i_aln out of bounds\n");
+		PERROR("_rapi_prepare_aln_record: i_aln out of bounds\n");
 		return RAPI_PARAM_ERROR;
 	}
 
-	rapi_alignment tmp_read, tmp_mate;
+	rec->read = read;
+	rec->i_aln = i_aln;
+	rec->has_mate = mate != NULL;
+
+	rapi_alignment* aln = &rec->aln;
+	rapi_alignment* mate_aln = &rec->mate_aln;
 
 	if (i_aln < 0) { // select no alignment
-		memset(&tmp_read, 0, sizeof(tmp_read));
+		memset(aln, 0, sizeof(*aln));
 	}
 	else {
-		tmp_read = read->alignments[i_aln];
+		*aln = read->alignments[i_aln];
 	}
 
 	if (mate && mate->n_alignments > 0) {
-		tmp_mate = *mate->alignments;
+		*mate_aln = *mate->alignments;
 	}
 	else {
-		memset(&tmp_mate, 0, sizeof(tmp_mate));
+		memset(mate_aln, 0, sizeof(*mate_aln));
 	}
 
 	if (mate) {
-		tmp_read.paired = 1;
-		tmp_mate.paired = 1;
+		aln->paired = 1;
+		mate_aln->paired = 1;
 	}
 
-	rapi_alignment* aln = &tmp_read;
-	rapi_alignment* mate_aln = &tmp_mate;
-
 	if (!aln->mapped && mate && mate_aln->mapped) { // copy mate position to read
 		aln->contig         = mate_aln->contig;
 		aln->pos            = mate_aln->pos;
@@ -251,17 +349,51 @@ static rapi_error_t _rapi_format_sam_aln(const rapi_read* read, int i_aln, const
 
 	// supplementary alignment -- i.e., additional alignments that are not marked as secondary
 	flag |= (i_aln > 0 && !aln->secondary_aln) ? 0x800 : 0;
+	rec->flag = flag & 0xffff;
+
+	// BWA forces hard clipping for supplementary alignments -- i.e., additional
+	// alignments that are not marked as secondary.  Those alignments are have the bit 0x800
+	rec->hard_clip = (i_aln > 0 && !aln->secondary_aln) ? 1 : 0;
+
+	// for secondary alignments, don't write SEQ and QUAL
+	rec->write_seq = !aln->secondary_aln;
+
+	rec->front_trim = rec->rear_trim = 0;
+	// Trim the printed sequence for supplementary alignments (those after the
+	// first in the list, so i_aln > 0, and not labeled as secondary 0x100)
+	if (aln->n_cigar_ops > 0 && i_aln > 0) {
+		if (aln->cigar_ops[0].op == RAPI_CIG_S || aln->cigar_ops[0].op == RAPI_CIG_H) {
+			rec->front_trim = aln->cigar_ops[0].len;
+		}
+		if (aln->cigar_ops[aln->n_cigar_ops - 1].op == RAPI_CIG_S || aln->cigar_ops[aln->n_cigar_ops - 1].op == RAPI_CIG_H) {
+			rec->rear_trim = aln->cigar_ops[aln->n_cigar_ops - 1].len;
+		}
+	}
+
+	return RAPI_NO_ERROR;
+}
+
+/**
+ * Produce SAM for `read`, using the alignment at index i_aln, or no alignment (as unmapped read) if i_aln < 0.
+ */
+static rapi_error_t _rapi_format_sam_aln(const rapi_read* read, int i_aln, const rapi_read* mate, int read_num, kstring_t* output)
+{
+	aln_record rec;
+	rapi_error_t error = _rapi_prepare_aln_record(read, i_aln, mate, read_num, &rec);
+	if (error)
+		return error;
+
+	const rapi_alignment* aln = &rec.aln;
+	const rapi_alignment* mate_aln = &rec.mate_aln;
 
 	kputs(read->id, output); kputc('\t', output); // QNAME\t
-	kputw((flag & 0xffff), output); kputc('\t', output); // FLAG
+	kputw(rec.flag, output); kputc('\t', output); // FLAG
 
 	if (aln->contig) { // with coordinate
 		kputs(aln->contig->name, output); kputc('\t', output); // RNAME
 		kputl(aln->pos, output); kputc('\t', output); // POS
 		kputw(aln->mapq, output); kputc('\t', output); // MAPQ
-		// BWA forces hard clipping for supplementary alignments -- i.e., additional
-		// alignments that are not marked as secondary.  Those alignments are have the bit 0x800
-		rapi_put_cigar(aln->n_cigar_ops, aln->cigar_ops, (i_aln > 0 && !aln->secondary_aln) ? 1 : 0, output);
+		rapi_put_cigar(aln->n_cigar_ops, aln->cigar_ops, rec.hard_clip, output);
 	}
 	else
 		kputsn("*\t0\t0\t*", 7, output); // unmapped
@@ -287,22 +419,12 @@ static rapi_error_t _rapi_format_sam_aln(const rapi_read* read, int i_aln, const
 	kputc('\t', output);
 
 	// print SEQ and QUAL
-	if (aln->secondary_aln) { // for secondary alignments, don't write SEQ and QUAL
+	if (!rec.write_seq) {
 		kputsn("*\t*", 3, output);
 	}
 	else {
 		int i, end = read->length;
-		int front_trim = 0, rear_trim = 0;
-		// Trim the printed sequence for supplementary alignments (those after the
-		// first in the list, so i_aln > 0, and not labeled as secondary 0x100)
-		if (aln->n_cigar_ops > 0) {
-			if (i_aln > 0 && (aln->cigar_ops[0].op == RAPI_CIG_S || aln->cigar_ops[0].op == RAPI_CIG_H)) {
-				front_trim = aln->cigar_ops[0].len;
-			}
-			if (i_aln > 0 && (aln->cigar_ops[aln->n_cigar_ops - 1].op == RAPI_CIG_S || aln->cigar_ops[aln->n_cigar_ops - 1].op == RAPI_CIG_H)) {
-				rear_trim = aln->cigar_ops[aln->n_cigar_ops - 1].len;
-			}
-		}
+		const int front_trim = rec.front_trim, rear_trim = rec.rear_trim;
 		int trimmed_length = read->length - front_trim - rear_trim;
 		int new_size = output->l + trimmed_length + 1; // +1 for delimiter
 		if (read->qual)
@@ -343,8 +465,6 @@ static rapi_error_t _rapi_format_sam_aln(const rapi_read* read, int i_aln, const
 
 	if (aln->score >= 0) { kputsn("\tAS:i:", 6, output); kputw(aln->score, output); }
 
-	rapi_error_t error = RAPI_NO_ERROR;
-
 	// write all othere tags
 	for (int t = 0; t < kv_size(aln->tags) && RAPI_NO_ERROR == error; ++t) {
 		kputc('\t', output);
@@ -467,14 +587,143 @@ rapi_error_t rapi_format_sam_b(const rapi_batch* batch, rapi_ssize_t n_frag, kst
 	return error;
 }
 
+/*
+ * Formats one fragment, appending it to output.  Used by the batch formatters.
+ */
+typedef rapi_error_t (*fragment_formatter)(const rapi_ref* ref, const rapi_batch* batch, rapi_ssize_t n_frag, kstring_t* output);
+
+typedef struct {
+	fragment_formatter format;
+	const rapi_ref* ref;
+	const rapi_batch* batch;
+	rapi_ssize_t start_fragment;
+	rapi_ssize_t end_fragment;
+	rapi_ssize_t chunk_size;
+	kstring_t* outputs;     // one per chunk
+	rapi_error_t* errors;   // one per chunk
+} format_batch_worker_t;
+
+static void _format_batch_worker(void* data, int i, int tid)
+{
+	format_batch_worker_t* w = (format_batch_worker_t*)data;
+	const rapi_ssize_t start = w->start_fragment + i * w->chunk_size;
+	const rapi_ssize_t end = start + w->chunk_size < w->end_fragment ? start + w->chunk_size : w->end_fragment;
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	for (rapi_ssize_t f = start; f < end && error == RAPI_NO_ERROR; ++f)
+		error = w->format(w->ref, w->batch, f, &w->outputs[i]);
+	w->errors[i] = error;
+}
+
+/*
+ * Format the fragments [start_fragment, end_fragment) with `format`.  The range
+ * is split into chunks that are formatted in parallel into separate buffers,
+ * which are then appended to `output` in order.
+ */
+static rapi_error_t _format_batch(fragment_formatter format, const rapi_ref* ref, const rapi_batch* batch,
+        rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, int n_threads, kstring_t* output)
+{
+	if (NULL == batch || NULL == output) {
+		PERROR("NULL argument!\n");
+		return RAPI_PARAM_ERROR;
+	}
+
+	if (start_fragment < 0 || end_fragment > batch->n_frags || start_fragment > end_fragment) {
+		PERROR("start or end fragment is out of bounds. Got start %lld and end %lld but we have %lld fragments\n",
+		        start_fragment, end_fragment, batch->n_frags);
+		return RAPI_PARAM_ERROR;
+	}
+
+	const rapi_ssize_t n_frags = end_fragment - start_fragment;
+	if (n_frags == 0)
+		return RAPI_NO_ERROR;
+
+	if (n_threads < 1)
+		n_threads = 1;
+
+	// Split the range into a few chunks per thread, so that the work is balanced
+	// even if some fragments produce much more output than others.
+	rapi_ssize_t n_chunks = n_threads == 1 ? 1 : 4 * n_threads;
+	if (n_chunks > n_frags)
+		n_chunks = n_frags;
+
+	format_batch_worker_t w;
+	w.format = format;
+	w.ref = ref;
+	w.batch = batch;
+	w.start_fragment = start_fragment;
+	w.end_fragment = end_fragment;
+	w.chunk_size = (n_frags + n_chunks - 1) / n_chunks;
+	n_chunks = (n_frags + w.chunk_size - 1) / w.chunk_size;
+	w.outputs = calloc(n_chunks, sizeof(w.outputs[0]));
+	w.errors = calloc(n_chunks, sizeof(w.errors[0]));
+	if (NULL == w.outputs || NULL == w.errors) {
+		free(w.outputs); free(w.errors);
+		return RAPI_MEMORY_ERROR;
+	}
+
+	if (n_chunks == 1) // skip the thread start-up
+		_format_batch_worker(&w, 0, 0);
+	else
+		kt_for(n_threads, _format_batch_worker, &w, n_chunks);
+
+	// splice the chunks together, in order
+	rapi_error_t error = RAPI_NO_ERROR;
+	size_t total_len = 0;
+	for (int i = 0; i < n_chunks; ++i) {
+		if (error == RAPI_NO_ERROR)
+			error = w.errors[i];
+		total_len += w.outputs[i].l;
+	}
+
+	if (error == RAPI_NO_ERROR) {
+		if (ks_resize(output, output->l + total_len + 1) != 0)
+			error = RAPI_MEMORY_ERROR;
+		else {
+			for (int i = 0; i < n_chunks; ++i) {
+				memcpy(output->s + output->l, w.outputs[i].s, w.outputs[i].l);
+				output->l += w.outputs[i].l;
+			}
+			output->s[output->l] = '\0';
+		}
+	}
+
+	for (int i = 0; i < n_chunks; ++i)
+		free(w.outputs[i].s);
+	free(w.outputs);
+	free(w.errors);
+
+	return error;
+}
+
+static rapi_error_t _format_sam_fragment_line(const rapi_ref* ref, const rapi_batch* batch, rapi_ssize_t n_frag, kstring_t* output)
+{
+	rapi_error_t error = rapi_format_sam_b(batch, n_frag, output);
+	kputc('\n', output);
+	return error;
+}
+
+rapi_error_t rapi_format_sam_batch(const rapi_batch* batch, rapi_ssize_t start_fragment, rapi_ssize_t end_fragment,
+        int n_threads, kstring_t* output)
+{
+	return _format_batch(_format_sam_fragment_line, NULL, batch, start_fragment, end_fragment, n_threads, output);
+}
+
 
 rapi_error_t rapi_format_sam_hdr(const rapi_ref* ref, kstring_t* output)
 {
 	if (!ref || !output)
 		return RAPI_PARAM_ERROR;
 
-	for (int i = 0; i < ref->n_contigs; ++i)
-		ksprintf(output, "@SQ\tSN:%s\tLN:%lld\n", ref->contigs[i].name, ref->contigs[i].len);
+	for (int i = 0; i < ref->n_contigs; ++i) {
+		const rapi_contig* c = &ref->contigs[i];
+		ksprintf(output, "@SQ\tSN:%s\tLN:%lld", c->name, c->len);
+		if (c->assembly_identifier) ksprintf(output, "\tAS:%s", c->assembly_identifier);
+		if (c->md5)                 ksprintf(output, "\tM5:%s", c->md5);
+		if (c->species)             ksprintf(output, "\tSP:%s", c->species);
+		if (c->uri)                 ksprintf(output, "\tUR:%s", c->uri);
+		kputc('\n', output);
+	}
 
 	ksprintf(output, "@PG\tID:rapi (%s)\tPN:rapi (%s)\tVN:%s (%s)\n",
 	    rapi_aligner_name(),
@@ -485,6 +734,307 @@ rapi_error_t rapi_format_sam_hdr(const rapi_ref* ref, kstring_t* output)
 	return RAPI_NO_ERROR;
 }
 
+/******** BAM output *******/
+
+// BAM integers are little-endian, regardless of the host
+static inline void _bam_put_u8(uint8_t v, kstring_t* s)
+{
+	kputc_(v, s);
+}
+
+static inline void _bam_put_u16(uint16_t v, kstring_t* s)
+{
+	const char b[2] = { v & 0xff, (v >> 8) & 0xff };
+	kputsn_(b, 2, s);
+}
+
+static inline void _bam_put_u32(uint32_t v, kstring_t* s)
+{
+	const char b[4] = { v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, (v >> 24) & 0xff };
+	kputsn_(b, 4, s);
+}
+
+static inline void _bam_set_u32(uint32_t v, char* dest)
+{
+	dest[0] = v & 0xff; dest[1] = (v >> 8) & 0xff; dest[2] = (v >> 16) & 0xff; dest[3] = (v >> 24) & 0xff;
+}
+
+// From the SAM specification: compute the bin given an alignment covering [beg,end) (0-based, half-closed)
+static int _bam_reg2bin(int beg, int end)
+{
+	--end;
+	if (beg>>14 == end>>14) return ((1<<15)-1)/7 + (beg>>14);
+	if (beg>>17 == end>>17) return ((1<<12)-1)/7 + (beg>>17);
+	if (beg>>20 == end>>20) return ((1<<9)-1)/7 + (beg>>20);
+	if (beg>>23 == end>>23) return ((1<<6)-1)/7 + (beg>>23);
+	if (beg>>26 == end>>26) return ((1<<3)-1)/7 + (beg>>26);
+	return 0;
+}
+
+// RAPI cigar op codes (see rapi_cigops_char) to BAM op codes ("MIDNSHP=X")
+static const uint8_t _bam_cigar_op[] = { 0, 1, 2, 4, 5, 3, 6 };
+
+// 4-bit BAM base codes, indexed by nst_nt4_table values (A, C, G, T, N)
+static const uint8_t _bam_nt16[] = { 1, 2, 4, 8, 15 };
+// complements, for the reverse strand
+static const uint8_t _bam_nt16_comp[] = { 8, 4, 2, 1, 15 };
+
+static inline int32_t _bam_ref_id(const rapi_ref* ref, const rapi_contig* contig)
+{
+	return contig ? (int32_t)(contig - ref->contigs) : -1;
+}
+
+static inline void _bam_put_tag_key(uint16_t key, kstring_t* s)
+{
+	_bam_put_u8(key >> 8, s);
+	_bam_put_u8(key & 0xff, s);
+}
+
+// Append an integer tag, with the smallest integer type that holds the value
+static void _bam_put_int_tag(uint16_t key, long v, kstring_t* output)
+{
+	_bam_put_tag_key(key, output);
+	if (v >= 0) {
+		if (v <= UINT8_MAX)       { _bam_put_u8('C', output); _bam_put_u8(v, output); }
+		else if (v <= UINT16_MAX) { _bam_put_u8('S', output); _bam_put_u16(v, output); }
+		else                      { _bam_put_u8('I', output); _bam_put_u32(v, output); }
+	}
+	else {
+		if (v >= INT8_MIN)        { _bam_put_u8('c', output); _bam_put_u8((uint8_t)v, output); }
+		else if (v >= INT16_MIN)  { _bam_put_u8('s', output); _bam_put_u16((uint16_t)v, output); }
+		else                      { _bam_put_u8('i', output); _bam_put_u32((uint32_t)v, output); }
+	}
+}
+
+static rapi_error_t _bam_put_tag(const rapi_tag* tag, kstring_t* output)
+{
+	switch (tag->type) {
+		case RAPI_VTYPE_CHAR: {
+			char c;
+			if (rapi_tag_get_char(tag, &c)) return RAPI_TYPE_ERROR;
+			_bam_put_tag_key(tag->key, output);
+			_bam_put_u8('A', output);
+			_bam_put_u8(c, output);
+			break;
+		}
+		case RAPI_VTYPE_TEXT: {
+			const char* text;
+			size_t len;
+			if (rapi_tag_get_text(tag, &text, &len)) return RAPI_TYPE_ERROR;
+			_bam_put_tag_key(tag->key, output);
+			_bam_put_u8('Z', output);
+			kputsn_(text, len, output);
+			_bam_put_u8('\0', output);
+			break;
+		}
+		case RAPI_VTYPE_DERIVED: {
+			_bam_put_tag_key(tag->key, output);
+			_bam_put_u8('Z', output);
+			rapi_error_t error = rapi_tag_put_text(tag, output);
+			if (error) return error;
+			_bam_put_u8('\0', output);
+			break;
+		}
+		case RAPI_VTYPE_INT: {
+			long i;
+			if (rapi_tag_get_long(tag, &i)) return RAPI_TYPE_ERROR;
+			_bam_put_int_tag(tag->key, i, output);
+			break;
+		}
+		case RAPI_VTYPE_REAL: {
+			double d;
+			if (rapi_tag_get_dbl(tag, &d)) return RAPI_TYPE_ERROR;
+			union { float f; uint32_t u; } v;
+			v.f = (float)d;
+			_bam_put_tag_key(tag->key, output);
+			_bam_put_u8('f', output);
+			_bam_put_u32(v.u, output);
+			break;
+		}
+		default:
+			PERROR("Unrecognized tag type id %d\n", tag->type);
+			return RAPI_TYPE_ERROR;
+	};
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Append the BAM record for the alignment i_aln of `read` (see _rapi_format_sam_aln).
+ */
+static rapi_error_t _rapi_format_bam_aln(const rapi_ref* ref, const rapi_read* read, int i_aln,
+        const rapi_read* mate, int read_num, kstring_t* output)
+{
+	aln_record rec;
+	rapi_error_t error = _rapi_prepare_aln_record(read, i_aln, mate, read_num, &rec);
+	if (error)
+		return error;
+
+	const rapi_alignment* aln = &rec.aln;
+	const rapi_alignment* mate_aln = &rec.mate_aln;
+
+	const size_t name_len = strlen(read->id) + 1;
+	if (name_len > UINT8_MAX) {
+		PERROR("Read id %s is too long for BAM\n", read->id);
+		return RAPI_PARAM_ERROR;
+	}
+
+	const int seq_len = rec.write_seq ? read->length - rec.front_trim - rec.rear_trim : 0;
+	const int n_cigar = aln->contig ? aln->n_cigar_ops : 0;
+
+	const size_t block_size_pos = output->l;
+	_bam_put_u32(0, output); // block_size; we'll fill it in at the end
+
+	const int32_t pos = aln->contig ? (int32_t)(aln->pos - 1) : -1;
+	int32_t end_pos = pos + 1;
+	if (n_cigar > 0) {
+		int rlen = rapi_get_rlen(n_cigar, aln->cigar_ops);
+		if (rlen > 0)
+			end_pos = pos + rlen;
+	}
+
+	_bam_put_u32(_bam_ref_id(ref, aln->contig), output);            // refID
+	_bam_put_u32(pos, output);                                        // pos
+	_bam_put_u8(name_len, output);                                    // l_read_name
+	_bam_put_u8(aln->contig ? aln->mapq : 0, output);                 // mapq
+	_bam_put_u16(_bam_reg2bin(pos, end_pos), output);                 // bin
+	_bam_put_u16(n_cigar, output);                                    // n_cigar_op
+	_bam_put_u16(rec.flag, output);                                   // flag
+	_bam_put_u32(seq_len, output);                                    // l_seq
+
+	if (mate_aln->contig) {
+		_bam_put_u32(_bam_ref_id(ref, mate_aln->contig), output);     // next_refID
+		_bam_put_u32(mate_aln->pos - 1, output);                      // next_pos
+		if (aln->mapped && aln->contig == mate_aln->contig)
+			_bam_put_u32((int32_t)rapi_get_insert_size(aln, mate_aln), output); // tlen
+		else
+			_bam_put_u32(0, output);
+	}
+	else {
+		_bam_put_u32(-1, output);
+		_bam_put_u32(-1, output);
+		_bam_put_u32(0, output);
+	}
+
+	kputsn_(read->id, name_len, output); // includes the NULL terminator
+
+	for (int i = 0; i < n_cigar; ++i) {
+		int op = aln->cigar_ops[i].op;
+		if (op == RAPI_CIG_S || op == RAPI_CIG_H) op = rec.hard_clip ? RAPI_CIG_H : RAPI_CIG_S;
+		_bam_put_u32(((uint32_t)aln->cigar_ops[i].len << 4) | _bam_cigar_op[op], output);
+	}
+
+	if (seq_len > 0) {
+		// see _rapi_format_sam_aln for the logic behind the trimming on the reverse strand
+		const size_t seq_bytes = (seq_len + 1) / 2;
+		if (ks_resize(output, output->l + seq_bytes + seq_len + 1) != 0)
+			return RAPI_MEMORY_ERROR;
+
+		uint8_t* packed = (uint8_t*)output->s + output->l;
+		uint8_t* qual = packed + seq_bytes;
+		memset(packed, 0, seq_bytes);
+
+		for (int i = 0; i < seq_len; ++i) {
+			int j = aln->reverse_strand ? read->length - rec.front_trim - 1 - i : rec.front_trim + i;
+			const int b = nst_nt4_table[(int)read->seq[j]];
+			const uint8_t code = aln->reverse_strand ? _bam_nt16_comp[b] : _bam_nt16[b];
+			packed[i >> 1] |= (i & 1) ? code : code << 4;
+			qual[i] = read->qual ? read->qual[j] - 33 : 0xff;
+		}
+		output->l += seq_bytes + seq_len;
+	}
+
+	// tags
+	if (n_cigar > 0)
+		_bam_put_int_tag(RAPI_TAG_KEY('N', 'M'), aln->n_mismatches, output);
+	if (aln->score >= 0)
+		_bam_put_int_tag(RAPI_TAG_KEY('A', 'S'), aln->score, output);
+
+	for (int t = 0; t < kv_size(aln->tags) && RAPI_NO_ERROR == error; ++t)
+		error = _bam_put_tag(&kv_A(aln->tags, t), output);
+
+	_bam_set_u32(output->l - block_size_pos - 4, output->s + block_size_pos);
+	return error;
+}
+
+static rapi_error_t _rapi_format_bam_read(const rapi_ref* ref, const rapi_read* read, const rapi_read* mate, int read_num, kstring_t* output)
+{
+	if (read->n_alignments == 0)
+		return _rapi_format_bam_aln(ref, read, -1, mate, read_num, output);
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	for (int i = 0; i < read->n_alignments && !error; ++i)
+		error = _rapi_format_bam_aln(ref, read, i, mate, read_num, output);
+	return error;
+}
+
+rapi_error_t rapi_format_bam_b(const rapi_ref* ref, const rapi_batch* batch, rapi_ssize_t n_frag, kstring_t* output)
+{
+	if (NULL == ref || NULL == batch || NULL == output) {
+		PERROR("NULL argument!\n");
+		return RAPI_PARAM_ERROR;
+	}
+
+	if (batch->n_reads_frag > 2 || batch->n_reads_frag <= 0) {
+		PERROR("Only single and paired reads are supported (got %d)\n", batch->n_reads_frag);
+		return RAPI_PARAM_ERROR;
+	}
+
+	const rapi_read* read = rapi_get_read(batch, n_frag, 0);
+	const rapi_read* mate = batch->n_reads_frag > 1 ? rapi_get_read(batch, n_frag, 1) : NULL;
+	if (NULL == read || (batch->n_reads_frag > 1 && NULL == mate)) {
+		PERROR("Error fetching reads for fragment %lld\n", n_frag);
+		return RAPI_PARAM_ERROR;
+	}
+
+	const size_t start_len = output->l;
+	rapi_error_t error = _rapi_format_bam_read(ref, read, mate, 1, output);
+	if (mate && error == RAPI_NO_ERROR)
+		error = _rapi_format_bam_read(ref, mate, read, 2, output);
+
+	if (error != RAPI_NO_ERROR) // don't leave partial records behind
+		output->l = start_len;
+	return error;
+}
+
+rapi_error_t rapi_format_bam_batch(const rapi_ref* ref, const rapi_batch* batch,
+        rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, int n_threads, kstring_t* output)
+{
+	if (NULL == ref) {
+		PERROR("NULL argument!\n");
+		return RAPI_PARAM_ERROR;
+	}
+	return _format_batch(rapi_format_bam_b, ref, batch, start_fragment, end_fragment, n_threads, output);
+}
+
+rapi_error_t rapi_format_bam_hdr(const rapi_ref* ref, kstring_t* output)
+{
+	if (!ref || !output)
+		return RAPI_PARAM_ERROR;
+
+	kstring_t text = { 0, 0, NULL };
+	rapi_error_t error = rapi_format_sam_hdr(ref, &text);
+	if (error) {
+		free(text.s);
+		return error;
+	}
+	if (text.l > 0 && text.s[text.l - 1] != '\n')
+		kputc('\n', &text);
+
+	kputsn_("BAM\1", 4, output);
+	_bam_put_u32(text.l, output);
+	kputsn_(text.s, text.l, output);
+	free(text.s);
+
+	_bam_put_u32(ref->n_contigs, output);
+	for (int i = 0; i < ref->n_contigs; ++i) {
+		const size_t name_len = strlen(ref->contigs[i].name) + 1;
+		_bam_put_u32(name_len, output);
+		kputsn_(ref->contigs[i].name, name_len, output);
+		_bam_put_u32(ref->contigs[i].len, output);
+	}
+	return RAPI_NO_ERROR;
+}
+
 /**********************************/
 
 
@@ -510,7 +1060,11 @@ static void _print_bwa_batch(FILE* out, const bwa_batch* read_batch)
 		const bseq1_t* bwa_read = read_batch->seqs + r;
 		fprintf(out, "-=-=--=\n");
 		fprintf(out, "name: %s\n", bwa_read->name);
-		fprintf(out, "seq: %s\n", bwa_read->seq);
+		// the sequence is in BWA's 2-bit encoding
+		fprintf(out, "seq: ");
+		for (int i = 0; i < bwa_read->l_seq; ++i)
+			fputc("ACGTN"[(int)bwa_read->seq[i]], out);
+		fputc('\n', out);
 		fprintf(out, "qual %.*s\n", bwa_read->l_seq, bwa_read->qual);
 	}
 }
@@ -520,29 +1074,74 @@ static void _print_bwa_batch(FILE* out, const bwa_batch* read_batch)
 /**
  * Definition of the aligner state structure.
  */
+/* An alignment request queued by rapi_align_reads_async */
+struct rapi_align_handle {
+	const rapi_ref* ref;
+	rapi_batch* batch;
+	rapi_ssize_t start_fragment;
+	rapi_ssize_t end_fragment;
+	struct rapi_align_handle* next; // queue link
+	// completion status, protected by `lock`
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	rapi_error_t error;
+	int done;
+};
+
+/*
+ * A uniform random sample (reservoir) of the insert sizes in one orientation
+ * over all the batches aligned, so the estimate can be refined indefinitely
+ * in bounded memory.
+ */
+#define ISIZE_MAX_SAMPLES (1 << 16)
+typedef struct {
+	int64_t n_seen;
+	kvec_t(uint32_t) sizes;
+} isize_samples;
+
 struct rapi_aligner_state {
-	const library_opts* opts;
+	// Snapshot of the options, owned by the state and never modified after
+	// rapi_aligner_state_init.  The RAPI-level options have already been
+	// applied to opts.bwa_opts.
+	library_opts opts;
 	int64_t n_reads_processed;
-	// paired-end stats
+	// paired-end stats.  Only modified under `align_lock`.
 	mem_pestat_t pes[4];
+	int isize_fixed;      // pes was set with rapi_aligner_isize_set
+	// For RAPI_ISIZE_FROZEN and RAPI_ISIZE_RUNNING, the insert sizes seen so far
+	int64_t isize_n_pairs; // read pairs that went into isize_samples
+	isize_samples isize_samples[4];
+	uint64_t isize_rng;
+
+	// Worker threads for the alignment phases, created with the state
+	rapi_pool* pool;
+
+	// Cumulative statistics, protected by `stats_lock`.  _align_reads adds
+	// each alignment's numbers at the end.
+	pthread_mutex_t stats_lock;
+	rapi_aligner_stats stats;
+
+	// Held while an alignment runs.  It serializes synchronous and
+	// asynchronous calls using this state (and so the use of the pool).
+	pthread_mutex_t align_lock;
+
+	// Scratch for rapi_align_fragment (protected by align_lock), so it
+	// doesn't allocate anything of its own.
+	bseq1_t frag_seqs[2];
+	mem_alnreg_v frag_regs[2];
+
+	// Asynchronous alignment.  The dispatcher thread is only started by the
+	// first call to rapi_align_reads_async.  `queue_lock` protects all the
+	// following members.
+	pthread_mutex_t queue_lock;
+	pthread_cond_t queue_cond; // signalled when a job is queued or on shutdown
+	struct rapi_align_handle* queue_head;
+	struct rapi_align_handle* queue_tail;
+	pthread_t dispatcher;
+	int dispatcher_started;
+	int shutting_down;
 };
 
-
-#if 1 // strdup is not defined if we compile with c99, but is when I include kvec.h.
-// Is there a preprocessor DEFINE I can use to test whether a function is defined?
-char* strdup(const char* str)
-{
-	if (NULL == str)
-		return NULL;
-
-	size_t len = strlen(str);
-	char* new_str = malloc(len + 1);
-	if (NULL == new_str)
-		return NULL;
-	return strcpy(new_str, str);
-}
-#endif
-
 static rapi_error_t _library_opts_init(void) {
     _g_library_opts = calloc(1, sizeof(library_opts));
     if (!_g_library_opts) {
@@ -566,8 +1165,13 @@ static rapi_error_t _set_library_opts(library_opts* lib_opts, const rapi_opts* o
 	lib_opts->mapq_min = opts->mapq_min;
 	lib_opts->isize_min = opts->isize_min;
 	lib_opts->isize_max = opts->isize_max;
+	lib_opts->isize_mode = opts->isize_mode;
+	lib_opts->isize_freeze_pairs = opts->isize_freeze_pairs;
 	lib_opts->n_threads = opts->n_threads;
+	lib_opts->pin_threads = opts->pin_threads;
 	lib_opts->share_ref_mem = opts->share_ref_mem;
+	lib_opts->numa_replicate_ref = opts->numa_replicate_ref;
+	lib_opts->verbose = opts->verbose;
 	lib_opts->bwa_opts = mem_opt_init();
 	if (NULL == lib_opts->bwa_opts)
 		return RAPI_MEMORY_ERROR;
@@ -586,6 +1190,20 @@ static inline const library_opts* _library_opts_get(void) {
 	return _g_library_opts;
 }
 
+/* Set `lib_opts` from `opts`, or to the default options if `opts` is NULL. */
+static rapi_error_t _set_library_opts_or_defaults(library_opts* lib_opts, const rapi_opts* opts) {
+	if (opts)
+		return _set_library_opts(lib_opts, opts);
+
+	rapi_opts defaults;
+	rapi_error_t error = rapi_opts_init(&defaults);
+	if (error == RAPI_NO_ERROR) {
+		error = _set_library_opts(lib_opts, &defaults);
+		rapi_opts_free(&defaults);
+	}
+	return error;
+}
+
 /* Init Library */
 rapi_error_t rapi_init(const rapi_opts* opts)
 {
@@ -594,10 +1212,7 @@ rapi_error_t rapi_init(const rapi_opts* opts)
 	if (RAPI_NO_ERROR != error)
 		return error;
 
-	if (opts)
-		return _set_library_opts(_g_library_opts, opts);
-	else
-		return RAPI_NO_ERROR;
+	return _set_library_opts_or_defaults(_g_library_opts, opts);
 }
 
 rapi_error_t rapi_shutdown(void) {
@@ -644,8 +1259,13 @@ rapi_error_t rapi_opts_init( rapi_opts * my_opts )
 	my_opts->mapq_min     = 0;
 	my_opts->isize_min    = 0;
 	my_opts->isize_max    = bwa_opt->max_ins;
+	my_opts->isize_mode   = RAPI_ISIZE_PER_BATCH;
+	my_opts->isize_freeze_pairs = 100000;
 	my_opts->n_threads    = 1;
+	my_opts->pin_threads  = 0;
 	my_opts->share_ref_mem = 1;
+	my_opts->numa_replicate_ref = 0;
+	my_opts->verbose      = 0;
 	kv_init(my_opts->parameters);
 
 	return RAPI_NO_ERROR;
@@ -672,34 +1292,204 @@ const char* rapi_plugin_version(void)
 	return RAPI_BWA_PLUGIN_VERSION;
 }
 
-/* Load Reference */
-rapi_error_t rapi_ref_load( const char * reference_path, rapi_ref * ref_struct )
+/******** Reference registry *******/
+/*
+ * References are shared within the process.  The registry maps the canonical
+ * path of each loaded index to a single copy of the BWA index and of the
+ * contig table; rapi_ref_load of a path that's already loaded returns another
+ * handle to them.  rapi_ref_free releases a handle and the index is unloaded
+ * when the last one is released.
+ *
+ * The registry lock isn't held while an index loads.  The loader inserts its
+ * entry in the `loading` state and concurrent loads of the same path wait on
+ * _g_ref_registry_cond for it, rather than loading the index twice.  If the
+ * load fails the entry is unlinked and the waiters return the same error.
+ */
+typedef struct ref_entry {
+	char* key;          // canonical index path
+	bwaidx_t* bwa_idx;
+	int n_contigs;
+	rapi_contig* contigs;
+	// Hash index of the contig names (open addressing with linear probing).
+	// Each slot holds a contig index + 1, or 0 if it's empty.
+	int* name_slots;
+	uint32_t name_mask;
+	// Copies of the index for each NUMA node, made on demand for aligners that
+	// set numa_replicate_ref.  replicas[node] may point to bwa_idx itself.
+	int n_replicas;
+	bwaidx_t** replicas;
+	pthread_mutex_t lock; // serializes rapi_ref_fill_md5 and the replication
+	// The fields below are protected by _g_ref_registry_lock
+	int loading;             // the index is being loaded
+	rapi_error_t load_error; // set if the load failed
+	int refcount;
+	struct ref_entry* next;
+} ref_entry;
+
+static pthread_mutex_t _g_ref_registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _g_ref_registry_cond = PTHREAD_COND_INITIALIZER; // signalled when a load completes
+static ref_entry* _g_ref_registry = NULL;
+
+#define RefGetEntry(ref_ptr) ( (ref_entry*) ((ref_ptr)->_private) )
+#define RefGetBwaIdx(ref_ptr) ( RefGetEntry(ref_ptr)->bwa_idx )
+
+/*
+ * The BWA index path is a prefix that doesn't have to exist as a file, so
+ * we resolve the path of the .bwt file and strip the extension.  If that
+ * fails we fall back to the path itself, and if that doesn't exist either we
+ * use the path as given and let bwa_idx_load report the error.
+ *
+ * \return a newly allocated string, or NULL if out of memory.
+ */
+static char* _ref_canonical_path(const char* path)
 {
-	if ( NULL == ref_struct || NULL == reference_path )
-		return RAPI_PARAM_ERROR;
+	static const char bwt_ext[] = ".bwt";
+	const size_t ext_len = sizeof(bwt_ext) - 1;
+	const size_t path_len = strlen(path);
+
+	char* bwt_path = malloc(path_len + ext_len + 1);
+	if (bwt_path == NULL)
+		return NULL;
+	memcpy(bwt_path, path, path_len);
+	memcpy(bwt_path + path_len, bwt_ext, ext_len + 1);
+
+	char* canonical = realpath(bwt_path, NULL);
+	free(bwt_path);
+	if (canonical) {
+		const size_t len = strlen(canonical);
+		if (len > ext_len && strcmp(canonical + len - ext_len, bwt_ext) == 0) {
+			canonical[len - ext_len] = '\0';
+			return canonical;
+		}
+		// .bwt is a symlink to something with a different name
+		free(canonical);
+	}
+
+	canonical = realpath(path, NULL);
+	return canonical ? canonical : strdup(path);
+}
+
+static ref_entry* _ref_registry_find(const char* key)
+{
+	for (ref_entry* e = _g_ref_registry; e != NULL; e = e->next) {
+		if (strcmp(e->key, key) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+// FNV-1a
+static inline uint32_t _contig_name_hash(const char* name)
+{
+	uint32_t h = 2166136261u;
+	for (const unsigned char* p = (const unsigned char*)name; *p; ++p)
+		h = (h ^ *p) * 16777619u;
+	return h;
+}
+
+static rapi_error_t _ref_build_name_index(ref_entry* entry)
+{
+	// keep the table at most half full
+	uint32_t n_slots = 2;
+	while (n_slots < 2 * (uint32_t)entry->n_contigs)
+		n_slots <<= 1;
+
+	entry->name_slots = calloc(n_slots, sizeof(entry->name_slots[0]));
+	if (NULL == entry->name_slots)
+		return RAPI_MEMORY_ERROR;
+	entry->name_mask = n_slots - 1;
+
+	for (int i = 0; i < entry->n_contigs; ++i) {
+		const char* name = entry->contigs[i].name;
+		uint32_t slot = _contig_name_hash(name) & entry->name_mask;
+		while (entry->name_slots[slot] != 0) {
+			// with duplicate names the first contig wins, like a linear scan
+			if (strcmp(entry->contigs[entry->name_slots[slot] - 1].name, name) == 0)
+				break;
+			slot = (slot + 1) & entry->name_mask;
+		}
+		if (entry->name_slots[slot] == 0)
+			entry->name_slots[slot] = i + 1;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static void _ref_free_replica(bwaidx_t* replica)
+{
+	// the replica shares its bns with the original
+	if (replica->bwt) {
+		free(replica->bwt->bwt);
+		free(replica->bwt->sa);
+		free(replica->bwt);
+	}
+	free(replica->pac);
+	free(replica);
+}
+
+static void _ref_entry_free(ref_entry* entry)
+{
+	for (int i = 0; i < entry->n_replicas; ++i) {
+		if (entry->replicas[i] != entry->bwa_idx)
+			_ref_free_replica(entry->replicas[i]);
+	}
+	free(entry->replicas);
+	if (entry->bwa_idx) // NULL if the load failed
+		bwa_idx_destroy(entry->bwa_idx);
+	free(entry->name_slots);
+	pthread_mutex_destroy(&entry->lock);
+	if (entry->contigs) {
+		for (int i = 0; i < entry->n_contigs; ++i)
+		{
+			rapi_contig* c = &entry->contigs[i];
+			// *Don't* free name since it points to BWA's string
+			free(c->assembly_identifier);
+			free(c->species);
+			free(c->uri);
+			free(c->md5);
+		}
+		free(entry->contigs);
+	}
+	free(entry->key);
+	free(entry);
+}
+
+/*
+ * A new entry for `key`, in the `loading` state and with a reference count of 1.
+ * The entry takes ownership of `key`.
+ */
+static ref_entry* _ref_entry_new(char* key)
+{
+	ref_entry* entry = calloc(1, sizeof(*entry));
+	if (NULL == entry)
+		return NULL;
+	pthread_mutex_init(&entry->lock, NULL);
+	entry->key = key;
+	entry->loading = 1;
+	entry->refcount = 1;
+	return entry;
+}
 
-	const bwaidx_t*const bwa_idx = bwa_idx_load(reference_path, BWA_IDX_ALL, _library_opts_get()->share_ref_mem);
+/*
+ * Load the index at `reference_path` into `entry`.  Called without the
+ * registry lock.  On error, whatever was loaded is released by _ref_entry_free.
+ */
+static rapi_error_t _ref_entry_load(const char* reference_path, ref_entry* entry)
+{
+	const library_opts*const lib_opts = _library_opts_get();
+	bwaidx_t*const bwa_idx = bwa_idx_load(reference_path, BWA_IDX_ALL, lib_opts ? lib_opts->share_ref_mem : 0);
 	if ( NULL == bwa_idx )
 		return RAPI_GENERIC_ERROR;
+	entry->bwa_idx = bwa_idx;
 
-	// allocate memory
-	ref_struct->path = strdup(reference_path);
-	ref_struct->contigs = calloc( bwa_idx->bns->n_seqs, sizeof(rapi_contig) );
-	if ( NULL == ref_struct->path || NULL == ref_struct->contigs )
-	{
-		// if either allocations we free everything and return an error
-		bwa_idx_destroy((bwaidx_t*)bwa_idx);
-		free(ref_struct->path);
-		free(ref_struct->contigs);
-		memset(ref_struct, 0, sizeof(*ref_struct));
+	entry->contigs = calloc( bwa_idx->bns->n_seqs, sizeof(rapi_contig) );
+	if ( NULL == entry->contigs )
 		return RAPI_MEMORY_ERROR;
-	}
 
 	/* Fill in Contig Information */
-	ref_struct->n_contigs = bwa_idx->bns->n_seqs; /* Handle contains bnt_seq_t * bns holding contig information */
-	for ( int i = 0; i < ref_struct->n_contigs; ++i )
+	entry->n_contigs = bwa_idx->bns->n_seqs; /* Handle contains bnt_seq_t * bns holding contig information */
+	for ( int i = 0; i < entry->n_contigs; ++i )
 	{
-		rapi_contig* c = &ref_struct->contigs[i];
+		rapi_contig* c = &entry->contigs[i];
 		c->len = bwa_idx->bns->anns[i].len;
 		c->name = bwa_idx->bns->anns[i].name; // points to BWA string
 		c->assembly_identifier = NULL;
@@ -707,7 +1497,80 @@ rapi_error_t rapi_ref_load( const char * reference_path, rapi_ref * ref_struct )
 		c->uri = NULL;
 		c->md5 = NULL;
 	}
-	ref_struct->_private = (bwaidx_t*)bwa_idx;
+
+	return _ref_build_name_index(entry);
+}
+
+/* Load Reference */
+rapi_error_t rapi_ref_load( const char * reference_path, rapi_ref * ref_struct )
+{
+	if ( NULL == ref_struct || NULL == reference_path )
+		return RAPI_PARAM_ERROR;
+
+	char* path = strdup(reference_path);
+	char* key = _ref_canonical_path(reference_path);
+	if ( NULL == path || NULL == key )
+	{
+		free(path);
+		free(key);
+		return RAPI_MEMORY_ERROR;
+	}
+
+	rapi_error_t error = RAPI_NO_ERROR;
+	int last = 0;
+	pthread_mutex_lock(&_g_ref_registry_lock);
+	ref_entry* entry = _ref_registry_find(key);
+	if (entry) {
+		free(key);
+		// our reference keeps the entry alive if its load fails while we wait
+		entry->refcount += 1;
+		while (entry->loading)
+			pthread_cond_wait(&_g_ref_registry_cond, &_g_ref_registry_lock);
+		error = entry->load_error;
+	}
+	else {
+		entry = _ref_entry_new(key);
+		if (NULL == entry) {
+			free(key);
+			pthread_mutex_unlock(&_g_ref_registry_lock);
+			free(path);
+			memset(ref_struct, 0, sizeof(*ref_struct));
+			return RAPI_MEMORY_ERROR;
+		}
+		entry->next = _g_ref_registry;
+		_g_ref_registry = entry;
+		pthread_mutex_unlock(&_g_ref_registry_lock);
+
+		error = _ref_entry_load(reference_path, entry);
+
+		pthread_mutex_lock(&_g_ref_registry_lock);
+		if (error) {
+			// unlink it so that later loads of the path try again
+			ref_entry** p = &_g_ref_registry;
+			while (*p != entry)
+				p = &(*p)->next;
+			*p = entry->next;
+			entry->load_error = error;
+		}
+		entry->loading = 0;
+		pthread_cond_broadcast(&_g_ref_registry_cond);
+	}
+	if (error)
+		last = --entry->refcount == 0;
+	pthread_mutex_unlock(&_g_ref_registry_lock);
+
+	if (error) {
+		if (last)
+			_ref_entry_free(entry);
+		free(path);
+		memset(ref_struct, 0, sizeof(*ref_struct));
+		return error;
+	}
+
+	ref_struct->path = path;
+	ref_struct->n_contigs = entry->n_contigs;
+	ref_struct->contigs = entry->contigs;
+	ref_struct->_private = entry;
 
 	return RAPI_NO_ERROR;
 }
@@ -715,40 +1578,494 @@ rapi_error_t rapi_ref_load( const char * reference_path, rapi_ref * ref_struct )
 /* Free Reference */
 rapi_error_t rapi_ref_free( rapi_ref * ref )
 {
-	// free bwa's part
-	bwa_idx_destroy(ref->_private);
+	if ( NULL == ref )
+		return RAPI_PARAM_ERROR;
+
+	ref_entry*const entry = RefGetEntry(ref);
+	if (entry) {
+		int last = 0;
+		pthread_mutex_lock(&_g_ref_registry_lock);
+		if (--entry->refcount == 0) {
+			// unlink it from the registry
+			ref_entry** p = &_g_ref_registry;
+			while (*p != entry)
+				p = &(*p)->next;
+			*p = entry->next;
+			last = 1;
+		}
+		pthread_mutex_unlock(&_g_ref_registry_lock);
+
+		// the registry no longer knows about the entry, so we can free it
+		// without holding the lock
+		if (last)
+			_ref_entry_free(entry);
+	}
 
-	// then free the rest of the structure
 	free(ref->path);
+	memset(ref, 0, sizeof(*ref));
+	return RAPI_NO_ERROR;
+}
 
-	if (ref->contigs) {
-		for ( int i = 0; i < ref->n_contigs; ++i )
-		{
-			rapi_contig* c = &ref->contigs[i];
-			// *Don't* free name since it points to BWA's string
-			free(c->assembly_identifier);
-			free(c->species);
-			free(c->uri);
-			free(c->md5);
+const rapi_contig* rapi_ref_find_contig(const rapi_ref* ref, const char* name)
+{
+	if (NULL == ref || NULL == ref->_private || NULL == name)
+		return NULL;
+
+	const ref_entry*const entry = RefGetEntry(ref);
+	uint32_t slot = _contig_name_hash(name) & entry->name_mask;
+	while (entry->name_slots[slot] != 0) {
+		const rapi_contig* c = &entry->contigs[entry->name_slots[slot] - 1];
+		if (strcmp(c->name, name) == 0)
+			return c;
+		slot = (slot + 1) & entry->name_mask;
+	}
+	return NULL;
+}
+
+/******** Contig MD5 checksums *******/
+/*
+ * The checksums are computed from the index's packed sequence, with the
+ * ambiguous bases (which BWA replaces with random ones in `pac`) restored from
+ * the list of holes, so they match the M5 of the original FASTA sequence.
+ *
+ * They're cached in a sidecar file next to the index (<index>.md5) with one
+ * line per contig:  name, length and checksum, separated by tabs.  The cache
+ * is only used if it matches the contig table and is newer than the .pac.
+ */
+
+#define MD5_BLOCK_SIZE (64 * 1024)
+
+typedef struct {
+	const bntseq_t* bns;
+	const uint8_t* pac;
+	int* first_amb; // index of the first hole of each contig in bns->ambs
+	char (*md5s)[RAPI_MD5_HEX_LEN + 1];
+	int error;
+} md5_worker_t;
+
+static void _md5_worker(void* data, int i, int tid)
+{
+	md5_worker_t* w = (md5_worker_t*)data;
+	const bntann1_t* ann = &w->bns->anns[i];
+	char* buf = malloc(MD5_BLOCK_SIZE);
+	if (NULL == buf) {
+		w->error = 1; // only ever set, so the race is harmless
+		return;
+	}
+
+	rapi_md5_ctx ctx;
+	rapi_md5_init(&ctx);
+	int amb = w->first_amb[i];
+	const int end_amb = amb + ann->n_ambs;
+
+	for (int64_t start = 0; start < ann->len; start += MD5_BLOCK_SIZE) {
+		const int64_t block_len = ann->len - start < MD5_BLOCK_SIZE ? ann->len - start : MD5_BLOCK_SIZE;
+		const int64_t offset = ann->offset + start; // position in pac
+		for (int64_t j = 0; j < block_len; ++j) {
+			const int64_t p = offset + j;
+			buf[j] = "ACGT"[(w->pac[p >> 2] >> ((~p & 3) << 1)) & 3];
 		}
-		free (ref->contigs);
+
+		// put back the ambiguous bases that overlap this block
+		while (amb < end_amb && w->bns->ambs[amb].offset + w->bns->ambs[amb].len <= offset)
+			++amb;
+		for (int a = amb; a < end_amb && w->bns->ambs[a].offset < offset + block_len; ++a) {
+			const bntamb1_t* h = &w->bns->ambs[a];
+			const int64_t from = h->offset > offset ? h->offset : offset;
+			const int64_t to = h->offset + h->len < offset + block_len ? h->offset + h->len : offset + block_len;
+			memset(buf + (from - offset), toupper(h->amb), to - from);
+		}
+		rapi_md5_update(&ctx, buf, block_len);
 	}
-	memset(ref, 0, sizeof(*ref));
+	rapi_md5_final_hex(&ctx, w->md5s[i]);
+	free(buf);
+}
+
+static char* _ref_md5_sidecar_path(const ref_entry* entry, const char* ext)
+{
+	kstring_t path = { 0, 0, NULL };
+	ksprintf(&path, "%s%s", entry->key, ext);
+	return path.s;
+}
+
+/* Fill `md5s` from the sidecar file.  Returns 0 if it's valid. */
+static int _ref_md5_read_sidecar(const ref_entry* entry, char (*md5s)[RAPI_MD5_HEX_LEN + 1])
+{
+	char* sidecar_path = _ref_md5_sidecar_path(entry, ".md5");
+	char* pac_path = _ref_md5_sidecar_path(entry, ".pac");
+	struct stat sidecar_st, pac_st;
+	int valid = sidecar_path && pac_path
+		&& stat(sidecar_path, &sidecar_st) == 0
+		&& (stat(pac_path, &pac_st) != 0 || sidecar_st.st_mtime >= pac_st.st_mtime);
+
+	FILE* f = valid ? fopen(sidecar_path, "r") : NULL;
+	free(sidecar_path);
+	free(pac_path);
+	if (NULL == f)
+		return -1;
+
+	char* line = NULL;
+	size_t line_cap = 0;
+	int i = 0;
+	while (valid && getline(&line, &line_cap, f) >= 0) {
+		char* name_end = strchr(line, '\t');
+		char* len_end = NULL;
+		long long len = -1;
+		if (name_end) {
+			*name_end = '\0';
+			len = strtoll(name_end + 1, &len_end, 10);
+		}
+		valid = i < entry->n_contigs
+			&& name_end && len_end && *len_end == '\t'
+			&& strcmp(line, entry->contigs[i].name) == 0
+			&& len == entry->contigs[i].len
+			&& strspn(len_end + 1, "0123456789abcdef") == RAPI_MD5_HEX_LEN;
+		if (valid) {
+			memcpy(md5s[i], len_end + 1, RAPI_MD5_HEX_LEN);
+			md5s[i][RAPI_MD5_HEX_LEN] = '\0';
+			++i;
+		}
+	}
+	free(line);
+	fclose(f);
+	return valid && i == entry->n_contigs ? 0 : -1;
+}
+
+/*
+ * Write the sidecar file through a temporary file, so that other processes
+ * never see a partial one.  It's only a cache, so failures are ignored.
+ */
+static void _ref_md5_write_sidecar(const ref_entry* entry, char (*md5s)[RAPI_MD5_HEX_LEN + 1])
+{
+	char* sidecar_path = _ref_md5_sidecar_path(entry, ".md5");
+	kstring_t tmp_path = { 0, 0, NULL };
+	if (sidecar_path)
+		ksprintf(&tmp_path, "%s.%ld.tmp", sidecar_path, (long)getpid());
+
+	FILE* f = tmp_path.s ? fopen(tmp_path.s, "w") : NULL;
+	if (f) {
+		int ok = 1;
+		for (int i = 0; i < entry->n_contigs && ok; ++i)
+			ok = fprintf(f, "%s\t%lld\t%s\n", entry->contigs[i].name, (long long)entry->contigs[i].len, md5s[i]) > 0;
+		ok = (fclose(f) == 0) && ok;
+		if (!ok || rename(tmp_path.s, sidecar_path) != 0)
+			unlink(tmp_path.s);
+	}
+	free(tmp_path.s);
+	free(sidecar_path);
+}
+
+rapi_error_t rapi_ref_fill_md5(rapi_ref* ref, int n_threads)
+{
+	if (NULL == ref || NULL == ref->_private) {
+		PERROR("NULL or unloaded reference\n");
+		return RAPI_PARAM_ERROR;
+	}
+	if (n_threads < 1)
+		n_threads = 1;
+
+	ref_entry*const entry = RefGetEntry(ref);
+	rapi_error_t error = RAPI_NO_ERROR;
+	pthread_mutex_lock(&entry->lock);
+
+	int missing = 0;
+	for (int i = 0; i < entry->n_contigs; ++i)
+		missing |= entry->contigs[i].md5 == NULL;
+	if (!missing)
+		goto unlock;
+
+	md5_worker_t w;
+	memset(&w, 0, sizeof(w));
+	w.md5s = calloc(entry->n_contigs, sizeof(w.md5s[0]));
+	if (NULL == w.md5s) {
+		error = RAPI_MEMORY_ERROR;
+		goto unlock;
+	}
+
+	if (_ref_md5_read_sidecar(entry, w.md5s) != 0) {
+		const bwaidx_t*const bwa_idx = entry->bwa_idx;
+		if (NULL == bwa_idx->pac) {
+			PERROR("The reference's packed sequence isn't loaded\n");
+			error = RAPI_OP_NOT_SUPPORTED_ERROR;
+			goto free_md5s;
+		}
+		w.bns = bwa_idx->bns;
+		w.pac = bwa_idx->pac;
+		w.first_amb = malloc(entry->n_contigs * sizeof(w.first_amb[0]));
+		if (NULL == w.first_amb) {
+			error = RAPI_MEMORY_ERROR;
+			goto free_md5s;
+		}
+		for (int i = 0, n = 0; i < entry->n_contigs; n += w.bns->anns[i].n_ambs, ++i)
+			w.first_amb[i] = n;
+
+		// one contig per task:  the digest of a sequence can't be split
+		kt_for(n_threads, _md5_worker, &w, entry->n_contigs);
+		free(w.first_amb);
+		if (w.error) {
+			error = RAPI_MEMORY_ERROR;
+			goto free_md5s;
+		}
+		_ref_md5_write_sidecar(entry, w.md5s);
+	}
+
+	for (int i = 0; i < entry->n_contigs; ++i) {
+		rapi_contig* c = &entry->contigs[i];
+		if (c->md5 == NULL && (c->md5 = strdup(w.md5s[i])) == NULL)
+			error = RAPI_MEMORY_ERROR;
+	}
+
+free_md5s:
+	free(w.md5s);
+unlock:
+	pthread_mutex_unlock(&entry->lock);
+	return error;
+}
+
+/******** Reference prefetch *******/
+
+#define PREFETCH_CHUNK_SIZE (16 * 1024 * 1024)
+#define PREFETCH_MAX_REGIONS 3
+
+typedef struct {
+	const uint8_t* ptr;
+	size_t len;
+	int n_chunks;
+} prefetch_region;
+
+typedef struct {
+	prefetch_region regions[PREFETCH_MAX_REGIONS];
+	int n_regions;
+	size_t page_size;
+	size_t total_bytes;
+	size_t done_bytes; // updated atomically
+	int verbose;
+	double start_time;
+} prefetch_worker_t;
+
+static void _prefetch_worker(void* data, int i, int tid)
+{
+	prefetch_worker_t* w = (prefetch_worker_t*)data;
+
+	int r = 0;
+	while (i >= w->regions[r].n_chunks) {
+		i -= w->regions[r].n_chunks;
+		++r;
+	}
+	const size_t offset = (size_t)i * PREFETCH_CHUNK_SIZE;
+	const uint8_t* start = w->regions[r].ptr + offset;
+	const size_t len = w->regions[r].len - offset < PREFETCH_CHUNK_SIZE ? w->regions[r].len - offset : PREFETCH_CHUNK_SIZE;
+
+	// Ask the kernel to start reading the pages in (it's only a hint, so
+	// errors don't matter) and then touch every page to make sure they're
+	// actually resident.
+	const uintptr_t aligned = (uintptr_t)start & ~(uintptr_t)(w->page_size - 1);
+	posix_madvise((void*)aligned, len + ((uintptr_t)start - aligned), POSIX_MADV_WILLNEED);
+	for (size_t p = 0; p < len; p += w->page_size)
+		(void)((volatile const uint8_t*)start)[p];
+
+	const size_t done = __sync_add_and_fetch(&w->done_bytes, len);
+	if (w->verbose) {
+		const int prev_pct = (int)((done - len) * 10 / w->total_bytes) * 10;
+		const int pct = (int)(done * 10 / w->total_bytes) * 10;
+		if (pct > prev_pct)
+			fprintf(stderr, "[rapi] prefetched %d%% of the reference (%.1f sec)\n",
+			    pct, _clock_time(CLOCK_MONOTONIC) - w->start_time);
+	}
+}
+
+rapi_error_t rapi_ref_prefetch(const rapi_ref* ref, int n_threads, double* elapsed)
+{
+	if (NULL == ref || NULL == ref->_private) {
+		PERROR("NULL or unloaded reference\n");
+		return RAPI_PARAM_ERROR;
+	}
+	if (n_threads < 1)
+		n_threads = 1;
+
+	const bwaidx_t*const bwa_idx = RefGetBwaIdx(ref);
+	const library_opts*const lib_opts = _library_opts_get();
+
+	prefetch_worker_t w;
+	memset(&w, 0, sizeof(w));
+	w.page_size = sysconf(_SC_PAGESIZE);
+	w.verbose = lib_opts ? lib_opts->verbose : 0;
+	w.start_time = _clock_time(CLOCK_MONOTONIC);
+
+	const prefetch_region regions[PREFETCH_MAX_REGIONS] = {
+		{ (const uint8_t*)bwa_idx->bwt->bwt, bwa_idx->bwt->bwt_size * sizeof(bwa_idx->bwt->bwt[0]), 0 },
+		{ (const uint8_t*)bwa_idx->bwt->sa,  bwa_idx->bwt->n_sa * sizeof(bwa_idx->bwt->sa[0]), 0 },
+		{ bwa_idx->pac, bwa_idx->pac ? bwa_idx->bns->l_pac / 4 + 1 : 0, 0 }
+	};
+	int n_chunks = 0;
+	for (int r = 0; r < PREFETCH_MAX_REGIONS; ++r) {
+		if (regions[r].ptr == NULL || regions[r].len == 0)
+			continue;
+		prefetch_region* region = &w.regions[w.n_regions++];
+		*region = regions[r];
+		region->n_chunks = (region->len + PREFETCH_CHUNK_SIZE - 1) / PREFETCH_CHUNK_SIZE;
+		n_chunks += region->n_chunks;
+		w.total_bytes += region->len;
+	}
+
+	if (n_chunks > 0) {
+		if (n_threads == 1 || n_chunks == 1) {
+			for (int i = 0; i < n_chunks; ++i)
+				_prefetch_worker(&w, i, 0);
+		}
+		else
+			kt_for(n_threads, _prefetch_worker, &w, n_chunks);
+	}
+
+	const double time = _clock_time(CLOCK_MONOTONIC) - w.start_time;
+	if (w.verbose)
+		fprintf(stderr, "[rapi] prefetched %.1f MB of reference %s with %d threads in %.2f sec\n",
+		    w.total_bytes / (1024.0 * 1024.0), ref->path, n_threads, time);
+	if (elapsed)
+		*elapsed = time;
+
 	return RAPI_NO_ERROR;
 }
 
-void _free_bwa_batch_contents(bwa_batch* batch)
+/******** NUMA index replicas *******/
+
+/*
+ * With numa_replicate_ref the aligner reads the index through a copy local to
+ * the NUMA node of each worker thread.  Each copy is made by a thread bound to
+ * its node, so the kernel's first-touch policy places its pages there.  The
+ * copies share the original's bntseq_t, which is small and only read for
+ * coordinate conversions.
+ */
+
+typedef struct {
+	int node;
+	const bwaidx_t* src;
+	bwaidx_t* replica; // NULL if the copy failed
+} replica_job;
+
+static void* _ref_replica_thread(void* data)
+{
+	replica_job*const job = (replica_job*)data;
+	const bwaidx_t*const src = job->src;
+	rapi_numa_bind_thread(job->node, -1);
+
+	bwaidx_t* replica = calloc(1, sizeof(*replica));
+	if (NULL == replica)
+		return NULL;
+	replica->bns = src->bns;
+	replica->bwt = malloc(sizeof(*replica->bwt));
+	if (NULL == replica->bwt)
+		goto fail;
+	*replica->bwt = *src->bwt;
+	replica->bwt->bwt = NULL;
+	replica->bwt->sa = NULL;
+
+	const size_t bwt_len = src->bwt->bwt_size * sizeof(src->bwt->bwt[0]);
+	const size_t sa_len = src->bwt->n_sa * sizeof(src->bwt->sa[0]);
+	const size_t pac_len = src->pac ? src->bns->l_pac / 4 + 1 : 0;
+	if (NULL == (replica->bwt->bwt = malloc(bwt_len))
+	    || NULL == (replica->bwt->sa = malloc(sa_len))
+	    || (pac_len > 0 && NULL == (replica->pac = malloc(pac_len))))
+		goto fail;
+	memcpy(replica->bwt->bwt, src->bwt->bwt, bwt_len);
+	memcpy(replica->bwt->sa, src->bwt->sa, sa_len);
+	if (pac_len > 0)
+		memcpy(replica->pac, src->pac, pac_len);
+
+	job->replica = replica;
+	return NULL;
+
+fail:
+	_ref_free_replica(replica);
+	return NULL;
+}
+
+/*
+ * Get the entry's index replicas, one per NUMA node, making them if this is
+ * the first time they're needed.  The node we're running on keeps the
+ * original.  The copies are made in parallel, one thread per node.
+ */
+static rapi_error_t _ref_get_replicas(ref_entry* entry, const bwaidx_t*const** ret_replicas)
 {
-	for (int i = 0; i < batch->n_reads; ++i) {
-		// *Don't* free the read id since it points to the original structure's string
-		free(batch->seqs[i].seq);
-		free(batch->seqs[i].qual);
+	rapi_error_t error = RAPI_NO_ERROR;
+	pthread_mutex_lock(&entry->lock);
+	if (entry->replicas == NULL) {
+		const int n_nodes = rapi_numa_n_nodes();
+		const int home = rapi_numa_current_node();
+		const double start_time = _clock_time(CLOCK_MONOTONIC);
+		bwaidx_t** replicas = calloc(n_nodes, sizeof(replicas[0]));
+		replica_job* jobs = calloc(n_nodes, sizeof(jobs[0]));
+		pthread_t* threads = calloc(n_nodes, sizeof(threads[0]));
+		int* started = calloc(n_nodes, sizeof(started[0]));
+		if (NULL == replicas || NULL == jobs || NULL == threads || NULL == started)
+			error = RAPI_MEMORY_ERROR;
+
+		for (int node = 0; error == RAPI_NO_ERROR && node < n_nodes; ++node) {
+			jobs[node].node = node;
+			jobs[node].src = entry->bwa_idx;
+			if (node != home)
+				started[node] = pthread_create(&threads[node], NULL, _ref_replica_thread, &jobs[node]) == 0;
+		}
+		for (int node = 0; error == RAPI_NO_ERROR && node < n_nodes; ++node) {
+			if (node == home)
+				replicas[node] = entry->bwa_idx;
+			else {
+				if (started[node])
+					pthread_join(threads[node], NULL);
+				// If the copy failed the node makes do with the original
+				replicas[node] = jobs[node].replica ? jobs[node].replica : entry->bwa_idx;
+			}
+		}
+
+		if (error == RAPI_NO_ERROR) {
+			entry->n_replicas = n_nodes;
+			entry->replicas = replicas;
+			const library_opts*const lib_opts = _library_opts_get();
+			if (lib_opts && lib_opts->verbose)
+				fprintf(stderr, "[rapi] replicated reference %s on %d NUMA nodes in %.2f sec\n",
+				    entry->key, n_nodes, _clock_time(CLOCK_MONOTONIC) - start_time);
+		}
+		else
+			free(replicas);
+		free(jobs);
+		free(threads);
+		free(started);
 	}
+	pthread_mutex_unlock(&entry->lock);
+
+	if (error == RAPI_NO_ERROR)
+		*ret_replicas = (const bwaidx_t*const*)entry->replicas;
+	return error;
+}
 
+void _free_bwa_batch_contents(bwa_batch* batch)
+{
+	// *Don't* free the read strings since they point into the rapi_batch
 	free(batch->seqs);
 	memset(batch, 0, sizeof(bwa_batch));
 }
 
+/*
+ * rapi_set_read stores, right after the read's seq and qual, a copy of the
+ * sequence already in BWA's 2-bit encoding (see nst_nt4_table).  BWA encodes
+ * its input sequence in place, but encoding an encoded sequence is a no-op,
+ * so we can hand it this copy directly without duplicating anything.
+ */
+static inline char* _rapi_read_bwa_seq(const rapi_read* read)
+{
+	return (read->qual ? read->qual : read->seq) + read->length + 1;
+}
+
+static inline void _read_to_bwa_seq(const rapi_read* rapi_read, bseq1_t* bwa_read)
+{
+	// -- In bseq1_t, all strings are null-terminated.
+	// No copies here:  the sequence is the pre-encoded one, which BWA
+	// can "modify" at will, and BWA doesn't touch the qualities.
+	bwa_read->seq = _rapi_read_bwa_seq(rapi_read);
+	bwa_read->qual = rapi_read->qual;
+	bwa_read->name = rapi_read->id;
+	bwa_read->l_seq = rapi_read->length;
+}
 
 static rapi_error_t _batch_to_bwa_seq(const rapi_batch* batch, int start_fragment, int end_fragment, bwa_batch* bwa_seqs)
 {
@@ -780,35 +2097,14 @@ static rapi_error_t _batch_to_bwa_seq(const rapi_batch* batch, int start_fragmen
 		for (int r = 0; r < batch->n_reads_frag; ++r)
 		{
 			const rapi_read*const rapi_read = rapi_get_read(batch, f, r);
-			bseq1_t* bwa_read = bwa_seqs->seqs + bwa_seqs->n_reads;
-
-			// -- In bseq1_t, all strings are null-terminated.
-			// We duplicated the seq and qual since BWA modifies them.
-			bwa_read->seq = strdup(rapi_read->seq);
-			bwa_read->qual = (NULL == rapi_read->qual) ? NULL : strdup(rapi_read->qual);
-			if (!bwa_read->seq || (rapi_read->qual && !bwa_read->qual))
-				goto failed_allocation;
-
-			bwa_read->name = rapi_read->id;
-			bwa_read->l_seq = rapi_read->length;
 			// Since we use calloc to allocate this structures there's no need to set
-			// these members to NULL.
-			//bwa_read->comment = NULL;
-			//bwa_read->sam = NULL;
-
-			// As we build the objects n_reads keeps the actual number
-			// constructed thus far and thus can be used to free the allocated
-			// structres in case of error.
+			// comment and sam to NULL.
+			_read_to_bwa_seq(rapi_read, bwa_seqs->seqs + bwa_seqs->n_reads);
 			bwa_seqs->n_reads += 1;
 			bwa_seqs->n_bases += rapi_read->length;
 		}
 	}
 	return RAPI_NO_ERROR;
-
-failed_allocation:
-	PERROR("Failed to allocate while constructing sequences! Freeing and returning\n");
-	_free_bwa_batch_contents(bwa_seqs);
-	return RAPI_MEMORY_ERROR;
 }
 
 /*
@@ -848,58 +2144,163 @@ void adjust_bwa_opts(mem_opt_t* opt, const mem_opt_t* override)
 	}
 }
 
-static int _convert_opts(const library_opts* opts, mem_opt_t* bwa_opts)
-{
-	bwa_opts->T = opts->mapq_min;
-	bwa_opts->max_ins = opts->isize_max;
-	bwa_opts->n_threads = opts->n_threads;
+static int _convert_opts(const library_opts* opts, mem_opt_t* bwa_opts)
+{
+	bwa_opts->T = opts->mapq_min;
+	bwa_opts->max_ins = opts->isize_max;
+	bwa_opts->n_threads = opts->n_threads;
+
+	if (opts->isize_mode < RAPI_ISIZE_PER_BATCH || opts->isize_mode > RAPI_ISIZE_RUNNING) {
+		PERROR("Invalid isize_mode %d\n", opts->isize_mode);
+		return RAPI_PARAM_ERROR;
+	}
+
+	// TODO: other options provided through 'parameters' field
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_aligner_state_init(struct rapi_aligner_state** ret_state, const rapi_opts* opts)
+{
+	rapi_error_t error;
+
+	// allocate and zero the structure
+	rapi_aligner_state* state = calloc(1, sizeof(rapi_aligner_state));
+	if (NULL == state)
+		return RAPI_MEMORY_ERROR;
+
+	// Take a private snapshot of the options:  from `opts` if we have them,
+	// else from the library-wide options.  We never refer to the library-wide
+	// structure again, so rapi_init can be called while states are in use.
+	const library_opts* lib_opts = _library_opts_get();
+	if (opts || NULL == lib_opts || NULL == lib_opts->bwa_opts)
+		error = _set_library_opts_or_defaults(&state->opts, opts);
+	else {
+		state->opts = *lib_opts;
+		state->opts.bwa_opts = mem_opt_init();
+		if (NULL == state->opts.bwa_opts)
+			error = RAPI_MEMORY_ERROR;
+		else {
+			memcpy(state->opts.bwa_opts, lib_opts->bwa_opts, sizeof(mem_opt_t));
+			error = RAPI_NO_ERROR;
+		}
+	}
+
+	if (error == RAPI_NO_ERROR)
+		error = _convert_opts(&state->opts, state->opts.bwa_opts);
+
+	if (error == RAPI_NO_ERROR)
+		error = rapi_pool_create(&state->pool, state->opts.bwa_opts->n_threads, state->opts.pin_threads,
+		                         state->opts.numa_replicate_ref);
+
+	if (error != RAPI_NO_ERROR) {
+		free(state->opts.bwa_opts);
+		free(state);
+		return error;
+	}
+
+	// no insert size distribution until we've seen some pairs
+	for (int d = 0; d < 4; ++d)
+		state->pes[d].failed = 1;
+	state->isize_rng = 11400714819323198485ULL;
+
+	pthread_mutex_init(&state->align_lock, NULL);
+	pthread_mutex_init(&state->stats_lock, NULL);
+	pthread_mutex_init(&state->queue_lock, NULL);
+	pthread_cond_init(&state->queue_cond, NULL);
 
-	// TODO: other options provided through 'parameters' field
+	*ret_state = state;
 	return RAPI_NO_ERROR;
 }
 
-rapi_error_t rapi_aligner_state_init(struct rapi_aligner_state** ret_state, const rapi_opts* opts)
+rapi_error_t rapi_aligner_state_free(rapi_aligner_state* state)
 {
-	rapi_error_t error;
-	const library_opts* lib_opts;
-	library_opts* tmp = NULL;
+	// Stop the dispatcher, if we have one.  It completes any queued
+	// alignments before exiting.
+	pthread_mutex_lock(&state->queue_lock);
+	int started = state->dispatcher_started;
+	state->shutting_down = 1;
+	pthread_cond_signal(&state->queue_cond);
+	pthread_mutex_unlock(&state->queue_lock);
+	if (started)
+		pthread_join(state->dispatcher, NULL);
+
+	pthread_cond_destroy(&state->queue_cond);
+	pthread_mutex_destroy(&state->queue_lock);
+	pthread_mutex_destroy(&state->stats_lock);
+	pthread_mutex_destroy(&state->align_lock);
+
+	rapi_pool_destroy(state->pool);
+	for (int d = 0; d < 4; ++d)
+		kv_destroy(state->isize_samples[d].sizes);
+	free(state->opts.bwa_opts);
+	free(state);
+	return RAPI_NO_ERROR;
+}
 
-	if (opts) {
-		tmp = calloc(1, sizeof(library_opts));
-		if (!tmp) return RAPI_MEMORY_ERROR;
+rapi_error_t rapi_aligner_stats_get(rapi_aligner_state* state, rapi_aligner_stats* stats)
+{
+	if (NULL == state || NULL == stats)
+		return RAPI_PARAM_ERROR;
 
-		error = _set_library_opts(tmp, opts);
+	pthread_mutex_lock(&state->stats_lock);
+	*stats = state->stats;
+	pthread_mutex_unlock(&state->stats_lock);
+	return RAPI_NO_ERROR;
+}
 
-		if (error != RAPI_NO_ERROR) {
-			free(tmp);
-			return error;
-		}
-		lib_opts = tmp;
-	}
-	else {
-		lib_opts = _library_opts_get();
-	}
+rapi_error_t rapi_aligner_stats_reset(rapi_aligner_state* state)
+{
+	if (NULL == state)
+		return RAPI_PARAM_ERROR;
 
-	// allocate and zero the structure
-	rapi_aligner_state* state = *ret_state = calloc(1, sizeof(rapi_aligner_state));
-	if (NULL == state) {
-		if (_library_opts_get() != lib_opts) // if it's not the library-wide option structure
-			free(tmp); // free through tmp avoid the warning about dropping 'const'
-		return RAPI_MEMORY_ERROR;
-	}
+	pthread_mutex_lock(&state->stats_lock);
+	memset(&state->stats, 0, sizeof(state->stats));
+	pthread_mutex_unlock(&state->stats_lock);
+	return RAPI_NO_ERROR;
+}
 
-	state->opts = lib_opts;
+// RAPI_ORIENT_* have the same values as BWA's orientation indices
+rapi_error_t rapi_aligner_isize_get(rapi_aligner_state* state, rapi_isize_dist dist[RAPI_N_ORIENT])
+{
+	if (NULL == state || NULL == dist)
+		return RAPI_PARAM_ERROR;
 
+	pthread_mutex_lock(&state->align_lock);
+	for (int d = 0; d < RAPI_N_ORIENT; ++d) {
+		dist[d].failed = state->pes[d].failed;
+		dist[d].low = state->pes[d].low;
+		dist[d].high = state->pes[d].high;
+		dist[d].avg = state->pes[d].avg;
+		dist[d].std = state->pes[d].std;
+	}
+	pthread_mutex_unlock(&state->align_lock);
 	return RAPI_NO_ERROR;
 }
 
-rapi_error_t rapi_aligner_state_free(rapi_aligner_state* state)
+rapi_error_t rapi_aligner_isize_set(rapi_aligner_state* state, const rapi_isize_dist dist[RAPI_N_ORIENT])
 {
-	if (state->opts != _library_opts_get()) {
-		free((library_opts*)state->opts);
-		state->opts = NULL;
+	if (NULL == state || NULL == dist)
+		return RAPI_PARAM_ERROR;
+
+	for (int d = 0; d < RAPI_N_ORIENT; ++d) {
+		// BWA scores pairs by their distance from avg in standard deviations
+		if (!dist[d].failed && (dist[d].low > dist[d].high || dist[d].std <= 0)) {
+			PERROR("Invalid insert size distribution for orientation %d: [%d, %d], std %f\n",
+			    d, dist[d].low, dist[d].high, dist[d].std);
+			return RAPI_PARAM_ERROR;
+		}
 	}
-	free(state);
+
+	pthread_mutex_lock(&state->align_lock);
+	for (int d = 0; d < RAPI_N_ORIENT; ++d) {
+		state->pes[d].failed = dist[d].failed;
+		state->pes[d].low = dist[d].low;
+		state->pes[d].high = dist[d].high;
+		state->pes[d].avg = dist[d].avg;
+		state->pes[d].std = dist[d].std;
+	}
+	state->isize_fixed = 1;
+	pthread_mutex_unlock(&state->align_lock);
 	return RAPI_NO_ERROR;
 }
 
@@ -982,21 +2383,202 @@ static int mem_infer_dir(int64_t l_pac, int64_t b1, int64_t b2, int64_t *dist)
 	return (r1 == r2? 0 : 1) ^ (p2 > b1? 0 : 3);
 }
 
+/*
+ * Insert size estimation.  With RAPI_ISIZE_PER_BATCH we call BWA's mem_pestat.
+ * For the other modes we keep the insert sizes across batches, so we have our
+ * own copies of its two halves:  _isize_add_pairs collects the sizes of the
+ * unique pairs and _isize_dist_from_sizes computes a distribution from them.
+ * The thresholds are the same as mem_pestat's.
+ */
+#define MIN_RATIO     0.8
+#define MIN_DIR_CNT   10
+#define MIN_DIR_RATIO 0.05
+#define OUTLIER_BOUND 2.0
+#define MAPPING_BOUND 3.0
+#define MAX_STDDEV    4.0
+
+/* Copied directly from bwamem_pair */
+static int cal_sub(const mem_opt_t *opt, const mem_alnreg_v *r)
+{
+	int j;
+	for (j = 1; j < r->n; ++j) { // choose unique alignment
+		int b_max = r->a[j].qb > r->a[0].qb? r->a[j].qb : r->a[0].qb;
+		int e_min = r->a[j].qe < r->a[0].qe? r->a[j].qe : r->a[0].qe;
+		if (e_min > b_max) { // have overlap
+			int min_l = r->a[j].qe - r->a[j].qb < r->a[0].qe - r->a[0].qb? r->a[j].qe - r->a[j].qb : r->a[0].qe - r->a[0].qb;
+			if (e_min - b_max >= min_l * opt->mask_level) break; // significant overlap
+		}
+	}
+	return j < r->n? r->a[j].score : opt->min_seed_len * opt->a;
+}
+
+static inline uint64_t _isize_rand(uint64_t* x)
+{
+	// xorshift64*
+	*x ^= *x >> 12; *x ^= *x << 25; *x ^= *x >> 27;
+	return *x * 2685821657736338717ULL;
+}
+
+/* Add the insert sizes of the unique pairs among the `n` reads to the state's samples. */
+static void _isize_add_pairs(rapi_aligner_state* state, const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *regs)
+{
+	for (int i = 0; i < n>>1; ++i) {
+		const mem_alnreg_v *r[2] = { &regs[i<<1|0], &regs[i<<1|1] };
+		if (r[0]->n == 0 || r[1]->n == 0) continue;
+		if (cal_sub(opt, r[0]) > MIN_RATIO * r[0]->a[0].score) continue;
+		if (cal_sub(opt, r[1]) > MIN_RATIO * r[1]->a[0].score) continue;
+		int64_t is;
+		const int dir = mem_infer_dir(l_pac, r[0]->a[0].rb, r[1]->a[0].rb, &is);
+		if (is == 0 || is > opt->max_ins) continue;
+
+		isize_samples* q = &state->isize_samples[dir];
+		q->n_seen += 1;
+		if (kv_size(q->sizes) < ISIZE_MAX_SAMPLES)
+			kv_push(uint32_t, q->sizes, (uint32_t)is);
+		else {
+			// reservoir sampling:  keep each of the sizes seen with the same probability
+			const uint64_t j = _isize_rand(&state->isize_rng) % q->n_seen;
+			if (j < ISIZE_MAX_SAMPLES)
+				kv_A(q->sizes, j) = (uint32_t)is;
+		}
+	}
+	state->isize_n_pairs += n >> 1;
+}
+
+static int _cmp_uint32(const void* a, const void* b)
+{
+	const uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* The distribution of the `n` (>= MIN_DIR_CNT) insert sizes in `q`, which are sorted in place. */
+static void _isize_dist_from_sizes(uint32_t* q, size_t n, mem_pestat_t* r)
+{
+	memset(r, 0, sizeof(*r));
+	qsort(q, n, sizeof(q[0]), _cmp_uint32);
+	const int p25 = q[(size_t)(.25 * n + .499)];
+	const int p75 = q[(size_t)(.75 * n + .499)];
+	r->low  = (int)(p25 - OUTLIER_BOUND * (p75 - p25) + .499);
+	if (r->low < 1) r->low = 1;
+	r->high = (int)(p75 + OUTLIER_BOUND * (p75 - p25) + .499);
+	size_t x = 0;
+	for (size_t i = 0; i < n; ++i)
+		if (q[i] >= r->low && q[i] <= r->high)
+			r->avg += q[i], ++x;
+	r->avg /= x;
+	for (size_t i = 0; i < n; ++i)
+		if (q[i] >= r->low && q[i] <= r->high)
+			r->std += (q[i] - r->avg) * (q[i] - r->avg);
+	r->std = sqrt(r->std / x);
+	r->low  = (int)(p25 - MAPPING_BOUND * (p75 - p25) + .499);
+	r->high = (int)(p75 + MAPPING_BOUND * (p75 - p25) + .499);
+	if (r->low  > r->avg - MAX_STDDEV * r->std) r->low  = (int)(r->avg - MAX_STDDEV * r->std + .499);
+	if (r->high < r->avg + MAX_STDDEV * r->std) r->high = (int)(r->avg + MAX_STDDEV * r->std + .499);
+	if (r->low < 1) r->low = 1;
+}
+
+/* Recompute state->pes from the insert sizes collected so far. */
+static void _isize_estimate(rapi_aligner_state* state)
+{
+	int64_t max = 0;
+	for (int d = 0; d < 4; ++d) {
+		isize_samples* q = &state->isize_samples[d];
+		if (q->n_seen < MIN_DIR_CNT) {
+			memset(&state->pes[d], 0, sizeof(state->pes[d]));
+			state->pes[d].failed = 1;
+		}
+		else
+			_isize_dist_from_sizes(q->sizes.a, kv_size(q->sizes), &state->pes[d]);
+		max = max > q->n_seen ? max : q->n_seen;
+	}
+	for (int d = 0; d < 4; ++d) {
+		if (state->pes[d].failed == 0 && state->isize_samples[d].n_seen < max * MIN_DIR_RATIO)
+			state->pes[d].failed = 1;
+	}
+}
+
+/*
+ * Update the insert size distribution with the `n` (paired) reads of a batch,
+ * as required by the state's isize_mode.
+ */
+static void _isize_update(rapi_aligner_state* state, const mem_opt_t *opt, int64_t l_pac, int n, const mem_alnreg_v *regs)
+{
+	if (state->isize_fixed)
+		return;
+
+	switch (state->opts.isize_mode) {
+	case RAPI_ISIZE_FROZEN:
+		if (state->isize_n_pairs >= state->opts.isize_freeze_pairs)
+			return;
+		// fall through
+	case RAPI_ISIZE_RUNNING:
+		_isize_add_pairs(state, opt, l_pac, n, regs);
+		_isize_estimate(state);
+		break;
+	default:
+		mem_pestat(opt, l_pac, n, regs, state->pes);
+	}
+
+	if (state->opts.verbose) {
+		fprintf(stderr, "[rapi] insert size distribution after %" PRId64 " pairs%s:",
+		    state->opts.isize_mode == RAPI_ISIZE_PER_BATCH ? (int64_t)(n >> 1) : state->isize_n_pairs,
+		    state->opts.isize_mode == RAPI_ISIZE_FROZEN && state->isize_n_pairs >= state->opts.isize_freeze_pairs ? " (frozen)" : "");
+		for (int d = 0; d < 4; ++d) {
+			if (state->pes[d].failed)
+				fprintf(stderr, " %c%c none;", "FR"[d>>1&1], "FR"[d&1]);
+			else
+				fprintf(stderr, " %c%c %.1f +- %.1f [%d, %d];", "FR"[d>>1&1], "FR"[d&1],
+				    state->pes[d].avg, state->pes[d].std, state->pes[d].low, state->pes[d].high);
+		}
+		fputc('\n', stderr);
+	}
+}
+
 // IMPORTANT: must run mem_sort_and_dedup() before calling the mem_mark_primary_se function (but it's called by mem_align1_core)
 
+/*
+ * Alignment results are carved out of one of the batch's result arenas (one
+ * per aligner thread), so no per-read allocation is made and rapi_reads_clear
+ * releases them all at once.  The tag arrays are allocated with room for the
+ * tags we generate (MD, XS, SA) and are never grown:  raise ALN_MAX_TAGS when
+ * adding one, or rapi_tag_list_push fails and the conversion with it.
+ */
+#define ALN_MAX_TAGS 3
+
+/* Like rapi_tag_set_text, but the string is copied into `arena`. */
+static rapi_error_t _arena_tag_set_text(rapi_arena* arena, rapi_tag* tag, const char* value, size_t len)
+{
+	char* s = rapi_arena_alloc(arena, len + 1);
+	if (NULL == s)
+		return RAPI_MEMORY_ERROR;
+	memcpy(s, value, len);
+	s[len] = '\0';
+	tag->type = RAPI_VTYPE_TEXT;
+	tag->value.text = s;
+	tag->text_len = len;
+	return RAPI_NO_ERROR;
+}
+
 /* based on mem_aln2sam */
 static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, int is_paired,
 		const bseq1_t *s,
-		const mem_aln_t *const bwa_aln_list, int list_length)
+		const mem_aln_t *const bwa_aln_list, int list_length, rapi_arena* arena)
 {
 	if (list_length < 0)
 		return RAPI_PARAM_ERROR;
+	// rapi_read.n_alignments is a uint8_t:  keep the best UINT8_MAX
+	// alignments (BWA sorts them by score) rather than let the count wrap.
+	if (list_length > UINT8_MAX)
+		list_length = UINT8_MAX;
 
 	rapi_tag* pTag; // temporary pointer to form tags
 
-	our_read->alignments = calloc(list_length, sizeof(rapi_alignment));
-	if (NULL == our_read->alignments)
+	our_read->alignments = rapi_arena_alloc(arena, list_length * sizeof(rapi_alignment));
+	if (NULL == our_read->alignments) {
+		our_read->n_alignments = 0;
 		return RAPI_MEMORY_ERROR;
+	}
+	memset(our_read->alignments, 0, list_length * sizeof(rapi_alignment));
 	our_read->n_alignments = list_length;
 
 	for (int which = 0; which < list_length; ++which)
@@ -1006,11 +2588,15 @@ static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, i
 
 		if (bwa_aln->rid >= rapi_ref->n_contigs) { // huh?? Out of bounds
 			PERROR("read reference id value %d is out of bounds (n_contigs: %d)\n", bwa_aln->rid, rapi_ref->n_contigs);
-			free(our_read->alignments);
 			our_read->alignments = NULL; our_read->n_alignments = 0;
 			return RAPI_GENERIC_ERROR;
 		}
 
+		our_aln->tags.a = rapi_arena_alloc(arena, ALN_MAX_TAGS * sizeof(rapi_tag));
+		if (NULL == our_aln->tags.a)
+			goto mem_error;
+		our_aln->tags.m = ALN_MAX_TAGS;
+
 		// set flags
 		our_aln->paired = is_paired != 0;
 		our_aln->prop_paired = (bwa_aln->flag & 0x2) != 0; // 0x2 is the SAM proper pair flag
@@ -1027,9 +2613,9 @@ static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, i
 			our_aln->pos = bwa_aln->pos + 1;
 			our_aln->n_mismatches = bwa_aln->NM;
 			if (bwa_aln->n_cigar) { // aligned
-				our_aln->cigar_ops = malloc(bwa_aln->n_cigar * sizeof(our_aln->cigar_ops[0]));
+				our_aln->cigar_ops = rapi_arena_alloc(arena, bwa_aln->n_cigar * sizeof(our_aln->cigar_ops[0]));
 				if (NULL == our_aln->cigar_ops)
-					err_fatal(__func__, "Failed to allocate cigar space");
+					goto mem_error;
 				our_aln->n_cigar_ops = bwa_aln->n_cigar;
 				for (int i = 0; i < bwa_aln->n_cigar; ++i) {
 					our_aln->cigar_ops[i].op = bwa_aln->cigar[i] & 0xf;
@@ -1038,63 +2624,74 @@ static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, i
 
 				// BWA stores the MD string right after the cigar array.
 				const char* md = (char*)(bwa_aln->cigar + bwa_aln->n_cigar);
-				pTag = kv_pushp(rapi_tag, our_aln->tags);
-				rapi_tag_set_key(pTag, "MD");
-				rapi_tag_set_text(pTag, md);
+				pTag = rapi_tag_list_push(&our_aln->tags, RAPI_TAG_KEY('M', 'D'));
+				if (NULL == pTag || _arena_tag_set_text(arena, pTag, md, strlen(md)))
+					goto mem_error;
 			}
 		}
 
 		if (bwa_aln->sub >= 0) {
-			pTag = kv_pushp(rapi_tag, our_aln->tags);
-			rapi_tag_set_key(pTag, "XS");
+			pTag = rapi_tag_list_push(&our_aln->tags, RAPI_TAG_KEY('X', 'S'));
+			if (NULL == pTag)
+				goto mem_error;
 			rapi_tag_set_long(pTag, bwa_aln->sub);
 		}
 	}
 
-	// generate SA tags for all alignments in the list
-	kstring_t tmp_sa = { 0, 0, NULL };
-	for (int i_aln = 0; i_aln < our_read->n_alignments; ++i_aln) {
-		tmp_sa.l = 0; // reposition the string cursor to the beginning
-		rapi_alignment*const aln = our_read->alignments + i_aln;
-
-		if (!(aln->secondary_aln)) { // not multi-hit --
-			// XXX: actually, secondary_aln is set if BWA set either 0x100 or 0x10000
-			// are set in the alignments' flag.  On the other hand, BWA's original code only
-			// checks the 0x100 bit :-o
-
-			// Find the first alignment in the list, which is not the main alignment that
-			// we're considering (i.e., i_aln), and is not a secondary alignment
-			int other_primary = 0;
-			for (other_primary = 0; other_primary < our_read->n_alignments; ++other_primary) {
-				if (other_primary != i_aln && !our_read->alignments[other_primary].secondary_aln)
-					break;
-			}
-			if (other_primary < our_read->n_alignments) { // there are other primary hits; output them
-				for (; other_primary < our_read->n_alignments; ++other_primary) {
-					const rapi_alignment*const sa = our_read->alignments + other_primary;
-
-					// proceed if: 1) different from the current; 2) not shadowed multi hit
-					if (other_primary == i_aln || sa->secondary_aln) continue;
-
-					kputs(sa->contig->name, &tmp_sa); kputc(',', &tmp_sa);
-					kputl(sa->pos, &tmp_sa); kputc(',', &tmp_sa); // XXX: BWA has sa->pos + 1
-					kputc(sa->reverse_strand ? '-' : '+', &tmp_sa); kputc(',', &tmp_sa);
-					rapi_put_cigar(sa->n_cigar_ops, sa->cigar_ops, 0, &tmp_sa);
-					kputc(',', &tmp_sa); kputw(sa->mapq, &tmp_sa);
-					kputc(',', &tmp_sa); kputw(sa->n_mismatches, &tmp_sa);
-					kputc(';', &tmp_sa);
-				}
-
-				// now set the tag
-				rapi_tag* pTag = kv_pushp(rapi_tag, aln->tags);
-				rapi_tag_set_key(pTag, "SA");
-				rapi_tag_set_text(pTag, tmp_sa.s);
-			}
+	// The SA tags are derived:  their text is generated from the read's other
+	// primary alignments only if it's requested (see rapi_tag_put_text).
+	int n_primary = 0;
+	for (int i_aln = 0; i_aln < our_read->n_alignments; ++i_aln)
+		n_primary += !our_read->alignments[i_aln].secondary_aln;
+
+	if (n_primary > 1) {
+		// XXX: actually, secondary_aln is set if BWA set either 0x100 or 0x10000
+		// are set in the alignments' flag.  On the other hand, BWA's original code only
+		// checks the 0x100 bit :-o
+		for (int i_aln = 0; i_aln < our_read->n_alignments; ++i_aln) {
+			rapi_alignment*const aln = our_read->alignments + i_aln;
+			if (aln->secondary_aln)
+				continue;
+			pTag = rapi_tag_list_push(&aln->tags, RAPI_TAG_KEY('S', 'A'));
+			if (NULL == pTag)
+				goto mem_error;
+			pTag->type = RAPI_VTYPE_DERIVED;
+			pTag->value.alignments = our_read->alignments;
+			pTag->text_len = SA_TAG_PACK(our_read->n_alignments, i_aln);
 		}
 	}
-	free(tmp_sa.s);
 
 	return RAPI_NO_ERROR;
+
+mem_error:
+	// Out of arena space or of tag slots.  The space stays in the arena until
+	// the batch is cleared.
+	our_read->alignments = NULL; our_read->n_alignments = 0;
+	return RAPI_MEMORY_ERROR;
+}
+
+/*
+ * Where a worker thread puts its alignment results:  its arena in the batch.
+ * We also keep the time the thread spends converting them, and the copy of the
+ * index the thread reads (see numa_replicate_ref).  The structure is padded to
+ * a cache line since each thread updates its own for every read.
+ */
+typedef struct {
+	rapi_arena* arena;
+	const bwaidx_t* idx;
+	rapi_phase_time convert_time;
+	char _pad[64 - sizeof(rapi_arena*) - sizeof(const bwaidx_t*) - sizeof(rapi_phase_time)];
+} aln_output;
+
+static int _convert_alns(const rapi_ref* rapi_ref, rapi_read* our_read, int is_paired,
+		const bseq1_t *s, const mem_aln_t *const bwa_aln_list, int list_length, aln_output* out)
+{
+	const double wall = _clock_time(CLOCK_MONOTONIC);
+	const double cpu = _clock_time(CLOCK_THREAD_CPUTIME_ID);
+	int error = _bwa_aln_to_rapi_aln(rapi_ref, our_read, is_paired, s, bwa_aln_list, list_length, out->arena);
+	out->convert_time.wall += _clock_time(CLOCK_MONOTONIC) - wall;
+	out->convert_time.cpu += _clock_time(CLOCK_THREAD_CPUTIME_ID) - cpu;
+	return error;
 }
 
 /*
@@ -1102,11 +2699,11 @@ static int _bwa_aln_to_rapi_aln(const rapi_ref* rapi_ref, rapi_read* our_read, i
  * We took out the call to mem_aln2sam and instead write the result to
  * the corresponding rapi_read structure.
  */
-static int _bwa_reg2_rapi_aln(const mem_opt_t *opt, const rapi_ref* rapi_ref, rapi_read* our_read, int is_paired, bseq1_t *seq, mem_alnreg_v *a, int extra_flag)
+static int _bwa_reg2_rapi_aln(const mem_opt_t *opt, const rapi_ref* rapi_ref, rapi_read* our_read, int is_paired, bseq1_t *seq, mem_alnreg_v *a, int extra_flag, aln_output* out)
 {
 	rapi_error_t error = RAPI_NO_ERROR;
-	const bntseq_t *const bns = ((bwaidx_t*)rapi_ref->_private)->bns;
-	const uint8_t *const pac = ((bwaidx_t*)rapi_ref->_private)->pac;
+	const bntseq_t *const bns = out->idx->bns;
+	const uint8_t *const pac = out->idx->pac;
 
 	kvec_t(mem_aln_t) aa;
 	int k;
@@ -1132,10 +2729,10 @@ static int _bwa_reg2_rapi_aln(const mem_opt_t *opt, const rapi_ref* rapi_ref, ra
 		t = mem_reg2aln(opt, bns, pac, seq->l_seq, seq->seq, 0);
 		t.flag |= extra_flag;
 		// RAPI
-		error = _bwa_aln_to_rapi_aln(rapi_ref, our_read, is_paired, seq, &t, 1);
+		error = _convert_alns(rapi_ref, our_read, is_paired, seq, &t, 1, out);
 	}
 	else {
-		error = _bwa_aln_to_rapi_aln(rapi_ref, our_read, is_paired, seq, /* list of aln */ aa.a, aa.n);
+		error = _convert_alns(rapi_ref, our_read, is_paired, seq, /* list of aln */ aa.a, aa.n, out);
 	}
 
 	if (aa.n > 0)
@@ -1154,14 +2751,14 @@ static int _bwa_reg2_rapi_aln(const mem_opt_t *opt, const rapi_ref* rapi_ref, ra
 /*
  * Mostly taken from mem_sam_pe in bwamem_pair.c
  *
- * \return I think this function returns the number pairs aligned by SW
+ * \return RAPI_NO_ERROR, or the error from converting the alignments.
  */
-int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2], rapi_read out[2])
+static rapi_error_t _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat_t pes[4], uint64_t id, bseq1_t s[2], mem_alnreg_v a[2], rapi_read out[2], aln_output* output)
 {
-	const bntseq_t *const bns = ((bwaidx_t*)rapi_ref->_private)->bns;
-	const uint8_t *const pac = ((bwaidx_t*)rapi_ref->_private)->pac;
+	const bntseq_t *const bns = output->idx->bns;
+	const uint8_t *const pac = output->idx->pac;
 
-	int n = 0, i, j, z[2], o, subo, n_sub, extra_flag = 1;
+	int i, j, z[2], o, subo, n_sub, extra_flag = 1;
 	kstring_t str;
 	mem_aln_t h[2];
 
@@ -1175,7 +2772,7 @@ int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat
 					kv_push(mem_alnreg_t, b[i], a[i].a[j]);
 		for (i = 0; i < 2; ++i)
 			for (j = 0; j < b[i].n && j < opt->max_matesw; ++j)
-				n += mem_matesw(opt, bns->l_pac, pac, pes, &b[i].a[j], s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i]);
+				mem_matesw(opt, bns->l_pac, pac, pes, &b[i].a[j], s[!i].l_seq, (uint8_t*)s[!i].seq, &a[!i]);
 		free(b[0].a); free(b[1].a);
 	}
 	mem_mark_primary_se(opt, a[0].n, a[0].a, id<<1|0);
@@ -1225,18 +2822,18 @@ int _bwa_mem_pe(const mem_opt_t *opt, const rapi_ref* rapi_ref, const mem_pestat
 		h[1] = mem_reg2aln(opt, bns, pac, s[1].l_seq, s[1].seq, &a[1].a[z[1]]); h[1].mapq = q_se[1]; h[1].flag |= 0x80 | extra_flag;
 		// RAPI: instead of writing sam, convert mem_aln_t into our alignments
 		// XXX: I'm not so sure about the alignment I'm passing in.  Review
-		int error1 = _bwa_aln_to_rapi_aln(rapi_ref, &out[0], 1, &s[0], &h[0], 1);
-		int error2 = _bwa_aln_to_rapi_aln(rapi_ref, &out[1], 1, &s[1], &h[1], 1);
+		int error1 = _convert_alns(rapi_ref, &out[0], 1, &s[0], &h[0], 1, output);
+		int error2 = error1 ? RAPI_NO_ERROR : _convert_alns(rapi_ref, &out[1], 1, &s[1], &h[1], 1, output);
+		free(h[0].cigar); free(h[1].cigar);
 		if (error1 || error2) {
-			err_fatal(__func__, "error %d while converting BWA mem_aln_t for read %d into rapi alignments\n", (error1 ? 1 : 2), (error1 ? error1 : error2));
-			abort();
+			PERROR("%s while converting BWA mem_aln_t for read %d into rapi alignments\n", rapi_error_name(error1 ? error1 : error2), (error1 ? 1 : 2));
+			return error1 ? error1 : error2;
 		}
 
 		if (strcmp(s[0].name, s[1].name) != 0) err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
-		free(h[0].cigar); free(h[1].cigar);
 
 	} else goto no_pairing;
-	return n;
+	return RAPI_NO_ERROR;
 
 no_pairing:
 	for (i = 0; i < 2; ++i) {
@@ -1253,16 +2850,16 @@ no_pairing:
 
 	// We need to pass the extra flag bits to _bwa_reg2_rapi_aln because it needs to set them
 	// on any secondary alignments.
-	int error1 = _bwa_reg2_rapi_aln(opt, rapi_ref, &out[0], 1, &s[0], &a[0], 0x41|extra_flag);
-	int error2 = _bwa_reg2_rapi_aln(opt, rapi_ref, &out[1], 1, &s[1], &a[1], 0x81|extra_flag);
+	int error1 = _bwa_reg2_rapi_aln(opt, rapi_ref, &out[0], 1, &s[0], &a[0], 0x41|extra_flag, output);
+	int error2 = error1 ? RAPI_NO_ERROR : _bwa_reg2_rapi_aln(opt, rapi_ref, &out[1], 1, &s[1], &a[1], 0x81|extra_flag, output);
+	free(h[0].cigar); free(h[1].cigar);
 	if (error1 || error2) {
-		err_fatal(__func__, "error %d while converting *with no pairing* BWA mem_aln_t for read %d into rapi alignments\n", (error1 ? 1 : 2), (error1 ? error1 : error2));
-		abort();
+		PERROR("%s while converting *with no pairing* BWA mem_aln_t for read %d into rapi alignments\n", rapi_error_name(error1 ? error1 : error2), (error1 ? 1 : 2));
+		return error1 ? error1 : error2;
 	}
 
 	if (strcmp(s[0].name, s[1].name) != 0) err_fatal(__func__, "paired reads have different names: \"%s\", \"%s\"\n", s[0].name, s[1].name);
-	free(h[0].cigar); free(h[1].cigar);
-	return n;
+	return RAPI_NO_ERROR;
 }
 
 typedef struct {
@@ -1273,6 +2870,8 @@ typedef struct {
 	mem_pestat_t *pes;
 	mem_alnreg_v *regs;
 	int64_t n_processed;
+	aln_output* outputs; // one per thread; indexed by tid
+	rapi_error_t error; // the first error from any worker;  checked when the job is done
 } bwa_worker_t;
 
 /*
@@ -1282,7 +2881,7 @@ static void bwa_worker_1(void *data, int i, int tid)
 {
 	bwa_worker_t *w = (bwa_worker_t*)data;
 
-	const bwaidx_t* const bwaidx = (bwaidx_t*)(w->rapi_ref->_private);
+	const bwaidx_t* const bwaidx = w->outputs[tid].idx;
 	const bwt_t*    const bwt    = bwaidx->bwt;
 	const bntseq_t* const bns    = bwaidx->bns;
 	const uint8_t*  const pac    = bwaidx->pac;
@@ -1307,27 +2906,27 @@ static void bwa_worker_2(void *data, int i, int tid)
 
 	if ((w->opt->flag & MEM_F_PE)) {
 		// paired end
-		// This function does not return an error code but aborts if things go wrong.
-		// Unfortunately this strategy is nested deep in the BWA code.
 		//mem_sam_pe(w->opt, w->bns, w->pac, w->pes, (w->n_processed>>1) + i, &w->seqs[i<<1], &w->regs[i<<1]);
-		_bwa_mem_pe(w->opt, w->rapi_ref, w->pes, w->n_processed / 2 + i,
-		            &(w->read_batch->seqs[2 * i]), &w->regs[2 * i], &(w->rapi_reads[2 * i]));
+		error = _bwa_mem_pe(w->opt, w->rapi_ref, w->pes, w->n_processed / 2 + i,
+		            &(w->read_batch->seqs[2 * i]), &w->regs[2 * i], &(w->rapi_reads[2 * i]), &w->outputs[tid]);
 		free(w->regs[2 * i].a); kv_init(w->regs[2 * i]);
 		free(w->regs[2 * i + 1].a); kv_init(w->regs[2 * i + 1]);
 	}
 	else {
 		// single end
-		PERROR("Single end alignments aren't implemented in rapi_bwa yet!");
-		error = RAPI_OP_NOT_SUPPORTED_ERROR;
 		mem_mark_primary_se(w->opt, w->regs[i].n, w->regs[i].a, w->n_processed + i);
 		//mem_reg2sam_se(w->opt, w->bns, w->pac, &w->seqs[i], &w->regs[i], 0, 0);
-		//error = _bwa_reg2_rapi_aln(w->opt, w->rapi_ref, &(w->read_batch->seqs[i]), /* unpaired */ 0, &w->regs[i], &(w->rapi_reads[i]), 0, 0);
+		error = _bwa_reg2_rapi_aln(w->opt, w->rapi_ref, &(w->rapi_reads[i]), /* unpaired */ 0,
+		                           &(w->read_batch->seqs[i]), &w->regs[i], 0, &w->outputs[tid]);
 		free(w->regs[i].a); kv_init(w->regs[i]);
 	}
 
 	if (error != RAPI_NO_ERROR) {
-		err_fatal(__func__, "%s (%d) while running %s end alignments\n",
-		rapi_error_name(error), error, ((w->opt->flag & MEM_F_PE) ? "pair" : "single"));
+		// We can't stop the other workers, so we let them finish and keep
+		// the first error for the caller.
+		PERROR("%s while running %s end alignments\n",
+		    rapi_error_name(error), ((w->opt->flag & MEM_F_PE) ? "pair" : "single"));
+		__sync_bool_compare_and_swap(&w->error, RAPI_NO_ERROR, error);
 	}
 }
 
@@ -1336,7 +2935,39 @@ static void bwa_worker_2(void *data, int i, int tid)
 
 /******* Read batch functions *******/
 
-#define BatchGetReads(batch_ptr) ( (rapi_read*) ((batch_ptr)->_private) )
+// Initial size of the slabs of memory holding the read data.  The arena grows
+// geometrically from here.
+#define BATCH_ARENA_SLAB_SIZE (64 * 1024)
+// Same, for the arenas holding the alignment results
+#define BATCH_ALN_ARENA_SLAB_SIZE (256 * 1024)
+
+/*
+ * Private part of the rapi_batch.  The read strings (id, seq and qual) are
+ * carved out of `read_data`, so there's no per-read allocation and
+ * rapi_reads_clear merely resets the arena.
+ *
+ * The alignment results (alignments, cigars, tags) are likewise carved out of
+ * the arenas in `aln_arenas`.  Each alignment call takes arenas that no other
+ * call is using, one per thread writing alignments, so neither the threads
+ * nor concurrent alignments of different fragments of the batch need to
+ * synchronize while they write.  The call gives the arenas back when it's
+ * done, but the results stay in them until the batch is cleared.
+ */
+typedef struct {
+	rapi_arena arena; // first member:  we cast a rapi_arena* back to its aln_arena
+	int in_use;       // taken by a running alignment
+} aln_arena;
+
+typedef struct {
+	rapi_read* reads;
+	rapi_arena read_data;
+	pthread_mutex_t aln_lock; // protects aln_arenas and their in_use flags
+	aln_arena** aln_arenas;
+	int n_aln_arenas;
+} batch_private;
+
+#define BatchGetPrivate(batch_ptr) ( (batch_private*) ((batch_ptr)->_private) )
+#define BatchGetReads(batch_ptr) ( BatchGetPrivate(batch_ptr)->reads )
 
 rapi_read* rapi_get_read(const rapi_batch* batch, rapi_ssize_t n_frag, int n_read)
 {
@@ -1353,9 +2984,19 @@ rapi_error_t rapi_reads_alloc( rapi_batch * batch, int n_reads_fragment, int n_f
 	if (n_fragments < 0 || n_reads_fragment < 0)
 		return RAPI_PARAM_ERROR;
 
-	batch->_private = calloc( n_reads_fragment * n_fragments, sizeof(BatchGetReads(batch)[0]) );
-	if (NULL == BatchGetReads(batch))
+	batch_private* priv = calloc(1, sizeof(batch_private));
+	if (NULL == priv)
+		return RAPI_MEMORY_ERROR;
+
+	priv->reads = calloc( n_reads_fragment * n_fragments, sizeof(priv->reads[0]) );
+	if (NULL == priv->reads) {
+		free(priv);
 		return RAPI_MEMORY_ERROR;
+	}
+	rapi_arena_init(&priv->read_data, BATCH_ARENA_SLAB_SIZE);
+	pthread_mutex_init(&priv->aln_lock, NULL);
+
+	batch->_private = priv;
 	batch->n_frags = n_fragments;
 	batch->n_reads_frag = n_reads_fragment;
 	return RAPI_NO_ERROR;
@@ -1380,44 +3021,96 @@ rapi_error_t rapi_reads_reserve(rapi_batch* batch, rapi_ssize_t n_fragments)
 			// set new space to 0
 			memset(space + old_n_reads, 0, (new_n_reads - old_n_reads) * sizeof(BatchGetReads(batch)[0]));
 			batch->n_frags = n_fragments;
-			batch->_private = space;
+			BatchGetReads(batch) = space;
 		}
 	}
 	return RAPI_NO_ERROR;
 }
 
-static void _rapi_free_read_structures(rapi_batch* batch)
+/* Give back arenas taken with _batch_take_aln_arenas. */
+static void _batch_release_aln_arenas(rapi_batch* batch, int n, rapi_arena** arenas)
 {
-	for (rapi_ssize_t f = 0; f < batch->n_frags; ++f) {
-		for (int r = 0; r < batch->n_reads_frag; ++r) {
-			rapi_read* read = rapi_get_read(batch, f, r);
-			// the reads use a single chunk of memory for id, seq and quality
-			free(read->id);
-			for (int a = 0; a < read->n_alignments; ++a) {
-				for (int t = 0; t < read->alignments[a].tags.n; ++t)
-					rapi_tag_clear(&read->alignments[a].tags.a[t]);
-				kv_destroy(read->alignments[a].tags);
-				free(read->alignments[a].cigar_ops);
+	batch_private* priv = BatchGetPrivate(batch);
+	pthread_mutex_lock(&priv->aln_lock);
+	for (int i = 0; i < n; ++i)
+		((aln_arena*)arenas[i])->in_use = 0;
+	pthread_mutex_unlock(&priv->aln_lock);
+}
+
+/*
+ * Take `n` result arenas that no other alignment is using, one for each
+ * thread that will write alignments into the batch, and put them in `arenas`.
+ * New arenas are created as necessary.
+ */
+static rapi_error_t _batch_take_aln_arenas(rapi_batch* batch, int n, rapi_arena** arenas)
+{
+	batch_private* priv = BatchGetPrivate(batch);
+	rapi_error_t error = RAPI_NO_ERROR;
+	int taken = 0;
+
+	pthread_mutex_lock(&priv->aln_lock);
+	for (int i = 0; i < priv->n_aln_arenas && taken < n; ++i) {
+		if (!priv->aln_arenas[i]->in_use) {
+			priv->aln_arenas[i]->in_use = 1;
+			arenas[taken++] = &priv->aln_arenas[i]->arena;
+		}
+	}
+	if (taken < n) {
+		aln_arena** all = realloc(priv->aln_arenas, (priv->n_aln_arenas + n - taken) * sizeof(all[0]));
+		if (NULL == all)
+			error = RAPI_MEMORY_ERROR;
+		else {
+			priv->aln_arenas = all;
+			while (taken < n) {
+				aln_arena* a = malloc(sizeof(*a));
+				if (NULL == a) {
+					error = RAPI_MEMORY_ERROR;
+					break;
+				}
+				rapi_arena_init(&a->arena, BATCH_ALN_ARENA_SLAB_SIZE);
+				a->in_use = 1;
+				all[priv->n_aln_arenas++] = a;
+				arenas[taken++] = &a->arena;
 			}
-			free(read->alignments);
-			read->n_alignments = 0;
-			// *Don't* free the contig name.  It belongs to the contig structure.
 		}
 	}
+	pthread_mutex_unlock(&priv->aln_lock);
+
+	if (error)
+		_batch_release_aln_arenas(batch, taken, arenas);
+	return error;
 }
 
 rapi_error_t rapi_reads_clear(rapi_batch* batch)
 {
-	_rapi_free_read_structures(batch);
-	memset(BatchGetReads(batch), 0,  batch->n_reads_frag * batch->n_frags * sizeof(BatchGetReads(batch)[0]));
+	batch_private* priv = BatchGetPrivate(batch);
+	// Nothing in the reads needs to be freed:  the read data and the
+	// alignments are all in the batch's arenas (the contig names belong
+	// to the reference).  Keep the memory for the next round of reads.
+	memset(priv->reads, 0,  batch->n_reads_frag * batch->n_frags * sizeof(priv->reads[0]));
+	rapi_arena_reset(&priv->read_data);
+	pthread_mutex_lock(&priv->aln_lock);
+	for (int i = 0; i < priv->n_aln_arenas; ++i)
+		rapi_arena_reset(&priv->aln_arenas[i]->arena);
+	pthread_mutex_unlock(&priv->aln_lock);
 
 	return RAPI_NO_ERROR;
 }
 
 rapi_error_t rapi_reads_free(rapi_batch* batch )
 {
-	_rapi_free_read_structures(batch);
-	free(BatchGetReads(batch));
+	if (BatchGetPrivate(batch)) {
+		batch_private* priv = BatchGetPrivate(batch);
+		rapi_arena_destroy(&priv->read_data);
+		for (int i = 0; i < priv->n_aln_arenas; ++i) {
+			rapi_arena_destroy(&priv->aln_arenas[i]->arena);
+			free(priv->aln_arenas[i]);
+		}
+		free(priv->aln_arenas);
+		pthread_mutex_destroy(&priv->aln_lock);
+		free(BatchGetReads(batch));
+		free(BatchGetPrivate(batch));
+	}
 	memset(batch, 0, sizeof(*batch));
 
 	return RAPI_NO_ERROR;
@@ -1427,17 +3120,24 @@ rapi_error_t rapi_set_read(rapi_batch* batch,
 	        rapi_ssize_t n_frag, int n_read,
 	        const char* name, const char* seq, const char* qual,
 	        int q_offset) {
+	if (!name || !seq)
+		return RAPI_PARAM_ERROR;
+	return rapi_set_read_n(batch, n_frag, n_read, name, strlen(name), seq, strlen(seq), qual, q_offset);
+}
+
+rapi_error_t rapi_set_read_n(rapi_batch* batch,
+	        rapi_ssize_t n_frag, int n_read,
+	        const char* name, int name_len, const char* seq, int seq_len,
+	        const char* qual, int q_offset) {
 	rapi_error_t error_code = RAPI_NO_ERROR;
 
-	if (!batch ||
+	if (!batch || !name || !seq || name_len < 0 || seq_len < 0 ||
 	    n_frag < 0 || n_frag >= batch->n_frags ||
 	    n_read < 0 || n_read >= batch->n_reads_frag)
 		return RAPI_PARAM_ERROR;
 
 	rapi_read* read = rapi_get_read(batch, n_frag, n_read);
-	const int name_len = strlen(name);
 
-	const int seq_len = strlen(seq);
 	if (seq_len == 0) {
 		PERROR("Got sequence of length 0\n");
 		return RAPI_PARAM_ERROR;
@@ -1445,23 +3145,32 @@ rapi_error_t rapi_set_read(rapi_batch* batch,
 
 	read->length = seq_len;
 
-	// simplify allocation and error checking by allocating a single buffer
-	int buf_size = name_len + 1 + seq_len + 1;
+	// simplify allocation and error checking by allocating a single buffer,
+	// laid out as: id, seq, [qual], BWA-encoded seq (see _rapi_read_bwa_seq)
+	int buf_size = name_len + 1 + 2 * (seq_len + 1);
 	if (qual)
 		buf_size += seq_len + 1;
 
-	read->id = malloc(buf_size);
+	// If we fail we give the space back to the arena.  Note that if the read
+	// was previously set its old data remains in the arena until the batch is
+	// cleared.
+	rapi_arena* arena = &BatchGetPrivate(batch)->read_data;
+	const rapi_arena_mark mark = rapi_arena_get_mark(arena);
+
+	read->id = rapi_arena_alloc(arena, buf_size);
 	if (NULL == read->id) { // failed allocation
 		PERROR("Unable to allocate memory for sequence\n");
 		return RAPI_MEMORY_ERROR;
 	}
 
 	// copy name
-	strcpy(read->id, name);
+	memcpy(read->id, name, name_len);
+	read->id[name_len] = '\0';
 
 	// sequence, placed right after the name
 	read->seq = read->id + name_len + 1;
-	strcpy(read->seq, seq);
+	memcpy(read->seq, seq, seq_len);
+	read->seq[seq_len] = '\0';
 
 	// the quality, if we have it, may need to be recoded
 	if (NULL == qual)
@@ -1480,6 +3189,12 @@ rapi_error_t rapi_set_read(rapi_batch* batch,
 		read->qual[seq_len] = '\0';
 	}
 
+	// pre-encode the sequence for BWA
+	char* bwa_seq = _rapi_read_bwa_seq(read);
+	for (int i = 0; i < seq_len; ++i)
+		bwa_seq[i] = nst_nt4_table[(unsigned char)seq[i]];
+	bwa_seq[seq_len] = '\0';
+
 	// trim from the name /[12]$
 	int t = name_len;
 	if (t > 2 && read->id[t-2] == '/' && (read->id[t-1] == '1' || read->id[t-1] == '2'))
@@ -1488,14 +3203,36 @@ rapi_error_t rapi_set_read(rapi_batch* batch,
 	return RAPI_NO_ERROR;
 
 error:
-	// In case of error, free any allocated memory and return the error
-	free(read->id);
-	read->id = NULL;
+	// In case of error, give back the space and return the error
+	rapi_arena_rewind(arena, mark);
+	read->id = read->seq = read->qual = NULL;
 	return error_code;
 }
 
 /******* Read alignment ******/
-rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
+
+static void _add_phase_time(rapi_phase_time* total, const rapi_phase_time* t)
+{
+	total->wall += t->wall;
+	total->cpu += t->cpu;
+}
+
+static void _add_stats(rapi_aligner_state* state, const rapi_aligner_stats* stats)
+{
+	pthread_mutex_lock(&state->stats_lock);
+	rapi_aligner_stats* total = &state->stats;
+	_add_phase_time(&total->convert_input, &stats->convert_input);
+	_add_phase_time(&total->map, &stats->map);
+	_add_phase_time(&total->pestat, &stats->pestat);
+	_add_phase_time(&total->align, &stats->align);
+	_add_phase_time(&total->convert_output, &stats->convert_output);
+	total->n_batches += stats->n_batches;
+	total->n_reads += stats->n_reads;
+	total->n_bases += stats->n_bases;
+	pthread_mutex_unlock(&state->stats_lock);
+}
+
+static rapi_error_t _align_reads( const rapi_ref* ref, rapi_batch* batch,
         rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, rapi_aligner_state* state )
 {
 	rapi_error_t error = RAPI_NO_ERROR;
@@ -1506,29 +3243,66 @@ rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
 	if (batch->n_reads_frag <= 0)
 		return RAPI_PARAM_ERROR;
 
-	// "extract" BWA-specific structures
-	mem_opt_t*const bwa_opt = (mem_opt_t*) state->opts->bwa_opts;
+	// "extract" BWA-specific structures.  We set the per-batch flags on a
+	// copy of the state's options, so the alignment doesn't write to any
+	// options structure that may be shared.
+	mem_opt_t bwa_opt_copy = *state->opts.bwa_opts;
+	mem_opt_t*const bwa_opt = &bwa_opt_copy;
 
 	if (batch->n_reads_frag == 2) // paired-end
 		bwa_opt->flag |= MEM_F_PE;
-
-	if ((error = _convert_opts(state->opts, bwa_opt)))
-		return error;
+	else
+		bwa_opt->flag &= ~MEM_F_PE;
+
+	// We time each phase and add the numbers to the state's stats at the end.
+	// Phases run on this thread are timed with its CPU clock;  for the ones
+	// run on the pool, rapi_pool_for sums the CPU times of its threads.  We
+	// don't use the process clock since other states may be aligning.
+	rapi_aligner_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	double wall = _clock_time(CLOCK_MONOTONIC);
+	double cpu = _clock_time(CLOCK_THREAD_CPUTIME_ID);
+#define END_PHASE(phase, pool_cpu) do { \
+		const double now_wall = _clock_time(CLOCK_MONOTONIC); \
+		const double now_cpu = _clock_time(CLOCK_THREAD_CPUTIME_ID); \
+		stats.phase.wall += now_wall - wall; \
+		stats.phase.cpu += (pool_cpu) < 0 ? now_cpu - cpu : (pool_cpu); \
+		wall = now_wall; cpu = now_cpu; \
+	} while (0)
 
 	// traslate our read structure into BWA reads
 	bwa_batch bwa_seqs;
 	if ((error = _batch_to_bwa_seq(batch, start_fragment, end_fragment, &bwa_seqs)))
 		return error;
-	fprintf(stderr, "Converted reads to BWA structures.\n");
 
-	fprintf(stderr, "Going to process.\n");
+	const int n_threads = rapi_pool_n_threads(state->pool);
+	aln_output* outputs = NULL;
+	rapi_arena** arenas = NULL;
+	int arenas_taken = 0;
 	mem_alnreg_v *regs = malloc(bwa_seqs.n_reads * sizeof(mem_alnreg_v));
-	if (NULL == regs) {
+	outputs = calloc(n_threads, sizeof(outputs[0]));
+	arenas = calloc(n_threads, sizeof(arenas[0]));
+	if (NULL == regs || NULL == outputs || NULL == arenas) {
 		error = RAPI_MEMORY_ERROR;
 		goto clean_up;
 	}
 
-	extern void kt_for(int n_threads, void (*func)(void*,int,int), void *data, int n);
+	if ((error = _batch_take_aln_arenas(batch, n_threads, arenas)))
+		goto clean_up;
+	arenas_taken = 1;
+
+	for (int i = 0; i < n_threads; ++i) {
+		outputs[i].arena = arenas[i];
+		outputs[i].idx = RefGetBwaIdx(ref);
+	}
+	if (state->opts.numa_replicate_ref && rapi_numa_n_nodes() > 1) {
+		const bwaidx_t*const* replicas;
+		if ((error = _ref_get_replicas(RefGetEntry(ref), &replicas)))
+			goto clean_up;
+		for (int i = 0; i < n_threads; ++i)
+			outputs[i].idx = replicas[rapi_pool_thread_node(state->pool, i)];
+	}
+
 	bwa_worker_t w;
 	w.opt = bwa_opt;
 	w.read_batch = &bwa_seqs;
@@ -1536,29 +3310,288 @@ rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
 	w.pes = state->pes;
 	w.n_processed = state->n_reads_processed;
 	w.rapi_ref = ref;
-	w.rapi_reads = BatchGetReads(batch);
+	w.outputs = outputs;
+	w.error = RAPI_NO_ERROR;
+	// the reads from start_fragment onwards (the entire batch if it's negative)
+	w.rapi_reads = BatchGetReads(batch) + (start_fragment > 0 ? start_fragment : 0) * batch->n_reads_frag;
 
-	fprintf(stderr, "Calling bwa_worker_1. ");
-	rapi_print_bwa_flag_string(stderr, bwa_opt->flag);
+	END_PHASE(convert_input, -1);
 
 	int n_fragments = (bwa_opt->flag & MEM_F_PE) ? bwa_seqs.n_reads / 2 : bwa_seqs.n_reads;
-	fprintf(stderr, "Mapping in %d threads.\n", bwa_opt->n_threads);
-	kt_for(bwa_opt->n_threads, bwa_worker_1, &w, n_fragments); // find mapping positions
+	double job_cpu = rapi_pool_for(state->pool, bwa_worker_1, &w, n_fragments); // find mapping positions
+	END_PHASE(map, job_cpu);
 
 	if (bwa_opt->flag & MEM_F_PE) { // infer insert sizes if not provided
-		// TODO: support manually setting insert size dist parameters
-		// if (pes0) memcpy(pes, pes0, 4 * sizeof(mem_pestat_t)); // if pes0 != NULL, set the insert-size distribution as pes0
-		mem_pestat(bwa_opt, ((bwaidx_t*)ref->_private)->bns->l_pac, bwa_seqs.n_reads, regs, w.pes); // infer the insert size distribution from data
+		_isize_update(state, bwa_opt, RefGetBwaIdx(ref)->bns->l_pac, bwa_seqs.n_reads, regs);
+		END_PHASE(pestat, -1);
 	}
-	kt_for(bwa_opt->n_threads, bwa_worker_2, &w, n_fragments); // generate alignment
+	job_cpu = rapi_pool_for(state->pool, bwa_worker_2, &w, n_fragments); // generate alignment
+	END_PHASE(align, job_cpu);
+#undef END_PHASE
+	if ((error = w.error))
+		goto clean_up;
 
-	// run the alignment
 	state->n_reads_processed += bwa_seqs.n_reads;
-	fprintf(stderr, "processed %" PRId64 " reads\n", state->n_reads_processed);
+
+	stats.n_batches = 1;
+	stats.n_reads = bwa_seqs.n_reads;
+	for (int i = 0; i < bwa_seqs.n_reads; ++i)
+		stats.n_bases += bwa_seqs.seqs[i].l_seq;
+	for (int i = 0; i < n_threads; ++i) {
+		stats.convert_output.wall += outputs[i].convert_time.wall;
+		stats.convert_output.cpu += outputs[i].convert_time.cpu;
+	}
+	_add_stats(state, &stats);
+
+	if (state->opts.verbose) {
+		fprintf(stderr, "[rapi] aligned %" PRId64 " reads (%" PRId64 " bases) in %d threads; ",
+		    stats.n_reads, stats.n_bases, n_threads);
+		rapi_print_bwa_flag_string(stderr, bwa_opt->flag);
+		fprintf(stderr, "[rapi]   wall/cpu seconds: convert input %.3f/%.3f, map %.3f/%.3f, "
+		    "pestat %.3f/%.3f, align %.3f/%.3f (convert output %.3f/%.3f thread-seconds)\n",
+		    stats.convert_input.wall, stats.convert_input.cpu, stats.map.wall, stats.map.cpu,
+		    stats.pestat.wall, stats.pestat.cpu, stats.align.wall, stats.align.cpu,
+		    stats.convert_output.wall, stats.convert_output.cpu);
+	}
 
 clean_up:
+	if (arenas_taken)
+		_batch_release_aln_arenas(batch, n_threads, arenas);
+	free(arenas);
+	free(outputs);
 	free(regs);
 	_free_bwa_batch_contents(&bwa_seqs);
 
 	return error;
 }
+
+rapi_error_t rapi_align_reads( const rapi_ref* ref, rapi_batch* batch,
+        rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, rapi_aligner_state* state )
+{
+	pthread_mutex_lock(&state->align_lock);
+	rapi_error_t error = _align_reads(ref, batch, start_fragment, end_fragment, state);
+	pthread_mutex_unlock(&state->align_lock);
+	return error;
+}
+
+/*
+ * The same steps as _align_reads for a single fragment, run directly on the
+ * calling thread:  no conversion of the batch, no pool jobs, no insert size
+ * estimation and no allocation besides BWA's own.
+ */
+static rapi_error_t _align_fragment(const rapi_ref* ref, rapi_batch* batch, rapi_ssize_t fragment, rapi_aligner_state* state)
+{
+	rapi_error_t error = RAPI_NO_ERROR;
+	const int n_reads = batch->n_reads_frag;
+
+	if (n_reads > 2)
+		return RAPI_OP_NOT_SUPPORTED_ERROR;
+
+	if (n_reads <= 0 || fragment < 0 || fragment >= batch->n_frags) {
+		PERROR("fragment %lld is out of bounds (we have %lld fragments)\n", fragment, batch->n_frags);
+		return RAPI_PARAM_ERROR;
+	}
+
+	mem_opt_t bwa_opt_copy = *state->opts.bwa_opts;
+	mem_opt_t*const bwa_opt = &bwa_opt_copy;
+	if (n_reads == 2)
+		bwa_opt->flag |= MEM_F_PE;
+	else
+		bwa_opt->flag &= ~MEM_F_PE;
+
+	aln_output output;
+	memset(&output, 0, sizeof(output));
+	output.idx = RefGetBwaIdx(ref);
+	if (state->opts.numa_replicate_ref && rapi_numa_n_nodes() > 1) {
+		const bwaidx_t*const* replicas;
+		if ((error = _ref_get_replicas(RefGetEntry(ref), &replicas)))
+			return error;
+		output.idx = replicas[rapi_numa_current_node()];
+	}
+
+	// The alignments go in a result arena of our own, as in _align_reads,
+	// so other calls can align other fragments of the batch at the same time.
+	if ((error = _batch_take_aln_arenas(batch, 1, &output.arena)))
+		return error;
+
+	rapi_aligner_stats stats;
+	memset(&stats, 0, sizeof(stats));
+	const double start_wall = _clock_time(CLOCK_MONOTONIC);
+	const double start_cpu = _clock_time(CLOCK_THREAD_CPUTIME_ID);
+
+	bwa_batch bwa_seqs;
+	bwa_seqs.n_reads = n_reads;
+	bwa_seqs.n_bases = 0;
+	bwa_seqs.n_reads_per_frag = n_reads;
+	bwa_seqs.seqs = state->frag_seqs;
+	rapi_read*const reads = rapi_get_read(batch, fragment, 0);
+	for (int r = 0; r < n_reads; ++r) {
+		_read_to_bwa_seq(&reads[r], &state->frag_seqs[r]);
+		bwa_seqs.n_bases += reads[r].length;
+	}
+
+	bwa_worker_t w;
+	w.opt = bwa_opt;
+	w.read_batch = &bwa_seqs;
+	w.regs = state->frag_regs;
+	w.pes = state->pes; // as they are:  the distribution isn't estimated here
+	w.n_processed = state->n_reads_processed;
+	w.rapi_ref = ref;
+	w.outputs = &output;
+	w.rapi_reads = reads;
+	w.error = RAPI_NO_ERROR;
+
+	bwa_worker_1(&w, 0, 0);
+	const double map_wall = _clock_time(CLOCK_MONOTONIC);
+	const double map_cpu = _clock_time(CLOCK_THREAD_CPUTIME_ID);
+	bwa_worker_2(&w, 0, 0);
+	if ((error = w.error)) {
+		_batch_release_aln_arenas(batch, 1, &output.arena);
+		return error;
+	}
+
+	state->n_reads_processed += n_reads;
+
+	stats.map.wall = map_wall - start_wall;
+	stats.map.cpu = map_cpu - start_cpu;
+	stats.align.wall = _clock_time(CLOCK_MONOTONIC) - map_wall;
+	stats.align.cpu = _clock_time(CLOCK_THREAD_CPUTIME_ID) - map_cpu;
+	stats.convert_output = output.convert_time;
+	stats.n_batches = 1;
+	stats.n_reads = n_reads;
+	stats.n_bases = bwa_seqs.n_bases;
+	_add_stats(state, &stats);
+
+	_batch_release_aln_arenas(batch, 1, &output.arena);
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_align_fragment( const rapi_ref* ref, rapi_batch* batch,
+        rapi_ssize_t fragment, rapi_aligner_state* state )
+{
+	if (NULL == ref || NULL == ref->_private || NULL == batch || NULL == state)
+		return RAPI_PARAM_ERROR;
+
+	pthread_mutex_lock(&state->align_lock);
+	rapi_error_t error = _align_fragment(ref, batch, fragment, state);
+	pthread_mutex_unlock(&state->align_lock);
+	return error;
+}
+
+/*
+ * Body of the dispatcher thread.  Takes jobs from the state's queue in FIFO
+ * order and runs them, until the state is being freed and the queue is empty.
+ */
+static void* _align_dispatcher(void* arg)
+{
+	rapi_aligner_state* state = (rapi_aligner_state*) arg;
+
+	pthread_mutex_lock(&state->queue_lock);
+	while (1) {
+		while (NULL == state->queue_head && !state->shutting_down)
+			pthread_cond_wait(&state->queue_cond, &state->queue_lock);
+
+		struct rapi_align_handle* job = state->queue_head;
+		if (NULL == job) // shutting down and nothing left to do
+			break;
+
+		state->queue_head = job->next;
+		if (NULL == state->queue_head)
+			state->queue_tail = NULL;
+		pthread_mutex_unlock(&state->queue_lock);
+
+		rapi_error_t error = rapi_align_reads(job->ref, job->batch, job->start_fragment, job->end_fragment, state);
+
+		// The handle may be freed as soon as we set `done` and release its
+		// lock, so this is the last time we touch it.
+		pthread_mutex_lock(&job->lock);
+		job->error = error;
+		job->done = 1;
+		pthread_cond_broadcast(&job->cond);
+		pthread_mutex_unlock(&job->lock);
+
+		pthread_mutex_lock(&state->queue_lock);
+	}
+	pthread_mutex_unlock(&state->queue_lock);
+
+	return NULL;
+}
+
+rapi_error_t rapi_align_reads_async( const rapi_ref* ref, rapi_batch* batch,
+        rapi_ssize_t start_fragment, rapi_ssize_t end_fragment, rapi_aligner_state* state,
+        rapi_align_handle** handle )
+{
+	if (NULL == ref || NULL == batch || NULL == state || NULL == handle)
+		return RAPI_PARAM_ERROR;
+
+	struct rapi_align_handle* job = calloc(1, sizeof(*job));
+	if (NULL == job)
+		return RAPI_MEMORY_ERROR;
+
+	job->ref = ref;
+	job->batch = batch;
+	job->start_fragment = start_fragment;
+	job->end_fragment = end_fragment;
+	pthread_mutex_init(&job->lock, NULL);
+	pthread_cond_init(&job->cond, NULL);
+
+	pthread_mutex_lock(&state->queue_lock);
+	if (state->shutting_down) {
+		pthread_mutex_unlock(&state->queue_lock);
+		job->done = 1; // never queued
+		rapi_align_handle_free(job);
+		return RAPI_GENERIC_ERROR;
+	}
+
+	if (!state->dispatcher_started) {
+		if (pthread_create(&state->dispatcher, NULL, _align_dispatcher, state) != 0) {
+			pthread_mutex_unlock(&state->queue_lock);
+			PERROR("Failed to start the alignment dispatcher thread\n");
+			job->done = 1; // never queued
+			rapi_align_handle_free(job);
+			return RAPI_GENERIC_ERROR;
+		}
+		state->dispatcher_started = 1;
+	}
+
+	if (state->queue_tail)
+		state->queue_tail->next = job;
+	else
+		state->queue_head = job;
+	state->queue_tail = job;
+	pthread_cond_signal(&state->queue_cond);
+	pthread_mutex_unlock(&state->queue_lock);
+
+	*handle = job;
+	return RAPI_NO_ERROR;
+}
+
+int rapi_align_poll(rapi_align_handle* handle)
+{
+	pthread_mutex_lock(&handle->lock);
+	int done = handle->done;
+	pthread_mutex_unlock(&handle->lock);
+	return done;
+}
+
+rapi_error_t rapi_align_wait(rapi_align_handle* handle)
+{
+	pthread_mutex_lock(&handle->lock);
+	while (!handle->done)
+		pthread_cond_wait(&handle->cond, &handle->lock);
+	rapi_error_t error = handle->error;
+	pthread_mutex_unlock(&handle->lock);
+
+	return error;
+}
+
+rapi_error_t rapi_align_handle_free(rapi_align_handle* handle)
+{
+	if (handle) {
+		rapi_align_wait(handle);
+		pthread_cond_destroy(&handle->cond);
+		pthread_mutex_destroy(&handle->lock);
+		free(handle);
+	}
+	return RAPI_NO_ERROR;
+}
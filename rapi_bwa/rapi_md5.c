@@ -0,0 +1,138 @@
+/*
+ * rapi_md5.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#include "rapi_md5.h"
+
+#include <string.h>
+
+// per-round shift amounts
+static const uint8_t S[64] = {
+	7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+	5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+	4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+	6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+// K[i] = floor(abs(sin(i + 1)) * 2^32)
+static const uint32_t K[64] = {
+	0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+	0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+	0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+	0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+	0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+	0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+	0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+	0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static inline uint32_t rotl(uint32_t x, int c)
+{
+	return (x << c) | (x >> (32 - c));
+}
+
+static void md5_block(uint32_t state[4], const uint8_t block[64])
+{
+	uint32_t m[16];
+	for (int i = 0; i < 16; ++i) {
+		m[i] = (uint32_t)block[4*i] | ((uint32_t)block[4*i + 1] << 8) |
+		       ((uint32_t)block[4*i + 2] << 16) | ((uint32_t)block[4*i + 3] << 24);
+	}
+
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	for (int i = 0; i < 64; ++i) {
+		uint32_t f;
+		int g;
+		if (i < 16) {
+			f = (b & c) | (~b & d);
+			g = i;
+		}
+		else if (i < 32) {
+			f = (d & b) | (~d & c);
+			g = (5*i + 1) & 15;
+		}
+		else if (i < 48) {
+			f = b ^ c ^ d;
+			g = (3*i + 5) & 15;
+		}
+		else {
+			f = c ^ (b | ~d);
+			g = (7*i) & 15;
+		}
+		const uint32_t tmp = d;
+		d = c;
+		c = b;
+		b = b + rotl(a + f + K[i] + m[g], S[i]);
+		a = tmp;
+	}
+	state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+}
+
+void rapi_md5_init(rapi_md5_ctx* ctx)
+{
+	ctx->state[0] = 0x67452301;
+	ctx->state[1] = 0xefcdab89;
+	ctx->state[2] = 0x98badcfe;
+	ctx->state[3] = 0x10325476;
+	ctx->n_bytes = 0;
+}
+
+void rapi_md5_update(rapi_md5_ctx* ctx, const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	size_t used = ctx->n_bytes & 63;
+	ctx->n_bytes += len;
+
+	if (used > 0) {
+		const size_t n = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->buffer + used, p, n);
+		p += n; len -= n; used += n;
+		if (used < 64)
+			return;
+		md5_block(ctx->state, ctx->buffer);
+	}
+	for (; len >= 64; p += 64, len -= 64)
+		md5_block(ctx->state, p);
+	memcpy(ctx->buffer, p, len);
+}
+
+void rapi_md5_final_hex(rapi_md5_ctx* ctx, char hex[RAPI_MD5_HEX_LEN + 1])
+{
+	static const char digits[] = "0123456789abcdef";
+	const uint64_t n_bits = ctx->n_bytes * 8;
+
+	// pad with 0x80, then zeros up to 56 bytes mod 64, then the length in bits
+	static const uint8_t padding[64] = { 0x80 };
+	const size_t used = ctx->n_bytes & 63;
+	rapi_md5_update(ctx, padding, used < 56 ? 56 - used : 120 - used);
+
+	uint8_t len_bytes[8];
+	for (int i = 0; i < 8; ++i)
+		len_bytes[i] = (n_bits >> (8 * i)) & 0xff;
+	rapi_md5_update(ctx, len_bytes, 8);
+
+	for (int i = 0; i < 4; ++i) {
+		for (int j = 0; j < 4; ++j) {
+			const uint8_t byte = (ctx->state[i] >> (8 * j)) & 0xff;
+			hex[8*i + 2*j]     = digits[byte >> 4];
+			hex[8*i + 2*j + 1] = digits[byte & 15];
+		}
+	}
+	hex[RAPI_MD5_HEX_LEN] = '\0';
+}
@@ -0,0 +1,47 @@
+/*
+ * rapi_md5.h
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * MD5 message digest (RFC 1321), for the M5 checksums of the reference
+ * contigs in the SAM header.
+ */
+
+#ifndef __RAPI_MD5_H__
+#define __RAPI_MD5_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RAPI_MD5_HEX_LEN 32
+
+typedef struct {
+	uint32_t state[4];
+	uint64_t n_bytes;
+	uint8_t buffer[64];
+} rapi_md5_ctx;
+
+void rapi_md5_init(rapi_md5_ctx* ctx);
+
+void rapi_md5_update(rapi_md5_ctx* ctx, const void* data, size_t len);
+
+/** Finish the digest and write it to `hex` as a NULL-terminated lower-case hex string. */
+void rapi_md5_final_hex(rapi_md5_ctx* ctx, char hex[RAPI_MD5_HEX_LEN + 1]);
+
+#endif
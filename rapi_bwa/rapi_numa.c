@@ -0,0 +1,192 @@
+/*
+ * rapi_numa.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifdef __linux__
+#define _GNU_SOURCE // for the CPU_* macros, pthread_setaffinity_np and sched_getcpu
+#endif
+
+#include "rapi_numa.h"
+
+#include <rapi.h>
+#include <rapi_utils.h>
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NUMA_MAX_NODES 64
+#define SYSFS_NODE_DIR "/sys/devices/system/node"
+
+static struct {
+	int n_nodes;
+	cpu_set_t cpus[NUMA_MAX_NODES];
+} _g_topology;
+
+static pthread_once_t _g_topology_once = PTHREAD_ONCE_INIT;
+
+/* Parse a sysfs CPU list (e.g., "0-3,8-11") into `set`. */
+static int _parse_cpulist(const char* list, cpu_set_t* set)
+{
+	CPU_ZERO(set);
+	const char* p = list;
+	while (*p && *p != '\n') {
+		char* end;
+		long first = strtol(p, &end, 10);
+		if (end == p)
+			return -1;
+		long last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1)
+				return -1;
+			p = end;
+		}
+		for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu)
+			CPU_SET(cpu, set);
+		if (*p == ',')
+			++p;
+	}
+	return 0;
+}
+
+static int _compare_ints(const void* a, const void* b)
+{
+	return *(const int*)a - *(const int*)b;
+}
+
+static void _read_topology(void)
+{
+	_g_topology.n_nodes = 0;
+
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		CPU_ZERO(&allowed);
+
+	// collect the kernel's node ids, in order
+	int node_ids[NUMA_MAX_NODES];
+	int n_ids = 0;
+	DIR* dir = opendir(SYSFS_NODE_DIR);
+	if (dir) {
+		struct dirent* entry;
+		while ((entry = readdir(dir)) != NULL && n_ids < NUMA_MAX_NODES) {
+			int id;
+			char tail;
+			if (sscanf(entry->d_name, "node%d%c", &id, &tail) == 1)
+				node_ids[n_ids++] = id;
+		}
+		closedir(dir);
+	}
+	qsort(node_ids, n_ids, sizeof(node_ids[0]), _compare_ints);
+
+	for (int i = 0; i < n_ids; ++i) {
+		char path[128];
+		char list[4096];
+		snprintf(path, sizeof(path), SYSFS_NODE_DIR "/node%d/cpulist", node_ids[i]);
+		FILE* f = fopen(path, "r");
+		if (NULL == f)
+			continue;
+		const int ok = fgets(list, sizeof(list), f) != NULL;
+		fclose(f);
+
+		cpu_set_t* node_cpus = &_g_topology.cpus[_g_topology.n_nodes];
+		if (!ok || _parse_cpulist(list, node_cpus) != 0)
+			continue;
+		CPU_AND(node_cpus, node_cpus, &allowed);
+		if (CPU_COUNT(node_cpus) > 0)
+			_g_topology.n_nodes += 1;
+	}
+
+	if (_g_topology.n_nodes == 0) {
+		// no topology information:  a single node with all our CPUs
+		_g_topology.n_nodes = 1;
+		_g_topology.cpus[0] = allowed;
+	}
+}
+
+int rapi_numa_n_nodes(void)
+{
+	pthread_once(&_g_topology_once, _read_topology);
+	return _g_topology.n_nodes;
+}
+
+int rapi_numa_node_n_cpus(int node)
+{
+	if (node < 0 || node >= rapi_numa_n_nodes())
+		return 0;
+	return CPU_COUNT(&_g_topology.cpus[node]);
+}
+
+int rapi_numa_bind_thread(int node, int cpu)
+{
+	const int n_cpus = rapi_numa_node_n_cpus(node);
+	if (n_cpus == 0)
+		return -1;
+
+	cpu_set_t set;
+	if (cpu < 0)
+		set = _g_topology.cpus[node];
+	else {
+		int target = cpu % n_cpus;
+		CPU_ZERO(&set);
+		for (int c = 0; c < CPU_SETSIZE; ++c) {
+			if (CPU_ISSET(c, &_g_topology.cpus[node]) && target-- == 0) {
+				CPU_SET(c, &set);
+				break;
+			}
+		}
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		PERROR("Unable to bind thread to NUMA node %d\n", node);
+		return -1;
+	}
+	return 0;
+}
+
+int rapi_numa_current_node(void)
+{
+	const int n_nodes = rapi_numa_n_nodes();
+	const int cpu = sched_getcpu();
+	if (n_nodes > 1 && cpu >= 0 && cpu < CPU_SETSIZE) {
+		for (int node = 0; node < n_nodes; ++node) {
+			if (CPU_ISSET(cpu, &_g_topology.cpus[node]))
+				return node;
+		}
+	}
+	return 0;
+}
+
+#else // !__linux__
+
+int rapi_numa_n_nodes(void) { return 1; }
+
+int rapi_numa_node_n_cpus(int node) { return node == 0 ? 1 : 0; }
+
+int rapi_numa_bind_thread(int node, int cpu) { (void)node; (void)cpu; return -1; }
+
+int rapi_numa_current_node(void) { return 0; }
+
+#endif
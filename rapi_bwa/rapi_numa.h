@@ -0,0 +1,51 @@
+/*
+ * rapi_numa.h
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * Minimal NUMA topology support, read from Linux's sysfs so that we don't
+ * depend on libnuma.
+ *
+ * Nodes are numbered 0..n-1 among those that have CPUs this process is
+ * allowed to run on (so the numbers may differ from the kernel's node ids).
+ * On other systems, or if the topology can't be read, there's a single node.
+ */
+
+#ifndef __RAPI_NUMA_H__
+#define __RAPI_NUMA_H__
+
+/** Number of NUMA nodes with CPUs we can use (at least 1). */
+int rapi_numa_n_nodes(void);
+
+/** Number of CPUs we can use on `node`. */
+int rapi_numa_node_n_cpus(int node);
+
+/**
+ * Restrict the calling thread to the CPUs of `node`.  If `cpu` is
+ * non-negative, pin it to the cpu-th CPU of the node (modulo their number)
+ * instead.
+ *
+ * \return 0 on success.
+ */
+int rapi_numa_bind_thread(int node, int cpu);
+
+/** The node of the CPU on which the calling thread is running. */
+int rapi_numa_current_node(void);
+
+#endif
@@ -0,0 +1,249 @@
+/*
+ * rapi_pool.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+#ifdef __linux__
+#define _GNU_SOURCE // for pthread_setaffinity_np
+#else
+#define _XOPEN_SOURCE 700 // for clock_gettime
+#endif
+
+#include "rapi_numa.h"
+#include "rapi_pool.h"
+
+#include <rapi_utils.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+typedef struct {
+	rapi_pool* pool;
+	int tid;
+} pool_worker;
+
+struct rapi_pool {
+	int n_threads; // including the caller
+	int pin_threads;
+	int n_nodes;   // NUMA nodes over which the workers are spread;  0 if we don't
+	pthread_t* threads;
+	pool_worker* workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t job_cond;  // signalled when a job is posted or on shutdown
+	pthread_cond_t done_cond; // signalled when the last worker finishes a job
+
+	// The current job.  Set under `lock`; `next` is then taken atomically.
+	void (*func)(void*, int, int);
+	void* data;
+	int n;
+	int next;
+	long generation; // incremented for each job
+	int n_running;   // workers that haven't finished the current job
+	double job_cpu;  // thread CPU seconds spent on the current job, summed over the threads
+	int shutting_down;
+};
+
+static inline double _thread_cpu_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Run the job's iterations until there are none left.  Returns the CPU time it took. */
+static double _pool_run(rapi_pool* pool, int tid)
+{
+	const double start = _thread_cpu_time();
+	int i;
+	while ((i = __sync_fetch_and_add(&pool->next, 1)) < pool->n)
+		pool->func(pool->data, i, tid);
+	return _thread_cpu_time() - start;
+}
+
+#ifdef __linux__
+/* Pin the calling thread to the tid-th CPU among those we're allowed to use. */
+static void _pin_thread(int tid)
+{
+	cpu_set_t allowed;
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		return;
+
+	int n_cpus = CPU_COUNT(&allowed);
+	if (n_cpus <= 0)
+		return;
+
+	int target = tid % n_cpus;
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &allowed) && target-- == 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpu, &set);
+			if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+				PERROR("Unable to pin pool thread %d to CPU %d\n", tid, cpu);
+			return;
+		}
+	}
+}
+#else
+static void _pin_thread(int tid) { (void)tid; }
+#endif
+
+static void* _pool_worker(void* arg)
+{
+	pool_worker* self = (pool_worker*)arg;
+	rapi_pool* pool = self->pool;
+	long seen_generation = 0;
+
+	if (pool->n_nodes > 0)
+		rapi_numa_bind_thread(self->tid % pool->n_nodes, pool->pin_threads ? self->tid / pool->n_nodes : -1);
+	else if (pool->pin_threads)
+		_pin_thread(self->tid);
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		while (pool->generation == seen_generation && !pool->shutting_down)
+			pthread_cond_wait(&pool->job_cond, &pool->lock);
+		if (pool->shutting_down)
+			break;
+		seen_generation = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		const double cpu = _pool_run(pool, self->tid);
+
+		pthread_mutex_lock(&pool->lock);
+		pool->job_cpu += cpu;
+		if (--pool->n_running == 0)
+			pthread_cond_signal(&pool->done_cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+rapi_error_t rapi_pool_create(rapi_pool** ret_pool, int n_threads, int pin_threads, int numa)
+{
+	if (NULL == ret_pool)
+		return RAPI_PARAM_ERROR;
+
+	rapi_pool* pool = calloc(1, sizeof(*pool));
+	if (NULL == pool)
+		return RAPI_MEMORY_ERROR;
+
+	pool->n_threads = n_threads > 0 ? n_threads : 1;
+	pool->pin_threads = pin_threads;
+	if (numa && rapi_numa_n_nodes() > 1)
+		pool->n_nodes = rapi_numa_n_nodes();
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	int n_workers = pool->n_threads - 1;
+	if (n_workers > 0) {
+		pool->threads = calloc(n_workers, sizeof(pool->threads[0]));
+		pool->workers = calloc(n_workers, sizeof(pool->workers[0]));
+		if (NULL == pool->threads || NULL == pool->workers) {
+			pool->n_threads = 1; // no workers to stop
+			rapi_pool_destroy(pool);
+			return RAPI_MEMORY_ERROR;
+		}
+
+		for (int i = 0; i < n_workers; ++i) {
+			pool->workers[i].pool = pool;
+			pool->workers[i].tid = i + 1; // the caller is tid 0
+			if (pthread_create(&pool->threads[i], NULL, _pool_worker, &pool->workers[i]) != 0) {
+				PERROR("Unable to start pool thread (%d of %d)\n", i + 1, n_workers);
+				pool->n_threads = i + 1; // stop the ones we've started
+				rapi_pool_destroy(pool);
+				return RAPI_GENERIC_ERROR;
+			}
+		}
+	}
+
+	*ret_pool = pool;
+	return RAPI_NO_ERROR;
+}
+
+double rapi_pool_for(rapi_pool* pool, void (*func)(void*, int, int), void* data, int n)
+{
+	if (n <= 0)
+		return 0;
+
+	if (pool->n_threads == 1 || n == 1) {
+		const double start = _thread_cpu_time();
+		for (int i = 0; i < n; ++i)
+			func(data, i, 0);
+		return _thread_cpu_time() - start;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->data = data;
+	pool->n = n;
+	pool->next = 0;
+	pool->n_running = pool->n_threads - 1;
+	pool->job_cpu = 0;
+	pool->generation += 1;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	const double cpu = _pool_run(pool, 0);
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->n_running > 0)
+		pthread_cond_wait(&pool->done_cond, &pool->lock);
+	const double job_cpu = pool->job_cpu + cpu;
+	pthread_mutex_unlock(&pool->lock);
+	return job_cpu;
+}
+
+int rapi_pool_n_threads(const rapi_pool* pool)
+{
+	return pool->n_threads;
+}
+
+int rapi_pool_thread_node(const rapi_pool* pool, int tid)
+{
+	if (pool->n_nodes == 0)
+		return 0;
+	// the caller isn't bound to a node, so it's wherever it's running now
+	return tid == 0 ? rapi_numa_current_node() : tid % pool->n_nodes;
+}
+
+void rapi_pool_destroy(rapi_pool* pool)
+{
+	if (NULL == pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutting_down = 1;
+	pthread_cond_broadcast(&pool->job_cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (int i = 0; i < pool->n_threads - 1; ++i)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->job_cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->workers);
+	free(pool->threads);
+	free(pool);
+}
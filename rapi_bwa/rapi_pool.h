@@ -0,0 +1,71 @@
+/*
+ * rapi_pool.h
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * A persistent pool of worker threads, to replace BWA's kt_for (which
+ * creates and joins its threads at every call).
+ *
+ * rapi_pool_for has the same semantics as kt_for:  it calls func(data, i, tid)
+ * for each i in [0, n) and returns when all the calls have completed.  `tid`
+ * is in [0, n_threads).  The calling thread does part of the work as tid 0.
+ *
+ * The pool runs one job at a time:  rapi_pool_for must not be called
+ * concurrently on the same pool.
+ */
+
+#ifndef __RAPI_POOL_H__
+#define __RAPI_POOL_H__
+
+#include <rapi.h>
+
+typedef struct rapi_pool rapi_pool;
+
+/**
+ * Create a pool for jobs run by `n_threads` threads, the caller included
+ * (so n_threads - 1 workers are started).
+ *
+ * \param pin_threads If true, pin each worker thread to a CPU (only
+ * supported on Linux; elsewhere it's ignored).
+ * \param numa If true and the machine has more than one NUMA node, spread
+ * the workers round-robin over the nodes and bind each to the CPUs of its
+ * node (to a single one of them if `pin_threads` is also set).
+ */
+rapi_error_t rapi_pool_create(rapi_pool** pool, int n_threads, int pin_threads, int numa);
+
+/**
+ * \return the CPU time, in seconds, spent on the job:  the sum of the thread
+ * CPU times of the threads that ran it (the caller included).
+ */
+double rapi_pool_for(rapi_pool* pool, void (*func)(void*, int, int), void* data, int n);
+
+/** Number of threads running the pool's jobs (the caller included). */
+int rapi_pool_n_threads(const rapi_pool* pool);
+
+/**
+ * The NUMA node (see rapi_numa.h) on which thread `tid` runs.  Always 0 if the
+ * pool wasn't created with `numa`.  The caller (tid 0) isn't bound, so for it
+ * this is the node it's running on at the moment.
+ */
+int rapi_pool_thread_node(const rapi_pool* pool, int tid);
+
+/** Stop the worker threads and free the pool. */
+void rapi_pool_destroy(rapi_pool* pool);
+
+#endif
@@ -0,0 +1,776 @@
+/*
+ * rapi_reader.c
+ */
+
+/******************************************************************************
+ *  Copyright (c) 2014-2016 Center for Advanced Studies,
+ *                          Research and Development in Sardinia (CRS4)
+ *
+ *  Licensed under the terms of the MIT License (see LICENSE file included with the
+ *  project).
+ *
+ *  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ *  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ *  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ *  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ *  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ *  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ *  SOFTWARE.
+ ******************************************************************************/
+
+/*
+ * FASTQ and PRQ reader.
+ *
+ * Each input file is read (and decompressed, if it's gzipped) by a
+ * background thread into a small ring of chunks.  The caller's thread parses
+ * the records from the chunks and puts them directly into a rapi_batch.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <rapi.h>
+#include <rapi_utils.h>
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define READER_CHUNK_SIZE (1 << 20)
+#define READER_N_CHUNKS   4
+
+typedef struct {
+	char* data;
+	int len;
+} reader_chunk;
+
+/*
+ * One input file and the thread that fills its chunks.
+ *
+ * Chunks are used in a ring.  The producer fills chunks[n_filled % N], the
+ * consumer parses chunks[n_consumed % N]; n_filled - n_consumed is the
+ * number of chunks ready to be parsed.
+ */
+typedef struct {
+	gzFile fp;
+	char* path;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	reader_chunk chunks[READER_N_CHUNKS];
+	long n_filled;
+	long n_consumed;
+	int eof;
+	int error;
+	int stop;
+	// consumer's state
+	reader_chunk* current;  // chunk being parsed, or NULL
+	int pos;                // position in current
+	long line_no;
+} reader_stream;
+
+struct rapi_reader {
+	rapi_input_format format;
+	int n_reads_frag;
+	int n_streams;
+	reader_stream streams[2];
+	kstring_t id, seq, qual, line; // scratch space for the records
+	kstring_t id2, seq2, qual2;
+};
+
+static void* _stream_producer(void* arg)
+{
+	reader_stream* s = (reader_stream*)arg;
+
+	pthread_mutex_lock(&s->lock);
+	while (!s->stop) {
+		if (s->n_filled - s->n_consumed == READER_N_CHUNKS) {
+			pthread_cond_wait(&s->cond, &s->lock);
+			continue;
+		}
+		reader_chunk* chunk = &s->chunks[s->n_filled % READER_N_CHUNKS];
+		pthread_mutex_unlock(&s->lock);
+
+		// read outside the lock; the consumer doesn't touch this chunk
+		int n = gzread(s->fp, chunk->data, READER_CHUNK_SIZE);
+
+		pthread_mutex_lock(&s->lock);
+		if (n < 0) {
+			int errnum;
+			PERROR("Error reading %s: %s\n", s->path, gzerror(s->fp, &errnum));
+			s->error = 1;
+			break;
+		}
+		if (n == 0) {
+			s->eof = 1;
+			break;
+		}
+		chunk->len = n;
+		s->n_filled += 1;
+		pthread_cond_broadcast(&s->cond);
+	}
+	s->eof = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+static rapi_error_t _stream_open(reader_stream* s, const char* path)
+{
+	memset(s, 0, sizeof(*s));
+
+	// "-" is stdin.  gzdopen reads uncompressed data transparently.
+	if (strcmp(path, "-") == 0)
+		s->fp = gzdopen(dup(STDIN_FILENO), "rb");
+	else
+		s->fp = gzopen(path, "rb");
+	if (NULL == s->fp) {
+		PERROR("Unable to open input file %s\n", path);
+		return RAPI_GENERIC_ERROR;
+	}
+	gzbuffer(s->fp, READER_CHUNK_SIZE);
+
+	s->path = strdup(path);
+	for (int i = 0; i < READER_N_CHUNKS; ++i) {
+		s->chunks[i].data = malloc(READER_CHUNK_SIZE);
+		if (NULL == s->chunks[i].data || NULL == s->path) {
+			for (int j = 0; j <= i; ++j)
+				free(s->chunks[j].data);
+			free(s->path);
+			gzclose(s->fp);
+			return RAPI_MEMORY_ERROR;
+		}
+	}
+
+	pthread_mutex_init(&s->lock, NULL);
+	pthread_cond_init(&s->cond, NULL);
+	if (pthread_create(&s->thread, NULL, _stream_producer, s) != 0) {
+		PERROR("Unable to start reader thread\n");
+		pthread_cond_destroy(&s->cond);
+		pthread_mutex_destroy(&s->lock);
+		for (int i = 0; i < READER_N_CHUNKS; ++i)
+			free(s->chunks[i].data);
+		free(s->path);
+		gzclose(s->fp);
+		return RAPI_GENERIC_ERROR;
+	}
+	return RAPI_NO_ERROR;
+}
+
+static void _stream_close(reader_stream* s)
+{
+	pthread_mutex_lock(&s->lock);
+	s->stop = 1;
+	pthread_cond_broadcast(&s->cond);
+	pthread_mutex_unlock(&s->lock);
+	pthread_join(s->thread, NULL);
+
+	pthread_cond_destroy(&s->cond);
+	pthread_mutex_destroy(&s->lock);
+	for (int i = 0; i < READER_N_CHUNKS; ++i)
+		free(s->chunks[i].data);
+	free(s->path);
+	gzclose(s->fp);
+}
+
+/*
+ * Make sure s->current has data to parse.
+ * \return 1 if it does, 0 at the end of the stream, -1 on error.
+ */
+static int _stream_fill(reader_stream* s)
+{
+	if (s->current && s->pos < s->current->len)
+		return 1;
+
+	pthread_mutex_lock(&s->lock);
+	if (s->current) { // give the exhausted chunk back to the producer
+		s->current = NULL;
+		s->n_consumed += 1;
+		pthread_cond_broadcast(&s->cond);
+	}
+	while (s->n_filled == s->n_consumed && !s->eof)
+		pthread_cond_wait(&s->cond, &s->lock);
+
+	int retval;
+	if (s->n_filled > s->n_consumed) {
+		s->current = &s->chunks[s->n_consumed % READER_N_CHUNKS];
+		s->pos = 0;
+		retval = 1;
+	}
+	else
+		retval = s->error ? -1 : 0;
+	pthread_mutex_unlock(&s->lock);
+	return retval;
+}
+
+/*
+ * Read the next line into `line`, without the terminating newline (or
+ * carriage return).
+ * \return 1 if a line was read, 0 at the end of the stream, -1 on error.
+ */
+static int _stream_getline(reader_stream* s, kstring_t* line)
+{
+	line->l = 0;
+	int got_data = 0;
+
+	for (;;) {
+		int status = _stream_fill(s);
+		if (status < 0)
+			return status;
+		if (status == 0)
+			break;
+
+		got_data = 1;
+		const char* start = s->current->data + s->pos;
+		int avail = s->current->len - s->pos;
+		const char* nl = memchr(start, '\n', avail);
+		int n = nl ? nl - start : avail;
+		kputsn(start, n, line);
+		s->pos += nl ? n + 1 : n;
+		if (nl)
+			break;
+	}
+
+	if (!got_data)
+		return 0;
+
+	if (line->l > 0 && line->s[line->l - 1] == '\r')
+		line->l -= 1;
+	// the line may be empty, so we can't count on kputsn to terminate it
+	if (NULL == line->s)
+		kputsn("", 0, line);
+	else
+		line->s[line->l] = '\0';
+	s->line_no += 1;
+	return 1;
+}
+
+/*
+ * Truncate a read name at the first white space and remove the /1 or /2
+ * read number suffix, like BWA does (and like rapi_set_read).
+ */
+static size_t _trimmed_id_len(const char* id, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (id[i] == ' ' || id[i] == '\t') {
+			len = i;
+			break;
+		}
+	}
+	if (len > 2 && id[len - 2] == '/' && (id[len - 1] == '1' || id[len - 1] == '2'))
+		len -= 2;
+	return len;
+}
+
+static void _trim_read_id(kstring_t* id)
+{
+	id->l = _trimmed_id_len(id->s, id->l);
+	id->s[id->l] = '\0';
+}
+
+/*
+ * After an error, reset the reads of fragments [start, end) that we may have
+ * set, so the batch is left as the caller had it.  Their strings stay in the
+ * batch's arena until the batch is cleared, like those of overwritten reads.
+ */
+static void _unset_fragments(rapi_batch* batch, rapi_ssize_t start, rapi_ssize_t end)
+{
+	if (end > batch->n_frags)
+		end = batch->n_frags;
+	for (rapi_ssize_t f = start; f < end; ++f)
+		memset(rapi_get_read(batch, f, 0), 0, batch->n_reads_frag * sizeof(rapi_read));
+}
+
+/*
+ * Read one FASTQ record.
+ * \return 1 if a record was read, 0 at the end of the stream, < 0 on error.
+ */
+static int _read_fastq_record(reader_stream* s, kstring_t* line, kstring_t* id, kstring_t* seq, kstring_t* qual)
+{
+	int status;
+
+	// skip blank lines between records
+	do {
+		status = _stream_getline(s, line);
+	} while (status == 1 && line->l == 0);
+	if (status <= 0)
+		return status;
+
+	if (line->s[0] != '@') {
+		PERROR("%s: format error at line %ld.  Expected FASTQ header starting with '@'\n", s->path, s->line_no);
+		return -1;
+	}
+	id->l = 0;
+	kputsn(line->s + 1, line->l - 1, id);
+	_trim_read_id(id);
+
+	if (_stream_getline(s, seq) != 1) goto truncated;
+
+	if (_stream_getline(s, line) != 1) goto truncated;
+	if (line->s[0] != '+') {
+		PERROR("%s: format error at line %ld.  Expected '+' line\n", s->path, s->line_no);
+		return -1;
+	}
+
+	if (_stream_getline(s, qual) != 1) goto truncated;
+	if (qual->l != seq->l) {
+		PERROR("%s: format error at line %ld.  Sequence and quality lengths differ (%zu and %zu)\n",
+		    s->path, s->line_no, seq->l, qual->l);
+		return -1;
+	}
+	return 1;
+
+truncated:
+	PERROR("%s: truncated FASTQ record at line %ld\n", s->path, s->line_no);
+	return -1;
+}
+
+/*
+ * Split a PRQ line (id, seq1, qual1, seq2, qual2; tab-separated) in place.
+ */
+static int _split_prq_line(reader_stream* s, kstring_t* line, char* fields[5])
+{
+	char* p = line->s;
+	for (int i = 0; i < 5; ++i) {
+		fields[i] = p;
+		char* tab = strchr(p, '\t');
+		if (i < 4) {
+			if (NULL == tab) {
+				PERROR("%s: format error at line %ld.  Expected 5 tab-separated fields\n", s->path, s->line_no);
+				return -1;
+			}
+			*tab = '\0';
+			p = tab + 1;
+		}
+		else if (tab) {
+			PERROR("%s: format error at line %ld.  Too many fields\n", s->path, s->line_no);
+			return -1;
+		}
+	}
+	if (strlen(fields[1]) != strlen(fields[2]) || strlen(fields[3]) != strlen(fields[4])) {
+		PERROR("%s: format error at line %ld.  Sequence and quality lengths differ\n", s->path, s->line_no);
+		return -1;
+	}
+	return 0;
+}
+
+rapi_error_t rapi_reader_open(rapi_reader** reader, rapi_input_format format, int n_reads_frag,
+    const char* path1, const char* path2)
+{
+	if (NULL == reader || NULL == path1)
+		return RAPI_PARAM_ERROR;
+
+	if (format == RAPI_INPUT_FASTQ) {
+		if (n_reads_frag != 1 && n_reads_frag != 2) {
+			PERROR("FASTQ input supports 1 or 2 reads per fragment (got %d)\n", n_reads_frag);
+			return RAPI_PARAM_ERROR;
+		}
+		if (path2 && n_reads_frag != 2) {
+			PERROR("Two FASTQ input files require 2 reads per fragment\n");
+			return RAPI_PARAM_ERROR;
+		}
+	}
+	else if (format == RAPI_INPUT_PRQ) {
+		if (n_reads_frag != 2 || path2) {
+			PERROR("PRQ input requires a single file and 2 reads per fragment\n");
+			return RAPI_PARAM_ERROR;
+		}
+	}
+	else {
+		PERROR("Unknown input format %d\n", format);
+		return RAPI_PARAM_ERROR;
+	}
+
+	rapi_reader* r = calloc(1, sizeof(*r));
+	if (NULL == r)
+		return RAPI_MEMORY_ERROR;
+
+	r->format = format;
+	r->n_reads_frag = n_reads_frag;
+
+	rapi_error_t error = _stream_open(&r->streams[0], path1);
+	if (error) {
+		free(r);
+		return error;
+	}
+	r->n_streams = 1;
+
+	if (path2) {
+		error = _stream_open(&r->streams[1], path2);
+		if (error) {
+			_stream_close(&r->streams[0]);
+			free(r);
+			return error;
+		}
+		r->n_streams = 2;
+	}
+
+	*reader = r;
+	return RAPI_NO_ERROR;
+}
+
+rapi_error_t rapi_reader_close(rapi_reader* reader)
+{
+	if (NULL == reader)
+		return RAPI_PARAM_ERROR;
+
+	for (int i = 0; i < reader->n_streams; ++i)
+		_stream_close(&reader->streams[i]);
+
+	free(reader->id.s); free(reader->seq.s); free(reader->qual.s); free(reader->line.s);
+	free(reader->id2.s); free(reader->seq2.s); free(reader->qual2.s);
+	free(reader);
+	return RAPI_NO_ERROR;
+}
+
+/*
+ * Read the next fragment and insert it into the batch at n_frag.
+ * \return 1 if a fragment was read, 0 at the end of the input, or a negative
+ * rapi_error_t.
+ */
+static int _reader_next_fragment(rapi_reader* r, rapi_batch* batch, rapi_ssize_t n_frag, size_t* n_bases)
+{
+	const int q_offset = RAPI_QUALITY_ENCODING_SANGER;
+	int status;
+	rapi_error_t error;
+
+	if (r->format == RAPI_INPUT_PRQ) {
+		status = _stream_getline(&r->streams[0], &r->line);
+		while (status == 1 && r->line.l == 0) // skip blank lines
+			status = _stream_getline(&r->streams[0], &r->line);
+		if (status <= 0)
+			return status < 0 ? RAPI_GENERIC_ERROR : 0;
+
+		char* f[5];
+		if (_split_prq_line(&r->streams[0], &r->line, f) != 0)
+			return RAPI_GENERIC_ERROR;
+		f[0][_trimmed_id_len(f[0], strlen(f[0]))] = '\0';
+
+		error = rapi_set_read(batch, n_frag, 0, f[0], f[1], f[2], q_offset);
+		if (!error)
+			error = rapi_set_read(batch, n_frag, 1, f[0], f[3], f[4], q_offset);
+		if (error)
+			return error;
+		*n_bases += strlen(f[1]) + strlen(f[3]);
+		return 1;
+	}
+
+	// FASTQ
+	status = _read_fastq_record(&r->streams[0], &r->line, &r->id, &r->seq, &r->qual);
+	if (status <= 0)
+		return status < 0 ? RAPI_GENERIC_ERROR : 0;
+
+	error = rapi_set_read(batch, n_frag, 0, r->id.s, r->seq.s, r->qual.s, q_offset);
+	if (error)
+		return error;
+	*n_bases += r->seq.l;
+
+	if (r->n_reads_frag == 2) {
+		// mate comes from the second file, or is the next record if interleaved
+		reader_stream* s = &r->streams[r->n_streams - 1];
+		status = _read_fastq_record(s, &r->line, &r->id2, &r->seq2, &r->qual2);
+		if (status == 0) {
+			PERROR("%s: missing mate for read %s\n", s->path, r->id.s);
+			return RAPI_GENERIC_ERROR;
+		}
+		if (status < 0)
+			return RAPI_GENERIC_ERROR;
+
+		error = rapi_set_read(batch, n_frag, 1, r->id2.s, r->seq2.s, r->qual2.s, q_offset);
+		if (error)
+			return error;
+		*n_bases += r->seq2.l;
+	}
+
+	return 1;
+}
+
+rapi_error_t rapi_reader_fill(rapi_reader* reader, rapi_batch* batch, rapi_ssize_t start_fragment,
+    rapi_ssize_t max_fragments, size_t max_bases, rapi_ssize_t* n_loaded)
+{
+	if (NULL == reader || NULL == batch || NULL == n_loaded || start_fragment < 0 || max_fragments < 0)
+		return RAPI_PARAM_ERROR;
+
+	if (batch->n_reads_frag != reader->n_reads_frag) {
+		PERROR("Batch has %d reads per fragment but the reader produces %d\n",
+		    batch->n_reads_frag, reader->n_reads_frag);
+		return RAPI_PARAM_ERROR;
+	}
+
+	*n_loaded = 0;
+	size_t n_bases = 0;
+	rapi_ssize_t n_frag = start_fragment;
+	rapi_error_t error = RAPI_NO_ERROR;
+
+	while (*n_loaded < max_fragments && (max_bases == 0 || n_bases < max_bases)) {
+		if (n_frag >= batch->n_frags) {
+			// grow geometrically
+			rapi_ssize_t new_size = batch->n_frags > 0 ? batch->n_frags * 2 : 1024;
+			if (new_size < n_frag + 1)
+				new_size = n_frag + 1;
+			if (new_size - n_frag > max_fragments - *n_loaded) // don't reserve more than we'll use
+				new_size = n_frag + (max_fragments - *n_loaded);
+			if ((error = rapi_reads_reserve(batch, new_size)))
+				goto error;
+		}
+
+		int status = _reader_next_fragment(reader, batch, n_frag, &n_bases);
+		if (status < 0) {
+			error = status;
+			goto error;
+		}
+		if (status == 0) {
+			if (reader->n_streams == 2) {
+				// the second file must be finished too
+				reader_stream* s = &reader->streams[1];
+				int more = _stream_getline(s, &reader->line);
+				while (more == 1 && reader->line.l == 0)
+					more = _stream_getline(s, &reader->line);
+				if (more != 0) {
+					PERROR("%s has more reads than %s\n", s->path, reader->streams[0].path);
+					error = RAPI_GENERIC_ERROR;
+					goto error;
+				}
+			}
+			break;
+		}
+		n_frag += 1;
+		*n_loaded += 1;
+	}
+
+	return RAPI_NO_ERROR;
+
+error:
+	// n_frag may be partially set
+	_unset_fragments(batch, start_fragment, n_frag + 1);
+	*n_loaded = 0;
+	return error;
+}
+
+/******* In-memory input *******/
+
+/* Cursor over the buffer given to rapi_reads_parse. */
+typedef struct {
+	const char* p;
+	const char* end;
+	long line_no;
+} buf_cursor;
+
+/* A read whose fields point into the buffer. */
+typedef struct {
+	const char* id;
+	const char* seq;
+	const char* qual;
+	int id_len;
+	int seq_len;
+} buf_read;
+
+/*
+ * Find the next line in the buffer.  `line` and `len` are set to the line
+ * without its terminating newline (or carriage return).
+ * \return 1 if a line was found, 0 at the end of the buffer, -1 on error.
+ */
+static int _buf_getline(buf_cursor* c, const char** line, size_t* len)
+{
+	if (c->p >= c->end)
+		return 0;
+
+	const char* nl = memchr(c->p, '\n', c->end - c->p);
+	size_t n = nl ? (size_t)(nl - c->p) : (size_t)(c->end - c->p);
+	*line = c->p;
+	c->p += nl ? n + 1 : n;
+	c->line_no += 1;
+
+	if (n > 0 && (*line)[n - 1] == '\r')
+		n -= 1;
+	if (n > INT_MAX) {
+		PERROR("buffer: line %ld is too long (%zu bytes)\n", c->line_no, n);
+		return -1;
+	}
+	*len = n;
+	return 1;
+}
+
+static int _buf_next_nonblank(buf_cursor* c, const char** line, size_t* len)
+{
+	int status;
+	do {
+		status = _buf_getline(c, line, len);
+	} while (status == 1 && *len == 0);
+	return status;
+}
+
+/*
+ * Same as _read_fastq_record, without copying the record.
+ * \return 1 if a record was found, 0 at the end of the buffer, -1 on error.
+ */
+static int _buf_fastq_record(buf_cursor* c, buf_read* r)
+{
+	const char* line;
+	size_t len, seq_len, qual_len;
+
+	int status = _buf_next_nonblank(c, &line, &len);
+	if (status <= 0)
+		return status;
+
+	if (line[0] != '@') {
+		PERROR("buffer: format error at line %ld.  Expected FASTQ header starting with '@'\n", c->line_no);
+		return -1;
+	}
+	r->id = line + 1;
+	r->id_len = _trimmed_id_len(line + 1, len - 1);
+
+	if ((status = _buf_getline(c, &r->seq, &seq_len)) != 1) goto truncated;
+
+	if ((status = _buf_getline(c, &line, &len)) != 1) goto truncated;
+	if (len == 0 || line[0] != '+') {
+		PERROR("buffer: format error at line %ld.  Expected '+' line\n", c->line_no);
+		return -1;
+	}
+
+	if ((status = _buf_getline(c, &r->qual, &qual_len)) != 1) goto truncated;
+	if (qual_len != seq_len) {
+		PERROR("buffer: format error at line %ld.  Sequence and quality lengths differ (%zu and %zu)\n",
+		    c->line_no, seq_len, qual_len);
+		return -1;
+	}
+	r->seq_len = seq_len;
+	return 1;
+
+truncated:
+	if (status == 0)
+		PERROR("buffer: truncated FASTQ record at line %ld\n", c->line_no);
+	return -1;
+}
+
+/*
+ * Same as _split_prq_line, without modifying the line.
+ */
+static int _buf_prq_record(buf_cursor* c, buf_read r[2])
+{
+	const char* line;
+	size_t len;
+
+	int status = _buf_next_nonblank(c, &line, &len);
+	if (status <= 0)
+		return status;
+
+	const char* fields[5];
+	size_t lens[5];
+	const char* p = line;
+	const char* end = line + len;
+	for (int i = 0; i < 5; ++i) {
+		const char* tab = memchr(p, '\t', end - p);
+		if (i < 4 && NULL == tab) {
+			PERROR("buffer: format error at line %ld.  Expected 5 tab-separated fields\n", c->line_no);
+			return -1;
+		}
+		if (i == 4 && tab) {
+			PERROR("buffer: format error at line %ld.  Too many fields\n", c->line_no);
+			return -1;
+		}
+		fields[i] = p;
+		lens[i] = (tab ? tab : end) - p;
+		if (tab)
+			p = tab + 1;
+	}
+	if (lens[1] != lens[2] || lens[3] != lens[4]) {
+		PERROR("buffer: format error at line %ld.  Sequence and quality lengths differ\n", c->line_no);
+		return -1;
+	}
+
+	for (int i = 0; i < 2; ++i) {
+		r[i].id = fields[0];
+		r[i].id_len = _trimmed_id_len(fields[0], lens[0]);
+		r[i].seq = fields[1 + 2*i];
+		r[i].seq_len = lens[1 + 2*i];
+		r[i].qual = fields[2 + 2*i];
+	}
+	return 1;
+}
+
+rapi_error_t rapi_reads_parse(rapi_batch* batch, rapi_input_format format,
+    const char* buf, size_t len, rapi_ssize_t start_fragment, rapi_ssize_t* n_loaded)
+{
+	if (NULL == batch || NULL == n_loaded || (NULL == buf && len > 0) || start_fragment < 0)
+		return RAPI_PARAM_ERROR;
+
+	if (format == RAPI_INPUT_FASTQ) {
+		if (batch->n_reads_frag != 1 && batch->n_reads_frag != 2) {
+			PERROR("FASTQ input supports 1 or 2 reads per fragment (batch has %d)\n", batch->n_reads_frag);
+			return RAPI_PARAM_ERROR;
+		}
+	}
+	else if (format == RAPI_INPUT_PRQ) {
+		if (batch->n_reads_frag != 2) {
+			PERROR("PRQ input requires 2 reads per fragment (batch has %d)\n", batch->n_reads_frag);
+			return RAPI_PARAM_ERROR;
+		}
+	}
+	else {
+		PERROR("Unknown input format %d\n", format);
+		return RAPI_PARAM_ERROR;
+	}
+
+	*n_loaded = 0;
+	if (len == 0)
+		return RAPI_NO_ERROR;
+
+	// Size the batch once from the number of lines.  A FASTQ record takes
+	// at least 4 lines and a PRQ record 1, so this is an upper bound.
+	const char* end = buf + len;
+	rapi_ssize_t n_lines = 1;
+	for (const char* nl = memchr(buf, '\n', len); nl; nl = memchr(nl + 1, '\n', end - nl - 1))
+		n_lines += 1;
+
+	rapi_ssize_t max_frags = format == RAPI_INPUT_PRQ ? n_lines : n_lines / 4 / batch->n_reads_frag;
+	rapi_error_t error = rapi_reads_reserve(batch, start_fragment + max_frags);
+	if (error)
+		return error;
+
+	const int q_offset = RAPI_QUALITY_ENCODING_SANGER;
+	buf_cursor c = { buf, end, 0 };
+	buf_read r[2];
+	rapi_ssize_t n_frag = start_fragment;
+
+	for (;;) {
+		int status;
+		if (format == RAPI_INPUT_PRQ)
+			status = _buf_prq_record(&c, r);
+		else {
+			status = _buf_fastq_record(&c, &r[0]);
+			if (status == 1 && batch->n_reads_frag == 2) {
+				status = _buf_fastq_record(&c, &r[1]);
+				if (status == 0) {
+					PERROR("buffer: missing mate for read %.*s\n", r[0].id_len, r[0].id);
+					status = -1;
+				}
+			}
+		}
+		if (status < 0) {
+			error = RAPI_GENERIC_ERROR;
+			goto error;
+		}
+		if (status == 0)
+			break;
+
+		for (int i = 0; i < batch->n_reads_frag; ++i) {
+			error = rapi_set_read_n(batch, n_frag, i, r[i].id, r[i].id_len, r[i].seq, r[i].seq_len, r[i].qual, q_offset);
+			if (error)
+				goto error;
+		}
+		n_frag += 1;
+		*n_loaded += 1;
+	}
+
+	return RAPI_NO_ERROR;
+
+error:
+	// n_frag may be partially set
+	_unset_fragments(batch, start_fragment, n_frag + 1);
+	*n_loaded = 0;
+	return error;
+}